@@ -0,0 +1,88 @@
+/* bench.c
+ *
+ * Helpers shared by the benchmark upstream and load generator.
+ */
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/un.h>
+#include "bench.h"
+
+#define BENCH_HOST_LEN 1025  // same as NI_MAXHOST
+
+// -- PUBLIC --
+
+int bench_resolve(const char *spec, struct sockaddr_storage *addr, socklen_t *addr_len) {
+
+  char host[BENCH_HOST_LEN];
+  const char *port = strrchr(spec, ':');
+  const char *start = spec;
+  size_t length = 0;
+  struct addrinfo hints;
+  struct addrinfo *res = NULL;
+  int rc = 0;
+
+  if (0 == strncmp(spec, "unix:", 5)) {
+    struct sockaddr_un *un = (struct sockaddr_un *) addr;
+    length = strlen(spec + 5);
+    if (0 == length || length >= sizeof(un->sun_path)) {
+      fprintf(stderr, "invalid address: %s\n", spec);
+      return -1;
+    }
+    memset(un, 0, sizeof(*un));
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, spec + 5, length);
+    *addr_len = sizeof(*un);
+    if ('@' == un->sun_path[0]) {
+      un->sun_path[0] = '\0';  // abstract namespace
+      *addr_len = offsetof(struct sockaddr_un, sun_path) + length;
+    }
+    return 0;
+  }
+
+  if (NULL == port || '\0' == port[1]) {
+    fprintf(stderr, "invalid address: %s\n", spec);
+    return -1;
+  }
+  length = port - spec;
+  if ('[' == spec[0] && 2 <= length && ']' == spec[length - 1]) {
+    start++;  // bracketed IPv6 literal
+    length -= 2;
+  }
+  if (0 == length || length >= sizeof(host)) {
+    fprintf(stderr, "invalid address: %s\n", spec);
+    return -1;
+  }
+  memcpy(host, start, length);
+  host[length] = '\0';
+  port++;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (0 != (rc = getaddrinfo(host, port, &hints, &res))) {
+    fprintf(stderr, "getaddrinfo %s: %s\n", spec, gai_strerror(rc));
+    return -1;
+  }
+
+  memcpy(addr, res->ai_addr, res->ai_addrlen);
+  *addr_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+int bench_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return 0 > flags ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,25 @@
+/* bench.h
+ *
+ * Helpers shared by the benchmark upstream and load generator.
+ */
+#ifndef bench_h
+#define bench_h
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define BENCH_BUFFER_LEN 65536
+
+/* Resolves "host:port" (or "[v6]:port", or "unix:/path", or "unix:@name") into addr.
+ *
+ * @return 0, or -1 with a message on stderr.
+ */
+int bench_resolve(const char *spec, struct sockaddr_storage *addr, socklen_t *addr_len);
+
+/* Makes fd non-blocking. @return 0 or -1. */
+int bench_nonblocking(int fd);
+
+/* Returns monotonic microseconds. */
+uint64_t bench_now(void);
+
+#endif /* bench_h */
@@ -0,0 +1,376 @@
+/* loadgen.c
+ *
+ * Benchmark load generator. Opens connections through the proxy, spread over threads
+ * with an epoll set each, and drives either request/response round trips of a fixed
+ * size (against an echo upstream) or bulk streams, then prints requests per second,
+ * Gbit/s and latency percentiles. In udp mode, each connection is a connected UDP socket
+ * doing datagram round trips.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "bench.h"
+#include "metrics.h"
+
+#define LOADGEN_EVENTS 256
+#define LOADGEN_TICK_MS 100  // how often threads look at the clock while idle
+#define LOADGEN_UDP_TIMEOUT_MS 200  // a datagram round trip not answered by then is started over
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  int connections;
+  int threads;
+  int seconds;
+  size_t size;  // request and response size in rr mode, write size in stream mode
+  int stream;  // bulk streams instead of round trips
+  int udp;  // datagram round trips
+} loadgen_opts;
+
+typedef struct {
+  int fd;
+  size_t sent;  // of the current request
+  size_t received;  // of the current response
+  uint64_t started;  // when the current request was started
+} loadgen_conn;
+
+typedef struct {
+  const loadgen_opts *opts;
+  pthread_t thread;
+  int nconns;
+  const char *payload;
+  uint64_t deadline;
+  uint64_t requests;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t errors;
+  uint64_t lost;  // udp round trips that went unanswered
+  metrics_histogram latency;
+} loadgen_thread;
+
+// -- DECLARATIONS --
+
+static void *_run(void *arg);
+static int _connect(const loadgen_opts *opts);
+/* Moves the connection along as far as the socket allows. @return 0, or -1 on error. */
+static int _round_trip(loadgen_thread *t, loadgen_conn *c, char *scratch);
+static int _stream(loadgen_thread *t, loadgen_conn *c, char *scratch);
+/* Starts over the udp round trips that have gone unanswered for too long.
+ * @return how many connections were closed on errors. */
+static int _resend_lost(loadgen_thread *t, loadgen_conn *conns, char *scratch);
+static void _usage(const char *prog);
+
+// -- PUBLIC --
+
+int main(int argc, char **argv) {
+
+  loadgen_opts opts;
+  loadgen_thread *threads = NULL;
+  metrics_histogram *latency = NULL;
+  uint64_t requests = 0, sent = 0, received = 0, errors = 0, lost = 0;
+  uint64_t started = 0;
+  double elapsed = 0;
+  char *payload = NULL;
+  int c = 0;
+  int i = 0;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.connections = 64;
+  opts.threads = 4;
+  opts.seconds = 10;
+  opts.size = 64;
+
+  while (-1 != (c = getopt(argc, argv, "c:t:d:s:m:h"))) {
+    switch (c) {
+      case 'c': opts.connections = atoi(optarg); break;
+      case 't': opts.threads = atoi(optarg); break;
+      case 'd': opts.seconds = atoi(optarg); break;
+      case 's': opts.size = strtoul(optarg, NULL, 10); break;
+      case 'm':
+        if (0 == strcmp(optarg, "rr")) {
+          opts.stream = 0;
+        } else if (0 == strcmp(optarg, "stream")) {
+          opts.stream = 1;
+        } else if (0 == strcmp(optarg, "udp")) {
+          opts.udp = 1;
+        } else {
+          _usage(argv[0]);
+          return 1;
+        }
+        break;
+      default:
+        _usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind + 1 != argc || 0 >= opts.connections || 0 >= opts.threads || 0 >= opts.seconds ||
+      0 == opts.size || BENCH_BUFFER_LEN < opts.size) {
+    _usage(argv[0]);
+    return 1;
+  }
+  if (opts.threads > opts.connections) {
+    opts.threads = opts.connections;
+  }
+  if (0 != bench_resolve(argv[optind], &opts.addr, &opts.addr_len)) {
+    return 1;
+  }
+
+  if (NULL == (threads = calloc(opts.threads, sizeof(loadgen_thread))) ||
+      NULL == (latency = calloc(1, sizeof(metrics_histogram))) ||
+      NULL == (payload = malloc(opts.size))) {
+    perror("calloc");
+    return 1;
+  }
+  memset(payload, 'x', opts.size);
+
+  signal(SIGPIPE, SIG_IGN);  // a proxy that goes away is counted as errors
+  started = bench_now();
+  for (i = 0; i < opts.threads; i++) {
+    threads[i].opts = &opts;
+    threads[i].payload = payload;
+    threads[i].nconns = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+    threads[i].deadline = started + (uint64_t) opts.seconds * 1000000;
+    if (0 != pthread_create(&threads[i].thread, NULL, _run, &threads[i])) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  for (i = 0; i < opts.threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    requests += threads[i].requests;
+    sent += threads[i].bytes_sent;
+    received += threads[i].bytes_received;
+    errors += threads[i].errors;
+    lost += threads[i].lost;
+    metrics_histogram_merge(latency, &threads[i].latency);
+  }
+  elapsed = (bench_now() - started) / 1e6;
+
+  printf("mode %s, %d connections on %d threads, %zu-byte messages, %.1f s\n",
+         opts.stream ? "stream" : opts.udp ? "udp" : "rr", opts.connections, opts.threads, opts.size, elapsed);
+  if (opts.udp) {
+    printf("requests %lu (%.0f/s), errors %lu, lost %lu\n",
+           (unsigned long) requests, requests / elapsed, (unsigned long) errors, (unsigned long) lost);
+  } else if (!opts.stream) {
+    printf("requests %lu (%.0f/s), errors %lu\n",
+           (unsigned long) requests, requests / elapsed, (unsigned long) errors);
+  } else {
+    printf("errors %lu\n", (unsigned long) errors);
+  }
+  printf("throughput %.3f Gbit/s sent, %.3f Gbit/s received\n",
+         sent * 8 / elapsed / 1e9, received * 8 / elapsed / 1e9);
+  printf("bytes %lu sent, %lu received\n", (unsigned long) sent, (unsigned long) received);
+  if (!opts.stream) {
+    printf("latency p50 %luus p99 %luus p999 %luus\n",
+           (unsigned long) metrics_quantile(latency, 0.5),
+           (unsigned long) metrics_quantile(latency, 0.99),
+           (unsigned long) metrics_quantile(latency, 0.999));
+  }
+
+  free(payload);
+  free(latency);
+  free(threads);
+  return 0 == errors ? 0 : 2;
+}
+
+// -- PRIVATE --
+
+static void *_run(void *arg) {
+
+  loadgen_thread *t = arg;
+  struct epoll_event events[LOADGEN_EVENTS];
+  struct epoll_event ev;
+  loadgen_conn *conns = NULL;
+  char *scratch = NULL;
+  int epoll_fd = -1;
+  uint64_t last_check = bench_now();
+  int open = 0;
+  int n = 0;
+  int i = 0;
+
+  if (0 > (epoll_fd = epoll_create1(0)) ||
+      NULL == (conns = calloc(t->nconns, sizeof(loadgen_conn))) ||
+      NULL == (scratch = malloc(BENCH_BUFFER_LEN))) {
+    perror("epoll_create1");
+    exit(1);
+  }
+
+  for (i = 0; i < t->nconns; i++) {
+    if (0 > (conns[i].fd = _connect(t->opts))) {
+      t->errors++;
+      continue;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &conns[i];
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    conns[i].started = bench_now();
+    open++;
+  }
+
+  while (0 < open && bench_now() < t->deadline) {
+    if (0 > (n = epoll_wait(epoll_fd, events, LOADGEN_EVENTS, LOADGEN_TICK_MS))) {
+      if (EINTR == errno) continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (i = 0; i < n; i++) {
+      loadgen_conn *c = events[i].data.ptr;
+      if (0 > c->fd) {
+        continue;  // closed earlier in this batch
+      }
+      if (0 != (t->opts->stream ? _stream(t, c, scratch) : _round_trip(t, c, scratch))) {
+        t->errors++;
+        close(c->fd); c->fd = -1;
+        open--;
+      }
+    }
+    if (t->opts->udp && bench_now() - last_check >= LOADGEN_TICK_MS * 1000) {
+      open -= _resend_lost(t, conns, scratch);
+      last_check = bench_now();
+    }
+  }
+
+  for (i = 0; i < t->nconns; i++) {
+    if (0 <= conns[i].fd) {
+      close(conns[i].fd);
+    }
+  }
+  close(epoll_fd);
+  free(scratch);
+  free(conns);
+  return NULL;
+}
+
+static int _connect(const loadgen_opts *opts) {
+
+  int fd = socket(opts->addr.ss_family, opts->udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+  int yes = 1;
+
+  if (0 > fd) {
+    perror("socket");
+    return -1;
+  }
+  if (0 != connect(fd, (const struct sockaddr *) &opts->addr, opts->addr_len)) {
+    perror("connect");
+    close(fd);
+    return -1;
+  }
+  if (!opts->udp && AF_UNIX != opts->addr.ss_family) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+  if (0 != bench_nonblocking(fd)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int _round_trip(loadgen_thread *t, loadgen_conn *c, char *scratch) {
+
+  size_t size = t->opts->size;
+  ssize_t n = 0;
+
+  // edge-triggered, so keep going until the socket would block
+  for (;;) {
+    while (c->sent < size) {
+      if (0 > (n = write(c->fd, t->payload + c->sent, size - c->sent))) {
+        return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+      }
+      c->sent += n;
+      t->bytes_sent += n;
+    }
+
+    if (0 > (n = read(c->fd, scratch, size - c->received))) {
+      return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+    }
+    if (0 == n) {
+      return -1;  // the proxy or the upstream hung up
+    }
+    c->received += n;
+    t->bytes_received += n;
+
+    if (c->received == size) {
+      uint64_t now = bench_now();
+      metrics_observe(&t->latency, now - c->started);
+      t->requests++;
+      if (now >= t->deadline) {
+        return 0;
+      }
+      c->sent = 0;
+      c->received = 0;
+      c->started = now;
+    }
+  }
+}
+
+static int _stream(loadgen_thread *t, loadgen_conn *c, char *scratch) {
+
+  ssize_t n = 0;
+
+  for (;;) {
+    if (0 > (n = write(c->fd, t->payload, t->opts->size))) {
+      if (EAGAIN != errno && EWOULDBLOCK != errno) return -1;
+      break;
+    }
+    t->bytes_sent += n;
+  }
+
+  // whatever an echo upstream sends back
+  for (;;) {
+    if (0 > (n = read(c->fd, scratch, BENCH_BUFFER_LEN))) {
+      return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+    }
+    if (0 == n) {
+      return -1;
+    }
+    t->bytes_received += n;
+  }
+}
+
+static int _resend_lost(loadgen_thread *t, loadgen_conn *conns, char *scratch) {
+
+  uint64_t now = bench_now();
+  int closed = 0;
+  int i = 0;
+
+  for (i = 0; i < t->nconns; i++) {
+    loadgen_conn *c = &conns[i];
+    if (0 > c->fd || now - c->started < LOADGEN_UDP_TIMEOUT_MS * 1000) {
+      continue;
+    }
+    t->lost++;
+    c->sent = 0;
+    c->received = 0;
+    c->started = now;
+    if (0 != _round_trip(t, c, scratch)) {
+      t->errors++;
+      close(c->fd); c->fd = -1;
+      closed++;
+    }
+  }
+  return closed;
+}
+
+static void _usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] HOST:PORT|unix:PATH\n"
+          "  -m MODE  rr (round trips, needs an echo upstream), stream (bulk writes) or udp (datagram\n"
+          "           round trips, needs a udp echo upstream) (default rr)\n"
+          "  -c N     connections (default 64)\n"
+          "  -t N     threads (default 4)\n"
+          "  -d S     seconds to run (default 10)\n"
+          "  -s B     message size, at most %d (default 64)\n",
+          prog, BENCH_BUFFER_LEN);
+}
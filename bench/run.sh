@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+# Runs the benchmark scenarios on loopback: the load generator against the echo
+# upstream directly, for a baseline, and then through the proxy once per I/O engine.
+# Where perf is installed, the proxy's syscalls are counted during each proxied run
+# and reported per KiB relayed. Then datagram round trips are run against a UDP echo
+# upstream, directly and through the proxy with --protocol udp, and last the TCP
+# scenarios again over Unix sockets at both ends of the proxy.
+#
+# usage: bench/run.sh MAIN UPSTREAM LOADGEN
+#
+# BENCH_SECONDS, BENCH_CONNECTIONS, BENCH_THREADS and BENCH_PORT tune the runs,
+# BENCH_ENGINES lists the engines to compare (default "libevent uring"), and
+# BENCH_PROXY_ARGS is passed on to the proxy (e.g. "--workers 4 --relay splice").
+
+set -euo pipefail
+
+main=$1
+upstream=$2
+loadgen=$3
+
+seconds=${BENCH_SECONDS:-5}
+connections=${BENCH_CONNECTIONS:-64}
+threads=${BENCH_THREADS:-4}
+port=${BENCH_PORT:-19000}
+engines=${BENCH_ENGINES:-libevent uring}
+proxy_args=${BENCH_PROXY_ARGS:-}
+log=${TMPDIR:-/tmp}/event-proxy-bench.log
+stat=${TMPDIR:-/tmp}/event-proxy-bench.perf
+sock_dir=$(mktemp -d)
+proxy_listen=127.0.0.1:$((port + 1))
+proxy_upstream=127.0.0.1:$port
+
+pids=()
+proxy_pid=
+cleanup() {
+  for pid in "${pids[@]}" $proxy_pid; do
+    kill "$pid" 2>/dev/null || true  # background jobs ignore SIGQUIT
+  done
+  rm -rf "$sock_dir"
+}
+trap cleanup EXIT
+
+wait_for() {
+  for _ in $(seq 50); do
+    if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "nothing listening on port $1" >&2
+  exit 1
+}
+
+wait_for_socket() {
+  for _ in $(seq 50); do
+    if [ -S "$1" ]; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "nothing listening on $1" >&2
+  exit 1
+}
+
+# start_proxy ENGINE [ARGS...]
+start_proxy() {
+  if [ -n "$proxy_pid" ]; then
+    kill "$proxy_pid"
+    wait "$proxy_pid" 2>/dev/null || true
+  fi
+  # shellcheck disable=SC2086
+  "$main" --listen "$proxy_listen" --upstream "$proxy_upstream" --engine "$1" \
+    --admin "127.0.0.1:$((port + 2))" "${@:2}" $proxy_args >>"$log" 2>&1 &
+  proxy_pid=$!
+  wait_for "$((port + 2))"  # bound after the listeners, so this covers UDP too
+}
+
+run() {
+  echo "== $1"
+  shift
+  "$loadgen" -d "$seconds" -c "$connections" -t "$threads" "$@"
+  echo
+}
+
+# like run, and counts the proxy's syscalls while the load generator runs
+run_proxied() {
+  local out perf_pid=
+  echo "== $1"
+  shift
+  if command -v perf >/dev/null; then
+    perf stat -x, -e raw_syscalls:sys_enter -p "$proxy_pid" -o "$stat" -- sleep "$seconds" 2>/dev/null &
+    perf_pid=$!
+  fi
+  out=$("$loadgen" -d "$seconds" -c "$connections" -t "$threads" "$@" "$proxy_listen")
+  echo "$out"
+  if [ -n "$perf_pid" ] && wait "$perf_pid"; then
+    awk -F, -v bytes="$(awk '/^bytes/ { print $2 + $4 }' <<<"$out")" \
+      '/raw_syscalls/ { printf "syscalls %d, %.3f per KiB relayed\n", $1, bytes ? $1 * 1024 / bytes : 0 }' "$stat"
+  fi
+  echo
+}
+
+: >"$log"
+"$upstream" -m echo -t "$threads" "127.0.0.1:$port" &
+pids+=($!)
+wait_for "$port"
+
+run "direct, round trips" -m rr -s 64 "127.0.0.1:$port"
+
+if ! command -v perf >/dev/null; then
+  echo "(perf is not installed; skipping syscall counts)"
+  echo
+fi
+
+for engine in $engines; do
+  start_proxy "$engine"
+  run_proxied "$engine, proxied, round trips" -m rr -s 64
+  run_proxied "$engine, proxied, 16 KiB round trips" -m rr -s 16384
+  run_proxied "$engine, proxied, bulk streams" -m stream -s 65536
+done
+
+# UDP and TCP ports are apart, so the datagram echo shares the port number
+"$upstream" -m udp -t "$threads" "127.0.0.1:$port" &
+pids+=($!)
+sleep 0.5  # nothing to connect to, so give it time to bind
+
+run "direct, datagram round trips" -m udp -s 64 "127.0.0.1:$port"
+
+start_proxy libevent --protocol udp
+run_proxied "udp, proxied, datagram round trips" -m udp -s 64
+run_proxied "udp, proxied, 1400-byte datagram round trips" -m udp -s 1400
+
+# Unix sockets at both ends, as for a sidecar on the same host
+"$upstream" -m echo -t "$threads" "unix:$sock_dir/upstream.sock" &
+pids+=($!)
+wait_for_socket "$sock_dir/upstream.sock"
+
+run "direct, unix, round trips" -m rr -s 64 "unix:$sock_dir/upstream.sock"
+
+proxy_listen=unix:$sock_dir/proxy.sock
+proxy_upstream=unix:$sock_dir/upstream.sock
+for engine in $engines; do
+  start_proxy "$engine"
+  run_proxied "$engine, unix, round trips" -m rr -s 64
+  run_proxied "$engine, unix, 16 KiB round trips" -m rr -s 16384
+  run_proxied "$engine, unix, bulk streams" -m stream -s 65536
+done
@@ -0,0 +1,293 @@
+/* upstream.c
+ *
+ * Benchmark upstream: an epoll server that echoes or discards whatever it receives.
+ * Each thread has its own SO_REUSEPORT listener and epoll set, like the proxy's workers.
+ * In udp mode, each thread echoes datagrams off its own SO_REUSEPORT socket instead.
+ * Unix sockets have no SO_REUSEPORT, so the threads share one listener.
+ */
+
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bench.h"
+
+#define UPSTREAM_EVENTS 256
+#define UPSTREAM_BATCH 64  // datagrams per recvmmsg
+#define UPSTREAM_DATAGRAM_LEN 65536
+
+typedef struct {
+  int fd;
+  size_t pending;  // echoed bytes not yet written
+  size_t offset;
+  char buffer[BENCH_BUFFER_LEN];
+} upstream_conn;
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  int echo;  // or discard
+  int udp;  // echo datagrams
+  int listen_fd;  // shared by every thread for Unix sockets; -1 for a listener of its own
+  pthread_t thread;
+} upstream_thread;
+
+// -- DECLARATIONS --
+
+static void *_serve(void *arg);
+/* Echoes datagrams, a batch at a time; blocks, since the socket is all the thread has. */
+static void _serve_udp(const upstream_thread *t);
+static int _listen(const upstream_thread *t);
+static void _accept(int epoll_fd, int listen_fd);
+/* Moves as many bytes as the socket allows. @return 0, or -1 once the connection is done. */
+static int _relay(upstream_conn *c, int echo);
+static void _usage(const char *prog);
+
+// -- PUBLIC --
+
+int main(int argc, char **argv) {
+
+  upstream_thread *threads = NULL;
+  int nthreads = 1;
+  int echo = 1;
+  int udp = 0;
+  int c = 0;
+  int i = 0;
+
+  while (-1 != (c = getopt(argc, argv, "m:t:h"))) {
+    switch (c) {
+      case 'm':
+        if (0 == strcmp(optarg, "echo")) {
+          echo = 1;
+        } else if (0 == strcmp(optarg, "sink")) {
+          echo = 0;
+        } else if (0 == strcmp(optarg, "udp")) {
+          udp = 1;
+        } else {
+          _usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 't':
+        if (0 >= (nthreads = atoi(optarg))) {
+          _usage(argv[0]);
+          return 1;
+        }
+        break;
+      default:
+        _usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    _usage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);  // clients hang up with echoes in flight
+  if (NULL == (threads = calloc(nthreads, sizeof(upstream_thread)))) {
+    perror("calloc");
+    return 1;
+  }
+  for (i = 0; i < nthreads; i++) {
+    threads[i].echo = echo;
+    threads[i].udp = udp;
+    threads[i].listen_fd = 0 < i ? threads[0].listen_fd : -1;
+    if (0 != bench_resolve(argv[optind], &threads[i].addr, &threads[i].addr_len)) {
+      return 1;
+    }
+    if (0 == i && AF_UNIX == threads[0].addr.ss_family && 0 > (threads[0].listen_fd = _listen(&threads[0]))) {
+      return 1;
+    }
+    if (0 != pthread_create(&threads[i].thread, NULL, _serve, &threads[i])) {
+      return 1;
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i].thread, NULL);
+  }
+  free(threads);
+  return 0;
+}
+
+// -- PRIVATE --
+
+static void *_serve(void *arg) {
+
+  upstream_thread *t = arg;
+  struct epoll_event events[UPSTREAM_EVENTS];
+  struct epoll_event ev;
+  int listen_fd = -1;
+  int epoll_fd = -1;
+  int n = 0;
+  int i = 0;
+
+  if (t->udp) {
+    _serve_udp(t);
+    return NULL;
+  }
+
+  listen_fd = 0 <= t->listen_fd ? t->listen_fd : _listen(t);
+  if (0 > listen_fd || 0 > (epoll_fd = epoll_create1(0))) {
+    exit(1);
+  }
+
+  // the listener is registered with a NULL pointer, connections with their state
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+  for (;;) {
+    if (0 > (n = epoll_wait(epoll_fd, events, UPSTREAM_EVENTS, -1))) {
+      if (EINTR == errno) continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (i = 0; i < n; i++) {
+      upstream_conn *c = events[i].data.ptr;
+      if (NULL == c) {
+        _accept(epoll_fd, listen_fd);
+      } else if (0 != _relay(c, t->echo)) {
+        close(c->fd);  // also leaves the epoll set
+        free(c);
+      }
+    }
+  }
+  return NULL;
+}
+
+static void _serve_udp(const upstream_thread *t) {
+
+  char *buffers = malloc((size_t) UPSTREAM_BATCH * UPSTREAM_DATAGRAM_LEN);
+  struct mmsghdr msgs[UPSTREAM_BATCH];
+  struct iovec iovs[UPSTREAM_BATCH];
+  struct sockaddr_storage addrs[UPSTREAM_BATCH];
+  int fd = _listen(t);
+  int n = 0;
+  int i = 0;
+
+  if (0 > fd || NULL == buffers) {
+    exit(1);
+  }
+
+  for (;;) {
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < UPSTREAM_BATCH; i++) {
+      iovs[i].iov_base = buffers + (size_t) i * UPSTREAM_DATAGRAM_LEN;
+      iovs[i].iov_len = UPSTREAM_DATAGRAM_LEN;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+    // MSG_WAITFORONE: block for the first datagram, then take whatever else is queued
+    if (0 > (n = recvmmsg(fd, msgs, UPSTREAM_BATCH, MSG_WAITFORONE, NULL))) {
+      if (EINTR == errno) continue;
+      perror("recvmmsg");
+      exit(1);
+    }
+    for (i = 0; i < n; i++) {
+      iovs[i].iov_len = msgs[i].msg_len;
+    }
+    sendmmsg(fd, msgs, n, 0);
+  }
+}
+
+static int _listen(const upstream_thread *t) {
+
+  int fd = socket(t->addr.ss_family, t->udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+  int yes = 1;
+
+  if (0 > fd) {
+    perror("socket");
+    return -1;
+  }
+  if (AF_UNIX == t->addr.ss_family) {
+    unlink(((const struct sockaddr_un *) &t->addr)->sun_path);  // left behind by an earlier run
+  } else {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+  }
+  if (t->udp) {
+    if (0 != bind(fd, (const struct sockaddr *) &t->addr, t->addr_len)) {
+      perror("bind");
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+  if (0 != bind(fd, (const struct sockaddr *) &t->addr, t->addr_len) ||
+      0 != listen(fd, 4096) || 0 != bench_nonblocking(fd)) {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void _accept(int epoll_fd, int listen_fd) {
+
+  struct epoll_event ev;
+  upstream_conn *c = NULL;
+  int fd = -1;
+
+  while (0 <= (fd = accept(listen_fd, NULL, NULL))) {
+    if (0 != bench_nonblocking(fd) || NULL == (c = calloc(1, sizeof(upstream_conn)))) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+      close(fd);
+      free(c);
+    }
+  }
+}
+
+static int _relay(upstream_conn *c, int echo) {
+
+  ssize_t n = 0;
+
+  // edge-triggered, so keep going until the socket would block
+  for (;;) {
+    while (0 < c->pending) {
+      if (0 > (n = write(c->fd, c->buffer + c->offset, c->pending))) {
+        return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+      }
+      c->offset += n;
+      c->pending -= n;
+    }
+
+    if (0 > (n = read(c->fd, c->buffer, sizeof(c->buffer)))) {
+      return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+    }
+    if (0 == n) {
+      return -1;
+    }
+    if (echo) {
+      c->offset = 0;
+      c->pending = n;
+    }
+  }
+}
+
+static void _usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] HOST:PORT|unix:PATH\n"
+          "  -m MODE  echo (send everything back), sink (discard it) or udp (echo datagrams) (default echo)\n"
+          "  -t N     threads, each with its own listener (default 1)\n",
+          prog);
+}
@@ -0,0 +1,196 @@
+/* admin.c
+ *
+ * Local admin listener that answers every request with the proxy's metrics.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "admin.h"
+
+#define ADMIN_MAX_REQUEST 8192  // larger request heads are answered without reading further
+#define ADMIN_TIMEOUT_S 5
+
+struct admin_conn_struct {
+  admin_server *admin;
+  struct bufferevent *bev;
+  int responded;
+  admin_conn *prev;
+  admin_conn *next;
+};
+
+// -- DECLARATIONS --
+
+static void _accept_cb(evutil_socket_t listen_fd, short event, void *arg);
+/* Writes the response, and closes the connection once it is flushed. */
+static void _respond(admin_conn *ac);
+static void _conn_free(admin_conn *ac);
+static void _read_cb(struct bufferevent *bev, void *arg);
+static void _write_cb(struct bufferevent *bev, void *arg);
+static void _event_cb(struct bufferevent *bev, short what, void *arg);
+
+// -- PUBLIC --
+
+admin_server *admin_new(struct event_base *ev_base, int listen_fd, admin_render_cb render, void *arg) {
+
+  admin_server *admin = NULL;
+
+  if (NULL == (admin = calloc(1, sizeof(admin_server)))) {
+    error("calloc admin_server");
+    close(listen_fd);
+    return NULL;
+  }
+  admin->listen_fd = listen_fd;
+  admin->render = render;
+  admin->arg = arg;
+
+  if (0 != evutil_make_socket_nonblocking(listen_fd) ||
+      NULL == (admin->ev_listen = event_new(ev_base, listen_fd, EV_READ | EV_PERSIST, _accept_cb, admin)) ||
+      0 != event_add(admin->ev_listen, NULL)) {
+    admin_free(admin);
+    return NULL;
+  }
+
+  return admin;
+}
+
+void admin_free(admin_server *admin) {
+  while (NULL != admin->conns) {
+    _conn_free(admin->conns);
+  }
+  if (NULL != admin->ev_listen) {
+    event_free(admin->ev_listen); admin->ev_listen = NULL;
+  }
+  close(admin->listen_fd); admin->listen_fd = -1;
+  free(admin);
+}
+
+// -- PRIVATE --
+
+static void _accept_cb(evutil_socket_t listen_fd, short event, void *arg) {
+
+  struct timeval timeout = { ADMIN_TIMEOUT_S, 0 };
+  admin_server *admin = arg;
+  admin_conn *ac = NULL;
+  int fd = -1;
+
+  (void) event;
+
+  if (0 > (fd = accept(listen_fd, NULL, NULL))) {
+    if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno && ECONNABORTED != errno) {
+      error("accept admin");
+    }
+    return;
+  }
+
+  if (NULL == (ac = calloc(1, sizeof(admin_conn)))) {
+    error("calloc admin_conn");
+    close(fd);
+    return;
+  }
+  ac->admin = admin;
+
+  if (0 != evutil_make_socket_nonblocking(fd) ||
+      NULL == (ac->bev = bufferevent_socket_new(event_get_base(admin->ev_listen), fd, BEV_OPT_CLOSE_ON_FREE))) {
+    close(fd);
+    free(ac);
+    return;
+  }
+
+  ac->next = admin->conns;
+  if (NULL != ac->next) {
+    ac->next->prev = ac;
+  }
+  admin->conns = ac;
+
+  bufferevent_setcb(ac->bev, _read_cb, NULL, _event_cb, ac);
+  bufferevent_set_timeouts(ac->bev, &timeout, &timeout);
+  if (0 != bufferevent_enable(ac->bev, EV_READ | EV_WRITE)) {
+    _conn_free(ac);
+  }
+}
+
+static void _respond(admin_conn *ac) {
+
+  struct evbuffer *body = NULL;
+  struct evbuffer *output = bufferevent_get_output(ac->bev);
+  int rc = SUCCESS;
+
+  ac->responded = 1;
+  bufferevent_disable(ac->bev, EV_READ);
+
+  if (NULL == (body = evbuffer_new())) {
+    _conn_free(ac);
+    return;
+  }
+
+  if (SUCCESS != (rc = ac->admin->render(body, ac->admin->arg))) {
+    log_error("rendering admin response failed with rc: %d", rc);
+    evbuffer_add_printf(output, "HTTP/1.0 500 Internal Server Error\r\nConnection: close\r\n\r\n");
+  } else {
+    evbuffer_add_printf(output,
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n",
+                        evbuffer_get_length(body));
+    evbuffer_add_buffer(output, body);
+  }
+  evbuffer_free(body); body = NULL;
+
+  // close once written
+  bufferevent_setcb(ac->bev, NULL, _write_cb, _event_cb, ac);
+}
+
+static void _conn_free(admin_conn *ac) {
+  if (NULL != ac->prev) {
+    ac->prev->next = ac->next;
+  } else {
+    ac->admin->conns = ac->next;
+  }
+  if (NULL != ac->next) {
+    ac->next->prev = ac->prev;
+  }
+  bufferevent_free(ac->bev); ac->bev = NULL;
+  free(ac);
+}
+
+static void _read_cb(struct bufferevent *bev, void *arg) {
+
+  admin_conn *ac = arg;
+  struct evbuffer *input = bufferevent_get_input(bev);
+
+  if (-1 != evbuffer_search(input, "\r\n\r\n", 4, NULL).pos ||
+      -1 != evbuffer_search(input, "\n\n", 2, NULL).pos ||
+      ADMIN_MAX_REQUEST <= evbuffer_get_length(input)) {
+    _respond(ac);
+  }
+}
+
+static void _write_cb(struct bufferevent *bev, void *arg) {
+  (void) bev;
+  _conn_free(arg);
+}
+
+static void _event_cb(struct bufferevent *bev, short what, void *arg) {
+
+  admin_conn *ac = arg;
+
+  (void) bev;
+
+  // a client that closes its side without a blank line still gets an answer
+  if ((what & BEV_EVENT_EOF) && !ac->responded) {
+    _respond(ac);
+    return;
+  }
+  _conn_free(ac);
+}
@@ -0,0 +1,39 @@
+/* admin.h
+ *
+ * Local admin listener that answers every request with the proxy's metrics.
+ */
+#ifndef admin_h
+#define admin_h
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include "defs.h"
+
+typedef struct admin_conn_struct admin_conn;
+typedef struct admin_server_struct admin_server;
+
+/* Appends the response body. @return success or error codes. */
+typedef int (*admin_render_cb)(struct evbuffer *out, void *arg);
+
+/* Runs on the control loop, away from the workers. Requests are not parsed: once a
+ * blank line (or EOF) ends the request head, the client gets an HTTP/1.0 response
+ * with the rendered text, so both curl and Prometheus can scrape it.
+ */
+struct admin_server_struct {
+  int listen_fd;
+  struct event *ev_listen;
+  admin_render_cb render;
+  void *arg;
+  admin_conn *conns;  // open requests, freed along with the server
+};
+
+/* Starts accepting on listen_fd, which the server takes ownership of.
+ *
+ * @return the server, or NULL on error.
+ */
+admin_server *admin_new(struct event_base *ev_base, int listen_fd, admin_render_cb render, void *arg);
+
+/* Closes the listener and any open requests. */
+void admin_free(admin_server *admin);
+
+#endif /* admin_h */
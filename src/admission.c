@@ -0,0 +1,197 @@
+/* admission.c
+ *
+ * Per-client-address admission control: caps the connections a client address may have
+ * open at once, and the rate at which it may open new ones.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include "metrics.h"  // before defs.h, which libevent's headers trip over
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "admission.h"
+
+#define ADMISSION_BUCKETS (ADMISSION_SLOTS / ADMISSION_PROBES)
+
+// -- DECLARATIONS --
+
+/* Writes the address as 16 bytes. @return false for anything but IPv4 and IPv6. */
+static int _key(const struct sockaddr *client, uint8_t *key);
+static uint32_t _hash(const admission *a, const uint8_t *key);
+
+// -- PUBLIC --
+
+admission *admission_new(int max_active, int rate, int burst, uint64_t seed) {
+
+  admission *a = NULL;
+  int i = 0;
+
+  if (NULL == (a = calloc(1, sizeof(admission) + sizeof(admission_bucket) * ADMISSION_BUCKETS))) {
+    error("calloc admission");
+    return NULL;
+  }
+  for (i = 0; i < ADMISSION_BUCKETS; i++) {
+    pthread_mutex_init(&a->buckets[i].lock, NULL);
+  }
+  a->max_active = max_active;
+  if (0 < rate) {
+    a->interval = 1000000 / (uint64_t) rate;
+    a->tolerance = a->interval * (uint64_t) (0 < burst ? burst - 1 : 0);
+  }
+  a->seed = seed | 1;
+  return a;
+}
+
+void admission_free(admission *a) {
+  int i = 0;
+  for (i = 0; i < ADMISSION_BUCKETS; i++) {
+    pthread_mutex_destroy(&a->buckets[i].lock);
+  }
+  free(a);
+}
+
+int admission_admit(admission *a, const struct sockaddr *client, int *slot) {
+
+  uint8_t key[16];
+  uint64_t now = metrics_now();
+  uint32_t bucket = 0;
+  admission_bucket *b = NULL;
+  admission_entry *e = NULL;
+  int found = -1;
+  int reusable = -1;
+  int oldest = -1;
+  int rc = SUCCESS;
+  int i = 0;
+
+  *slot = -1;
+  if (!_key(client, key)) {
+    return SUCCESS;
+  }
+
+  bucket = _hash(a, key) % ADMISSION_BUCKETS;
+  b = &a->buckets[bucket];
+  pthread_mutex_lock(&b->lock);
+
+  // the whole bucket is searched, since a free-looking slot may precede the address
+  for (i = 0; i < ADMISSION_PROBES; i++) {
+    e = &b->slots[i];
+    if (0 == memcmp(e->addr, key, sizeof(key)) && (0 < e->active || e->tat > now)) {
+      found = i;
+      break;
+    }
+    if (0 > reusable && 0 == e->active && e->tat <= now) {
+      reusable = i;
+    }
+    if (0 == e->active && (0 > oldest || e->tat < b->slots[oldest].tat)) {
+      oldest = i;
+    }
+  }
+
+  if (0 > found) {
+    if (0 > reusable && 0 > oldest) {
+      pthread_mutex_unlock(&b->lock);
+      return ERR_ADMIT_FULL;
+    }
+    if (0 > reusable) {
+      // an idle address forgets what it has still to pay back, rather than let this one in unchecked
+      atomic_fetch_add_explicit(&a->evicted, 1, memory_order_relaxed);
+    }
+    found = 0 <= reusable ? reusable : oldest;
+    e = &b->slots[found];
+    memcpy(e->addr, key, sizeof(key));
+    e->active = 0;
+    e->tat = 0;
+  }
+  e = &b->slots[found];
+
+  if (0 < a->max_active && e->active >= (uint32_t) a->max_active) {
+    rc = ERR_ADMIT_CONNS;
+  } else if (0 < a->interval) {
+    if (e->tat < now) {
+      e->tat = now;
+    }
+    if (e->tat - now > a->tolerance) {
+      rc = ERR_ADMIT_RATE;
+    } else {
+      e->tat += a->interval;
+    }
+  }
+
+  if (SUCCESS == rc) {
+    e->active++;
+    *slot = (int) bucket * ADMISSION_PROBES + found;
+  }
+  pthread_mutex_unlock(&b->lock);
+  return rc;
+}
+
+void admission_release(admission *a, int slot) {
+
+  admission_bucket *b = NULL;
+  admission_entry *e = NULL;
+
+  if (0 > slot) {
+    return;
+  }
+  b = &a->buckets[slot / ADMISSION_PROBES];
+  e = &b->slots[slot % ADMISSION_PROBES];
+  pthread_mutex_lock(&b->lock);
+  if (0 < e->active) {
+    e->active--;
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+void admission_report(admission *a) {
+
+  uint64_t now = metrics_now();
+  unsigned long taken = 0;
+  int i = 0;
+  int j = 0;
+
+  for (i = 0; i < ADMISSION_BUCKETS; i++) {
+    pthread_mutex_lock(&a->buckets[i].lock);
+    for (j = 0; j < ADMISSION_PROBES; j++) {
+      if (0 < a->buckets[i].slots[j].active || a->buckets[i].slots[j].tat > now) {
+        taken++;
+      }
+    }
+    pthread_mutex_unlock(&a->buckets[i].lock);
+  }
+  log_info("admission: %lu of %d addresses tracked, %lu idle ones evicted",
+           taken, ADMISSION_SLOTS, atomic_load_explicit(&a->evicted, memory_order_relaxed));
+}
+
+// -- PRIVATE --
+
+static int _key(const struct sockaddr *client, uint8_t *key) {
+  memset(key, 0, 16);
+  switch (client->sa_family) {
+    case AF_INET:
+      key[10] = key[11] = 0xff;
+      memcpy(key + 12, &((const struct sockaddr_in *) client)->sin_addr, 4);
+      return 1;
+    case AF_INET6:
+      memcpy(key, &((const struct sockaddr_in6 *) client)->sin6_addr, 16);
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static uint32_t _hash(const admission *a, const uint8_t *key) {
+
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+  uint64_t h = 0;
+
+  // seeded per process, so that clients cannot aim their addresses at one bucket
+  memcpy(&lo, key, 8);
+  memcpy(&hi, key + 8, 8);
+  h = (lo ^ a->seed) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 29) ^ hi) * 0xbf58476d1ce4e5b9ULL;
+  return (uint32_t) (h >> 32);
+}
@@ -0,0 +1,72 @@
+/* admission.h
+ *
+ * Per-client-address admission control: caps the connections a client address may have
+ * open at once, and the rate at which it may open new ones.
+ */
+#ifndef admission_h
+#define admission_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "defs.h"
+
+typedef struct admission_struct admission;
+
+/* One client address. The rate is a token bucket kept as the theoretical arrival time
+ * of GCRA: a connection is admitted unless tat is more than the burst ahead of now.
+ */
+typedef struct {
+  uint8_t addr[16];  // IPv4 addresses are mapped into IPv6
+  uint32_t active;
+  uint64_t tat;  // metrics_now() by which the bucket is full again
+} admission_entry;
+
+/* ADMISSION_PROBES slots, which the addresses hashed to them share, under one lock. */
+typedef struct {
+  _Alignas(64) pthread_mutex_t lock;
+  admission_entry slots[ADMISSION_PROBES];
+} admission_bucket;
+
+/* One table, shared by the workers, of ADMISSION_SLOTS entries split into buckets. An
+ * address is looked for in the bucket its hash picks; an entry with nothing open and a full
+ * token bucket is as good as free, and is taken over by the next address that needs a slot.
+ * If there is none, the idle entry whose tokens come back soonest is evicted, and if every
+ * entry has connections open, the client is rejected.
+ */
+struct admission_struct {
+  int max_active;  // per address; 0 for no cap
+  uint64_t interval;  // microseconds per connection at the sustained rate; 0 for no rate limit
+  uint64_t tolerance;  // how far ahead of now tat may run, i.e. the burst
+  uint64_t seed;
+  _Atomic unsigned long evicted;
+  admission_bucket buckets[];
+};
+
+/* Creates a table; rate is in connections per second.
+ *
+ * @return the table, or NULL on error.
+ */
+admission *admission_new(int max_active, int rate, int burst, uint64_t seed);
+
+void admission_free(admission *a);
+
+/* Admits a client, counting it as open until admission_release is called with slot,
+ * which is -1 for clients that are not tracked (not an IP address). Safe to call from
+ * any thread.
+ *
+ * @return success, ERR_ADMIT_CONNS if the address is at its cap, ERR_ADMIT_RATE if it
+ *         is opening connections too fast, or ERR_ADMIT_FULL if its bucket of the table
+ *         has no entry to spare.
+ */
+int admission_admit(admission *a, const struct sockaddr *client, int *slot);
+
+/* Counts an admitted client as closed; safe to call from any thread. */
+void admission_release(admission *a, int slot);
+
+/* Logs how many slots are taken, and how many idle addresses were evicted. */
+void admission_report(admission *a);
+
+#endif /* admission_h */
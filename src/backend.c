@@ -0,0 +1,356 @@
+/* backend.c
+ *
+ * Per-worker set of upstream backends, and the strategies for picking one.
+ *
+ * Selection runs on every accept, so each strategy is a handful of integer
+ * operations: a cursor for round-robin, a scan of the (short) backend array for
+ * least-connections, two random probes for power-of-two-choices, and a binary
+ * search of a ring of BACKEND_VNODES points per backend for consistent hashing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <event2/util.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "client.h"
+#include "backend.h"
+
+// -- DECLARATIONS --
+
+/* FNV-1a, with a final mix so that keys differing in one byte spread over the ring. */
+static uint32_t _hash32(const void *data, size_t len);
+/* Rebuilds the hash ring from the current backends. */
+static int _ring_build(backend_set *set);
+static int _vnode_cmp(const void *a, const void *b);
+static uint32_t _random(backend_set *set);
+/* Share of new connections the backend should get, out of 100: 0 while ejected, and
+ * ramping up from BACKEND_MIN_WEIGHT during the slow start after re-admission. */
+static int _weight(backend *b, uint64_t *now);
+/* True if a's load relative to its weight is below b's. */
+static int _less_loaded(const backend *a, int wa, const backend *b, int wb);
+/* Each strategy returns NULL if every backend is ejected. */
+static backend *_round_robin(backend_set *set, uint64_t *now);
+static backend *_least_conn(backend_set *set, uint64_t *now);
+static backend *_p2c(backend_set *set, uint64_t *now);
+static backend *_hash(backend_set *set, const struct sockaddr *client, socklen_t client_len, uint64_t *now);
+
+static const char *_strategy_names[] = { "rr", "least", "p2c", "hash" };
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+// -- PUBLIC --
+
+int backend_strategy_parse(const char *name, backend_strategy *strategy) {
+  size_t i = 0;
+  for (i = 0; i < sizeof(_strategy_names) / sizeof(_strategy_names[0]); i++) {
+    if (0 == strcmp(name, _strategy_names[i])) {
+      *strategy = (backend_strategy) i;
+      return SUCCESS;
+    }
+  }
+  return ERR_OPTS_PARSE;
+}
+
+const char *backend_strategy_name(backend_strategy strategy) {
+  return _strategy_names[strategy];
+}
+
+backend_set *backend_set_new(backend_strategy strategy, uint32_t seed) {
+
+  backend_set *set = NULL;
+
+  if (NULL == (set = calloc(1, sizeof(backend_set)))) {
+    error("calloc backend_set");
+    return NULL;
+  }
+  set->strategy = strategy;
+  set->rng = 0 != seed ? seed : 1;  // xorshift never leaves 0
+  set->next = seed;
+  return set;
+}
+
+void backend_set_free(backend_set *set) {
+  int i = 0;
+  for (i = 0; i < set->nbackends; i++) {
+    if (NULL != set->backends[i].pool) {
+      upstream_pool_free(set->backends[i].pool); set->backends[i].pool = NULL;
+    }
+    free(set->backends[i].host); set->backends[i].host = NULL;
+    free(set->backends[i].port); set->backends[i].port = NULL;
+  }
+  free(set->backends); set->backends = NULL;
+  free(set->ring); set->ring = NULL;
+  free(set);
+}
+
+int backend_set_add(backend_set *set, const str host, const str port) {
+
+  backend *backends = NULL;
+  backend *b = NULL;
+  int port_num = 0;
+
+  // a Unix socket has its path for a host, and no port
+  if (0 != strncmp(host, "unix:", 5) && 0 > (port_num = client_port(port))) {
+    return ERR_NET_HOST;
+  }
+
+  // only called while the worker is being built, before any relay points into the array
+  if (NULL == (backends = realloc(set->backends, (set->nbackends + 1) * sizeof(backend)))) {
+    error("realloc backends");
+    return ERR_CONN_DETAILS_NEW;
+  }
+  set->backends = backends;
+
+  b = &set->backends[set->nbackends];
+  memset(b, 0, sizeof(backend));
+  b->port_num = port_num;
+  if (NULL == (b->host = strndup(host, MAX_LINE)) || NULL == (b->port = strndup(port, MAX_LINE))) {
+    error("strndup backend");
+    free(b->host); b->host = NULL;
+    return ERR_CONN_DETAILS_NEW;
+  }
+  set->nbackends++;
+
+  return _ring_build(set);
+}
+
+backend *backend_select(backend_set *set, const struct sockaddr *client, socklen_t client_len) {
+
+  backend *b = NULL;
+  uint64_t now = 0;  // read on demand, only while a backend is warming up
+
+  if (1 == set->nbackends) {
+    return &set->backends[0];
+  }
+
+  switch (set->strategy) {
+    case BACKEND_LEAST_CONN:
+      b = _least_conn(set, &now);
+      break;
+    case BACKEND_P2C:
+      b = _p2c(set, &now);
+      break;
+    case BACKEND_HASH:
+      b = _hash(set, client, client_len, &now);
+      break;
+    case BACKEND_ROUND_ROBIN:
+    default:
+      b = _round_robin(set, &now);
+      break;
+  }
+
+  // every backend is ejected; trying one beats refusing the client
+  if (NULL == b) {
+    b = &set->backends[set->next++ % set->nbackends];
+  }
+  return b;
+}
+
+uint64_t backend_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void backend_set_report(const backend_set *set, int worker_id) {
+  int i = 0;
+  for (i = 0; i < set->nbackends; i++) {
+    const backend *b = &set->backends[i];
+    log_info("worker %d backend %s:%s: %s, %d active, %lu total, %lu probes, %lu probe failures, "
+               "%lu passive failures, %lu ejections",
+               worker_id, b->host, b->port, b->ejected ? "ejected" : (0 != b->admitted_at ? "warming" : "healthy"),
+               b->active, b->total, b->probes, b->probe_failures, b->passive_failures, b->ejections_total);
+    if (NULL != set->backends[i].pool) {
+      upstream_pool_report(set->backends[i].pool, worker_id);
+    }
+  }
+}
+
+// -- PRIVATE --
+
+static uint32_t _hash32(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint32_t hash = FNV_OFFSET;
+  while (0 < len--) {
+    hash ^= *p++;
+    hash *= FNV_PRIME;
+  }
+  // murmur3 finalizer
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static int _ring_build(backend_set *set) {
+
+  backend_vnode *ring = NULL;
+  char key[BUFFER_LEN];
+  int i = 0;
+  int v = 0;
+  int n = 0;
+
+  if (NULL == (ring = calloc(set->nbackends * BACKEND_VNODES, sizeof(backend_vnode)))) {
+    error("calloc ring");
+    return ERR_CONN_DETAILS_NEW;
+  }
+
+  // points depend only on the backend's name, so every worker (and every restart) agrees
+  for (i = 0; i < set->nbackends; i++) {
+    for (v = 0; v < BACKEND_VNODES; v++) {
+      n = snprintf(key, sizeof(key), "%s:%s#%d", set->backends[i].host, set->backends[i].port, v);
+      ring[i * BACKEND_VNODES + v].hash = _hash32(key, (size_t) n < sizeof(key) ? (size_t) n : sizeof(key) - 1);
+      ring[i * BACKEND_VNODES + v].backend = i;
+    }
+  }
+  qsort(ring, set->nbackends * BACKEND_VNODES, sizeof(backend_vnode), _vnode_cmp);
+
+  free(set->ring);
+  set->ring = ring;
+  set->nvnodes = set->nbackends * BACKEND_VNODES;
+  return SUCCESS;
+}
+
+static int _vnode_cmp(const void *a, const void *b) {
+  uint32_t x = ((const backend_vnode *) a)->hash;
+  uint32_t y = ((const backend_vnode *) b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t _random(backend_set *set) {
+  uint32_t x = set->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return set->rng = x;
+}
+
+static int _weight(backend *b, uint64_t *now) {
+
+  uint64_t elapsed = 0;
+
+  if (b->ejected) {
+    return 0;
+  }
+  if (0 == b->admitted_at) {
+    return 100;
+  }
+
+  if (0 == *now) {
+    *now = backend_now();
+  }
+  elapsed = *now - b->admitted_at;
+  if (elapsed >= SLOW_START_MS) {
+    b->admitted_at = 0;
+    return 100;
+  }
+  return BACKEND_MIN_WEIGHT + (int) ((100 - BACKEND_MIN_WEIGHT) * elapsed / SLOW_START_MS);
+}
+
+static int _less_loaded(const backend *a, int wa, const backend *b, int wb) {
+  // (active + 1) / weight, cross-multiplied; the + 1 lets weight matter on idle backends
+  return (uint64_t) (a->active + 1) * wb < (uint64_t) (b->active + 1) * wa;
+}
+
+static backend *_round_robin(backend_set *set, uint64_t *now) {
+
+  backend *warming = NULL;
+  backend *b = NULL;
+  int w = 0;
+  int i = 0;
+
+  for (i = 0; i < set->nbackends; i++) {
+    b = &set->backends[set->next++ % set->nbackends];
+    w = _weight(b, now);
+    if (100 == w || (0 < w && (int) (_random(set) % 100) < w)) {
+      return b;
+    }
+    if (0 < w && NULL == warming) {
+      warming = b;
+    }
+  }
+  return warming;
+}
+
+static backend *_least_conn(backend_set *set, uint64_t *now) {
+
+  backend *best = NULL;
+  int best_w = 0;
+  int start = set->next++ % set->nbackends;  // rotate ties across backends
+  int i = 0;
+
+  for (i = 0; i < set->nbackends; i++) {
+    backend *b = &set->backends[(start + i) % set->nbackends];
+    int w = _weight(b, now);
+    if (0 < w && (NULL == best || _less_loaded(b, w, best, best_w))) {
+      best = b;
+      best_w = w;
+    }
+  }
+  return best;
+}
+
+static backend *_p2c(backend_set *set, uint64_t *now) {
+
+  uint32_t r = _random(set);
+  int i = r % set->nbackends;
+  int j = (i + 1 + (r >> 16) % (set->nbackends - 1)) % set->nbackends;  // distinct from i
+  int wi = _weight(&set->backends[i], now);
+  int wj = _weight(&set->backends[j], now);
+
+  if (0 == wi && 0 == wj) {
+    return _round_robin(set, now);
+  } else if (0 == wi) {
+    return &set->backends[j];
+  } else if (0 == wj) {
+    return &set->backends[i];
+  }
+  return _less_loaded(&set->backends[j], wj, &set->backends[i], wi) ? &set->backends[j] : &set->backends[i];
+}
+
+static backend *_hash(backend_set *set, const struct sockaddr *client, socklen_t client_len, uint64_t *now) {
+
+  uint32_t hash = 0;
+  int lo = 0;
+  int hi = set->nvnodes;
+  int mid = 0;
+  int i = 0;
+
+  // hash the address only, so every connection from one client lands on one backend
+  if (NULL != client && AF_INET == client->sa_family && client_len >= sizeof(struct sockaddr_in)) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *) client;
+    hash = _hash32(&in->sin_addr, sizeof(in->sin_addr));
+  } else if (NULL != client && AF_INET6 == client->sa_family && client_len >= sizeof(struct sockaddr_in6)) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) client;
+    hash = _hash32(&in6->sin6_addr, sizeof(in6->sin6_addr));
+  }
+
+  // first point at or after the hash, wrapping around the ring
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (set->ring[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  // clients of an ejected backend move to the next one on the ring, and come back once it
+  // is re-admitted; stickiness matters more than slow start here, so any weight will do
+  for (i = 0; i < set->nvnodes; i++) {
+    backend *b = &set->backends[set->ring[(lo + i) % set->nvnodes].backend];
+    if (0 < _weight(b, now)) {
+      return b;
+    }
+  }
+  return NULL;
+}
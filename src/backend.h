@@ -0,0 +1,108 @@
+/* backend.h
+ *
+ * Per-worker set of upstream backends, and the strategies for picking one.
+ */
+#ifndef backend_h
+#define backend_h
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include "defs.h"
+#include "upstream_pool.h"
+
+typedef struct backend_struct backend;
+typedef struct backend_set_struct backend_set;
+
+typedef enum {
+  BACKEND_ROUND_ROBIN,
+  BACKEND_LEAST_CONN,
+  BACKEND_P2C,  // power of two random choices
+  BACKEND_HASH,  // consistent hash of the client address
+} backend_strategy;
+
+struct backend_struct {
+  str host;
+  str port;
+  int port_num;
+  upstream_pool *pool;  // pre-connected sockets, or NULL
+  int active;  // relays to this backend on this worker
+  unsigned long total;
+
+  // health, maintained by health.c; selection skips ejected backends
+  int ejected;
+  int failures;  // consecutive failed connects, active or passive
+  int successes;  // consecutive good probes while ejected
+  int ejections;  // doubles the next ejection while the backend keeps failing
+  uint64_t ejected_until;  // monotonic ms
+  uint64_t admitted_at;  // start of the slow start after re-admission; 0 at full weight
+  unsigned long probes;
+  unsigned long probe_failures;
+  unsigned long passive_failures;
+  unsigned long ejections_total;
+};
+
+/* A point on the consistent hash ring. */
+typedef struct {
+  uint32_t hash;
+  int backend;
+} backend_vnode;
+
+/* Each worker has its own set, so the counters are plain ints; least-connections and
+ * power-of-two-choices balance the connections of one worker at a time.
+ */
+struct backend_set_struct {
+  backend_strategy strategy;
+  backend *backends;
+  int nbackends;
+  unsigned int next;  // round-robin cursor, also rotates the least-connections scan
+  uint32_t rng;  // xorshift state for power-of-two-choices
+  backend_vnode *ring;  // sorted by hash
+  int nvnodes;
+};
+
+/* Parses "rr", "least", "p2c" or "hash".
+ *
+ * @return success or ERR_OPTS_PARSE.
+ */
+int backend_strategy_parse(const char *name, backend_strategy *strategy);
+
+/* Returns the name backend_strategy_parse accepts for the strategy. */
+const char *backend_strategy_name(backend_strategy strategy);
+
+/* Creates an empty set; seed varies the random choices between workers. */
+backend_set *backend_set_new(backend_strategy strategy, uint32_t seed);
+
+/* Frees the backends along with their pools. */
+void backend_set_free(backend_set *set);
+
+/* Adds host:port to the set and places it on the hash ring.
+ *
+ * @return success or error codes.
+ */
+int backend_set_add(backend_set *set, const str host, const str port);
+
+/* Picks a backend for a new client, using the client's address for consistent hashing.
+ * Ejected backends are skipped unless every backend is ejected, and re-admitted ones
+ * get a growing share of connections while they warm up. The caller counts the
+ * connection with backend_acquire.
+ */
+backend *backend_select(backend_set *set, const struct sockaddr *client, socklen_t client_len);
+
+/* Counts a relay that starts or finishes with the backend. */
+static inline void backend_acquire(backend *b) {
+  b->active++;
+  b->total++;
+}
+
+static inline void backend_release(backend *b) {
+  b->active--;
+}
+
+/* Returns monotonic milliseconds. */
+uint64_t backend_now(void);
+
+/* Logs the per-backend counters, and their pools. */
+void backend_set_report(const backend_set *set, int worker_id);
+
+#endif /* backend_h */
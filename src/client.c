@@ -3,6 +3,8 @@
  * client for connecting to the upstream
  */
 
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
@@ -10,57 +12,89 @@
 #include <sys/param.h>
 #include <netdb.h>
 #include <sys/socket.h>
-#include <zlog.h>
+#include <event2/bufferevent.h>
+#include "log.h"
 #include "config.h"
 #include "errors.h"
 #include "client.h"
 
-int init_client_fd(const str up_addr,
-                   const str up_port,
-                   int *sock_fd) {
+int client_port(const str up_port) {
 
-  char printable[BUFFER_LEN];
-  struct addrinfo hints;
-  struct addrinfo *servinfo = NULL;
-  int client_fd = -1;
-  struct addrinfo *p = NULL;
+  char *end = NULL;
+  long port = 0;
+  struct servent *service = NULL;
 
-  memset(printable, 0, BUFFER_LEN);
-  dzlog_debug("init_client_fd invoked: %s:%s", up_addr, up_port);
+  port = strtol(up_port, &end, 10);
+  if ('\0' == *end && 0 < port && 65536 > port) {
+    return (int) port;
+  }
 
-  // convert str to addr_info
-  inet_hints(&hints);
-  if (0 != getaddrinfo(up_addr, up_port, &hints, &servinfo)) {  // modern way, instead of gethostinfo and htons
-    error("getaddrinfo");
-    return ERR_NET_HOST;
+  // named service, e.g. "http"
+  if (NULL != (service = getservbyname(up_port, "tcp"))) {
+    return ntohs(service->s_port);
   }
 
-  // create socket
-  for(p = servinfo; NULL != p; p = p->ai_next) {
-    client_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if (0 > client_fd) {
-      continue;
-    }
-    if (0 > connect(client_fd, p->ai_addr, p->ai_addrlen)) {
-      close(client_fd);
-      continue;
-    }
-    inet_ntop_addrinfo(p, printable, BUFFER_LEN);
-    dzlog_info("connected to %s:%s", printable, up_port);
-    break;
+  log_error("unknown port: %s", up_port);
+  return -1;
+}
+
+int client_connect_timeout(struct bufferevent *bev, const struct timeval *timeout) {
+  // until the upstream connects, the write timeout doubles as the connect timeout; it is
+  // armed before the socket exists so that it also covers waiting on the resolver
+  if (0 != bufferevent_set_timeouts(bev, NULL, timeout)) {
+    log_error("bufferevent_set_timeouts failed");
+    return ERR_NET_CONNECT;
   }
+  return SUCCESS;
+}
+
+int client_connect(struct bufferevent *bev,
+                   const struct sockaddr *addr,
+                   socklen_t addr_len,
+                   const sock_profile *sock) {
+
+  char printable[BUFFER_LEN];
+  int fd = -1;
 
-  // free address struct
-  if (NULL != servinfo) {
-    freeaddrinfo(servinfo);
-    servinfo = NULL;
+  memset(printable, 0, BUFFER_LEN);
+  inet_ntop_sockaddr((struct sockaddr_storage *) addr, printable, BUFFER_LEN);
+  log_debug("client_connect invoked: %s", printable);
+
+  // the socket is made here rather than by libevent, so that its options are set before
+  // the SYN goes out; the bufferevent closes it from here on
+  if (0 > (fd = socket(addr->sa_family, SOCK_STREAM, 0))) {
+    error("socket");
+    return ERR_NET_CONNECT;
+  }
+  if (0 != evutil_make_socket_nonblocking(fd) || 0 != evutil_make_socket_closeonexec(fd)) {
+    error("fcntl");
+    close(fd);
+    return ERR_NET_CONNECT;
+  }
+  sock_profile_upstream(sock, fd, addr->sa_family);
+  if (0 != bufferevent_setfd(bev, fd)) {
+    log_error("bufferevent_setfd failed");
+    close(fd);
+    return ERR_NET_CONNECT;
   }
 
-  if (NULL == p) {
-    // reached end of loop
+  // connects without blocking; completion is reported to the event callback as
+  // BEV_EVENT_CONNECTED or BEV_EVENT_ERROR
+  if (0 != bufferevent_socket_connect(bev, (struct sockaddr *) addr, addr_len)) {
+    error("connect");
+    log_error("could not start connecting to %s", printable);
     return ERR_NET_CONNECT;
   }
 
-  *sock_fd = client_fd;
   return SUCCESS;
 }
+
+void client_connected(struct bufferevent *bev) {
+  // clear the connect timeout
+  bufferevent_set_timeouts(bev, NULL, NULL);
+}
+
+void client_connect_error(const str up_addr, const str up_port) {
+  error("connect");
+  log_error("could not connect to %s:%s", up_addr, up_port);
+}
@@ -6,14 +6,39 @@
 #ifndef client_h
 #define client_h
 
+#include <sys/time.h>
+#include <event2/bufferevent.h>
+#include <sys/socket.h>
 #include "defs.h"
+#include "sockopt.h"
 
-/* Creates a connection to the upstream host.
+/* Converts a numeric or named port to a port number.
+ *
+ * @return the port, or -1 if it is unknown.
+ */
+int client_port(const str up_port);
+
+/* Bounds how long the given socket-less bufferevent may take to resolve and connect.
  *
  * @return success or error codes.
  */
-int init_client_fd(const str up_addr,
-                   const str up_port,
-                   int *sock_fd);
+int client_connect_timeout(struct bufferevent *bev, const struct timeval *timeout);
+
+/* Starts connecting the given socket-less bufferevent to a resolved upstream address,
+ * on a socket with the given options. Bytes written to bev in the meantime are held in
+ * its output buffer until the connection is established.
+ *
+ * @return success or error codes.
+ */
+int client_connect(struct bufferevent *bev,
+                   const struct sockaddr *addr,
+                   socklen_t addr_len,
+                   const sock_profile *sock);
+
+/* Called once the event callback sees BEV_EVENT_CONNECTED. */
+void client_connected(struct bufferevent *bev);
+
+/* Logs why a connect started by client_connect failed. */
+void client_connect_error(const str up_addr, const str up_port);
 
 #endif  // client_h
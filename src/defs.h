@@ -11,6 +11,9 @@
 // -- ERROR CODES --
 #define SUCCESS 0
 
+#define ERR_OPTS_PARSE 31
+#define ERR_OPTS_HELP 32  // not an error: the usage was asked for
+
 #define ERR_LOG_INIT 41
 
 #define ERR_NET_BIND 51
@@ -18,15 +21,37 @@
 #define ERR_NET_LISTEN 53
 #define ERR_NET_FCNTL 54
 #define ERR_NET_CONNECT 55
+#define ERR_NET_SPLICE 56
+#define ERR_NET_URING 57
+#define ERR_NET_HANDOFF 58
+#define ERR_NET_SOCKOPT 59
 
 #define ERR_EVENT_BASE 61
 #define ERR_EVENT_NEW 62
 #define ERR_EVENT_ADD 63
 #define ERR_EVENT_DISPATCH 64
+#define ERR_EVENT_THREADS 65
+#define ERR_EVENT_DNS 66
 
 #define ERR_BEVENT_NEW 71
 #define ERR_BEVENT_ENABLE 72
 
 #define ERR_CONN_DETAILS_NEW 81
 
+#define ERR_THREAD_CREATE 91
+#define ERR_THREAD_JOIN 92
+
+#define ERR_METRICS_RENDER 101
+
+#define ERR_SLAB_ALLOC 111
+
+#define ERR_ADMIT_CONNS 121
+#define ERR_ADMIT_RATE 122
+#define ERR_ADMIT_FULL 123
+
+#define ERR_TLS_INIT 131
+
+#define ERR_HTTP_CACHE_INIT 141
+#define ERR_HTTP_CACHE 142
+
 #endif /* defs_h */
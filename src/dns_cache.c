@@ -0,0 +1,513 @@
+/* dns_cache.c
+ *
+ * Per-worker cache of resolved upstream addresses.
+ *
+ * Entries honor the TTL of the A/AAAA answers, and entries that are in use are
+ * refreshed in the background before they expire, so the accept path is normally
+ * a list walk. Lookups that miss while a resolution is in flight wait on it
+ * instead of starting another one. Addresses that fail to connect are remembered,
+ * and tried last.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "dns_cache.h"
+
+struct dns_waiter_struct {
+  dns_cache_cb cb;  // NULL once cancelled
+  void *arg;
+  dns_waiter *next;
+};
+
+// -- DECLARATIONS --
+
+/* Returns the entry for host:port, or NULL. */
+static dns_entry *_entry_find(dns_cache *cache, const str host, int port);
+/* Creates an empty entry and links it into the cache. */
+static dns_entry *_entry_new(dns_cache *cache, const str host, int port);
+static void _entry_free(dns_entry *entry);
+/* Starts resolving the entry; may complete before returning. */
+static void _resolve(dns_entry *entry);
+/* Adds one resolved address to the staging area. */
+static void _stage(dns_entry *entry, int family, const void *addr);
+/* Publishes the staged addresses (or records the failure) and wakes the waiters. */
+static void _resolved(dns_entry *entry, int ttl);
+/* Moves the addresses that recently failed behind the others, keeping their order. */
+static void _order(dns_entry *entry);
+/* Returns the index of addr in the entry's failed addresses, or -1. */
+static int _failed_find(const dns_entry *entry, const struct sockaddr *addr);
+static int _addr_equal(const struct sockaddr_storage *a, const struct sockaddr *b);
+static void _gai_cb(int result, struct evutil_addrinfo *res, void *arg);
+static void _dns_cb(int result, char type, int count, int ttl, void *addresses, void *arg);
+static void _refresh_cb(evutil_socket_t fd, short event, void *arg);
+static time_t _now(void);
+
+// -- PUBLIC --
+
+dns_cache *dns_cache_new(struct event_base *ev_base, struct evdns_base *dns_base) {
+
+  dns_cache *cache = NULL;
+  struct timeval interval = { DNS_REFRESH_INTERVAL_MS / 1000, (DNS_REFRESH_INTERVAL_MS % 1000) * 1000 };
+
+  if (NULL == (cache = calloc(1, sizeof(dns_cache)))) {
+    error("calloc dns_cache");
+    return NULL;
+  }
+  cache->ev_base = ev_base;
+  cache->dns_base = dns_base;
+
+  if (NULL == (cache->ev_refresh = event_new(ev_base, -1, EV_PERSIST, _refresh_cb, cache))) {
+    free(cache);
+    return NULL;
+  }
+
+  if (0 != event_add(cache->ev_refresh, &interval)) {
+    event_free(cache->ev_refresh);
+    free(cache);
+    return NULL;
+  }
+
+  return cache;
+}
+
+void dns_cache_free(dns_cache *cache) {
+  dns_entry *entry = NULL;
+
+  event_free(cache->ev_refresh); cache->ev_refresh = NULL;
+  while (NULL != (entry = cache->entries)) {
+    cache->entries = entry->next;
+    _entry_free(entry);
+  }
+  free(cache);
+}
+
+const dns_entry *dns_cache_lookup(dns_cache *cache,
+                                  const str host,
+                                  int port,
+                                  dns_cache_cb cb,
+                                  void *arg,
+                                  dns_waiter **waiter) {
+
+  dns_entry *entry = _entry_find(cache, host, port);
+  dns_waiter *w = NULL;
+
+  *waiter = NULL;
+
+  // fast path
+  if (NULL != entry && 0 < entry->naddrs && _now() < entry->expires) {
+    cache->hits++;
+    entry->used = 1;
+    return entry;
+  }
+
+  cache->misses++;
+  if (NULL == entry && NULL == (entry = _entry_new(cache, host, port))) {
+    return NULL;
+  }
+
+  if (entry->resolving) {
+    cache->coalesced++;
+  } else {
+    _resolve(entry);
+    // numeric addresses and /etc/hosts entries are answered immediately
+    if (0 < entry->naddrs && _now() < entry->expires) {
+      entry->used = 1;
+      return entry;
+    }
+    if (!entry->resolving) {
+      return NULL;
+    }
+  }
+
+  if (NULL == (w = calloc(1, sizeof(dns_waiter)))) {
+    error("calloc dns_waiter");
+    return NULL;
+  }
+  w->cb = cb;
+  w->arg = arg;
+  w->next = entry->waiters;
+  entry->waiters = w;
+
+  *waiter = w;
+  return NULL;
+}
+
+void dns_cache_cancel(dns_waiter *waiter) {
+  // freed with the rest of the list once the resolution completes
+  waiter->cb = NULL;
+  waiter->arg = NULL;
+}
+
+void dns_cache_mark(dns_cache *cache, const str host, int port, const struct sockaddr *addr, int failed) {
+
+  dns_entry *entry = _entry_find(cache, host, port);
+  int i = 0;
+
+  if (NULL == entry) {
+    return;  // evicted in the meantime
+  }
+
+  i = _failed_find(entry, addr);
+  if (!failed && 0 > i) {
+    return;
+  }
+  if (!failed) {
+    entry->nfailed--;
+    entry->failed[i] = entry->failed[entry->nfailed];
+    entry->failed_until[i] = entry->failed_until[entry->nfailed];
+  } else {
+    if (0 > i && DNS_MAX_ADDRS > entry->nfailed) {
+      i = entry->nfailed++;
+    } else if (0 > i) {
+      i = 0;  // the list is full of failures; forget the first
+    }
+    memset(&entry->failed[i], 0, sizeof(struct sockaddr_storage));
+    memcpy(&entry->failed[i], addr, AF_INET == addr->sa_family ? sizeof(struct sockaddr_in) :
+                                    AF_INET6 == addr->sa_family ? sizeof(struct sockaddr_in6) :
+                                    sizeof(struct sockaddr_un));
+    entry->failed_until[i] = _now() + DNS_FAILURE_TTL;
+  }
+  _order(entry);
+}
+
+void dns_cache_report(const dns_cache *cache, int worker_id) {
+  log_info("worker %d dns cache: %lu hits, %lu misses (%lu coalesced), %lu refreshes, %lu failures",
+             worker_id, cache->hits, cache->misses, cache->coalesced, cache->refreshes, cache->failures);
+}
+
+// -- PRIVATE --
+
+static dns_entry *_entry_find(dns_cache *cache, const str host, int port) {
+  dns_entry *entry = NULL;
+  for (entry = cache->entries; NULL != entry; entry = entry->next) {
+    if (port == entry->port && 0 == strcmp(host, entry->host)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static dns_entry *_entry_new(dns_cache *cache, const str host, int port) {
+
+  dns_entry *entry = NULL;
+
+  if (NULL == (entry = calloc(1, sizeof(dns_entry)))) {
+    error("calloc dns_entry");
+    return NULL;
+  }
+
+  if (NULL == (entry->host = strndup(host, MAX_LINE))) {
+    error("strndup host");
+    free(entry);
+    return NULL;
+  }
+
+  entry->port = port;
+  entry->cache = cache;
+  entry->next = cache->entries;
+  cache->entries = entry;
+  return entry;
+}
+
+static void _entry_free(dns_entry *entry) {
+  dns_waiter *w = NULL;
+  while (NULL != (w = entry->waiters)) {
+    entry->waiters = w->next;
+    free(w);
+  }
+  free(entry->host); entry->host = NULL;
+  free(entry);
+}
+
+static void _resolve(dns_entry *entry) {
+
+  struct evutil_addrinfo hints;
+  char port[16];
+  struct evdns_getaddrinfo_request *req = NULL;
+
+  log_debug("resolving %s:%d", entry->host, entry->port);
+
+  entry->resolving = 1;
+  entry->nstaged = 0;
+  entry->ttl = DNS_MAX_TTL;
+
+  // a Unix socket path is its own address
+  if (0 == strncmp(entry->host, "unix:", 5)) {
+    entry->staged_lens[0] = unix_sockaddr(entry->host + 5, (struct sockaddr_un *) &entry->staged[0]);
+    entry->nstaged = 1;
+    _resolved(entry, DNS_MAX_TTL);
+    return;
+  }
+
+  // evdns_getaddrinfo answers numeric hosts and /etc/hosts entries right away, but does
+  // not report TTLs. A name it has to send queries for is left to finish, since they are
+  // already on their way, with a short TTL; its refreshes ask for the A and AAAA records
+  // directly, which carry theirs.
+  if (!entry->networked) {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    snprintf(port, sizeof(port), "%d", entry->port);
+
+    entry->pending = 1;
+    if (NULL != (req = evdns_getaddrinfo(entry->cache->dns_base, entry->host, port, &hints, _gai_cb, entry))) {
+      entry->networked = 1;
+    }
+    return;
+  }
+
+  entry->pending = 2;
+  if (NULL == evdns_base_resolve_ipv4(entry->cache->dns_base, entry->host, 0, _dns_cb, entry)) {
+    entry->pending--;
+  }
+  if (NULL == evdns_base_resolve_ipv6(entry->cache->dns_base, entry->host, 0, _dns_cb, entry)) {
+    entry->pending--;
+  }
+  if (0 == entry->pending) {
+    _resolved(entry, 0);
+  }
+}
+
+static void _stage(dns_entry *entry, int family, const void *addr) {
+
+  struct sockaddr_storage *ss = NULL;
+
+  if (DNS_MAX_ADDRS <= entry->nstaged) {
+    return;
+  }
+
+  ss = &entry->staged[entry->nstaged];
+  memset(ss, 0, sizeof(struct sockaddr_storage));
+  if (AF_INET == family) {
+    struct sockaddr_in *ipv4 = (struct sockaddr_in *) ss;
+    ipv4->sin_family = AF_INET;
+    ipv4->sin_port = htons(entry->port);
+    memcpy(&ipv4->sin_addr, addr, sizeof(struct in_addr));
+    entry->staged_lens[entry->nstaged] = sizeof(struct sockaddr_in);
+  } else {
+    struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *) ss;
+    ipv6->sin6_family = AF_INET6;
+    ipv6->sin6_port = htons(entry->port);
+    memcpy(&ipv6->sin6_addr, addr, sizeof(struct in6_addr));
+    entry->staged_lens[entry->nstaged] = sizeof(struct sockaddr_in6);
+  }
+  entry->nstaged++;
+}
+
+static void _resolved(dns_entry *entry, int ttl) {
+
+  dns_cache *cache = entry->cache;
+  dns_waiter *waiters = entry->waiters;
+  dns_waiter *w = NULL;
+  time_t now = _now();
+  int result = SUCCESS;
+  int v4 = 0;
+  int v6 = 0;
+
+  entry->resolving = 0;
+  entry->waiters = NULL;
+
+  if (0 < entry->nstaged) {
+    // IPv4 and IPv6 interleaved, IPv4 first, each in the order they were answered; health
+    // probes and pools connect to the first address only
+    entry->naddrs = 0;
+    while (v4 < entry->nstaged || v6 < entry->nstaged) {
+      while (v4 < entry->nstaged && AF_INET != entry->staged[v4].ss_family) {
+        v4++;
+      }
+      if (v4 < entry->nstaged) {
+        entry->addrs[entry->naddrs] = entry->staged[v4];
+        entry->addr_lens[entry->naddrs++] = entry->staged_lens[v4++];
+      }
+      while (v6 < entry->nstaged && AF_INET == entry->staged[v6].ss_family) {
+        v6++;
+      }
+      if (v6 < entry->nstaged) {
+        entry->addrs[entry->naddrs] = entry->staged[v6];
+        entry->addr_lens[entry->naddrs++] = entry->staged_lens[v6++];
+      }
+    }
+    _order(entry);
+
+    ttl = MAX(DNS_MIN_TTL, MIN(DNS_MAX_TTL, ttl));
+    entry->expires = now + ttl;
+    entry->refresh_at = now + ttl - MAX(1, ttl / 5);
+    entry->used = 0;
+    log_debug("resolved %s:%d to %d addresses, ttl %d", entry->host, entry->port, entry->naddrs, ttl);
+  } else {
+    // keep serving the previous answer, if any, until it expires
+    cache->failures++;
+    result = ERR_NET_HOST;
+    log_error("could not resolve %s", entry->host);
+  }
+
+  while (NULL != (w = waiters)) {
+    waiters = w->next;
+    if (NULL != w->cb) {
+      w->cb(result, SUCCESS == result ? entry : NULL, w->arg);
+    }
+    free(w);
+  }
+}
+
+static void _order(dns_entry *entry) {
+
+  struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+  socklen_t addr_lens[DNS_MAX_ADDRS];
+  time_t now = _now();
+  int n = 0;
+  int i = 0;
+
+  for (i = 0; i < entry->nfailed; ) {
+    if (now >= entry->failed_until[i]) {
+      entry->nfailed--;
+      entry->failed[i] = entry->failed[entry->nfailed];
+      entry->failed_until[i] = entry->failed_until[entry->nfailed];
+    } else {
+      i++;
+    }
+  }
+  if (0 == entry->nfailed) {
+    return;
+  }
+
+  for (i = 0; i < entry->naddrs; i++) {
+    if (0 > _failed_find(entry, (struct sockaddr *) &entry->addrs[i])) {
+      addrs[n] = entry->addrs[i];
+      addr_lens[n++] = entry->addr_lens[i];
+    }
+  }
+  for (i = 0; i < entry->naddrs; i++) {
+    if (0 <= _failed_find(entry, (struct sockaddr *) &entry->addrs[i])) {
+      addrs[n] = entry->addrs[i];
+      addr_lens[n++] = entry->addr_lens[i];
+    }
+  }
+  memcpy(entry->addrs, addrs, n * sizeof(struct sockaddr_storage));
+  memcpy(entry->addr_lens, addr_lens, n * sizeof(socklen_t));
+}
+
+static int _failed_find(const dns_entry *entry, const struct sockaddr *addr) {
+  int i = 0;
+  for (i = 0; i < entry->nfailed; i++) {
+    if (_addr_equal(&entry->failed[i], addr)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int _addr_equal(const struct sockaddr_storage *a, const struct sockaddr *b) {
+  if (a->ss_family != b->sa_family) {
+    return 0;
+  }
+  if (AF_INET == b->sa_family) {
+    const struct sockaddr_in *x = (const struct sockaddr_in *) a;
+    const struct sockaddr_in *y = (const struct sockaddr_in *) b;
+    return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+  }
+  if (AF_INET6 == b->sa_family) {
+    const struct sockaddr_in6 *x = (const struct sockaddr_in6 *) a;
+    const struct sockaddr_in6 *y = (const struct sockaddr_in6 *) b;
+    return x->sin6_port == y->sin6_port && 0 == memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(struct in6_addr));
+  }
+  return 0 == memcmp(a, b, sizeof(struct sockaddr_un));
+}
+
+static void _gai_cb(int result, struct evutil_addrinfo *res, void *arg) {
+
+  dns_entry *entry = arg;
+  struct evutil_addrinfo *p = NULL;
+
+  if (EVUTIL_EAI_CANCEL == result) {
+    return;  // the cache is going away
+  }
+
+  entry->pending = 0;
+  if (0 != result) {
+    log_error("getaddrinfo %s: %s", entry->host, evutil_gai_strerror(result));
+  }
+  for (p = res; NULL != p; p = p->ai_next) {
+    if (AF_INET == p->ai_family) {
+      _stage(entry, AF_INET, &((struct sockaddr_in *) p->ai_addr)->sin_addr);
+    } else if (AF_INET6 == p->ai_family) {
+      _stage(entry, AF_INET6, &((struct sockaddr_in6 *) p->ai_addr)->sin6_addr);
+    }
+  }
+  if (NULL != res) {
+    evutil_freeaddrinfo(res);
+  }
+
+  // answers carry no TTL: local ones are good until the longest, and the network's are
+  // refreshed soon, with their own
+  _resolved(entry, entry->networked ? DNS_MIN_TTL : DNS_MAX_TTL);
+}
+
+static void _dns_cb(int result, char type, int count, int ttl, void *addresses, void *arg) {
+
+  dns_entry *entry = arg;
+  int i = 0;
+
+  if (DNS_ERR_NONE == result) {
+    for (i = 0; i < count; i++) {
+      if (DNS_IPv4_A == type) {
+        _stage(entry, AF_INET, (struct in_addr *) addresses + i);
+      } else if (DNS_IPv6_AAAA == type) {
+        _stage(entry, AF_INET6, (struct in6_addr *) addresses + i);
+      }
+    }
+    if (0 < count) {
+      entry->ttl = MIN(entry->ttl, ttl);
+    }
+  } else {
+    log_debug("resolving %s (type %d): %s", entry->host, type, evdns_err_to_string(result));
+  }
+
+  if (0 == --entry->pending) {
+    _resolved(entry, entry->ttl);
+  }
+}
+
+static void _refresh_cb(evutil_socket_t fd, short event, void *arg) {
+
+  dns_cache *cache = arg;
+  dns_entry **link = &cache->entries;
+  dns_entry *entry = NULL;
+  time_t now = _now();
+
+  (void) fd;
+  (void) event;
+
+  while (NULL != (entry = *link)) {
+    if (!entry->resolving && entry->used && now >= entry->refresh_at) {
+      // still in use, so resolve again while the old answer is served
+      cache->refreshes++;
+      _resolve(entry);
+    } else if (!entry->resolving && !entry->used && now >= entry->expires) {
+      // nobody asked for it during its lifetime
+      log_debug("evicting %s:%d", entry->host, entry->port);
+      *link = entry->next;
+      _entry_free(entry);
+      continue;
+    }
+    link = &entry->next;
+  }
+}
+
+static time_t _now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
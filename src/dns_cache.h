@@ -0,0 +1,98 @@
+/* dns_cache.h
+ *
+ * Per-worker cache of resolved upstream addresses.
+ */
+#ifndef dns_cache_h
+#define dns_cache_h
+
+#include <time.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+#include "defs.h"
+
+#define DNS_MAX_ADDRS 8
+
+typedef struct dns_entry_struct dns_entry;
+typedef struct dns_waiter_struct dns_waiter;
+typedef struct dns_cache_struct dns_cache;
+
+/* Invoked on the worker's event loop once a lookup completes.
+ * result is SUCCESS, in which case entry holds at least one address, or ERR_NET_HOST.
+ */
+typedef void (*dns_cache_cb)(int result, const dns_entry *entry, void *arg);
+
+/* Resolved addresses for one host:port, in the order to try them: IPv4 and IPv6
+ * interleaved, with addresses that recently failed to connect at the back.
+ */
+struct dns_entry_struct {
+  char *host;
+  int port;
+  struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+  socklen_t addr_lens[DNS_MAX_ADDRS];
+  int naddrs;
+  struct sockaddr_storage failed[DNS_MAX_ADDRS];  // kept across resolutions
+  time_t failed_until[DNS_MAX_ADDRS];
+  int nfailed;
+  time_t expires;  // monotonic seconds; 0 until the first lookup completes
+  time_t refresh_at;  // when the background refresh kicks in
+  int used;  // looked up since the last resolution
+  int networked;  // the name is not local, so refreshes ask for its A/AAAA records directly
+
+  // state of the resolution in flight, if any
+  int resolving;
+  int pending;  // outstanding A/AAAA queries
+  int ttl;  // lowest TTL seen in the current resolution
+  struct sockaddr_storage staged[DNS_MAX_ADDRS];
+  socklen_t staged_lens[DNS_MAX_ADDRS];
+  int nstaged;
+  dns_waiter *waiters;  // lookups collapsed onto the current resolution
+
+  dns_cache *cache;
+  dns_entry *next;
+};
+
+struct dns_cache_struct {
+  struct event_base *ev_base;
+  struct evdns_base *dns_base;
+  struct event *ev_refresh;
+  dns_entry *entries;  // a handful of upstreams, so a list is enough
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long coalesced;  // misses that joined an in-flight resolution
+  unsigned long refreshes;
+  unsigned long failures;
+};
+
+/* Creates a cache and starts its background refresh timer. */
+dns_cache *dns_cache_new(struct event_base *ev_base, struct evdns_base *dns_base);
+
+/* Frees every entry. Resolutions still in flight are abandoned, so the evdns_base
+ * must be freed right after, without failing its requests. */
+void dns_cache_free(dns_cache *cache);
+
+/* Looks up host:port.
+ *
+ * @return the entry on a hit, without invoking cb. On a miss, returns NULL and sets
+ *         *waiter to a handle for the pending lookup, which will invoke cb later; if
+ *         the lookup could not be started, *waiter is NULL too.
+ */
+const dns_entry *dns_cache_lookup(dns_cache *cache,
+                                  const str host,
+                                  int port,
+                                  dns_cache_cb cb,
+                                  void *arg,
+                                  dns_waiter **waiter);
+
+/* Stops a pending lookup from invoking its callback. */
+void dns_cache_cancel(dns_waiter *waiter);
+
+/* Remembers whether connecting to addr, one of host:port's addresses, failed. A failed
+ * address is moved behind the others for DNS_FAILURE_TTL seconds, or until it connects.
+ */
+void dns_cache_mark(dns_cache *cache, const str host, int port, const struct sockaddr *addr, int failed);
+
+/* Logs the hit/miss counters. */
+void dns_cache_report(const dns_cache *cache, int worker_id);
+
+#endif /* dns_cache_h */
@@ -1,9 +1,11 @@
 /* errors.c */
 
 #include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
-#include <zlog.h>
+#include "log.h"
 #include "config.h"
 #include "errors.h"
 
@@ -15,7 +17,7 @@ int error(const str message) {
   memset(printable, 0, BUFFER_LEN);
 
   strerror_r(errno, printable, BUFFER_LEN);
-  dzlog_error("%s: %s", message, printable);
+  log_error("%s: %s", message, printable);
 
   return SUCCESS;
 }
@@ -27,7 +29,14 @@ void inet_ntop_addrinfo(struct addrinfo *p, char *printable, size_t length) {
 
 void inet_ntop_sockaddr(struct sockaddr_storage *ss, char *printable, size_t length) {
   // "network to presentation"
-  if (ss->ss_family == AF_INET) {
+  if (ss->ss_family == AF_UNIX) {
+    struct sockaddr_un *un = (struct sockaddr_un *)ss;
+    if ('\0' == un->sun_path[0]) {
+      snprintf(printable, length, "unix:@%.*s", (int) sizeof(un->sun_path) - 1, un->sun_path + 1);
+    } else {
+      snprintf(printable, length, "unix:%.*s", (int) sizeof(un->sun_path), un->sun_path);
+    }
+  } else if (ss->ss_family == AF_INET) {
     struct sockaddr_in *ipv4 = (struct sockaddr_in *)ss;
     inet_ntop(ss->ss_family, &(ipv4->sin_addr), printable, length);
   } else {
@@ -44,9 +53,25 @@ int ntoh_sockaddr(const struct sockaddr_storage *ss) {
   }
 }
 
-void inet_hints(struct addrinfo *hints) {
+void inet_hints(struct addrinfo *hints, int socktype) {
   memset(hints, 0, sizeof(struct addrinfo));
   hints->ai_family = AF_UNSPEC;  // both v4 and v6
-  hints->ai_socktype = SOCK_STREAM;  // TCP
+  hints->ai_socktype = socktype;  // TCP or UDP
   hints->ai_flags = AI_PASSIVE;  // fill in IP for me
 }
+
+socklen_t unix_sockaddr(const char *path, struct sockaddr_un *addr) {
+  size_t length = strlen(path);
+  if (length > sizeof(addr->sun_path) - 1) {
+    length = sizeof(addr->sun_path) - 1;
+  }
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path, length);
+  if ('@' == path[0]) {
+    // abstract names are not NUL-terminated; the length says where they end
+    addr->sun_path[0] = '\0';
+    return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length);
+  }
+  return (socklen_t) sizeof(struct sockaddr_un);
+}
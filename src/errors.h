@@ -7,6 +7,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include "defs.h"
 
@@ -18,7 +19,10 @@ void inet_ntop_addrinfo(struct addrinfo *p, char *printable, size_t length);
 void inet_ntop_sockaddr(struct sockaddr_storage *p, char *printable, size_t length);
 /* Network-to-host (for port), from sockaddr */
 int ntoh_sockaddr(const struct sockaddr_storage *ss);
-/* Prepares a hints struct suitable for getaddrinfo.  */
-void inet_hints(struct addrinfo *hints);
+/* Prepares a hints struct suitable for getaddrinfo, for SOCK_STREAM or SOCK_DGRAM.  */
+void inet_hints(struct addrinfo *hints, int socktype);
+/* Fills in a Unix domain address for path; "@name" is a socket in the abstract namespace.
+ * Returns the length to bind or connect with. */
+socklen_t unix_sockaddr(const char *path, struct sockaddr_un *addr);
 
 #endif /* error_h */
@@ -0,0 +1,242 @@
+/* eyeballs.c
+ *
+ * Happy Eyeballs (RFC 8305): races non-blocking connects to a host's resolved addresses.
+ *
+ * The addresses come from the DNS cache already interleaved by family, with those that
+ * recently failed at the back, so the race only has to stagger them.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "eyeballs.h"
+
+typedef struct {
+  int fd;  // -1 unless in flight
+  struct event *ev;  // EV_WRITE once connected or failed
+  eyeballs *race;
+} eyeballs_attempt;
+
+struct eyeballs_struct {
+  struct event_base *ev_base;
+  dns_cache *dns;
+  const char *host;  // pointers without ownership
+  int port;
+  const sock_profile *sock;
+  struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+  socklen_t addr_lens[DNS_MAX_ADDRS];
+  eyeballs_attempt attempts[DNS_MAX_ADDRS];
+  int naddrs;
+  int next;  // the next address to try
+  int pending;  // attempts in flight
+  struct event *ev_next;  // starts the next attempt once the current one has had its head start
+  eyeballs_cb cb;
+  void *arg;
+};
+
+// -- DECLARATIONS --
+
+/* Starts attempts until one is in flight or the addresses run out; never invokes the callback. */
+static void _attempt(eyeballs *race);
+/* Starts connecting to the i-th address. @return success or error codes. */
+static int _connect(eyeballs *race, int i);
+/* Closes an attempt, if it is in flight. */
+static void _close(eyeballs_attempt *attempt);
+/* Frees the race and hands fd, or -1, to the callback. */
+static void _finish(eyeballs *race, int fd);
+static void _next_cb(evutil_socket_t fd, short event, void *arg);
+static void _connect_cb(evutil_socket_t fd, short event, void *arg);
+
+// -- PUBLIC --
+
+eyeballs *eyeballs_start(struct event_base *ev_base,
+                         dns_cache *dns,
+                         const str host,
+                         int port,
+                         const dns_entry *entry,
+                         const sock_profile *sock,
+                         eyeballs_cb cb,
+                         void *arg) {
+
+  eyeballs *race = NULL;
+  int i = 0;
+
+  if (NULL == (race = calloc(1, sizeof(eyeballs)))) {
+    error("calloc eyeballs");
+    return NULL;
+  }
+
+  if (NULL == (race->ev_next = event_new(ev_base, -1, 0, _next_cb, race))) {
+    free(race);
+    return NULL;
+  }
+
+  race->ev_base = ev_base;
+  race->dns = dns;
+  race->host = host;
+  race->port = port;
+  race->sock = sock;
+  race->naddrs = entry->naddrs;
+  race->cb = cb;
+  race->arg = arg;
+  memcpy(race->addrs, entry->addrs, entry->naddrs * sizeof(struct sockaddr_storage));
+  memcpy(race->addr_lens, entry->addr_lens, entry->naddrs * sizeof(socklen_t));
+  for (i = 0; i < DNS_MAX_ADDRS; i++) {
+    race->attempts[i].fd = -1;
+    race->attempts[i].race = race;
+  }
+
+  _attempt(race);
+  return race;
+}
+
+void eyeballs_cancel(eyeballs *race) {
+  int i = 0;
+  for (i = 0; i < race->naddrs; i++) {
+    _close(&race->attempts[i]);
+  }
+  event_free(race->ev_next); race->ev_next = NULL;
+  free(race);
+}
+
+// -- PRIVATE --
+
+static void _attempt(eyeballs *race) {
+
+  struct timeval delay = { CONNECT_ATTEMPT_DELAY_MS / 1000, (CONNECT_ATTEMPT_DELAY_MS % 1000) * 1000 };
+  int i = 0;
+
+  while (race->next < race->naddrs) {
+    i = race->next++;
+    if (SUCCESS == _connect(race, i)) {
+      if (race->next < race->naddrs) {
+        event_add(race->ev_next, &delay);
+      }
+      return;
+    }
+    dns_cache_mark(race->dns, race->host, race->port, (struct sockaddr *) &race->addrs[i], 1);
+  }
+
+  // out of addresses; report the failure from the event loop, not from the caller's stack
+  if (0 == race->pending) {
+    event_active(race->ev_next, EV_TIMEOUT, 0);
+  }
+}
+
+static int _connect(eyeballs *race, int i) {
+
+  eyeballs_attempt *attempt = &race->attempts[i];
+  int family = race->addrs[i].ss_family;
+  int fd = -1;
+
+  if (0 > (fd = socket(family, SOCK_STREAM, 0))) {
+    error("socket");
+    return ERR_NET_CONNECT;
+  }
+  if (0 != evutil_make_socket_nonblocking(fd) || 0 != evutil_make_socket_closeonexec(fd)) {
+    error("fcntl");
+    close(fd);
+    return ERR_NET_CONNECT;
+  }
+  sock_profile_upstream(race->sock, fd, family);
+
+  if (0 != connect(fd, (struct sockaddr *) &race->addrs[i], race->addr_lens[i]) &&
+      EINPROGRESS != errno && EINTR != errno) {
+    log_debug("connect to address %d of %s failed at once: %s", i, race->host, strerror(errno));
+    close(fd);
+    return ERR_NET_CONNECT;
+  }
+
+  // writable once connected or failed, even if connect() already finished
+  if (NULL == (attempt->ev = event_new(race->ev_base, fd, EV_WRITE, _connect_cb, attempt)) ||
+      0 != event_add(attempt->ev, NULL)) {
+    if (NULL != attempt->ev) {
+      event_free(attempt->ev); attempt->ev = NULL;
+    }
+    close(fd);
+    return ERR_NET_CONNECT;
+  }
+
+  attempt->fd = fd;
+  race->pending++;
+  return SUCCESS;
+}
+
+static void _close(eyeballs_attempt *attempt) {
+  if (0 > attempt->fd) {
+    return;
+  }
+  event_free(attempt->ev); attempt->ev = NULL;
+  close(attempt->fd); attempt->fd = -1;
+  attempt->race->pending--;
+}
+
+static void _finish(eyeballs *race, int fd) {
+  eyeballs_cb cb = race->cb;
+  void *arg = race->arg;
+  eyeballs_cancel(race); race = NULL;
+  cb(fd, arg);
+}
+
+static void _next_cb(evutil_socket_t fd, short event, void *arg) {
+
+  eyeballs *race = arg;
+
+  (void) fd;
+  (void) event;
+
+  if (race->next >= race->naddrs && 0 == race->pending) {
+    log_debug("no address of %s could be connected to", race->host);
+    _finish(race, -1);
+    return;
+  }
+  _attempt(race);
+}
+
+static void _connect_cb(evutil_socket_t fd, short event, void *arg) {
+
+  eyeballs_attempt *attempt = arg;
+  eyeballs *race = attempt->race;
+  int i = attempt - race->attempts;
+  int err = 0;
+  socklen_t len = sizeof(err);
+  int j = 0;
+
+  (void) event;
+
+  if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+    err = errno;
+  }
+
+  if (0 != err) {
+    log_debug("connect to address %d of %s failed: %s", i, race->host, strerror(err));
+    dns_cache_mark(race->dns, race->host, race->port, (struct sockaddr *) &race->addrs[i], 1);
+    _close(attempt);
+    // no need to wait out the head start
+    event_del(race->ev_next);
+    _attempt(race);
+    return;
+  }
+
+  // the ones started before this one had a head start and still lost
+  log_debug("connected to address %d of %s", i, race->host);
+  for (j = 0; j < race->naddrs; j++) {
+    if (j < i && 0 <= race->attempts[j].fd) {
+      dns_cache_mark(race->dns, race->host, race->port, (struct sockaddr *) &race->addrs[j], 1);
+    }
+  }
+  dns_cache_mark(race->dns, race->host, race->port, (struct sockaddr *) &race->addrs[i], 0);
+
+  // keep the socket, and close the rest
+  event_free(attempt->ev); attempt->ev = NULL;
+  attempt->fd = -1;
+  race->pending--;
+  _finish(race, fd);
+}
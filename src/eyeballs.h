@@ -0,0 +1,42 @@
+/* eyeballs.h
+ *
+ * Happy Eyeballs (RFC 8305): races non-blocking connects to a host's resolved addresses
+ * and keeps the first one to connect.
+ */
+#ifndef eyeballs_h
+#define eyeballs_h
+
+#include <event2/event.h>
+#include "defs.h"
+#include "dns_cache.h"
+#include "sockopt.h"
+
+typedef struct eyeballs_struct eyeballs;
+
+/* Invoked once, on the event loop, with the connected non-blocking socket (which the
+ * callee owns), or with -1 if every address failed.
+ */
+typedef void (*eyeballs_cb)(int fd, void *arg);
+
+/* Starts connecting to entry's addresses in order. Each address gets CONNECT_ATTEMPT_DELAY_MS
+ * to itself before the next one is started alongside it, or the next one starts right away
+ * if it fails; the first to connect wins, and the others are closed. Addresses that fail,
+ * or that are overtaken by a later one, are marked as failed in dns for host:port.
+ *
+ * There is no overall timeout; the caller bounds the race and cancels it.
+ *
+ * @return the race, or NULL if it could not be set up.
+ */
+eyeballs *eyeballs_start(struct event_base *ev_base,
+                         dns_cache *dns,
+                         const str host,
+                         int port,
+                         const dns_entry *entry,
+                         const sock_profile *sock,
+                         eyeballs_cb cb,
+                         void *arg);
+
+/* Closes every attempt and frees the race, without invoking its callback. */
+void eyeballs_cancel(eyeballs *race);
+
+#endif /* eyeballs_h */
@@ -0,0 +1,338 @@
+/* handoff.c
+ *
+ * Hands the listening sockets of a running proxy to its replacement over a Unix socket
+ * (SCM_RIGHTS), so that a restart never leaves the address without a listener.
+ */
+
+#define _GNU_SOURCE  // accept4, struct ucred
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "handoff.h"
+
+#define HANDOFF_TIMEOUT_S 10  // for the replacement to set up, and for the old proxy to answer
+
+/* Sent along with the descriptors: the listeners come first, then the admin listener. */
+typedef struct {
+  uint32_t nlisten;
+  uint32_t admin;
+} handoff_header;
+
+// -- DECLARATIONS --
+
+/* returns a close-on-exec Unix stream socket, or -1 with errno set */
+static int _socket(void);
+/* accepts one close-on-exec connection, or returns -1 with errno set */
+static int _accept(int listen_fd);
+/* looks up the user and, where the platform tells, the pid at the other end of fd; pid is -1
+ * otherwise. @return success or error codes. */
+static int _peer(int fd, uid_t *uid, int *pid);
+static void _accept_cb(evutil_socket_t listen_fd, short event, void *arg);
+/* Sends the collected descriptors. @return success or error codes. */
+static int _send(int fd, const handoff_fds *fds);
+static void _peer_cb(evutil_socket_t fd, short event, void *arg);
+static void _peer_close(handoff_server *server);
+
+// -- PUBLIC --
+
+handoff_server *handoff_server_new(struct event_base *ev_base, int listen_fd,
+                                   handoff_collect_cb collect, handoff_ready_cb ready, void *arg) {
+
+  handoff_server *server = NULL;
+
+  if (NULL == (server = calloc(1, sizeof(handoff_server)))) {
+    error("calloc handoff_server");
+    close(listen_fd);
+    return NULL;
+  }
+  server->listen_fd = listen_fd;
+  server->peer_fd = -1;
+  server->collect = collect;
+  server->ready = ready;
+  server->arg = arg;
+
+  if (0 != evutil_make_socket_nonblocking(listen_fd) ||
+      NULL == (server->ev_listen = event_new(ev_base, listen_fd, EV_READ | EV_PERSIST, _accept_cb, server)) ||
+      0 != event_add(server->ev_listen, NULL)) {
+    handoff_server_free(server);
+    return NULL;
+  }
+
+  return server;
+}
+
+void handoff_server_free(handoff_server *server) {
+  _peer_close(server);
+  if (NULL != server->ev_listen) {
+    event_free(server->ev_listen); server->ev_listen = NULL;
+  }
+  close(server->listen_fd); server->listen_fd = -1;
+  free(server);
+}
+
+int handoff_receive(const char *path, handoff_fds *fds, int *peer_fd) {
+
+  struct sockaddr_un addr;
+  struct timeval timeout = { HANDOFF_TIMEOUT_S, 0 };
+  handoff_header header;
+  struct iovec iov = { &header, sizeof(header) };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg = NULL;
+  int received[HANDOFF_MAX_FDS];
+  int nreceived = 0;
+  int fd = -1;
+  int i = 0;
+
+  memset(fds, 0, sizeof(handoff_fds));
+  fds->admin_fd = -1;
+  *peer_fd = -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if (0 > (fd = _socket())) {
+    error("socket");
+    return ERR_NET_HANDOFF;
+  }
+
+  // nobody to take over from: a first start, or a socket file left behind
+  if (0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    if (ENOENT != errno && ECONNREFUSED != errno) {
+      error("connect handoff");
+    }
+    close(fd);
+    return SUCCESS;
+  }
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+#ifdef __linux__
+  if (sizeof(header) != recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) {
+#else
+  if (sizeof(header) != recvmsg(fd, &msg, MSG_WAITALL)) {
+#endif
+    error("recvmsg handoff");
+    close(fd);
+    return ERR_NET_HANDOFF;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type) {
+      nreceived = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(received, CMSG_DATA(cmsg), nreceived * sizeof(int));
+    }
+  }
+#ifndef __linux__
+  // there is no MSG_CMSG_CLOEXEC to set the flag as they arrive
+  for (i = 0; i < nreceived; i++) {
+    evutil_make_socket_closeonexec(received[i]);
+  }
+#endif
+
+  if ((msg.msg_flags & MSG_CTRUNC) || header.admin > 1 ||
+      header.nlisten > HANDOFF_MAX_FDS - 1 || (int) (header.nlisten + header.admin) != nreceived) {
+    log_error("handoff from %s carried %d descriptors, expected %u", path, nreceived,
+              header.nlisten + header.admin);
+    for (i = 0; i < nreceived; i++) {
+      close(received[i]);
+    }
+    close(fd);
+    return ERR_NET_HANDOFF;
+  }
+
+  memcpy(fds->listen_fds, received, header.nlisten * sizeof(int));
+  fds->nlisten = (int) header.nlisten;
+  if (header.admin) {
+    fds->admin_fd = received[header.nlisten];
+  }
+
+  log_info("inherited %d listeners%s from %s", fds->nlisten, header.admin ? " and the admin listener" : "", path);
+  *peer_fd = fd;
+  return SUCCESS;
+}
+
+int handoff_ready(int peer_fd) {
+  char ready = 1;
+  int rc = SUCCESS;
+  if (1 != send(peer_fd, &ready, 1, MSG_NOSIGNAL)) {
+    error("send handoff");
+    rc = ERR_NET_HANDOFF;
+  }
+  close(peer_fd);
+  return rc;
+}
+
+// -- PRIVATE --
+
+static int _socket(void) {
+#ifdef __linux__
+  return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (0 <= fd && 0 != evutil_make_socket_closeonexec(fd)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+#endif
+}
+
+static int _accept(int listen_fd) {
+#ifdef __linux__
+  return accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+#else
+  int fd = accept(listen_fd, NULL, NULL);
+  if (0 <= fd && 0 != evutil_make_socket_closeonexec(fd)) {
+    close(fd);
+    errno = ECONNABORTED;  // skip this one
+    return -1;
+  }
+  return fd;
+#endif
+}
+
+static int _peer(int fd, uid_t *uid, int *pid) {
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (0 != getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len)) {
+    return ERR_NET_HANDOFF;
+  }
+  *uid = cred.uid;
+  *pid = (int) cred.pid;
+  return SUCCESS;
+#else
+  gid_t gid;
+  *pid = -1;
+  return 0 == getpeereid(fd, uid, &gid) ? SUCCESS : ERR_NET_HANDOFF;
+#endif
+}
+
+static void _accept_cb(evutil_socket_t listen_fd, short event, void *arg) {
+
+  struct timeval timeout = { HANDOFF_TIMEOUT_S, 0 };
+  handoff_server *server = arg;
+  handoff_fds fds;
+  uid_t uid = 0;
+  int pid = -1;
+  int fd = -1;
+
+  (void) event;
+
+  if (0 > (fd = _accept(listen_fd))) {
+    if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno && ECONNABORTED != errno) {
+      error("accept handoff");
+    }
+    return;
+  }
+
+  if (SUCCESS != _peer(fd, &uid, &pid) || uid != getuid()) {
+    log_warn("refusing handoff to a process of another user");
+    close(fd);
+    return;
+  }
+
+  if (0 <= server->peer_fd) {
+    log_warn("refusing handoff to pid %d, pid already taking over", pid);
+    close(fd);
+    return;
+  }
+
+  memset(&fds, 0, sizeof(fds));
+  fds.admin_fd = -1;
+  server->collect(&fds, server->arg);
+  if (SUCCESS != _send(fd, &fds)) {
+    close(fd);
+    return;
+  }
+
+  server->peer_fd = fd;
+  if (NULL == (server->ev_peer = event_new(event_get_base(server->ev_listen), fd, EV_READ, _peer_cb, server)) ||
+      0 != event_add(server->ev_peer, &timeout)) {
+    _peer_close(server);
+    return;
+  }
+  log_info("handed %d listeners to pid %d, waiting for it to take over", fds.nlisten, pid);
+}
+
+static int _send(int fd, const handoff_fds *fds) {
+
+  handoff_header header = { (uint32_t) fds->nlisten, 0 <= fds->admin_fd };
+  struct iovec iov = { &header, sizeof(header) };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg = NULL;
+  int n = fds->nlisten + (int) header.admin;
+
+  memset(&control, 0, sizeof(control));
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+  memcpy(CMSG_DATA(cmsg), fds->listen_fds, sizeof(int) * fds->nlisten);
+  if (header.admin) {
+    memcpy(CMSG_DATA(cmsg) + sizeof(int) * fds->nlisten, &fds->admin_fd, sizeof(int));
+  }
+
+  // a fresh Unix socket has room for this, so the blocking send returns at once
+  if (sizeof(header) != sendmsg(fd, &msg, MSG_NOSIGNAL)) {
+    error("sendmsg handoff");
+    return ERR_NET_HANDOFF;
+  }
+  return SUCCESS;
+}
+
+static void _peer_cb(evutil_socket_t fd, short event, void *arg) {
+
+  handoff_server *server = arg;
+  char ready = 0;
+
+  if (event & EV_TIMEOUT) {
+    log_warn("replacement did not take over within %d s, carrying on", HANDOFF_TIMEOUT_S);
+  } else if (1 != recv(fd, &ready, 1, 0) || 1 != ready) {
+    log_warn("replacement hung up before taking over, carrying on");
+    ready = 0;
+  }
+
+  _peer_close(server);
+  if (ready) {
+    server->ready(server->arg);  // may free the server
+  }
+}
+
+static void _peer_close(handoff_server *server) {
+  if (NULL != server->ev_peer) {
+    event_free(server->ev_peer); server->ev_peer = NULL;
+  }
+  if (0 <= server->peer_fd) {
+    close(server->peer_fd); server->peer_fd = -1;
+  }
+}
@@ -0,0 +1,66 @@
+/* handoff.h
+ *
+ * Hands the listening sockets of a running proxy to its replacement over a Unix socket
+ * (SCM_RIGHTS), so that a restart never leaves the address without a listener.
+ */
+#ifndef handoff_h
+#define handoff_h
+
+#include <event2/event.h>
+#include "defs.h"
+
+#define HANDOFF_MAX_FDS 253  // SCM_MAX_FD, the most descriptors one message carries
+
+typedef struct handoff_server_struct handoff_server;
+
+/* The descriptors handed over; they stay open on the sending side. */
+typedef struct {
+  int listen_fds[HANDOFF_MAX_FDS - 1];  // one per worker
+  int nlisten;
+  int admin_fd;  // or -1
+} handoff_fds;
+
+/* Fills in the descriptors to hand over, when a replacement asks for them. */
+typedef void (*handoff_collect_cb)(handoff_fds *fds, void *arg);
+
+/* Invoked once the replacement is accepting on the descriptors it was handed. */
+typedef void (*handoff_ready_cb)(void *arg);
+
+/* Runs on the control loop. A replacement connects, is sent the descriptors, and
+ * replies with one byte once its workers are set up; one that hangs up first is
+ * forgotten, and the proxy carries on. Only processes of the same user are served.
+ */
+struct handoff_server_struct {
+  int listen_fd;
+  int peer_fd;  // the replacement being handed to, or -1
+  struct event *ev_listen;
+  struct event *ev_peer;
+  handoff_collect_cb collect;
+  handoff_ready_cb ready;
+  void *arg;
+};
+
+/* Starts accepting on listen_fd, which the server takes ownership of.
+ *
+ * @return the server, or NULL on error.
+ */
+handoff_server *handoff_server_new(struct event_base *ev_base, int listen_fd,
+                                   handoff_collect_cb collect, handoff_ready_cb ready, void *arg);
+
+/* Stops accepting, and hangs up on a replacement that has not replied. */
+void handoff_server_free(handoff_server *server);
+
+/* Asks the proxy listening on path for its descriptors. Nothing is inherited if there
+ * is no such proxy; otherwise peer_fd is left connected, for handoff_ready.
+ *
+ * @return success or error codes.
+ */
+int handoff_receive(const char *path, handoff_fds *fds, int *peer_fd);
+
+/* Tells the old proxy that its descriptors are in use, so it may drain, and closes peer_fd.
+ *
+ * @return success or error codes.
+ */
+int handoff_ready(int peer_fd);
+
+#endif /* handoff_h */
@@ -0,0 +1,260 @@
+/* health.c
+ *
+ * Per-worker health checking of the backends, with outlier ejection.
+ *
+ * Probes are plain non-blocking TCP connects on the worker's event loop, and are
+ * closed as soon as they connect. Relayed clients report their own connect results
+ * too, so a dead backend is usually ejected by the first few clients that hit it,
+ * before the next probe is due.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "health.h"
+
+struct health_probe_struct {
+  health_checker *hc;
+  backend *backend;
+  int fd;  // -1 unless connecting
+  struct event *ev;
+  dns_waiter *waiter;
+};
+
+// -- DECLARATIONS --
+
+/* Starts a probe, unless one is already in flight. */
+static void _probe(health_probe *probe);
+/* Closes the probe's socket and records the result. */
+static void _probe_done(health_probe *probe, int ok);
+static void _failed(backend *b, uint64_t now);
+static void _eject(backend *b, uint64_t now);
+static void _admit(backend *b, uint64_t now);
+static void _resolved_cb(int result, const dns_entry *entry, void *arg);
+static void _connect_cb(evutil_socket_t fd, short event, void *arg);
+static void _tick_cb(evutil_socket_t fd, short event, void *arg);
+
+// -- PUBLIC --
+
+health_checker *health_new(struct event_base *ev_base,
+                           dns_cache *dns,
+                           backend_set *set,
+                           int interval_ms,
+                           const struct timeval *timeout) {
+
+  health_checker *hc = NULL;
+  int tick_ms = 0 < interval_ms ? interval_ms : HEALTH_INTERVAL_MS;
+  struct timeval interval = { tick_ms / 1000, (tick_ms % 1000) * 1000 };
+  int i = 0;
+
+  if (NULL == (hc = calloc(1, sizeof(health_checker)))) {
+    error("calloc health_checker");
+    return NULL;
+  }
+  hc->ev_base = ev_base;
+  hc->dns = dns;
+  hc->set = set;
+  hc->probing = 0 < interval_ms;
+  hc->timeout = *timeout;
+
+  if (NULL == (hc->probes = calloc(set->nbackends, sizeof(health_probe)))) {
+    error("calloc health_probe");
+    free(hc);
+    return NULL;
+  }
+  for (i = 0; i < set->nbackends; i++) {
+    hc->probes[i].hc = hc;
+    hc->probes[i].backend = &set->backends[i];
+    hc->probes[i].fd = -1;
+  }
+
+  if (NULL == (hc->ev_tick = event_new(ev_base, -1, EV_PERSIST, _tick_cb, hc)) ||
+      0 != event_add(hc->ev_tick, &interval)) {
+    health_free(hc);
+    return NULL;
+  }
+
+  return hc;
+}
+
+void health_free(health_checker *hc) {
+  int i = 0;
+  for (i = 0; i < hc->set->nbackends; i++) {
+    health_probe *probe = &hc->probes[i];
+    if (NULL != probe->waiter) {
+      dns_cache_cancel(probe->waiter); probe->waiter = NULL;
+    }
+    if (NULL != probe->ev) {
+      event_free(probe->ev); probe->ev = NULL;
+    }
+    if (0 <= probe->fd) {
+      close(probe->fd); probe->fd = -1;
+    }
+  }
+  if (NULL != hc->ev_tick) {
+    event_free(hc->ev_tick); hc->ev_tick = NULL;
+  }
+  free(hc->probes); hc->probes = NULL;
+  free(hc);
+}
+
+void health_failure(backend *b) {
+  b->passive_failures++;
+  _failed(b, backend_now());
+}
+
+void health_success(backend *b) {
+  if (!b->ejected) {
+    b->failures = 0;
+  }
+}
+
+// -- PRIVATE --
+
+static void _probe(health_probe *probe) {
+
+  health_checker *hc = probe->hc;
+  backend *b = probe->backend;
+  const dns_entry *entry = NULL;
+
+  if (0 <= probe->fd || NULL != probe->waiter) {
+    return;  // the last one is still going
+  }
+
+  if (NULL == (entry = dns_cache_lookup(hc->dns, b->host, b->port_num, _resolved_cb, probe, &probe->waiter))) {
+    if (NULL == probe->waiter) {
+      _probe_done(probe, 0);
+    }
+    return;
+  }
+
+  b->probes++;
+  if (0 > (probe->fd = socket(entry->addrs[0].ss_family, SOCK_STREAM, 0))) {
+    error("socket");
+    _probe_done(probe, 0);
+    return;
+  }
+
+  if (0 != evutil_make_socket_nonblocking(probe->fd) || 0 != evutil_make_socket_closeonexec(probe->fd) ||
+      (0 != connect(probe->fd, (struct sockaddr *) &entry->addrs[0], entry->addr_lens[0]) && EINPROGRESS != errno)) {
+    _probe_done(probe, 0);
+    return;
+  }
+
+  // writable once connected (or refused); the timeout bounds the handshake
+  if (NULL == (probe->ev = event_new(hc->ev_base, probe->fd, EV_WRITE, _connect_cb, probe)) ||
+      0 != event_add(probe->ev, &hc->timeout)) {
+    _probe_done(probe, 0);
+  }
+}
+
+static void _probe_done(health_probe *probe, int ok) {
+
+  backend *b = probe->backend;
+  uint64_t now = backend_now();
+
+  if (NULL != probe->ev) {
+    event_free(probe->ev); probe->ev = NULL;
+  }
+  if (0 <= probe->fd) {
+    close(probe->fd); probe->fd = -1;
+  }
+
+  if (!ok) {
+    b->probe_failures++;
+    _failed(b, now);
+    return;
+  }
+
+  b->failures = 0;
+  if (b->ejected && HEALTH_SUCCESSES <= ++b->successes && now >= b->ejected_until) {
+    _admit(b, now);
+  } else if (!b->ejected && 0 < b->ejections && now - b->ejected_until > EJECT_MAX_MS) {
+    b->ejections = 0;  // healthy for a while, so the next ejection starts short again
+  }
+}
+
+static void _failed(backend *b, uint64_t now) {
+  b->successes = 0;
+  if (!b->ejected && HEALTH_FAILURES <= ++b->failures) {
+    _eject(b, now);
+  }
+}
+
+static void _eject(backend *b, uint64_t now) {
+
+  uint64_t period = (uint64_t) EJECT_BASE_MS << MIN(b->ejections, 16);
+
+  period = MIN(period, EJECT_MAX_MS);
+  b->ejected = 1;
+  b->ejected_until = now + period;
+  b->admitted_at = 0;
+  b->ejections++;
+  b->ejections_total++;
+  log_warn("ejecting backend %s:%s for %lu ms after %d failures", b->host, b->port,
+             (unsigned long) period, b->failures);
+}
+
+static void _admit(backend *b, uint64_t now) {
+  b->ejected = 0;
+  b->failures = 0;
+  b->successes = 0;
+  b->admitted_at = 0 < SLOW_START_MS ? now : 0;
+  log_warn("re-admitting backend %s:%s", b->host, b->port);
+}
+
+static void _resolved_cb(int result, const dns_entry *entry, void *arg) {
+  health_probe *probe = arg;
+
+  (void) entry;
+  probe->waiter = NULL;
+  if (SUCCESS != result) {
+    _probe_done(probe, 0);
+    return;
+  }
+  _probe(probe);
+}
+
+static void _connect_cb(evutil_socket_t fd, short event, void *arg) {
+
+  health_probe *probe = arg;
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (event & EV_TIMEOUT) {
+    err = ETIMEDOUT;
+  } else if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+    err = errno;
+  }
+
+  if (0 != err) {
+    log_debug("probe of %s:%s failed with errno %d", probe->backend->host, probe->backend->port, err);
+  }
+  _probe_done(probe, 0 == err);
+}
+
+static void _tick_cb(evutil_socket_t fd, short event, void *arg) {
+
+  health_checker *hc = arg;
+  uint64_t now = backend_now();
+  int i = 0;
+
+  (void) fd;
+  (void) event;
+
+  for (i = 0; i < hc->set->nbackends; i++) {
+    if (hc->probing) {
+      _probe(&hc->probes[i]);
+    } else if (hc->probes[i].backend->ejected && now >= hc->probes[i].backend->ejected_until) {
+      _admit(hc->probes[i].backend, now);  // nothing to wait for without probes
+    }
+  }
+}
@@ -0,0 +1,53 @@
+/* health.h
+ *
+ * Per-worker health checking of the backends, with outlier ejection.
+ */
+#ifndef health_h
+#define health_h
+
+#include <sys/time.h>
+#include <event2/event.h>
+#include "defs.h"
+#include "backend.h"
+#include "dns_cache.h"
+
+typedef struct health_probe_struct health_probe;
+typedef struct health_checker_struct health_checker;
+
+/* A backend is ejected after HEALTH_FAILURES consecutive failed connects, whether they
+ * come from probes or from relayed clients. It stays out for EJECT_BASE_MS, doubling
+ * with every ejection up to EJECT_MAX_MS, and is re-admitted once that has passed and
+ * HEALTH_SUCCESSES probes in a row have connected. Re-admitted backends then warm up
+ * over SLOW_START_MS (see backend_select).
+ */
+struct health_checker_struct {
+  struct event_base *ev_base;
+  dns_cache *dns;
+  backend_set *set;
+  int probing;  // active probes enabled
+  struct timeval timeout;
+  health_probe *probes;  // one per backend
+  struct event *ev_tick;
+};
+
+/* Creates a checker for the set and starts its timer. With interval_ms of 0 there
+ * are no probes, and ejected backends are let back in once their ejection expires.
+ *
+ * @return the checker, or NULL on error.
+ */
+health_checker *health_new(struct event_base *ev_base,
+                           dns_cache *dns,
+                           backend_set *set,
+                           int interval_ms,
+                           const struct timeval *timeout);
+
+/* Cancels any probes in flight and frees the checker. */
+void health_free(health_checker *hc);
+
+/* Records a failed connect (or a connection error) seen while relaying a client. */
+void health_failure(backend *b);
+
+/* Records a successful connect seen while relaying a client. */
+void health_success(backend *b);
+
+#endif /* health_h */
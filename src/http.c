@@ -0,0 +1,712 @@
+/* http.c
+ *
+ * Incremental HTTP/1.x message framing over evbuffers.
+ */
+
+#define _GNU_SOURCE  // strptime, timegm
+
+#include "config.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <event2/buffer.h>
+#include "http.h"
+
+// -- DECLARATIONS --
+
+typedef struct {
+  int chunked;  // Transfer-Encoding ends in chunked
+  int codings;  // Transfer-Encoding was given at all
+  int has_length;
+  uint64_t length;
+  int close;  // Connection: close
+  int keep_alive;  // Connection: keep-alive
+
+  // what a shared cache needs to know
+  int get;  // of a request
+  const char *target;  // the request target, in the head
+  size_t target_len;
+  const char *host;  // the Host field, in the head; NULL without one
+  size_t host_len;
+  int authorization;
+  int no_store;  // Cache-Control: no-store, of either
+  int no_cache;  // Cache-Control: no-cache, or Pragma: no-cache
+  int private;  // Cache-Control: private
+  long max_age;  // Cache-Control: max-age, or -1
+  long s_maxage;  // Cache-Control: s-maxage, or -1
+  int vary;
+  int set_cookie;
+  int age;
+  int has_date;
+  time_t date;
+  int has_expires;
+  time_t expires;  // 0 if the value does not parse, i.e. already expired
+} http_fields;
+
+static http_state _parse_head(http_message *m, struct evbuffer *input);
+static http_state _chunk_size(http_message *m, struct evbuffer *input, struct evbuffer *output);
+static int _line(http_message *m, struct evbuffer *input, struct evbuffer *output, size_t *len);
+static size_t _trimmed(const char *value, size_t len);
+static void _cache_control(const char *value, size_t len, http_fields *fields);
+static int _date(const char *value, size_t len, time_t *t);
+static size_t _move(http_message *m, struct evbuffer *input, struct evbuffer *output, size_t len);
+
+// -- PUBLIC --
+
+void http_request_init(http_message *m) {
+  free(m->key);
+  memset(m, 0, sizeof(*m));
+  m->state = HTTP_HEAD;
+}
+
+void http_message_clear(http_message *m) {
+  free(m->key); m->key = NULL;
+  m->key_len = 0;
+}
+
+void http_response_init(http_message *m, const http_message *request) {
+  memset(m, 0, sizeof(*m));
+  m->state = HTTP_HEAD;
+  m->response = 1;
+  m->head = request->head;
+  m->connect = request->connect;
+}
+
+void http_tunnel(http_message *m) {
+  m->state = HTTP_TUNNEL;
+  m->keep_alive = 0;
+}
+
+http_state http_parse(http_message *m, struct evbuffer *input) {
+  if (HTTP_HEAD == m->state && 0 == m->pending) {
+    m->state = _parse_head(m, input);
+  }
+  return m->state;
+}
+
+void http_skip(http_message *m, struct evbuffer *input) {
+  evbuffer_drain(input, m->pending);
+  m->pending = 0;
+}
+
+http_state http_relay(http_message *m, struct evbuffer *input, struct evbuffer *output) {
+
+  size_t len = 0;
+
+  while (0 < evbuffer_get_length(input)) {
+
+    // a parsed head goes first
+    if (0 < m->pending) {
+      m->pending -= _move(m, input, output, m->pending);
+      continue;
+    }
+
+    switch (m->state) {
+
+    case HTTP_HEAD:
+      if (HTTP_HEAD == (m->state = _parse_head(m, input)) && 0 == m->pending) {
+        return m->state;  // incomplete, rather than an interim response
+      }
+      break;
+
+    case HTTP_BODY:
+    case HTTP_CHUNK_DATA:
+      m->remaining -= _move(m, input, output, m->remaining);
+      if (0 < m->remaining) {
+        return m->state;
+      }
+      m->state = HTTP_BODY == m->state ? HTTP_DONE : HTTP_CHUNK_END;
+      break;
+
+    case HTTP_CHUNK_SIZE:
+      if (HTTP_CHUNK_SIZE == (m->state = _chunk_size(m, input, output))) {
+        return m->state;
+      }
+      break;
+
+    case HTTP_CHUNK_END:
+      switch (_line(m, input, output, &len)) {
+      case 0: return m->state;
+      case 1: m->state = 0 == len ? HTTP_CHUNK_SIZE : HTTP_ERROR; break;  // longer than its size
+      default: m->state = HTTP_ERROR; break;
+      }
+      break;
+
+    case HTTP_TRAILERS:
+      switch (_line(m, input, output, &len)) {
+      case 0: return m->state;
+      case 1: m->state = 0 == len ? HTTP_DONE : HTTP_TRAILERS; break;
+      default: m->state = HTTP_ERROR; break;
+      }
+      break;
+
+    case HTTP_UNTIL_CLOSE:
+    case HTTP_TUNNEL:
+      _move(m, input, output, evbuffer_get_length(input));
+      return m->state;
+
+    case HTTP_IDLE:
+    case HTTP_DONE:
+    case HTTP_ERROR:
+      return m->state;
+    }
+  }
+
+  return m->state;
+}
+
+int http_respond(struct evbuffer *output, int status) {
+
+  const char *reason = NULL;
+
+  switch (status) {
+  case 400: reason = "Bad Request"; break;
+  case 502: reason = "Bad Gateway"; break;
+  case 503: reason = "Service Unavailable"; break;
+  case 504: reason = "Gateway Timeout"; break;
+  default: reason = "Error"; break;
+  }
+
+  return evbuffer_add_printf(output,
+                             "HTTP/1.1 %d %s\r\n"
+                             "Content-Length: 0\r\n"
+                             "Connection: close\r\n"
+                             "\r\n", status, reason);
+}
+
+// -- PRIVATE --
+
+/* Whether data is a token: the characters a method or a field name may have. */
+static int _is_token(const char *data, size_t len) {
+
+  size_t i = 0;
+
+  for (i = 0; i < len; i++) {
+    if (!isalnum((unsigned char) data[i]) && NULL == strchr("!#$%&'*+-.^_`|~", data[i])) {
+      return 0;
+    }
+  }
+  return 0 < len;
+}
+
+/* Whether every CR and LF in data is part of a CRLF. A lone one ends a line for a peer that is
+ * lenient about it, which would frame the message differently than we did.
+ */
+static int _crlf_only(const char *data, size_t len) {
+
+  size_t i = 0;
+
+  for (i = 0; i < len; i++) {
+    if (('\r' == data[i] && (i + 1 == len || '\n' != data[i + 1])) ||
+        ('\n' == data[i] && (0 == i || '\r' != data[i - 1]))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Whether the line before eol, which ends it with the first CRLF, has a lone CR or LF. */
+static int _bare_eol(struct evbuffer *input, struct evbuffer_ptr *eol) {
+  return -1 != evbuffer_search_range(input, "\n", 1, NULL, eol).pos ||
+         -1 != evbuffer_search_range(input, "\r", 1, NULL, eol).pos;
+}
+
+/* Whether the comma-separated list in value has an element equal to token. */
+static int _has_token(const char *value, size_t len, const char *token) {
+
+  size_t n = strlen(token);
+  const char *end = value + len;
+  const char *start = NULL, *stop = NULL;
+
+  while (value < end) {
+    while (value < end && (' ' == *value || '\t' == *value || ',' == *value)) {
+      value++;
+    }
+    for (start = value; value < end && ',' != *value; value++) {
+      continue;
+    }
+    for (stop = value; stop > start && (' ' == stop[-1] || '\t' == stop[-1]); stop--) {
+      continue;
+    }
+    if (n == (size_t) (stop - start) && 0 == strncasecmp(start, token, n)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Whether the last element of the comma-separated list in value is token. */
+static int _ends_with_token(const char *value, size_t len, const char *token) {
+
+  size_t n = strlen(token);
+
+  while (0 < len && (' ' == value[len - 1] || '\t' == value[len - 1])) {
+    len--;
+  }
+  if (len < n || 0 != strncasecmp(value + len - n, token, n)) {
+    return 0;
+  }
+  return len == n || ',' == value[len - n - 1] || ' ' == value[len - n - 1] ||
+         '\t' == value[len - n - 1];
+}
+
+/* Parses a Content-Length value, which must be all digits; a list of equal values, which some
+ * senders emit when they merge fields, is accepted.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int _content_length(const char *value, size_t len, http_fields *fields) {
+
+  size_t i = 0;
+  uint64_t length = 0;
+  int digits = 0;
+
+  for (i = 0; i <= len; i++) {
+    if (i == len || ',' == value[i]) {
+      if (0 == digits || (fields->has_length && length != fields->length)) {
+        return -1;
+      }
+      fields->has_length = 1;
+      fields->length = length;
+      length = 0;
+      digits = 0;
+    } else if (isdigit((unsigned char) value[i])) {
+      if (length > (UINT64_MAX - 9) / 10) {
+        return -1;
+      }
+      length = length * 10 + (uint64_t) (value[i] - '0');
+      digits++;
+    } else if (' ' != value[i] && '\t' != value[i]) {
+      return -1;
+    } else if (0 < digits && i + 1 < len && isdigit((unsigned char) value[i + 1])) {
+      return -1;  // "1 2"
+    }
+  }
+
+  return 0;
+}
+
+/* Parses the start line of a request.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int _request_line(http_message *m, const char *line, size_t len, http_fields *fields, int *minor) {
+
+  const char *sp1 = memchr(line, ' ', len);
+  const char *sp2 = NULL;
+
+  if (NULL == sp1 || !_is_token(line, (size_t) (sp1 - line))) {
+    return -1;
+  }
+  if (NULL == (sp2 = memchr(sp1 + 1, ' ', (size_t) (line + len - sp1 - 1))) || sp2 == sp1 + 1) {
+    return -1;
+  }
+  if (9 != line + len - sp2 || 0 != strncmp(sp2 + 1, "HTTP/1.", 7) ||
+      ('0' != sp2[8] && '1' != sp2[8])) {
+    return -1;
+  }
+
+  *minor = sp2[8] - '0';
+  fields->get = 3 == sp1 - line && 0 == strncmp(line, "GET", 3);
+  fields->target = sp1 + 1;
+  fields->target_len = (size_t) (sp2 - sp1 - 1);
+  m->head = 4 == sp1 - line && 0 == strncmp(line, "HEAD", 4);
+  m->connect = 7 == sp1 - line && 0 == strncmp(line, "CONNECT", 7);
+  return 0;
+}
+
+/* Parses the status line of a response.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int _status_line(http_message *m, const char *line, size_t len, int *minor) {
+
+  if (12 > len || 0 != strncmp(line, "HTTP/1.", 7) || ('0' != line[7] && '1' != line[7]) ||
+      ' ' != line[8] || !isdigit((unsigned char) line[9]) ||
+      !isdigit((unsigned char) line[10]) || !isdigit((unsigned char) line[11]) ||
+      (12 < len && ' ' != line[12])) {
+    return -1;
+  }
+
+  *minor = line[7] - '0';
+  m->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+  return 0;
+}
+
+/* Parses a header field line into fields.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int _field(const char *line, size_t len, http_fields *fields) {
+
+  const char *colon = memchr(line, ':', len);
+  size_t name = 0;
+  const char *value = NULL;
+  size_t n = 0;
+
+  // a name that is not a token: obsolete line folding, whitespace before the colon, or worse
+  if (NULL == colon || !_is_token(line, (size_t) (colon - line))) {
+    return -1;
+  }
+
+  name = (size_t) (colon - line);
+  value = colon + 1;
+  n = len - name - 1;
+  while (0 < n && (' ' == *value || '\t' == *value)) {
+    value++;
+    n--;
+  }
+
+  if (14 == name && 0 == strncasecmp(line, "Content-Length", name)) {
+    return _content_length(value, n, fields);
+  }
+
+  if (17 == name && 0 == strncasecmp(line, "Transfer-Encoding", name)) {
+    fields->codings = 1;
+    fields->chunked = _ends_with_token(value, n, "chunked");
+  } else if (10 == name && 0 == strncasecmp(line, "Connection", name)) {
+    fields->close |= _has_token(value, n, "close");
+    fields->keep_alive |= _has_token(value, n, "keep-alive");
+  } else if (4 == name && 0 == strncasecmp(line, "Host", name)) {
+    fields->host = value;
+    fields->host_len = _trimmed(value, n);
+  } else if (13 == name && 0 == strncasecmp(line, "Cache-Control", name)) {
+    _cache_control(value, n, fields);
+  } else if (6 == name && 0 == strncasecmp(line, "Pragma", name)) {
+    fields->no_cache |= _has_token(value, n, "no-cache");
+  } else if (13 == name && 0 == strncasecmp(line, "Authorization", name)) {
+    fields->authorization = 1;
+  } else if (4 == name && 0 == strncasecmp(line, "Vary", name)) {
+    fields->vary = 1;
+  } else if (10 == name && 0 == strncasecmp(line, "Set-Cookie", name)) {
+    fields->set_cookie = 1;
+  } else if (3 == name && 0 == strncasecmp(line, "Age", name)) {
+    fields->age = 1;
+  } else if (4 == name && 0 == strncasecmp(line, "Date", name)) {
+    fields->has_date = 0 == _date(value, _trimmed(value, n), &fields->date);
+  } else if (7 == name && 0 == strncasecmp(line, "Expires", name)) {
+    fields->has_expires = 1;
+    if (0 != _date(value, _trimmed(value, n), &fields->expires)) {
+      fields->expires = 0;
+    }
+  }
+
+  return 0;
+}
+
+/* The length of value without trailing whitespace. */
+static size_t _trimmed(const char *value, size_t len) {
+  while (0 < len && (' ' == value[len - 1] || '\t' == value[len - 1])) {
+    len--;
+  }
+  return len;
+}
+
+/* Parses the Cache-Control directives a shared cache cares about. */
+static void _cache_control(const char *value, size_t len, http_fields *fields) {
+
+  const char *end = value + len;
+  const char *start = NULL, *stop = NULL;
+  long *seconds = NULL;
+  size_t n = 0;
+
+  while (value < end) {
+    while (value < end && (' ' == *value || '\t' == *value || ',' == *value)) {
+      value++;
+    }
+    for (start = value; value < end && ',' != *value; value++) {
+      continue;
+    }
+    stop = start + _trimmed(start, (size_t) (value - start));
+    n = (size_t) (stop - start);
+
+    seconds = NULL;
+    if (8 <= n && 0 == strncasecmp(start, "no-store", 8)) {
+      fields->no_store = 1;
+    } else if (8 <= n && 0 == strncasecmp(start, "no-cache", 8)) {
+      fields->no_cache = 1;  // with or without a list of fields
+    } else if (7 <= n && 0 == strncasecmp(start, "private", 7)) {
+      fields->private = 1;
+    } else if (8 < n && 0 == strncasecmp(start, "max-age=", 8)) {
+      seconds = &fields->max_age;
+      start += 8;
+    } else if (9 < n && 0 == strncasecmp(start, "s-maxage=", 9)) {
+      seconds = &fields->s_maxage;
+      start += 9;
+    }
+
+    if (NULL != seconds) {
+      *seconds = 0;
+      if ('"' == *start && stop - start >= 2 && '"' == stop[-1]) {
+        start++;
+        stop--;
+      }
+      for (; start < stop && isdigit((unsigned char) *start) && *seconds < 0x7fffffffL / 10; start++) {
+        *seconds = *seconds * 10 + (*start - '0');
+      }
+    }
+  }
+}
+
+/* Parses an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int _date(const char *value, size_t len, time_t *t) {
+
+  char date[64];
+  struct tm tm;
+  const char *end = NULL;
+
+  if (len >= sizeof(date)) {
+    return -1;
+  }
+  memcpy(date, value, len);
+  date[len] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  if (NULL == (end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) || '\0' != *end) {
+    return -1;
+  }
+  *t = timegm(&tm);
+  return 0;
+}
+
+/* Keys a GET that a shared cache may answer by its host and target, e.g. "GET example.com /a". */
+static void _key(http_message *m, const http_fields *fields) {
+
+  size_t host_len = NULL != fields->host ? fields->host_len : 0;
+  size_t i = 0;
+
+  if (!fields->get || fields->has_length || fields->codings || fields->authorization ||
+      fields->no_store || fields->no_cache || 0 == fields->max_age || HTTP_CACHE_KEY_LEN < host_len + fields->target_len) {
+    return;
+  }
+
+  m->key_len = 4 + host_len + 1 + fields->target_len;
+  if (NULL == (m->key = malloc(m->key_len + 1))) {
+    m->key_len = 0;
+    return;
+  }
+  memcpy(m->key, "GET ", 4);
+  for (i = 0; i < host_len; i++) {
+    m->key[4 + i] = (char) tolower((unsigned char) fields->host[i]);
+  }
+  m->key[4 + host_len] = ' ';
+  memcpy(m->key + 4 + host_len + 1, fields->target, fields->target_len);
+  m->key[m->key_len] = '\0';
+}
+
+/* How long a shared cache may serve a final response to a GET without asking again. */
+static void _freshness(http_message *m, const http_fields *fields, http_state state) {
+
+  long ttl = 0;
+
+  m->ttl_s = 0;
+  if (m->interim || !m->keep_alive || !fields->has_length || (HTTP_BODY != state && HTTP_DONE != state) ||
+      fields->no_store || fields->no_cache || fields->private || fields->vary || fields->set_cookie ||
+      fields->age) {
+    return;
+  }
+  // too long to store whole: known from the head, so waiting lookups need not wait for the body
+  if (fields->length > HTTP_CACHE_MAX_OBJECT || m->head_len > HTTP_CACHE_MAX_OBJECT - fields->length) {
+    return;
+  }
+  switch (m->status) {
+  case 200: case 203: case 300: case 301: case 404: case 410:
+    break;
+  default:
+    return;
+  }
+
+  if (0 <= fields->s_maxage) {
+    ttl = fields->s_maxage;
+  } else if (0 <= fields->max_age) {
+    ttl = fields->max_age;
+  } else if (fields->has_expires) {
+    ttl = (long) (fields->expires - (fields->has_date ? fields->date : time(NULL)));
+  }
+  m->ttl_s = 0 < ttl ? (uint64_t) ttl : 0;
+}
+
+/* Decides where the message's body ends from its head. */
+static http_state _framing(http_message *m, const http_fields *fields, int minor) {
+
+  m->keep_alive = 1 == minor ? !fields->close : fields->keep_alive && !fields->close;
+
+  if (!m->response) {
+    // anything the upstream could read differently from us is refused
+    if (fields->codings && (fields->has_length || !fields->chunked || 0 == minor)) {
+      return HTTP_ERROR;
+    }
+    if (fields->chunked) {
+      return HTTP_CHUNK_SIZE;
+    }
+    m->remaining = fields->has_length ? fields->length : 0;
+    return 0 < m->remaining ? HTTP_BODY : HTTP_DONE;
+  }
+
+  if (100 <= m->status && 200 > m->status && 101 != m->status) {
+    return HTTP_HEAD;  // interim; the final response follows
+  }
+  if (101 == m->status || (m->connect && 200 <= m->status && 300 > m->status)) {
+    m->keep_alive = 0;
+    return HTTP_TUNNEL;
+  }
+  if (m->head || 204 == m->status || 304 == m->status) {
+    return HTTP_DONE;
+  }
+  if (fields->codings) {
+    // chunked wins over a Content-Length, but the connection is not worth trusting after
+    m->keep_alive = m->keep_alive && !fields->has_length && fields->chunked;
+    if (fields->chunked) {
+      return HTTP_CHUNK_SIZE;
+    }
+    m->keep_alive = 0;
+    return HTTP_UNTIL_CLOSE;
+  }
+  if (fields->has_length) {
+    m->remaining = fields->length;
+    return 0 < m->remaining ? HTTP_BODY : HTTP_DONE;
+  }
+  m->keep_alive = 0;
+  return HTTP_UNTIL_CLOSE;
+}
+
+static http_state _parse_head(http_message *m, struct evbuffer *input) {
+
+  struct evbuffer_ptr end;
+  http_fields fields;
+  const char *head = NULL;
+  const char *line = NULL;
+  const char *eol = NULL;
+  size_t len = 0;
+  int minor = 0;
+  http_state state = HTTP_HEAD;
+
+  // a few empty lines before a request are tolerated
+  while (!m->response && 2 <= evbuffer_get_length(input)) {
+    unsigned char crlf[2];
+    evbuffer_copyout(input, crlf, 2);
+    if ('\r' != crlf[0] || '\n' != crlf[1]) {
+      break;
+    }
+    evbuffer_drain(input, 2);
+  }
+
+  end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+  if (-1 == end.pos) {
+    return HTTP_MAX_HEAD < evbuffer_get_length(input) ? HTTP_ERROR : HTTP_HEAD;
+  }
+  if (HTTP_MAX_HEAD < (size_t) end.pos + 4) {
+    return HTTP_ERROR;
+  }
+
+  // the head is made contiguous where it lies, and is moved along as it is by http_relay
+  len = (size_t) end.pos + 4;
+  if (NULL == (head = (const char *) evbuffer_pullup(input, (ev_ssize_t) len))) {
+    return HTTP_ERROR;
+  }
+
+  if (!_crlf_only(head, len)) {
+    return HTTP_ERROR;
+  }
+
+  memset(&fields, 0, sizeof(fields));
+  fields.max_age = -1;
+  fields.s_maxage = -1;
+  eol = memchr(head, '\r', len);
+  if ((m->response ? _status_line(m, head, (size_t) (eol - head), &minor)
+                   : _request_line(m, head, (size_t) (eol - head), &fields, &minor)) < 0) {
+    return HTTP_ERROR;
+  }
+
+  for (line = eol + 2; line < head + len - 2; line = eol + 2) {
+    eol = memchr(line, '\r', (size_t) (head + len - line));
+    if ('\n' != eol[1] || _field(line, (size_t) (eol - line), &fields) < 0) {
+      return HTTP_ERROR;
+    }
+  }
+
+  m->pending = len;
+  m->head_len = len;
+  state = _framing(m, &fields, minor);
+  if (m->response) {
+    _freshness(m, &fields, state);
+    m->interim |= HTTP_HEAD == state;
+  } else if (m->keyed && HTTP_ERROR != state) {
+    _key(m, &fields);
+  }
+  return state;
+}
+
+static http_state _chunk_size(http_message *m, struct evbuffer *input, struct evbuffer *output) {
+
+  char line[32];
+  struct evbuffer_ptr eol;
+  size_t len = 0, i = 0;
+  uint64_t size = 0;
+
+  eol = evbuffer_search_eol(input, NULL, &len, EVBUFFER_EOL_CRLF_STRICT);
+  if (-1 == eol.pos) {
+    return (size_t) HTTP_MAX_HEAD < evbuffer_get_length(input) ? HTTP_ERROR : HTTP_CHUNK_SIZE;
+  }
+  if (_bare_eol(input, &eol)) {
+    return HTTP_ERROR;
+  }
+
+  // the size, and then any extensions, which are ignored
+  evbuffer_copyout(input, line, (size_t) eol.pos < sizeof(line) ? (size_t) eol.pos : sizeof(line));
+  for (i = 0; i < (size_t) eol.pos && i < sizeof(line) && isxdigit((unsigned char) line[i]); i++) {
+    if (size > (UINT64_MAX >> 4)) {
+      return HTTP_ERROR;
+    }
+    size = (size << 4) | (uint64_t) (isdigit((unsigned char) line[i]) ? line[i] - '0'
+                                                                       : (tolower((unsigned char) line[i]) - 'a' + 10));
+  }
+  if (0 == i || (i < (size_t) eol.pos && (i == sizeof(line) || (';' != line[i] && ' ' != line[i] &&
+                                                                '\t' != line[i])))) {
+    return HTTP_ERROR;
+  }
+
+  _move(m, input, output, (size_t) eol.pos + len);
+  m->remaining = size;
+  return 0 == size ? HTTP_TRAILERS : HTTP_CHUNK_DATA;
+}
+
+/* Moves one CRLF-terminated line, and gives its length without the CRLF.
+ *
+ * @return 1 if a line was moved, 0 if it is incomplete, -1 if it is too long or has a lone CR or LF
+ */
+static int _line(http_message *m, struct evbuffer *input, struct evbuffer *output, size_t *len) {
+
+  size_t eol_len = 0;
+  struct evbuffer_ptr eol = evbuffer_search_eol(input, NULL, &eol_len, EVBUFFER_EOL_CRLF_STRICT);
+
+  if (-1 == eol.pos) {
+    return (size_t) HTTP_MAX_HEAD < evbuffer_get_length(input) ? -1 : 0;
+  }
+  if (_bare_eol(input, &eol)) {
+    return -1;
+  }
+
+  *len = (size_t) eol.pos;
+  _move(m, input, output, (size_t) eol.pos + eol_len);
+  return 1;
+}
+
+/* Moves up to len bytes, without copying them.
+ *
+ * @return the number of bytes moved
+ */
+static size_t _move(http_message *m, struct evbuffer *input, struct evbuffer *output, size_t len) {
+  int moved = evbuffer_remove_buffer(input, output, len);
+  if (moved <= 0) {
+    return 0;
+  }
+  m->moved += (uint64_t) moved;
+  return (size_t) moved;
+}
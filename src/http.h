@@ -0,0 +1,89 @@
+/* http.h
+ *
+ * Incremental HTTP/1.x message framing over evbuffers: finds where each request and
+ * response ends, so that upstream connections can be reused between them. Heads are
+ * parsed in place, and messages are moved from one evbuffer to another without copying.
+ */
+#ifndef http_h
+#define http_h
+
+#include <stdint.h>
+#include <event2/buffer.h>
+
+typedef enum {
+  HTTP_IDLE,  // no message is expected, i.e. a response before its request
+  HTTP_HEAD,  // waiting for the start line and header fields
+  HTTP_BODY,  // remaining bytes of a Content-Length body
+  HTTP_CHUNK_SIZE,  // waiting for a chunk-size line
+  HTTP_CHUNK_DATA,  // remaining bytes of a chunk
+  HTTP_CHUNK_END,  // waiting for the CRLF after a chunk
+  HTTP_TRAILERS,  // waiting for the trailer fields after the last chunk
+  HTTP_UNTIL_CLOSE,  // a response that ends when the upstream closes
+  HTTP_DONE,  // the message is complete
+  HTTP_TUNNEL,  // after an upgrade or a CONNECT, bytes are relayed as they are
+  HTTP_ERROR  // framing that cannot be relayed safely
+} http_state;
+
+typedef struct {
+  http_state state;
+  int response;  // frames responses rather than requests
+  int keep_alive;  // the connection may carry another message after this one
+  int head;  // a HEAD request, or the response to one
+  int connect;  // a CONNECT request, or the response to one
+  int status;  // of a response
+  uint64_t remaining;  // in HTTP_BODY and HTTP_CHUNK_DATA
+  uint64_t moved;  // bytes of the message relayed so far
+  size_t pending;  // bytes of a parsed head still waiting in the input
+  size_t head_len;  // of the last head parsed
+  int interim;  // a response that an interim (1xx) response came before
+
+  // for a shared cache
+  int keyed;  // set on a request before its head is parsed, to have key set if it is cacheable
+  char *key;  // "GET host target" of a GET that a shared cache may answer; NULL otherwise
+  size_t key_len;
+  uint64_t ttl_s;  // of a response to a GET, how long a shared cache may serve it; 0 if it may not store it
+} http_message;
+
+/* Expects a request; frees the key of an earlier one. */
+void http_request_init(http_message *m);
+
+/* Frees what the message holds on to. */
+void http_message_clear(http_message *m);
+
+/* Expects the response to a request whose head has been relayed. */
+void http_response_init(http_message *m, const http_message *request);
+
+/* Stops framing: everything from here on is relayed as it is. */
+void http_tunnel(http_message *m);
+
+/* Parses the head of a request, without relaying it, so that the request can be answered
+ * from a cache instead; http_relay or http_skip picks up from there.
+ *
+ * @return the message's state, as http_relay does
+ */
+http_state http_parse(http_message *m, struct evbuffer *input);
+
+/* Drops a head that http_parse left in input. */
+void http_skip(http_message *m, struct evbuffer *input);
+
+/* Moves as much of the current message as input holds over to output, parsing its framing
+ * on the way, and stops at the end of the message; bytes after it are left in input. An
+ * interim (1xx) response is relayed along with the final response that follows it.
+ *
+ * Requests are held to a stricter standard than responses, since a request that the
+ * proxy and the upstream frame differently could smuggle another past it on a reused
+ * connection: both Content-Length and Transfer-Encoding, conflicting lengths, or a
+ * transfer coding other than chunked are errors.
+ *
+ * @return the message's state: HTTP_DONE at its end, HTTP_TUNNEL if it turned the
+ *         connection into a tunnel, HTTP_ERROR if it cannot be relayed, and otherwise
+ *         the state that is waiting for more bytes.
+ */
+http_state http_relay(http_message *m, struct evbuffer *input, struct evbuffer *output);
+
+/* Appends a complete response with the given status, and no body, that closes the
+ * connection; for errors that the proxy answers itself.
+ */
+int http_respond(struct evbuffer *output, int status);
+
+#endif /* http_h */
@@ -0,0 +1,485 @@
+/* http_cache.c
+ *
+ * In-memory cache of HTTP responses to GET requests, shared by the workers.
+ *
+ * Each shard is a chained hash table whose entries are also on an LRU list, most recently
+ * used first, under one mutex; lookups of different keys rarely take the same lock. An
+ * entry holds the response verbatim, head and body in one block, and a reference count:
+ * one for the shard, and one for each hit or evbuffer still pointing into the block. Hits
+ * are served with evbuffer_add_reference, so a response is copied once, on its way in,
+ * and never on its way out.
+ *
+ * A miss registers a fill for its key; misses on the same key that follow wait on it,
+ * and are woken with event_active, from whichever worker ends the fill.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "http_cache.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+#define HTTP_CACHE_FILL_MIN 4096  // first allocation for a response being filled
+
+struct http_cache_entry_struct {
+  _Atomic unsigned long refs;
+  uint64_t hash;
+  char *key;
+  size_t key_len;
+  char *data;  // head, then body
+  size_t len;
+  size_t head_len;
+  size_t bytes;  // counted against the shard's capacity
+  uint64_t stored_at;  // metrics_now()
+  uint64_t expires_at;
+  http_cache_entry *chain;  // next in its bucket
+  http_cache_entry *prev;  // in the LRU list
+  http_cache_entry *next;
+};
+
+struct http_cache_fill_struct {
+  uint64_t hash;
+  char *key;
+  size_t key_len;
+  char *data;  // only the filler touches these three
+  size_t len;
+  size_t cap;
+  http_cache_waiter *waiters;  // guarded by the shard's lock, as is the list of fills
+  http_cache_fill *prev;
+  http_cache_fill *next;
+};
+
+typedef struct {
+  _Alignas(64) pthread_mutex_t lock;
+  http_cache_entry *buckets[HTTP_CACHE_BUCKETS];
+  http_cache_entry *head;  // most recently used
+  http_cache_entry *tail;  // next to be evicted
+  http_cache_fill *fills;
+  size_t bytes;
+  size_t capacity;
+} http_cache_shard;
+
+struct http_cache_struct {
+  http_cache_shard shards[HTTP_CACHE_SHARDS];
+};
+
+// -- DECLARATIONS --
+
+static uint64_t _hash(const char *key, size_t len);
+static http_cache_shard *_shard(http_cache *cache, uint64_t hash);
+static http_cache_entry **_bucket(http_cache_shard *shard, uint64_t hash);
+/* Returns the entry for key, or NULL; the shard's lock is held. */
+static http_cache_entry *_find(http_cache_shard *shard, uint64_t hash, const char *key, size_t len);
+/* Returns the fill under way for key, or NULL; the shard's lock is held. */
+static http_cache_fill *_find_fill(http_cache_shard *shard, uint64_t hash, const char *key, size_t len);
+/* Links the entry in as the most recently used; the shard's lock is held. */
+static void _insert(http_cache_shard *shard, http_cache_entry *entry, metrics *m);
+/* Unlinks the entry and drops the shard's reference; the shard's lock is held. */
+static void _remove(http_cache_shard *shard, http_cache_entry *entry, metrics *m);
+static void _lru_unlink(http_cache_shard *shard, http_cache_entry *entry);
+static void _lru_push(http_cache_shard *shard, http_cache_entry *entry);
+/* Unlinks the fill and wakes its waiters; the shard's lock is held. */
+static void _fill_unlink(http_cache_shard *shard, http_cache_fill *fill, int abandoned);
+static void _fill_free(http_cache_fill *fill);
+static void _unref(http_cache_entry *entry);
+/* Cleanup for evbuffer references into an entry. */
+static void _unref_cb(const void *data, size_t len, void *arg);
+
+// -- PUBLIC --
+
+http_cache *http_cache_new(size_t capacity) {
+
+  http_cache *cache = NULL;
+  int i = 0;
+
+  if (NULL == (cache = calloc(1, sizeof(http_cache)))) {
+    error("calloc http_cache");
+    return NULL;
+  }
+
+  for (i = 0; i < HTTP_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+    cache->shards[i].capacity = capacity / HTTP_CACHE_SHARDS;
+  }
+
+  log_info("caching HTTP responses in %lu bytes, %d shards, objects up to %d bytes",
+           (unsigned long) capacity, HTTP_CACHE_SHARDS, HTTP_CACHE_MAX_OBJECT);
+  return cache;
+}
+
+void http_cache_free(http_cache *cache) {
+
+  http_cache_shard *shard = NULL;
+  int i = 0;
+
+  for (i = 0; i < HTTP_CACHE_SHARDS; i++) {
+    shard = &cache->shards[i];
+    while (NULL != shard->tail) {
+      _remove(shard, shard->tail, NULL);
+    }
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(cache);
+}
+
+http_cache_result http_cache_lookup(http_cache *cache, const char *key, size_t key_len, metrics *m,
+                                    http_cache_entry **entry, http_cache_fill **fill, http_cache_waiter *waiter) {
+
+  uint64_t hash = _hash(key, key_len);
+  http_cache_shard *shard = _shard(cache, hash);
+  http_cache_entry *e = NULL;
+  http_cache_fill *f = NULL;
+
+  pthread_mutex_lock(&shard->lock);
+
+  if (NULL != (e = _find(shard, hash, key, key_len)) && e->expires_at <= metrics_now()) {
+    _remove(shard, e, m);
+    e = NULL;
+  }
+
+  if (NULL != e) {
+    _lru_unlink(shard, e);
+    _lru_push(shard, e);
+    atomic_fetch_add(&e->refs, 1);
+    pthread_mutex_unlock(&shard->lock);
+    metrics_add(&m->http_cache[METRICS_CACHE_HIT], 1);
+    *entry = e;
+    return HTTP_CACHE_HIT;
+  }
+
+  if (NULL != waiter && NULL != (f = _find_fill(shard, hash, key, key_len))) {
+    waiter->fill = f;
+    waiter->shard = (int) (shard - cache->shards);
+    waiter->abandoned = 0;
+    waiter->prev = NULL;
+    if (NULL != (waiter->next = f->waiters)) {
+      waiter->next->prev = waiter;
+    }
+    f->waiters = waiter;
+    pthread_mutex_unlock(&shard->lock);
+    metrics_add(&m->http_cache[METRICS_CACHE_COALESCED], 1);
+    return HTTP_CACHE_WAIT;
+  }
+
+  *fill = NULL;
+  if (NULL != waiter && NULL != (f = calloc(1, sizeof(http_cache_fill)))) {
+    if (NULL == (f->key = malloc(key_len))) {
+      free(f);
+    } else {
+      memcpy(f->key, key, key_len);
+      f->key_len = key_len;
+      f->hash = hash;
+      if (NULL != (f->next = shard->fills)) {
+        f->next->prev = f;
+      }
+      shard->fills = f;
+      *fill = f;
+    }
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+  metrics_add(&m->http_cache[METRICS_CACHE_MISS], 1);
+  return HTTP_CACHE_MISS;
+}
+
+int http_cache_serve(http_cache_entry *entry, struct evbuffer *output) {
+
+  uint64_t age = (metrics_now() - entry->stored_at) / 1000000;
+
+  // the head up to its blank line, an Age field, and the body; the block stays put, so
+  // each reference holds one of its refs until the evbuffer is done with it
+  atomic_fetch_add(&entry->refs, 1);
+  if (0 != evbuffer_add_reference(output, entry->data, entry->head_len - 2, _unref_cb, entry)) {
+    _unref(entry);
+    return ERR_HTTP_CACHE;
+  }
+  if (0 > evbuffer_add_printf(output, "Age: %lu\r\n\r\n", (unsigned long) age)) {
+    return ERR_HTTP_CACHE;
+  }
+  if (entry->len > entry->head_len) {
+    atomic_fetch_add(&entry->refs, 1);
+    if (0 != evbuffer_add_reference(output, entry->data + entry->head_len, entry->len - entry->head_len,
+                                    _unref_cb, entry)) {
+      _unref(entry);
+      return ERR_HTTP_CACHE;
+    }
+  }
+  return SUCCESS;
+}
+
+void http_cache_release(http_cache_entry *entry) {
+  _unref(entry);
+}
+
+int http_cache_fill_append(http_cache_fill *fill, struct evbuffer *buffer, size_t offset) {
+
+  size_t n = evbuffer_get_length(buffer) - offset;
+  size_t cap = 0;
+  size_t copied = 0;
+  size_t len = 0;
+  char *data = NULL;
+  struct evbuffer_ptr ptr;
+  struct evbuffer_iovec vec;
+
+  if (0 == n) {
+    return SUCCESS;
+  }
+  if (fill->len + n > HTTP_CACHE_MAX_OBJECT) {
+    return ERR_HTTP_CACHE;
+  }
+
+  if (fill->len + n > fill->cap) {
+    cap = MIN(MAX(MAX(fill->cap * 2, fill->len + n), HTTP_CACHE_FILL_MIN), HTTP_CACHE_MAX_OBJECT);
+    if (NULL == (data = realloc(fill->data, cap))) {
+      error("realloc http_cache_fill");
+      return ERR_HTTP_CACHE;
+    }
+    fill->data = data;
+    fill->cap = cap;
+  }
+
+  // peeked rather than copied out, which a bufferevent's frozen output buffer refuses
+  for (copied = 0; copied < n; copied += len) {
+    if (0 != evbuffer_ptr_set(buffer, &ptr, offset + copied, EVBUFFER_PTR_SET) ||
+        1 > evbuffer_peek(buffer, (ev_ssize_t) (n - copied), &ptr, &vec, 1) || 0 == vec.iov_len) {
+      return ERR_HTTP_CACHE;
+    }
+    len = MIN(vec.iov_len, n - copied);
+    memcpy(fill->data + fill->len + copied, vec.iov_base, len);
+  }
+  fill->len += n;
+  return SUCCESS;
+}
+
+void http_cache_fill_end(http_cache *cache, http_cache_fill *fill, size_t head_len, uint64_t ttl_s, metrics *m) {
+
+  http_cache_shard *shard = _shard(cache, fill->hash);
+  http_cache_entry *e = NULL;
+  http_cache_entry *old = NULL;
+  char *data = NULL;
+
+  // waiters woken by an abandoned fill go upstream themselves, rather than queue up for another
+  if (head_len < 4 || head_len > fill->len ||
+      sizeof(http_cache_entry) + fill->key_len + fill->len > shard->capacity ||
+      NULL == (e = calloc(1, sizeof(http_cache_entry)))) {
+    http_cache_fill_abandon(cache, fill);
+    return;
+  }
+
+  // the entry takes the fill's key and block over, trimmed to the response
+  if (fill->cap > fill->len && NULL != (data = realloc(fill->data, fill->len))) {
+    fill->data = data;
+    fill->cap = fill->len;
+  }
+  atomic_init(&e->refs, 1);
+  e->hash = fill->hash;
+  e->key = fill->key; fill->key = NULL;
+  e->key_len = fill->key_len;
+  e->data = fill->data; fill->data = NULL;
+  e->len = fill->len;
+  e->head_len = head_len;
+  e->bytes = sizeof(http_cache_entry) + e->key_len + fill->cap;  // as allocated
+  e->stored_at = metrics_now();
+  e->expires_at = e->stored_at + ttl_s * 1000000;
+
+  pthread_mutex_lock(&shard->lock);
+  _fill_unlink(shard, fill, 0);
+  if (NULL != (old = _find(shard, e->hash, e->key, e->key_len))) {
+    _remove(shard, old, m);
+  }
+  _insert(shard, e, m);
+  while (shard->bytes > shard->capacity) {
+    _remove(shard, shard->tail, m);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  _fill_free(fill);
+}
+
+void http_cache_fill_abandon(http_cache *cache, http_cache_fill *fill) {
+
+  http_cache_shard *shard = _shard(cache, fill->hash);
+
+  pthread_mutex_lock(&shard->lock);
+  _fill_unlink(shard, fill, 1);
+  pthread_mutex_unlock(&shard->lock);
+
+  _fill_free(fill);
+}
+
+void http_cache_cancel(http_cache *cache, http_cache_waiter *waiter) {
+
+  http_cache_shard *shard = &cache->shards[waiter->shard];
+
+  pthread_mutex_lock(&shard->lock);
+  if (NULL != waiter->fill) {
+    if (NULL != waiter->prev) {
+      waiter->prev->next = waiter->next;
+    } else {
+      waiter->fill->waiters = waiter->next;
+    }
+    if (NULL != waiter->next) {
+      waiter->next->prev = waiter->prev;
+    }
+    waiter->fill = NULL;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  // woken already, but not run yet
+  if (NULL != waiter->ev) {
+    event_del(waiter->ev);
+  }
+}
+
+// -- PRIVATE --
+
+static uint64_t _hash(const char *key, size_t len) {
+
+  uint64_t hash = FNV_OFFSET;
+  size_t i = 0;
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) key[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static http_cache_shard *_shard(http_cache *cache, uint64_t hash) {
+  return &cache->shards[hash % HTTP_CACHE_SHARDS];
+}
+
+static http_cache_entry **_bucket(http_cache_shard *shard, uint64_t hash) {
+  return &shard->buckets[(hash / HTTP_CACHE_SHARDS) % HTTP_CACHE_BUCKETS];
+}
+
+static http_cache_entry *_find(http_cache_shard *shard, uint64_t hash, const char *key, size_t len) {
+
+  http_cache_entry *e = NULL;
+
+  for (e = *_bucket(shard, hash); NULL != e; e = e->chain) {
+    if (e->hash == hash && e->key_len == len && 0 == memcmp(e->key, key, len)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static http_cache_fill *_find_fill(http_cache_shard *shard, uint64_t hash, const char *key, size_t len) {
+
+  http_cache_fill *f = NULL;
+
+  for (f = shard->fills; NULL != f; f = f->next) {
+    if (f->hash == hash && f->key_len == len && 0 == memcmp(f->key, key, len)) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+static void _insert(http_cache_shard *shard, http_cache_entry *entry, metrics *m) {
+
+  http_cache_entry **bucket = _bucket(shard, entry->hash);
+
+  entry->chain = *bucket;
+  *bucket = entry;
+  _lru_push(shard, entry);
+  shard->bytes += entry->bytes;
+
+  metrics_add(&m->http_cache_stored, entry->bytes);
+  metrics_add(&m->http_cache_objects_stored, 1);
+}
+
+static void _remove(http_cache_shard *shard, http_cache_entry *entry, metrics *m) {
+
+  http_cache_entry **link = _bucket(shard, entry->hash);
+
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+  _lru_unlink(shard, entry);
+  shard->bytes -= entry->bytes;
+
+  if (NULL != m) {
+    metrics_add(&m->http_cache_removed, entry->bytes);
+    metrics_add(&m->http_cache_objects_removed, 1);
+  }
+  _unref(entry);
+}
+
+static void _lru_unlink(http_cache_shard *shard, http_cache_entry *entry) {
+  if (NULL != entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    shard->head = entry->next;
+  }
+  if (NULL != entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    shard->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void _lru_push(http_cache_shard *shard, http_cache_entry *entry) {
+  entry->prev = NULL;
+  if (NULL != (entry->next = shard->head)) {
+    entry->next->prev = entry;
+  } else {
+    shard->tail = entry;
+  }
+  shard->head = entry;
+}
+
+static void _fill_unlink(http_cache_shard *shard, http_cache_fill *fill, int abandoned) {
+
+  http_cache_waiter *waiter = NULL;
+
+  if (NULL != fill->prev) {
+    fill->prev->next = fill->next;
+  } else {
+    shard->fills = fill->next;
+  }
+  if (NULL != fill->next) {
+    fill->next->prev = fill->prev;
+  }
+
+  // under the lock, so that a waiter being cancelled on its own thread is either still
+  // linked, or already woken
+  while (NULL != (waiter = fill->waiters)) {
+    fill->waiters = waiter->next;
+    waiter->fill = NULL;
+    waiter->abandoned = abandoned;
+    event_active(waiter->ev, EV_TIMEOUT, 0);
+  }
+}
+
+static void _fill_free(http_cache_fill *fill) {
+  free(fill->key);
+  free(fill->data);
+  free(fill);
+}
+
+static void _unref(http_cache_entry *entry) {
+  if (1 == atomic_fetch_sub(&entry->refs, 1)) {
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+  }
+}
+
+static void _unref_cb(const void *data, size_t len, void *arg) {
+  (void) data;
+  (void) len;
+  _unref(arg);
+}
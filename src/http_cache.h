@@ -0,0 +1,88 @@
+/* http_cache.h
+ *
+ * In-memory cache of HTTP responses to GET requests, shared by the workers. It is split
+ * into HTTP_CACHE_SHARDS shards by key, each with its own lock, hash table, LRU list and
+ * share of the capacity. Responses are stored whole, in one block, and served by
+ * reference: the block is refcounted, so it outlives an eviction for as long as an
+ * evbuffer still points into it.
+ *
+ * Lookups that miss while another lookup of the same key is fetching the response wait
+ * for it instead of going upstream as well.
+ */
+#ifndef http_cache_h
+#define http_cache_h
+
+#include <stdint.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include "metrics.h"
+
+typedef struct http_cache_struct http_cache;
+typedef struct http_cache_entry_struct http_cache_entry;
+typedef struct http_cache_fill_struct http_cache_fill;
+typedef struct http_cache_waiter_struct http_cache_waiter;
+
+/* One lookup's wait on another's fill. */
+struct http_cache_waiter_struct {
+  struct event *ev;  // activated, possibly from another worker's thread, when the fill ends
+  int abandoned;  // the fill ended without storing a response
+  int shard;  // of the fill; only the waiter's thread uses it
+  http_cache_fill *fill;  // NULL once woken or cancelled; guarded by the shard's lock
+  http_cache_waiter *prev;
+  http_cache_waiter *next;
+};
+
+typedef enum {
+  HTTP_CACHE_HIT,
+  HTTP_CACHE_MISS,
+  HTTP_CACHE_WAIT
+} http_cache_result;
+
+/* Creates a cache that holds up to capacity bytes of responses and keys.
+ *
+ * @return the cache, or NULL on error.
+ */
+http_cache *http_cache_new(size_t capacity);
+
+/* Frees the cache; entries still referenced by evbuffers are freed along with them. */
+void http_cache_free(http_cache *cache);
+
+/* Looks key up, and counts the result in m.
+ *
+ * @return HTTP_CACHE_HIT with *entry set, for the caller to serve and release;
+ *         HTTP_CACHE_MISS, with *fill set unless waiter is NULL, in which case the caller
+ *         relays the request and ends the fill with the response; or HTTP_CACHE_WAIT, if
+ *         another lookup's fill is under way, in which case waiter->ev is activated when it
+ *         ends, and the caller looks the key up again.
+ */
+http_cache_result http_cache_lookup(http_cache *cache, const char *key, size_t key_len, metrics *m,
+                                    http_cache_entry **entry, http_cache_fill **fill, http_cache_waiter *waiter);
+
+/* Appends the entry's response to output by reference, with an Age field added.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int http_cache_serve(http_cache_entry *entry, struct evbuffer *output);
+
+/* Drops the reference a hit took. */
+void http_cache_release(http_cache_entry *entry);
+
+/* Copies the bytes of buffer from offset on, i.e. what was just relayed of the response.
+ *
+ * @return 0 on success, -1 if the response is too long to store
+ */
+int http_cache_fill_append(http_cache_fill *fill, struct evbuffer *buffer, size_t offset);
+
+/* Stores the complete response, whose head is head_len bytes long, for ttl_s seconds,
+ * evicting the least recently used responses of its shard to make room; wakes the
+ * lookups that waited for it, and frees the fill.
+ */
+void http_cache_fill_end(http_cache *cache, http_cache_fill *fill, size_t head_len, uint64_t ttl_s, metrics *m);
+
+/* Gives up on the fill, e.g. for a response that may not be stored, and wakes its waiters. */
+void http_cache_fill_abandon(http_cache *cache, http_cache_fill *fill);
+
+/* Stops waiting; after this, the waiter's event is not activated. */
+void http_cache_cancel(http_cache *cache, http_cache_waiter *waiter);
+
+#endif /* http_cache_h */
@@ -3,59 +3,215 @@
  * Defines read/write/accept handlers.
  */
 
+#define _GNU_SOURCE  // accept4
+
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/param.h>
 #include <netdb.h>
 #include <string.h>
 #include <strings.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
-#include <zlog.h>
+#include "log.h"
 #include "config.h"
 #include "errors.h"
 #include "defs.h"
 #include "client.h"
+#include "eyeballs.h"
+#include "health.h"
+#include "http.h"
+#include "probes.h"
+#include "splice.h"
 #include "io.h"
 
 typedef struct cb_arg_struct {
   int accept_fd;
-  int client_fd;
+  int client_fd;  // -1 until the upstream connection is established
+  int connected;
+  int a2c_eof;  // the upstream finished sending
+  int c2a_eof;  // the client finished sending
+  int retries;  // backends tried after the first one failed to connect
+  int admitted;  // the client's slot in conn->admission, or -1
+  int traced;  // sampled for the trace log
+  int handshaken;  // the client's TLS handshake is done, or there is none
+  int offloaded;  // and the kernel does the client's crypto both ways, so its socket carries plain text
+  int detached;  // with HTTP, between requests: a2c has no upstream until the next one
+  uint64_t accepted_at;  // metrics_now() when the pipe was created
+  uint64_t connect_started;  // and when the current upstream was looked up
+  uint64_t resolved_at;  // its address was known, and the connect began
+  uint64_t connected_at;  // it accepted
+  uint64_t first_a2c_at;  // the client's first byte was relayed; 0 until then
+  uint64_t first_c2a_at;  // and the upstream's
+  conn_details *conn;
+  backend *backend;  // counted in backend->active for as long as the pipe lives
+  dns_waiter *dns_waiter;  // set while waiting on the resolver
+  eyeballs *race;  // and while racing the upstream's addresses
   struct bufferevent *a2c;  // pointers without ownership
   struct bufferevent *c2a;  // pointers without ownership
+  http_message request;  // with HTTP, the exchange in flight; one at a time, so pipelining is safe
+  http_message response;
+  http_cache_fill *fill;  // with a cache, the response being stored as it is relayed
+  http_cache_waiter waiter;  // or the wait for another client's request of the same response
+  int waiting;
+  splice_relay *splice;  // set while a zero-copy relay has the descriptors
+  uring_relay *ring;
+  uint64_t idle_bytes;  // what that relay had moved when the idle timer was last armed
+  wheel_timer idle;  // pushed back by reads on either side
+  wheel_timer lifetime;
+  wheel_timer a2c_read;  // pushed back by reads from a2c, i.e. the upstream
+  wheel_timer c2a_read;  // and from c2a, the client
+  wheel_timer a2c_write;  // armed while a2c's output is queued, pushed back as it drains
+  wheel_timer c2a_write;
+  struct cb_arg_struct *prev;  // in conn->live
+  struct cb_arg_struct *next;
 } cb_arg;
 
 // -- DECLARATIONS --
-/* initializes read/write/error callbacks on the given file descriptors. */
-static int _init_bufferevents(struct event_base *ev_base, int accept_fd, int client_fd);
-/* helper method for _init_bufferevents */
-static int _fd_event_new(struct event_base *ev_base, int fd, struct bufferevent **event, cb_arg *partner_arg);
+/* accepts one non-blocking, close-on-exec connection, or returns -1 with errno set */
+static int _accept(int listen_fd);
+/* sets up a relay for a freshly accepted connection */
+static void _accepted(conn_details *conn, int accept_fd);
+/* picks a backend, initializes read/write/error callbacks on the accepted descriptor, and
+ * starts connecting to the backend. */
+static int _init_bufferevents(conn_details *conn, int accept_fd, const struct sockaddr *client, socklen_t client_len,
+                              int admitted);
+/* turns the client away with a reset, counting the reason */
+static void _reject(conn_details *conn, int accept_fd, int reason);
+/* creates the pipe and both bufferevents; client_fd may be -1 for a socket that is yet to connect.
+ * On failure, client_fd is closed and accept_fd is left to the caller. */
+static cb_arg *_pipe_new(conn_details *conn, backend *backend, int accept_fd, int client_fd);
+/* creates both bufferevents for the pipe's descriptors, with the same ownership rules as _pipe_new */
+static int _pipe_attach(cb_arg *pipe);
+/* called once the upstream is connected and the client's TLS handshake is done; hands the pipe to the
+ * splice or io_uring relay if enabled */
+static void _upstream_ready(cb_arg *pipe);
+/* called once the client's TLS handshake is done */
+static void _handshaken(cb_arg *pipe);
+static void _splice_fallback(int accept_fd, int client_fd, void *arg);
+static void _relay_closed(void *arg);
+/* helper method for _pipe_new; fd may be -1 for a socket that is yet to connect. With tls, the
+ * bufferevent does the server side of a TLS handshake first. */
+static int _fd_event_new(struct event_base *ev_base, int fd, struct bufferevent **event, cb_arg *partner_arg,
+                         tls_server *tls);
+/* looks up the upstream and starts connecting to it */
+static int _connect_upstream(cb_arg *pipe);
+static void _resolved_cb(int result, const dns_entry *entry, void *arg);
+/* connects a2c to the upstream's only address, or races its addresses */
+static int _connect_to(cb_arg *pipe, const dns_entry *entry);
+static void _raced_cb(int fd, void *arg);
+/* called once a2c is connected to the upstream */
+static void _upstream_connected(cb_arg *pipe, int fd);
+/* counts a failed connect, and retries it on another backend or frees the pipe */
+static void _upstream_failed(cb_arg *pipe);
+/* counts a failed upstream connect against the backend and in the metrics */
+static void _connect_failed(cb_arg *pipe);
+/* moves a pipe whose backend failed to connect over to another backend */
+static int _retry_upstream(cb_arg *pipe);
+/* with HTTP, relays the client's current request, and picks an upstream for it if it needs one */
+static void _http_requests(cb_arg *pipe);
+/* and the upstream's response to it */
+static void _http_responses(cb_arg *pipe);
+/* answers the current request from the cache if it can; otherwise, waits for another client's
+ * request of the same response if coalesce is set and there is one, or relays it */
+static int _http_cached(cb_arg *pipe, int coalesce);
+static void _http_woken_cb(evutil_socket_t fd, short what, void *arg);
+/* stores what was just relayed of the response, starting at offset in the client's output */
+static void _http_fill(cb_arg *pipe, size_t offset, http_state state);
+/* attaches a detached pipe to an idle upstream connection, or starts a new one */
+static int _http_upstream(cb_arg *pipe);
+/* picks the backend for the pipe's next request */
+static backend *_http_backend(cb_arg *pipe);
+/* hands the upstream connection back to the pool, or closes it, and starts the next exchange */
+static void _http_exchange_done(cb_arg *pipe);
+/* detaches a2c from its upstream, keeping the connection for another request if keep is set */
+static int _http_release(cb_arg *pipe, int keep);
+/* answers the client with status, if nothing of a response has been relayed yet, and closes it */
+static void _http_reject(cb_arg *pipe, int status);
+/* closes the client once what is queued for it is flushed */
+static void _http_finish(cb_arg *pipe);
+/* frees both bufferevents (closing their descriptors) and the pipe itself */
+static void _pipe_free(cb_arg *pipe);
+/* releases the backend and frees the pipe, once nothing else points at it */
+static void _pipe_done(cb_arg *pipe);
+/* records how long each stage of a closing pipe took, and logs them if it was sampled */
+static void _trace(cb_arg *pipe, uint64_t closed_at);
+/* returns microseconds from accepting the pipe's client to at, or -1 if at never came */
+static long _since(const cb_arg *pipe, uint64_t at);
+/* frees a bufferevent, and takes its unsent bytes out of the worker's count */
+static void _bev_free(cb_arg *pipe, struct bufferevent *bev);
+/* arms a timer for the given timeout, unless it is 0 */
+static void _timer_arm(cb_arg *pipe, wheel_timer *timer, int timeout_ms);
+/* returns the read timer of one of the pipe's bufferevents */
+static wheel_timer *_read_timer(cb_arg *pipe, struct bufferevent *bev);
+/* disarms the timers that watch the bufferevents, once a zero-copy relay takes over */
+static void _bev_timers_cancel(cb_arg *pipe);
+/* counts the timeout and closes the pipe, whichever relay it is on */
+static void _timeout_cb(wheel_timer *timer, void *arg);
+/* passes the EOF of to's partner on to it, once to's output is flushed; frees the pipe when
+ * both directions are finished */
+static void _shutdown_when_flushed(cb_arg *pipe, struct bufferevent *to);
+/* calls writecb once bev's output drains to lowmark */
+static void _watch_drain(cb_arg *pipe, struct bufferevent *bev, size_t lowmark);
+/* pauses bev while the receiver is behind, or while the worker is over its budget */
+static void _flow_control(cb_arg *pipe, struct bufferevent *bev, struct bufferevent *output);
+/* stops reading from bev until output drains to the low watermark */
+static void _pause(cb_arg *pipe, struct bufferevent *bev, struct bufferevent *output);
+/* keeps conn->buffered in step with an output buffer, and times its draining */
+static void _buffered_cb(struct evbuffer *buffer, const struct evbuffer_cb_info *info, void *arg);
 static void readcb (struct bufferevent *bev, void *arg);
+static void writecb (struct bufferevent *bev, void *arg);
 static void errorcb (struct bufferevent *bev, short what, void *arg);
 
 // -- PUBLIC --
 
-/* Frees the struct and the inner strings. */
+/* Frees the struct; the backends belong to the worker. */
 void conn_details_free(conn_details *conn) {
+  if (NULL != conn->pipes) {
+    slab_pool_free(conn->pipes); conn->pipes = NULL;
+  }
   conn->ev_base = NULL;
+  conn->dns = NULL;
+  conn->backends = NULL;
+  free(conn);
+}
+
+void conn_details_report(const conn_details *conn, int worker_id) {
+  log_info("worker %d buffers: %zu bytes queued, high water %zu, budget %zu, %lu pauses",
+             worker_id, conn->buffered, conn->buffered_max, conn->memory_budget, conn->pauses);
+  slab_pool_report(conn->pipes, worker_id);
+}
+
+void conn_details_close(conn_details *conn) {
 
-  free(conn->up_addr);
-  conn->up_addr = NULL;
+  cb_arg *pipe = NULL;
+
+  while (NULL != (pipe = conn->live)) {
+    if (NULL != pipe->splice) {
+      splice_relay_close(pipe->splice);  // and _relay_closed frees the pipe
+    } else if (NULL != pipe->ring) {
+      pipe->ring = NULL;  // uring_free closes its descriptors
+      _pipe_done(pipe);
+    } else {
+      _pipe_free(pipe);
+    }
+  }
+}
 
-  free(conn->up_port);
-  conn->up_port = NULL;
+unsigned long conn_details_active(const conn_details *conn) {
+  return conn->pipes->in_use;
 }
 
-/* Creates a new struct and copies the contents of each string into a new memory space. */
 conn_details *conn_details_new(struct event_base *ev_base,
-                               const str up_addr,
-                               const str up_port) {
+                               dns_cache *dns,
+                               backend_set *backends,
+                               int connect_timeout_ms) {
 
   conn_details *conn = NULL;
-  size_t length = 0;
 
   if (NULL == (conn = calloc(1, sizeof(conn_details)))) {
     error("calloc conn_details");
@@ -63,124 +219,511 @@ conn_details *conn_details_new(struct event_base *ev_base,
   }
 
   conn->ev_base = ev_base;
+  conn->dns = dns;
+  conn->backends = backends;
+  conn->connect_timeout.tv_sec = connect_timeout_ms / 1000;
+  conn->connect_timeout.tv_usec = (connect_timeout_ms % 1000) * 1000;
+  conn->buffer_high = BUFFER_HIGH_WM;
+  conn->buffer_low = BUFFER_LOW_WM;
 
-  length = strnlen(up_addr, MAX_LINE);
-  if (NULL == (conn->up_addr = calloc(1, length + 1))) {  // add one for null byte
-    error("calloc up_addr");
-    free(conn);
-    return NULL;
-  }
-  strncpy(conn->up_addr, up_addr, length);
-
-  length = strnlen(up_port, MAX_LINE);
-  if (NULL == (conn->up_port = calloc(1, length + 1))) {  // add one for null byte
-    error("calloc up_port");
-    free(conn->up_addr);
-    free(conn);
+  if (NULL == (conn->pipes = slab_pool_new("pipe", sizeof(cb_arg), SLAB_OBJECTS))) {
+    conn_details_free(conn);
     return NULL;
   }
-  strncpy(conn->up_port, up_port, length);
 
   return conn;
 }
 
 void do_accept(int listen_fd, short event, void *arg) {
 
-  char printable[BUFFER_LEN];
   conn_details *conn = arg;
-  struct sockaddr_storage ss;
-  socklen_t slen = sizeof(ss);
   int accept_fd = -1;
-  int client_fd = -1;
-  in_port_t port = -1;
+  int i = 0;
 
-  memset(printable, 0, BUFFER_LEN);
+  log_debug("received event: %u on fd: %u", event, listen_fd);
 
-  // accept connection
-  dzlog_debug("received event: %u on fd: %u", event, listen_fd);
-  accept_fd = accept(listen_fd, (struct sockaddr *) &ss, &slen);
-  if (0 > accept_fd) {
-    error("accept");
-    return;
-  } else if (accept_fd > FD_SETSIZE) { // when does this happen?
-    dzlog_error("accept_fd: %u > %u, closing", accept_fd, FD_SETSIZE);
+  // drain the backlog, but leave the loop to other events after a batch
+  for (i = 0; i < ACCEPT_BATCH; i++) {
+    if (0 > (accept_fd = _accept(listen_fd))) {
+      if (EINTR == errno || ECONNABORTED == errno) {
+        continue;
+      }
+      if (EAGAIN != errno && EWOULDBLOCK != errno) {
+        error("accept");
+      }
+      return;
+    }
+    _accepted(conn, accept_fd);
+  }
+}
+
+void do_accepted(int accept_fd, void *arg) {
+  _accepted(arg, accept_fd);
+}
+
+// -- PRIVATE --
+
+static int _accept(int listen_fd) {
+#ifdef __linux__
+  return accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int accept_fd = accept(listen_fd, NULL, NULL);
+  if (0 <= accept_fd &&
+      (0 != evutil_make_socket_nonblocking(accept_fd) || 0 != evutil_make_socket_closeonexec(accept_fd))) {
     close(accept_fd);
-    return;
+    errno = ECONNABORTED;  // skip this one
+    return -1;
   }
+  return accept_fd;
+#endif
+}
+
+static void _accepted(conn_details *conn, int accept_fd) {
+
+  char printable[BUFFER_LEN];
+  struct sockaddr_storage ss;
+  socklen_t slen = sizeof(ss);
+  in_port_t port = -1;
+  int admitted = -1;
+  int rc = SUCCESS;
+
+  memset(printable, 0, BUFFER_LEN);
+  memset(&ss, 0, sizeof(ss));
+  getpeername(accept_fd, (struct sockaddr *) &ss, &slen);
+  sock_profile_accepted(&conn->sock, accept_fd, ss.ss_family);
+  PROBE2(accept, accept_fd, ss.ss_family);
 
   // print diagnostics
   port = ntoh_sockaddr(&ss);
   inet_ntop_sockaddr(&ss, printable, BUFFER_LEN);
-  dzlog_info("accepted connection on %s:%u with fd %u", printable, port, accept_fd);
+  log_info("accepted connection on %s:%u with fd %u", printable, port, accept_fd);
 
-  // create client connection to upstream
-  if (SUCCESS != init_client_fd(conn->up_addr, conn->up_port, &client_fd)) {
-    dzlog_error("could not connect to %s:%s", conn->up_addr, conn->up_port);
-    close(accept_fd);
+  if (NULL != conn->admission &&
+      SUCCESS != (rc = admission_admit(conn->admission, (struct sockaddr *) &ss, &admitted))) {
+    log_info("rejecting %s:%u, %s", printable, port,
+             ERR_ADMIT_CONNS == rc ? "too many connections from it" :
+             ERR_ADMIT_RATE == rc ? "connecting too fast" : "no room to track it");
+    _reject(conn, accept_fd, ERR_ADMIT_CONNS == rc ? METRICS_REJECT_CONNS :
+                             ERR_ADMIT_RATE == rc ? METRICS_REJECT_RATE : METRICS_REJECT_TABLE);
     return;
   }
-  dzlog_info("created connection to %s:%s with fd %u", conn->up_addr, conn->up_port, client_fd);
 
-  // init buffer events
-  if (SUCCESS != _init_bufferevents(conn->ev_base, accept_fd, client_fd)) {
-    close(client_fd);
+  // init buffer events, and start connecting to the upstream
+  if (SUCCESS != _init_bufferevents(conn, accept_fd, (struct sockaddr *) &ss, slen, admitted)) {
     close(accept_fd);
+    return;
   }
-  dzlog_info("callbacks registered with new connection at accept_fd %u and client_fd %u", accept_fd, client_fd);
+  log_debug("callbacks registered with new connection at accept_fd %u", accept_fd);
 }
 
-static int _init_bufferevents(struct event_base *ev_base, int accept_fd, int client_fd) {
-  // Use bufferevent API.
-  // Bufferevents are higher level than evbuffers: each has an underlying evbuffer for reading and
-  // one for writing, and callbacks that are invoked under certain circumstances.
+static void _reject(conn_details *conn, int accept_fd, int reason) {
+  struct linger linger = { 1, 0 };  // no TIME_WAIT left behind on our side
+  setsockopt(accept_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  close(accept_fd);
+  metrics_add(&conn->metrics->rejected[reason], 1);
+}
+
+static int _init_bufferevents(conn_details *conn, int accept_fd, const struct sockaddr *client, socklen_t client_len,
+                              int admitted) {
 
   int rc = SUCCESS;
+  int client_fd = -1;
   cb_arg *pipe = NULL;
+  backend *b = backend_select(conn->backends, client, client_len);
+
+  // skip the upstream handshake if a pre-connected socket is available
+  if (NULL != b->pool && !conn->http) {
+    client_fd = upstream_pool_take(b->pool);
+  }
 
-  if (NULL == (pipe = calloc(1, sizeof(cb_arg)))) {
-    error("cb_arg");
+  if (NULL == (pipe = _pipe_new(conn, b, accept_fd, client_fd))) {
+    if (NULL != conn->admission) admission_release(conn->admission, admitted);
     return ERR_BEVENT_NEW;
   }
+  pipe->admitted = admitted;
+
+  // with HTTP, the upstream is picked, and connected to, once there is a request for it: a client
+  // that is answered from the cache, or never asks, costs none
+  if (conn->http) {
+    pipe->detached = 1;
+    return SUCCESS;
+  }
+
+  if (0 <= client_fd) {
+    log_info("reusing pooled connection to %s:%s with fd %u", b->host, b->port, client_fd);
+    _upstream_ready(pipe);
+    return SUCCESS;
+  }
+
+  // anything the client sends before the upstream is ready waits in a2c's output buffer; a
+  // backend that fails right away (no such socket, no descriptors) is retried like one that is
+  // refused later
+  if ((SUCCESS != (rc = client_connect_timeout(pipe->a2c, &conn->connect_timeout)) ||
+       SUCCESS != (rc = _connect_upstream(pipe))) &&
+      SUCCESS != _retry_upstream(pipe)) {
+    _bev_free(pipe, pipe->a2c); pipe->a2c = NULL;
+    bufferevent_setfd(pipe->c2a, -1);  // leave accept_fd to the caller
+    _bev_free(pipe, pipe->c2a); pipe->c2a = NULL;
+    _pipe_done(pipe); pipe = NULL;
+    return rc;
+  }
+
+  log_info("connecting fd %u to %s:%s", accept_fd, b->host, b->port);
+  return SUCCESS;
+}
+
+static cb_arg *_pipe_new(conn_details *conn, backend *backend, int accept_fd, int client_fd) {
+
+  cb_arg *pipe = NULL;
+
+  if (NULL == (pipe = slab_alloc(conn->pipes))) {
+    if (0 <= client_fd) close(client_fd);
+    return NULL;
+  }
   pipe->client_fd = client_fd;
+  pipe->connected = 0 <= client_fd;
   pipe->accept_fd = accept_fd;
+  pipe->admitted = -1;
+  pipe->conn = conn;
+  pipe->accepted_at = metrics_now();
+  pipe->connected_at = 0 <= client_fd ? pipe->accepted_at : 0;  // pooled
+  pipe->traced = 0 < conn->trace_sample && 0 == conn->sampled++ % conn->trace_sample;
+  pipe->handshaken = NULL == conn->tls;
+  http_request_init(&pipe->request);
+  pipe->request.keyed = NULL != conn->cache;
+
+  if (SUCCESS != _pipe_attach(pipe)) {
+    slab_free(conn->pipes, pipe); pipe = NULL;
+    return NULL;
+  }
+
+  pipe->next = conn->live;
+  if (NULL != conn->live) {
+    conn->live->prev = pipe;
+  }
+  conn->live = pipe;
+
+  pipe->backend = backend;
+  backend_acquire(backend);
+  metrics_add(&conn->metrics->connections_opened, 1);
+
+  wheel_timer_init(&pipe->idle, _timeout_cb, pipe);
+  wheel_timer_init(&pipe->lifetime, _timeout_cb, pipe);
+  wheel_timer_init(&pipe->a2c_read, _timeout_cb, pipe);
+  wheel_timer_init(&pipe->c2a_read, _timeout_cb, pipe);
+  wheel_timer_init(&pipe->a2c_write, _timeout_cb, pipe);
+  wheel_timer_init(&pipe->c2a_write, _timeout_cb, pipe);
+  _timer_arm(pipe, &pipe->idle, conn->idle_timeout_ms);
+  _timer_arm(pipe, &pipe->lifetime, conn->lifetime_ms);
+  _timer_arm(pipe, &pipe->c2a_read, conn->read_timeout_ms);
+  return pipe;
+}
+
+static int _pipe_attach(cb_arg *pipe) {
+  // Use bufferevent API.
+  // Bufferevents are higher level than evbuffers: each has an underlying evbuffer for reading and
+  // one for writing, and callbacks that are invoked under certain circumstances.
+
+  conn_details *conn = pipe->conn;
+  int rc = SUCCESS;
 
   // note that client_event should be freed in the error callback
-  if (0 > (rc = _fd_event_new(ev_base, client_fd, &pipe->a2c, pipe))) {
-    free(pipe); pipe = NULL;
+  if (SUCCESS != (rc = _fd_event_new(conn->ev_base, pipe->client_fd, &pipe->a2c, pipe, NULL))) {
+    if (0 <= pipe->client_fd) close(pipe->client_fd);
     return rc;
   }
 
-  if (0 > (rc = _fd_event_new(ev_base, accept_fd, &pipe->c2a, pipe))) {
-    bufferevent_free(pipe->a2c); pipe->a2c = NULL;
-    free(pipe); pipe = NULL;
+  // once the kernel does the crypto, a client that falls back from splice is plain text
+  if (SUCCESS != (rc = _fd_event_new(conn->ev_base, pipe->accept_fd, &pipe->c2a, pipe,
+                                     pipe->handshaken ? NULL : conn->tls))) {
+    _bev_free(pipe, pipe->a2c); pipe->a2c = NULL;
     return rc;
   }
 
+  // with splice or io_uring, leave the client's bytes in the kernel until we know which relay runs
+  if (conn->splice || NULL != conn->uring) {
+    bufferevent_disable(pipe->c2a, EV_READ);
+  }
+
   return SUCCESS;
 }
 
-static int _fd_event_new(struct event_base *ev_base, int fd, struct bufferevent **event, cb_arg *arg) {
+static void _upstream_ready(cb_arg *pipe) {
 
-  struct bufferevent *bev = NULL;
+  conn_details *conn = pipe->conn;
+  splice_relay *relay = NULL;
+  uring_relay *ring_relay = NULL;
+  int empty = 0;
+
+  // the relay starts once both are ready
+  if (!pipe->handshaken) {
+    return;
+  }
+
+  // a TLS client is relayed without copies only if the kernel does its crypto
+  empty = 0 == evbuffer_get_length(bufferevent_get_output(pipe->a2c)) &&
+          0 == evbuffer_get_length(bufferevent_get_input(pipe->c2a)) &&
+          (NULL == conn->tls || pipe->offloaded);
+
+  if (conn->splice && empty &&
+      NULL != (relay = splice_relay_new(conn->ev_base, pipe->accept_fd, pipe->client_fd,
+                                        conn->metrics, _splice_fallback, _relay_closed, pipe))) {
+    // the relay takes over both descriptors; the pipe stays behind to count the backend
+    log_debug("splicing fds %u and %u", pipe->accept_fd, pipe->client_fd);
+    bufferevent_setfd(pipe->a2c, -1);
+    bufferevent_setfd(pipe->c2a, -1);
+    _bev_free(pipe, pipe->a2c); pipe->a2c = NULL;
+    _bev_free(pipe, pipe->c2a); pipe->c2a = NULL;
+    _bev_timers_cancel(pipe);
+    pipe->splice = relay;
+    splice_relay_trace(relay, &pipe->first_a2c_at, &pipe->first_c2a_at);
+    splice_relay_start(relay);
+    return;
+  }
+
+  if (!conn->splice && NULL != conn->uring && empty &&
+      NULL != (ring_relay = uring_relay_new(conn->uring, pipe->accept_fd, pipe->client_fd, _relay_closed, pipe))) {
+    log_debug("relaying fds %u and %u through io_uring", pipe->accept_fd, pipe->client_fd);
+    bufferevent_setfd(pipe->a2c, -1);
+    bufferevent_setfd(pipe->c2a, -1);
+    _bev_free(pipe, pipe->a2c); pipe->a2c = NULL;
+    _bev_free(pipe, pipe->c2a); pipe->c2a = NULL;
+    _bev_timers_cancel(pipe);
+    pipe->ring = ring_relay;
+    uring_relay_trace(ring_relay, &pipe->first_a2c_at, &pipe->first_c2a_at);
+    uring_relay_start(ring_relay);
+    return;
+  }
+
+  _timer_arm(pipe, &pipe->a2c_read, conn->read_timeout_ms);
+  if (0 < evbuffer_get_length(bufferevent_get_output(pipe->a2c))) {
+    _timer_arm(pipe, &pipe->a2c_write, conn->write_timeout_ms);  // what the client sent early
+  }
+  if (conn->splice || NULL != conn->uring) {
+    bufferevent_enable(pipe->c2a, EV_READ);
+  }
+}
+
+static void _handshaken(cb_arg *pipe) {
+
+  conn_details *conn = pipe->conn;
+  int resumed = tls_resumed(pipe->c2a);
+
+  pipe->handshaken = 1;
+  pipe->offloaded = tls_offloaded(pipe->c2a);
+  metrics_add(&conn->metrics->tls_handshakes[resumed ? METRICS_TLS_RESUMED : METRICS_TLS_FULL], 1);
+  metrics_add(&conn->metrics->tls_offloaded, pipe->offloaded);
+  log_debug("TLS handshake on fd %u done, %s session, %s", pipe->accept_fd, resumed ? "resumed" : "new",
+            pipe->offloaded ? "offloaded to the kernel" : "crypto in user space");
+
+  if (pipe->connected) {
+    _upstream_ready(pipe);
+  }
+}
+
+static void _splice_fallback(int accept_fd, int client_fd, void *arg) {
+
+  cb_arg *pipe = arg;
+
+  pipe->splice = NULL;
+  pipe->accept_fd = accept_fd;
+  pipe->client_fd = client_fd;
+  if (SUCCESS != _pipe_attach(pipe)) {
+    close(accept_fd);
+    _pipe_done(pipe); pipe = NULL;
+    return;
+  }
+  _timer_arm(pipe, &pipe->a2c_read, pipe->conn->read_timeout_ms);
+  _timer_arm(pipe, &pipe->c2a_read, pipe->conn->read_timeout_ms);
+  bufferevent_enable(pipe->c2a, EV_READ);
+}
+
+static void _relay_closed(void *arg) {
+  cb_arg *pipe = arg;
+  pipe->splice = NULL;
+  pipe->ring = NULL;
+  _pipe_done(pipe);
+}
+
+static int _connect_upstream(cb_arg *pipe) {
+
+  conn_details *conn = pipe->conn;
+  backend *b = pipe->backend;
+  const dns_entry *entry = NULL;
+  int rc = SUCCESS;
+
+  pipe->connect_started = metrics_now();
+  entry = dns_cache_lookup(conn->dns, b->host, b->port_num, _resolved_cb, pipe, &pipe->dns_waiter);
+  if (NULL != entry) {
+    pipe->resolved_at = pipe->connect_started;
+    metrics_observe(&conn->metrics->resolve_time, 0);
+    if (SUCCESS != (rc = _connect_to(pipe, entry))) {
+      _connect_failed(pipe);
+    }
+    return rc;
+  }
+
+  if (NULL == pipe->dns_waiter) {
+    log_error("could not resolve %s", b->host);
+    _connect_failed(pipe);
+    return ERR_NET_HOST;
+  }
+
+  return SUCCESS;
+}
+
+static void _resolved_cb(int result, const dns_entry *entry, void *arg) {
+
+  cb_arg *pipe = arg;
+
+  pipe->dns_waiter = NULL;
+  if (SUCCESS == result) {
+    pipe->resolved_at = metrics_now();
+    metrics_observe(&pipe->conn->metrics->resolve_time, pipe->resolved_at - pipe->connect_started);
+  }
+  if (SUCCESS != result || SUCCESS != _connect_to(pipe, entry)) {
+    log_error("upstream %s is unavailable for fd %u", pipe->backend->host, pipe->accept_fd);
+    _upstream_failed(pipe);
+  }
+}
+
+static int _connect_to(cb_arg *pipe, const dns_entry *entry) {
+
+  conn_details *conn = pipe->conn;
+
+  if (1 == entry->naddrs) {
+    return client_connect(pipe->a2c, (struct sockaddr *) &entry->addrs[0], entry->addr_lens[0], &conn->sock);
+  }
+
+  // a2c stays socket-less until an address wins; its connect timeout covers the race
+  if (NULL == (pipe->race = eyeballs_start(conn->ev_base, conn->dns, pipe->backend->host, pipe->backend->port_num,
+                                           entry, &conn->sock, _raced_cb, pipe))) {
+    return ERR_NET_CONNECT;
+  }
+  return SUCCESS;
+}
+
+static void _raced_cb(int fd, void *arg) {
 
-  // set fd to be non blocking
-  if (0 != fcntl(fd, F_SETFL, O_NONBLOCK)) {
-    error("fcntl");
-    return ERR_NET_FCNTL;
+  cb_arg *pipe = arg;
+
+  pipe->race = NULL;
+  if (0 > fd) {
+    log_error("could not connect to any address of %s:%s", pipe->backend->host, pipe->backend->port);
+    _upstream_failed(pipe);
+    return;
+  }
+  if (0 != bufferevent_setfd(pipe->a2c, fd)) {
+    log_error("bufferevent_setfd failed");
+    close(fd);
+    _upstream_failed(pipe);
+    return;
+  }
+  _upstream_connected(pipe, fd);
+}
+
+static void _upstream_connected(cb_arg *pipe, int fd) {
+  pipe->connected = 1;
+  pipe->client_fd = fd;
+  pipe->connected_at = metrics_now();
+  client_connected(pipe->a2c);
+  health_success(pipe->backend);
+  metrics_observe(&pipe->conn->metrics->connect_time, pipe->connected_at - pipe->resolved_at);
+  log_info("created connection to %s:%s with fd %u", pipe->backend->host, pipe->backend->port, fd);
+  _upstream_ready(pipe);
+}
+
+static void _upstream_failed(cb_arg *pipe) {
+  _connect_failed(pipe);
+  if (SUCCESS == _retry_upstream(pipe)) {
+    return;
+  }
+  if (pipe->conn->http) {
+    _http_reject(pipe, 502);
+    return;
   }
+  _pipe_free(pipe); pipe = NULL;
+}
+
+static void _connect_failed(cb_arg *pipe) {
+  health_failure(pipe->backend);
+  metrics_add(&pipe->conn->metrics->connect_failures, 1);
+}
+
+static int _retry_upstream(cb_arg *pipe) {
+
+  conn_details *conn = pipe->conn;
+  backend_set *set = conn->backends;
+  struct bufferevent *a2c = NULL;
+  backend *b = NULL;
 
+  while (pipe->retries < CONNECT_RETRIES && 1 < set->nbackends) {
+    pipe->retries++;
+
+    // another backend than the one that just failed, healthy if possible
+    b = backend_select(set, NULL, 0);
+    if (b == pipe->backend) {
+      b = &set->backends[(b - set->backends + 1) % set->nbackends];
+    }
+
+    if (SUCCESS != _fd_event_new(conn->ev_base, -1, &a2c, pipe, NULL)) {
+      return ERR_BEVENT_NEW;
+    }
+
+    // nothing has been written upstream yet, so the new backend gets everything the client sent
+    evbuffer_add_buffer(bufferevent_get_output(a2c), bufferevent_get_output(pipe->a2c));
+    _bev_free(pipe, pipe->a2c);
+    pipe->a2c = a2c;
+    if (pipe->c2a_eof) {
+      _watch_drain(pipe, a2c, 0);
+    } else if (!conn->splice && NULL == conn->uring && !(bufferevent_get_enabled(pipe->c2a) & EV_READ)) {
+      _watch_drain(pipe, a2c, conn->buffer_low);  // still paused
+    }
+
+    backend_release(pipe->backend);
+    pipe->backend = b;
+    backend_acquire(b);
+
+    log_info("retrying fd %u on %s:%s", pipe->accept_fd, b->host, b->port);
+    if (SUCCESS == client_connect_timeout(a2c, &conn->connect_timeout) && SUCCESS == _connect_upstream(pipe)) {
+      return SUCCESS;
+    }
+  }
+
+  return ERR_NET_CONNECT;
+}
+
+static int _fd_event_new(struct event_base *ev_base, int fd, struct bufferevent **event, cb_arg *arg,
+                         tls_server *tls) {
+
+  struct bufferevent *bev = NULL;
+
+  // accepted, pooled and bufferevent-connected sockets are all non-blocking already
   // note that bev and partner_arg get freed in the error callback
-  if (NULL == (bev = bufferevent_socket_new(ev_base, fd, BEV_OPT_CLOSE_ON_FREE))) {
-    dzlog_error("bufferevent_socket_new returned NULL");
+  if (NULL != tls) {
+    if (NULL == (bev = tls_bufferevent_new(tls, ev_base, fd))) {
+      return ERR_BEVENT_NEW;
+    }
+  } else if (NULL == (bev = bufferevent_socket_new(ev_base, fd, BEV_OPT_CLOSE_ON_FREE))) {
+    log_error("bufferevent_socket_new returned NULL");
     return ERR_BEVENT_NEW;
   }
   *event = bev;
 
-  //bufferevent_setwatermark(bev, EV_READ | EV_WRITE, 0, MAX_LINE);
+  // cap what one read may pull in; the partner's output is capped in readcb
+  bufferevent_setwatermark(bev, EV_READ, 0, arg->conn->buffer_high);
   bufferevent_setcb(bev, readcb, NULL, errorcb, arg);
+  evbuffer_add_cb(bufferevent_get_output(bev), _buffered_cb, arg);
+
+  if ((NULL != arg->conn->rate_limit && 0 != bufferevent_set_rate_limit(bev, arg->conn->rate_limit)) ||
+      (NULL != arg->conn->rate_group && 0 != bufferevent_add_to_rate_limit_group(bev, arg->conn->rate_group))) {
+    log_error("bufferevent rate limit failed");
+    bufferevent_free(bev); bev = NULL;
+    return ERR_BEVENT_NEW;
+  }
 
   if (0 != bufferevent_enable(bev, EV_READ | EV_WRITE)) {
-    dzlog_error("bufferevent_enable failed");
+    log_error("bufferevent_enable failed");
     bufferevent_free(bev); bev = NULL;
     return ERR_BEVENT_ENABLE;
   }
@@ -196,25 +739,68 @@ static void readcb (struct bufferevent *bev, void *arg) {
   cb_arg *pipe = arg;
   struct evbuffer *input = NULL;
   struct bufferevent *output = NULL;
+  uint64_t *first = NULL;
+  size_t length = 0;
   int fd = bufferevent_getfd(bev);
 
-  dzlog_debug("received data on fd %u", fd);
+  log_debug("received data on fd %u", fd);
 
   // copy bytes from input to partner write buffer
   input = bufferevent_get_input(bev);
-  if (fd == pipe->accept_fd) {
+  if (bev == pipe->c2a) {
     output = pipe->a2c;
-  } else if (fd == pipe->client_fd) {
+  } else if (bev == pipe->a2c) {
     output = pipe->c2a;
   } else {
-    dzlog_error("unknown fd: %u", fd);
+    log_error("unknown fd: %u", fd);
     return;
   }
 
-  dzlog_info("copying %zu bytes from %d", evbuffer_get_length(input), fd);
+  _timer_arm(pipe, &pipe->idle, pipe->conn->idle_timeout_ms);
+  _timer_arm(pipe, _read_timer(pipe, bev), pipe->conn->read_timeout_ms);
+
+  length = evbuffer_get_length(input);
+  log_debug("copying %zu bytes from %d", length, fd);
+  PROBE3(read, fd, bev == pipe->c2a, length);
+  first = bev == pipe->c2a ? &pipe->first_a2c_at : &pipe->first_c2a_at;
+  if (0 == *first) {
+    *first = metrics_now();
+  }
+  metrics_add(bev == pipe->c2a ? &pipe->conn->metrics->bytes_a2c : &pipe->conn->metrics->bytes_c2a, length);
+
+  // HTTP is relayed a message at a time, and may swap the upstream, or free the pipe, in between
+  if (pipe->conn->http) {
+    if (bev == pipe->c2a) {
+      _http_requests(pipe);
+    } else {
+      _http_responses(pipe);
+    }
+    return;
+  }
 
   if (0 > bufferevent_write_buffer(output, input)) { // do we need a lock here?
-    dzlog_error("evbuffer_add_buffer failed");  // what do we do here?
+    log_error("evbuffer_add_buffer failed");  // what do we do here?
+  }
+
+  _flow_control(pipe, bev, output);
+}
+
+static void writecb (struct bufferevent *bev, void *arg) {
+  // A write callback for a bufferevent. It is only set while the partner is paused, or has
+  // sent EOF, and is triggered once the output buffer drains to the low watermark.
+
+  cb_arg *pipe = arg;
+  struct bufferevent *source = bev == pipe->a2c ? pipe->c2a : pipe->a2c;
+  int source_eof = bev == pipe->a2c ? pipe->c2a_eof : pipe->a2c_eof;
+
+  bufferevent_setcb(bev, readcb, NULL, errorcb, pipe);
+  bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+  if (source_eof) {
+    _shutdown_when_flushed(pipe, bev);
+  } else {
+    log_debug("resuming reads on fd %d", bufferevent_getfd(source));
+    _timer_arm(pipe, _read_timer(pipe, source), pipe->conn->read_timeout_ms);
+    bufferevent_enable(source, EV_READ);
   }
 }
 
@@ -224,34 +810,597 @@ static void errorcb (struct bufferevent *bev, short what, void *arg) {
 
   int fd = bufferevent_getfd(bev);
   cb_arg *pipe = arg;
+
+  PROBE3(event, fd, what, pipe->connected);
+  if (bev == pipe->a2c && !pipe->connected) {
+    if (what & BEV_EVENT_CONNECTED) {
+      _upstream_connected(pipe, fd);
+      return;
+    }
+    // the upstream never came up, so there is nothing to relay to the client
+    if (NULL != pipe->race) {
+      eyeballs_cancel(pipe->race); pipe->race = NULL;
+    }
+    if (what & BEV_EVENT_TIMEOUT) {
+      log_error("timed out connecting to %s:%s", pipe->backend->host, pipe->backend->port);
+      metrics_add(&pipe->conn->metrics->timeouts[METRICS_TIMEOUT_CONNECT], 1);
+    } else {
+      client_connect_error(pipe->backend->host, pipe->backend->port);
+    }
+    _upstream_failed(pipe);
+    return;
+  }
+
+  if (bev == pipe->c2a && !pipe->handshaken) {
+    if (what & BEV_EVENT_CONNECTED) {
+      _handshaken(pipe);
+      return;
+    }
+    tls_log_error(bev, fd);
+    metrics_add(&pipe->conn->metrics->tls_handshakes[METRICS_TLS_FAILED], 1);
+    _pipe_free(pipe); pipe = NULL;
+    return;
+  }
+
+  // with HTTP, an upstream that hangs up between requests is let go, and one that hangs up before
+  // answering gets the client a 502; the request may have had effects, so it is not sent again
+  if (bev == pipe->a2c && pipe->conn->http && HTTP_IDLE == pipe->response.state) {
+    log_info("upstream %s:%s closed idle fd %u", pipe->backend->host, pipe->backend->port, fd);
+    if (SUCCESS != _http_release(pipe, 0)) {
+      _pipe_free(pipe); pipe = NULL;
+    } else if (pipe->c2a_eof) {
+      _http_finish(pipe);
+    }
+    return;
+  }
+  if (bev == pipe->c2a && pipe->waiting && (what & BEV_EVENT_EOF)) {
+    // the request is still to be answered, from the cache or the upstream
+    log_info("connection with fd %u closed", fd);
+    bufferevent_disable(bev, EV_READ);
+    wheel_timer_cancel(&pipe->c2a_read);
+    pipe->c2a_eof = 1;
+    return;
+  }
+  if (bev == pipe->a2c && pipe->conn->http && 0 == pipe->response.moved) {
+    log_info("upstream %s:%s closed fd %u before responding", pipe->backend->host, pipe->backend->port, fd);
+    _http_reject(pipe, 502);
+    return;
+  }
+
   if (what & BEV_EVENT_EOF) {
-    // connection closed
-    dzlog_info("connection with fd %u closed", fd);
-  } else if (what & BEV_EVENT_ERROR) {
+    // half closed: pass it on once everything read from this side has been written
+    log_info("connection with fd %u closed", fd);
+    bufferevent_disable(bev, EV_READ);
+    wheel_timer_cancel(_read_timer(pipe, bev));
+    if (bev == pipe->a2c) {
+      pipe->a2c_eof = 1;
+      _shutdown_when_flushed(pipe, pipe->c2a);
+    } else {
+      pipe->c2a_eof = 1;
+      _shutdown_when_flushed(pipe, pipe->a2c);
+    }
+    return;
+  }
+
+  if (what & BEV_EVENT_ERROR) {
     error("connection error");
+    if (bev == pipe->a2c) {
+      health_failure(pipe->backend);
+    }
   } else if (what & BEV_EVENT_TIMEOUT) {
-    dzlog_error("connection timeout with fd %u", fd);
+    log_error("connection timeout with fd %u", fd);
+  }
+  _pipe_free(pipe); pipe = NULL;
+}
+
+static void _http_requests(cb_arg *pipe) {
+
+  conn_details *conn = pipe->conn;
+  struct evbuffer *input = bufferevent_get_input(pipe->c2a);
+
+  // one exchange at a time: a pipelined request waits in the input until the response before it is done
+  if (0 == evbuffer_get_length(input) || (HTTP_DONE == pipe->request.state && 0 == pipe->request.pending) ||
+      pipe->waiting) {
+    return;
+  }
+
+  // a GET's head is parsed before it is relayed, in case the cache can answer it instead
+  if (NULL != conn->cache && HTTP_HEAD == pipe->request.state) {
+    switch (http_parse(&pipe->request, input)) {
+    case HTTP_HEAD:
+      return;
+    case HTTP_ERROR:
+      log_info("rejecting a malformed request on fd %u", pipe->accept_fd);
+      _http_reject(pipe, 400);
+      return;
+    default:
+      if (NULL != pipe->request.key && _http_cached(pipe, 1)) {
+        return;
+      }
+    }
+  }
+
+  if (HTTP_ERROR == http_relay(&pipe->request, input, bufferevent_get_output(pipe->a2c))) {
+    log_info("rejecting a malformed request on fd %u", pipe->accept_fd);
+    _http_reject(pipe, 400);
+    return;
+  }
+
+  if (HTTP_HEAD != pipe->request.state && HTTP_IDLE == pipe->response.state) {
+    metrics_add(&conn->metrics->http_requests, 1);
+    http_response_init(&pipe->response, &pipe->request);
+  }
+
+  // the upstream is picked once there is a request for it
+  if (pipe->detached && 0 < evbuffer_get_length(bufferevent_get_output(pipe->a2c)) &&
+      SUCCESS != _http_upstream(pipe)) {
+    return;
+  }
+
+  _flow_control(pipe, pipe->c2a, pipe->a2c);
+}
+
+static void _http_responses(cb_arg *pipe) {
+
+  struct evbuffer *output = bufferevent_get_output(pipe->c2a);
+  size_t queued = evbuffer_get_length(output);
+  http_state state = http_relay(&pipe->response, bufferevent_get_input(pipe->a2c), output);
+
+  if (NULL != pipe->fill) {
+    _http_fill(pipe, queued, state);
+  }
+
+  switch (state) {
+
+  case HTTP_IDLE:
+    log_error("upstream %s:%s sent fd %u a response before a request", pipe->backend->host, pipe->backend->port,
+              pipe->accept_fd);
+    _pipe_free(pipe); pipe = NULL;
+    return;
+
+  case HTTP_ERROR:
+    log_error("upstream %s:%s sent fd %u a malformed response", pipe->backend->host, pipe->backend->port,
+              pipe->accept_fd);
+    _http_reject(pipe, 502);
+    return;
+
+  case HTTP_DONE:
+    _http_exchange_done(pipe);
+    return;
+
+  case HTTP_TUNNEL:
+    // an upgrade or a CONNECT: from here on, both directions are relayed as they are
+    if (HTTP_TUNNEL != pipe->request.state) {
+      http_tunnel(&pipe->request);
+      _http_requests(pipe);
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  _flow_control(pipe, pipe->a2c, pipe->c2a);
+}
+
+static int _http_cached(cb_arg *pipe, int coalesce) {
+
+  conn_details *conn = pipe->conn;
+  http_cache_entry *entry = NULL;
+  int rc = SUCCESS;
+
+  if (coalesce && NULL == pipe->waiter.ev &&
+      NULL == (pipe->waiter.ev = event_new(conn->ev_base, -1, 0, _http_woken_cb, pipe))) {
+    coalesce = 0;
+  }
+
+  switch (http_cache_lookup(conn->cache, pipe->request.key, pipe->request.key_len, conn->metrics,
+                            &entry, &pipe->fill, coalesce ? &pipe->waiter : NULL)) {
+
+  case HTTP_CACHE_HIT:
+    log_debug("answering fd %u from the cache", pipe->accept_fd);
+    http_skip(&pipe->request, bufferevent_get_input(pipe->c2a));
+    rc = http_cache_serve(entry, bufferevent_get_output(pipe->c2a));
+    http_cache_release(entry); entry = NULL;
+    if (SUCCESS != rc) {
+      log_error("cannot answer fd %u from the cache", pipe->accept_fd);
+      _pipe_free(pipe); pipe = NULL;
+      return 1;
+    }
+    pipe->response.state = HTTP_DONE;
+    pipe->response.keep_alive = 1;
+    _http_exchange_done(pipe);
+    return 1;
+
+  case HTTP_CACHE_WAIT:
+    log_debug("fd %u waits for a response being fetched for another client", pipe->accept_fd);
+    pipe->waiting = 1;
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+static void _http_woken_cb(evutil_socket_t fd, short what, void *arg) {
+
+  cb_arg *pipe = arg;
+
+  (void) fd;
+  (void) what;
+
+  // a fill that was given up on is not waited for again; the request goes upstream instead
+  pipe->waiting = 0;
+  if (!_http_cached(pipe, !pipe->waiter.abandoned)) {
+    _http_requests(pipe);
   }
+}
+
+static void _http_fill(cb_arg *pipe, size_t offset, http_state state) {
 
-  // flush the other end
-  if (pipe->c2a != NULL) bufferevent_flush(pipe->c2a, EV_WRITE, BEV_FINISHED);
-  if (pipe->a2c != NULL) bufferevent_flush(pipe->a2c, EV_WRITE, BEV_FINISHED);
+  conn_details *conn = pipe->conn;
 
-  // free bufferevent, and make sure we set shared references to NULL
-  bufferevent_free(bev); bev = NULL;
-  if (fd == pipe->client_fd) {
-    pipe->a2c = NULL;
+  // ttl_s is known once the final response's head is parsed; one that may not be stored, or is too
+  // long to, is given up on right away, so the lookups waiting for it go upstream without waiting
+  if ((HTTP_HEAD != state && 0 == pipe->response.ttl_s) ||
+      SUCCESS != http_cache_fill_append(pipe->fill, bufferevent_get_output(pipe->c2a), offset)) {
+    http_cache_fill_abandon(conn->cache, pipe->fill); pipe->fill = NULL;
+    return;
+  }
+  if (HTTP_DONE == state) {
+    http_cache_fill_end(conn->cache, pipe->fill, pipe->response.head_len, pipe->response.ttl_s, conn->metrics);
+    pipe->fill = NULL;
+  }
+}
+
+static int _http_upstream(cb_arg *pipe) {
+
+  conn_details *conn = pipe->conn;
+  backend *b = _http_backend(pipe);
+  int fd = -1;
+  int rc = SUCCESS;
+
+  pipe->detached = 0;
+  pipe->retries = 0;
+
+  // each request is balanced on its own; the pipe counts against the backend it last used
+  if (b != pipe->backend) {
+    backend_release(pipe->backend);
+    pipe->backend = b;
+    backend_acquire(b);
+  }
+
+  if (NULL != b->pool && 0 <= (fd = upstream_pool_take(b->pool))) {
+    if (0 != bufferevent_setfd(pipe->a2c, fd)) {
+      log_error("bufferevent_setfd failed");
+      close(fd);
+      _http_reject(pipe, 502);
+      return ERR_BEVENT_NEW;
+    }
+    log_debug("reusing connection to %s:%s with fd %u for fd %u", b->host, b->port, fd, pipe->accept_fd);
+    pipe->connected = 1;
+    pipe->client_fd = fd;
+    _upstream_ready(pipe);
+    return SUCCESS;
+  }
+
+  if (SUCCESS == (rc = client_connect_timeout(pipe->a2c, &conn->connect_timeout)) &&
+      SUCCESS == (rc = _connect_upstream(pipe))) {
+    return SUCCESS;
+  }
+  if (SUCCESS == _retry_upstream(pipe)) {
+    return SUCCESS;
+  }
+  _http_reject(pipe, 502);
+  return rc;
+}
+
+static backend *_http_backend(cb_arg *pipe) {
+
+  struct sockaddr_storage ss;
+  socklen_t slen = sizeof(ss);
+
+  // only the hash strategy looks at the client, which keeps it on one backend across requests
+  if (BACKEND_HASH == pipe->conn->backends->strategy &&
+      0 == getpeername(pipe->accept_fd, (struct sockaddr *) &ss, &slen)) {
+    return backend_select(pipe->conn->backends, (struct sockaddr *) &ss, slen);
+  }
+  return backend_select(pipe->conn->backends, NULL, 0);
+}
+
+static void _http_exchange_done(cb_arg *pipe) {
+
+  conn_details *conn = pipe->conn;
+  int keep_client = pipe->request.keep_alive && pipe->response.keep_alive &&
+                    HTTP_DONE == pipe->request.state && !pipe->c2a_eof;
+
+  // the upstream is only reused if it has nothing left to say, and nothing left to hear
+  int keep_upstream = keep_client && pipe->connected && !pipe->a2c_eof &&
+                      0 == evbuffer_get_length(bufferevent_get_input(pipe->a2c)) &&
+                      0 == evbuffer_get_length(bufferevent_get_output(pipe->a2c));
+
+  if (SUCCESS != _http_release(pipe, keep_upstream)) {
+    _pipe_free(pipe); pipe = NULL;
+    return;
+  }
+
+  if (!keep_client) {
+    _http_finish(pipe);
+    return;
+  }
+
+  http_request_init(&pipe->request);
+  pipe->request.keyed = NULL != conn->cache;
+  memset(&pipe->response, 0, sizeof(pipe->response));
+  _timer_arm(pipe, &pipe->c2a_read, conn->read_timeout_ms);
+  bufferevent_enable(pipe->c2a, EV_READ);
+  _http_requests(pipe);  // pipelined
+}
+
+static int _http_release(cb_arg *pipe, int keep) {
+
+  conn_details *conn = pipe->conn;
+  int fd = pipe->client_fd;
+
+  if (NULL != pipe->dns_waiter) {
+    dns_cache_cancel(pipe->dns_waiter); pipe->dns_waiter = NULL;
+  }
+  if (NULL != pipe->race) {
+    eyeballs_cancel(pipe->race); pipe->race = NULL;
+  }
+  if (NULL != pipe->fill) {
+    http_cache_fill_abandon(conn->cache, pipe->fill); pipe->fill = NULL;
+  }
+
+  if (keep && NULL != pipe->backend->pool) {
+    bufferevent_setfd(pipe->a2c, -1);
+    _bev_free(pipe, pipe->a2c); pipe->a2c = NULL;
+    upstream_pool_put(pipe->backend->pool, fd);
+    metrics_add(&conn->metrics->http_kept, 1);
   } else {
-    pipe->c2a = NULL;
+    _bev_free(pipe, pipe->a2c); pipe->a2c = NULL;
   }
-  dzlog_debug("bev struct freed");
 
-  // NOTE we can't get a callback if we close it ourselves, so wait for the server
-  // to close.
+  wheel_timer_cancel(&pipe->a2c_read);
+  wheel_timer_cancel(&pipe->a2c_write);
+  pipe->connected = 0;
+  pipe->client_fd = -1;
+  pipe->a2c_eof = 0;
+  pipe->detached = 1;
 
-  if (NULL == pipe->a2c && NULL == pipe->c2a) {
-    free(pipe); pipe = NULL;
-    dzlog_debug("cb_arg struct freed");
+  // a2c may have paused c2a to wait for its output to drain; that is moot now
+  bufferevent_setcb(pipe->c2a, readcb, NULL, errorcb, pipe);
+  bufferevent_setwatermark(pipe->c2a, EV_WRITE, 0, 0);
+
+  // the next request is queued in a socket-less a2c, as when a connection is accepted
+  return _fd_event_new(conn->ev_base, -1, &pipe->a2c, pipe, NULL);
+}
+
+static void _http_reject(cb_arg *pipe, int status) {
+
+  if (0 == pipe->response.moved) {
+    http_respond(bufferevent_get_output(pipe->c2a), status);
+  }
+  if (SUCCESS != _http_release(pipe, 0)) {
+    _pipe_free(pipe); pipe = NULL;
+    return;
   }
+  _http_finish(pipe);
+}
+
+static void _http_finish(cb_arg *pipe) {
+  pipe->a2c_eof = 1;  // the upstream has nothing more to send, and the client nothing more to ask
+  bufferevent_disable(pipe->c2a, EV_READ);
+  wheel_timer_cancel(&pipe->c2a_read);
+  _shutdown_when_flushed(pipe, pipe->c2a);
+}
+
+static void _pipe_free(cb_arg *pipe) {
+  if (NULL != pipe->dns_waiter) {
+    dns_cache_cancel(pipe->dns_waiter); pipe->dns_waiter = NULL;
+  }
+  if (NULL != pipe->race) {
+    eyeballs_cancel(pipe->race); pipe->race = NULL;
+  }
+  if (NULL != pipe->a2c) {
+    _bev_free(pipe, pipe->a2c); pipe->a2c = NULL;
+  }
+  if (NULL != pipe->c2a) {
+    _bev_free(pipe, pipe->c2a); pipe->c2a = NULL;
+  }
+  _pipe_done(pipe);
+}
 
+static void _pipe_done(cb_arg *pipe) {
+  metrics *m = pipe->conn->metrics;
+  uint64_t now = metrics_now();
+  wheel_timer_cancel(&pipe->idle);
+  wheel_timer_cancel(&pipe->lifetime);
+  _bev_timers_cancel(pipe);
+  if (NULL != pipe->fill) {
+    http_cache_fill_abandon(pipe->conn->cache, pipe->fill); pipe->fill = NULL;
+  }
+  if (pipe->waiting) {
+    http_cache_cancel(pipe->conn->cache, &pipe->waiter);
+  }
+  if (NULL != pipe->waiter.ev) {
+    event_free(pipe->waiter.ev); pipe->waiter.ev = NULL;
+  }
+  http_message_clear(&pipe->request);
+  metrics_add(&m->connections_closed, 1);
+  metrics_observe(&m->lifetime, now - pipe->accepted_at);
+  _trace(pipe, now);
+  backend_release(pipe->backend);
+  if (NULL != pipe->conn->admission) {
+    admission_release(pipe->conn->admission, pipe->admitted);
+  }
+  if (NULL != pipe->prev) {
+    pipe->prev->next = pipe->next;
+  } else {
+    pipe->conn->live = pipe->next;
+  }
+  if (NULL != pipe->next) {
+    pipe->next->prev = pipe->prev;
+  }
+  slab_free(pipe->conn->pipes, pipe);
+  log_debug("cb_arg struct freed");
+}
+
+static void _trace(cb_arg *pipe, uint64_t closed_at) {
+
+  uint64_t asked_at = pipe->connected_at;
+  long first_byte = -1;
+
+  // the upstream could not answer before it had the client's first byte, unless it speaks first
+  if (0 != pipe->first_c2a_at && 0 != asked_at) {
+    if (pipe->first_a2c_at > asked_at && pipe->first_a2c_at < pipe->first_c2a_at) {
+      asked_at = pipe->first_a2c_at;
+    }
+    first_byte = (long) (pipe->first_c2a_at - asked_at);
+    metrics_observe(&pipe->conn->metrics->first_byte_time, (uint64_t) first_byte);
+  }
+  PROBE3(close, pipe->accept_fd, closed_at - pipe->accepted_at, first_byte);
+
+  if (pipe->traced) {
+    log_info("trace fd %u to %s:%s: resolved at %ldus, connected at %ldus, first byte up at %ldus, "
+             "first byte down at %ldus, closed at %luus, %d retries",
+             pipe->accept_fd, pipe->backend->host, pipe->backend->port,
+             _since(pipe, pipe->resolved_at), _since(pipe, pipe->connected_at),
+             _since(pipe, pipe->first_a2c_at), _since(pipe, pipe->first_c2a_at),
+             (unsigned long) (closed_at - pipe->accepted_at), pipe->retries);
+  }
+}
+
+static long _since(const cb_arg *pipe, uint64_t at) {
+  return 0 == at ? -1 : (long) (at - pipe->accepted_at);
+}
+
+static void _bev_free(cb_arg *pipe, struct bufferevent *bev) {
+  struct evbuffer *output = bufferevent_get_output(bev);
+  evbuffer_remove_cb(output, _buffered_cb, pipe);
+  pipe->conn->buffered -= evbuffer_get_length(output);
+  bufferevent_free(bev);
+}
+
+static void _timer_arm(cb_arg *pipe, wheel_timer *timer, int timeout_ms) {
+  if (0 < timeout_ms) {
+    wheel_timer_arm(pipe->conn->timers, timer, timeout_ms);
+  }
+}
+
+static wheel_timer *_read_timer(cb_arg *pipe, struct bufferevent *bev) {
+  return bev == pipe->a2c ? &pipe->a2c_read : &pipe->c2a_read;
+}
+
+static void _bev_timers_cancel(cb_arg *pipe) {
+  wheel_timer_cancel(&pipe->a2c_read);
+  wheel_timer_cancel(&pipe->c2a_read);
+  wheel_timer_cancel(&pipe->a2c_write);
+  wheel_timer_cancel(&pipe->c2a_write);
+}
+
+static void _timeout_cb(wheel_timer *timer, void *arg) {
+
+  cb_arg *pipe = arg;
+  conn_details *conn = pipe->conn;
+  metrics_timeout kind = METRICS_TIMEOUT_WRITE;
+  uint64_t bytes = 0;
+
+  if (timer == &pipe->idle) {
+    // zero-copy relays do not report their reads; see whether they moved anything since
+    if (NULL != pipe->splice || NULL != pipe->ring) {
+      bytes = NULL != pipe->splice ? splice_relay_bytes(pipe->splice) : uring_relay_bytes(pipe->ring);
+      if (bytes != pipe->idle_bytes) {
+        pipe->idle_bytes = bytes;
+        _timer_arm(pipe, &pipe->idle, conn->idle_timeout_ms);
+        return;
+      }
+    }
+    kind = METRICS_TIMEOUT_IDLE;
+  } else if (timer == &pipe->lifetime) {
+    kind = METRICS_TIMEOUT_LIFETIME;
+  } else if (timer == &pipe->a2c_read || timer == &pipe->c2a_read) {
+    kind = METRICS_TIMEOUT_READ;
+  }
+
+  log_info("closing fd %u after a %s timeout", pipe->accept_fd,
+           METRICS_TIMEOUT_IDLE == kind ? "idle" : METRICS_TIMEOUT_LIFETIME == kind ? "lifetime" :
+           METRICS_TIMEOUT_READ == kind ? "read" : "write");
+  metrics_add(&conn->metrics->timeouts[kind], 1);
+
+  wheel_timer_cancel(&pipe->idle);
+  wheel_timer_cancel(&pipe->lifetime);
+  _bev_timers_cancel(pipe);
+  if (NULL != pipe->splice) {
+    splice_relay_close(pipe->splice);  // and _relay_closed frees the pipe
+  } else if (NULL != pipe->ring) {
+    uring_relay_close(pipe->ring);
+  } else {
+    _pipe_free(pipe); pipe = NULL;
+  }
+}
+
+static void _shutdown_when_flushed(cb_arg *pipe, struct bufferevent *to) {
+
+  if (0 < evbuffer_get_length(bufferevent_get_output(to))) {
+    _watch_drain(pipe, to, 0);
+    return;
+  }
+
+  // an upstream that is still connecting has nothing to be told; a TLS client is told first
+  if (to == pipe->c2a && NULL != pipe->conn->tls) {
+    tls_shutdown(to);
+  }
+  if (to == pipe->c2a || pipe->connected) {
+    shutdown(bufferevent_getfd(to), SHUT_WR);
+  }
+
+  if (!pipe->connected || (pipe->a2c_eof && pipe->c2a_eof &&
+                           0 == evbuffer_get_length(bufferevent_get_output(pipe->a2c)) &&
+                           0 == evbuffer_get_length(bufferevent_get_output(pipe->c2a)))) {
+    _pipe_free(pipe); pipe = NULL;
+  }
+}
+
+static void _flow_control(cb_arg *pipe, struct bufferevent *bev, struct bufferevent *output) {
+  size_t length = evbuffer_get_length(bufferevent_get_output(output));
+  if (length >= pipe->conn->buffer_high ||
+      (0 < length && 0 < pipe->conn->memory_budget && pipe->conn->buffered > pipe->conn->memory_budget)) {
+    _pause(pipe, bev, output);
+  }
+}
+
+static void _pause(cb_arg *pipe, struct bufferevent *bev, struct bufferevent *output) {
+  log_debug("pausing reads on fd %d", bufferevent_getfd(bev));
+  pipe->conn->pauses++;
+  bufferevent_disable(bev, EV_READ);
+  wheel_timer_cancel(_read_timer(pipe, bev));  // we stopped reading, not the peer sending
+  _watch_drain(pipe, output, pipe->conn->buffer_low);
+}
+
+static void _watch_drain(cb_arg *pipe, struct bufferevent *bev, size_t lowmark) {
+  bufferevent_setwatermark(bev, EV_WRITE, lowmark, 0);
+  bufferevent_setcb(bev, readcb, writecb, errorcb, pipe);
+}
+
+static void _buffered_cb(struct evbuffer *buffer, const struct evbuffer_cb_info *info, void *arg) {
+
+  cb_arg *pipe = arg;
+  conn_details *conn = pipe->conn;
+  int to_client = NULL != pipe->c2a && buffer == bufferevent_get_output(pipe->c2a);
+  wheel_timer *timer = to_client ? &pipe->c2a_write : &pipe->a2c_write;
+
+  conn->buffered += info->n_added;
+  conn->buffered -= info->n_deleted;
+  if (conn->buffered > conn->buffered_max) {
+    conn->buffered_max = conn->buffered;
+  }
+
+  // the write timer runs while there is output, and restarts whenever some of it goes out;
+  // an upstream that is still connecting is covered by the connect timeout instead
+  if (0 == info->orig_size + info->n_added - info->n_deleted) {
+    wheel_timer_cancel(timer);
+  } else if ((0 < info->n_deleted || !wheel_timer_armed(timer)) && (to_client || pipe->connected)) {
+    _timer_arm(pipe, timer, conn->write_timeout_ms);
+  }
 }
@@ -5,15 +5,57 @@
 #ifndef io_h
 #define io_h
 
+#include <sys/time.h>
 #include <event2/event.h>
+#include <event2/bufferevent.h>
+#include "defs.h"
+#include "admission.h"
+#include "backend.h"
+#include "dns_cache.h"
+#include "http_cache.h"
+#include "metrics.h"
+#include "slab.h"
+#include "sockopt.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "uring.h"
 
 /* connection details to be passed along to callbacks;
  * note that this struct "owns" ev_base and is responsible for free-ing the memory.
  */
 struct conn_details_struct {
   struct event_base *ev_base;
-  str up_addr;
-  str up_port;
+  dns_cache *dns;  // resolves backend names without blocking the event loop
+  backend_set *backends;  // where connections are relayed to, and their pools
+  struct timeval connect_timeout;  // covers the TCP connect to the upstream
+  int splice;  // relay connected pipes with splice(2) instead of bufferevents
+  uring *uring;  // or through io_uring, if the worker has a ring
+  metrics *metrics;  // the worker's counters
+  slab_pool *pipes;  // per-connection state, recycled
+  struct cb_arg_struct *live;  // the pipes in use, for conn_details_close
+  timer_wheel *timers;  // the worker's, for the timeouts below; 0 disables one
+  int idle_timeout_ms;  // nothing relayed either way
+  int read_timeout_ms;  // nothing read from a side that is being read from
+  int write_timeout_ms;  // queued output not draining
+  int lifetime_ms;  // since the client was accepted
+  admission *admission;  // per-address caps checked on accept; NULL for none
+  struct ev_token_bucket_cfg *rate_limit;  // each bufferevent's read rate; NULL for none
+  struct bufferevent_rate_limit_group *rate_group;  // and all of the worker's together
+  sock_profile sock;  // options set on accepted and upstream sockets
+  int trace_sample;  // log the stages of one in this many connections; 0 for none
+  unsigned long sampled;  // connections counted towards the next sample
+  tls_server *tls;  // does a TLS handshake with each client first; NULL for plain TCP
+  int http;  // relays one HTTP request and response at a time, and reuses upstream connections
+  http_cache *cache;  // answers GETs it holds a fresh response to, shared by the workers; NULL for none
+
+  // flow control: a side stops reading while the other side's output is above buffer_high,
+  // and resumes once it drains to buffer_low
+  size_t buffer_high;
+  size_t buffer_low;
+  size_t memory_budget;  // this worker's share of the output buffered across connections; 0 for none
+  size_t buffered;  // bytes currently queued for writing, across connections
+  size_t buffered_max;
+  unsigned long pauses;
 };
 
 typedef struct conn_details_struct conn_details;
@@ -21,12 +63,27 @@ typedef struct conn_details_struct conn_details;
 /* Callback used by the event loop when a connection is ready to be accepted. */
 void do_accept(int listen_fd, short event, void *arg);
 
-/* Frees the struct and the inner strings. */
+/* Callback used by the io_uring engine for each connection it accepted. */
+void do_accepted(int accept_fd, void *arg);
+
+/* Frees the struct; the backends belong to the worker. */
 void conn_details_free(conn_details *conn);
 
-/* Creates a new struct and copies the contents of each string into a new memory space. */
+/* Closes the connections still open once the loop has stopped, e.g. those the drain
+ * deadline cut short. Their bufferevents are finalized by the next turn of the loop.
+ */
+void conn_details_close(conn_details *conn);
+
+/* Logs the buffer counters. */
+void conn_details_report(const conn_details *conn, int worker_id);
+
+/* Returns the connections accepted and not yet closed. */
+unsigned long conn_details_active(const conn_details *conn);
+
+/* Creates a new struct for relaying to the given backends. */
 conn_details *conn_details_new(struct event_base *ev_base,
-                               const str up_addr,
-                               const str up_port);
+                               dns_cache *dns,
+                               backend_set *backends,
+                               int connect_timeout_ms);
 
 #endif /* io_h */
@@ -0,0 +1,213 @@
+/* log.c
+ *
+ * Asynchronous logging. Every thread formats its records into a ring of its own,
+ * and a writer thread hands them to zlog, so the event loops never wait on output.
+ *
+ * Each ring has exactly one producer (its thread) and one consumer (the writer), so
+ * head and tail are plain atomics with acquire/release ordering and no locks. The
+ * mutex only guards the list of rings, which a thread joins on its first record.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <zlog.h>
+#include "config.h"
+#include "defs.h"
+#include "log.h"
+
+#if 0 != (LOG_RING_SIZE & (LOG_RING_SIZE - 1))
+#error "LOG_RING_SIZE must be a power of two"
+#endif
+
+typedef struct {
+  int level;
+  char message[LOG_LINE_LEN];
+} log_record;
+
+typedef struct log_ring_struct log_ring;
+
+struct log_ring_struct {
+  _Atomic uint32_t head;  // next slot to fill; advanced by the owning thread
+  _Atomic uint32_t tail;  // next slot to write out; advanced by the writer
+  _Atomic unsigned long dropped;
+  unsigned long reported;  // drops already reported; writer only
+  log_ring *next;
+  log_record records[LOG_RING_SIZE];
+};
+
+// -- DECLARATIONS --
+
+/* Returns the calling thread's ring, creating it on first use. */
+static log_ring *_ring(void);
+/* Writes out everything queued so far. @return the number of records written. */
+static int _drain(void);
+static void *_writer_main(void *arg);
+
+static __thread log_ring *_thread_ring = NULL;
+static log_ring *_rings = NULL;
+static pthread_mutex_t _rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t _writer;
+static atomic_int _running = 0;
+static atomic_int _stopping = 0;
+
+// -- PUBLIC --
+
+int log_init(const char *conf) {
+
+  int rc = 0;
+
+  if (0 != (rc = dzlog_init(conf, "main"))) {
+    return ERR_LOG_INIT;
+  }
+
+  atomic_store(&_stopping, 0);
+  if (0 != pthread_create(&_writer, NULL, _writer_main, NULL)) {
+    zlog_fini();
+    return ERR_LOG_INIT;
+  }
+  atomic_store(&_running, 1);
+  return SUCCESS;
+}
+
+void log_fini(void) {
+
+  log_ring *ring = NULL;
+
+  if (atomic_load(&_running)) {
+    atomic_store(&_stopping, 1);
+    pthread_join(_writer, NULL);
+    atomic_store(&_running, 0);
+  }
+  zlog_fini();
+
+  // every other thread has been joined by now
+  pthread_mutex_lock(&_rings_lock);
+  while (NULL != (ring = _rings)) {
+    _rings = ring->next;
+    free(ring);
+  }
+  pthread_mutex_unlock(&_rings_lock);
+  _thread_ring = NULL;
+}
+
+void log_write(int level, const char *format, ...) {
+
+  log_ring *ring = NULL;
+  log_record *record = NULL;
+  uint32_t head = 0;
+  va_list ap;
+
+  if (!atomic_load_explicit(&_running, memory_order_relaxed) || NULL == (ring = _ring())) {
+    char message[LOG_LINE_LEN];
+    va_start(ap, format);
+    vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+    dzlog(__FILE__, sizeof(__FILE__) - 1, __func__, sizeof(__func__) - 1, __LINE__, level, "%s", message);
+    return;
+  }
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  record = &ring->records[head & (LOG_RING_SIZE - 1)];
+  record->level = level;
+  va_start(ap, format);
+  vsnprintf(record->message, sizeof(record->message), format, ap);
+  va_end(ap);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+unsigned long log_dropped(void) {
+
+  unsigned long dropped = 0;
+  log_ring *ring = NULL;
+
+  pthread_mutex_lock(&_rings_lock);
+  for (ring = _rings; NULL != ring; ring = ring->next) {
+    dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&_rings_lock);
+  return dropped;
+}
+
+// -- PRIVATE --
+
+static log_ring *_ring(void) {
+
+  log_ring *ring = _thread_ring;
+
+  if (NULL != ring) {
+    return ring;
+  }
+
+  if (NULL == (ring = calloc(1, sizeof(log_ring)))) {
+    return NULL;
+  }
+  pthread_mutex_lock(&_rings_lock);
+  ring->next = _rings;
+  _rings = ring;
+  pthread_mutex_unlock(&_rings_lock);
+
+  _thread_ring = ring;
+  return ring;
+}
+
+static int _drain(void) {
+
+  log_ring *ring = NULL;
+  log_record *record = NULL;
+  unsigned long dropped = 0;
+  uint32_t head = 0;
+  uint32_t tail = 0;
+  int n = 0;
+
+  pthread_mutex_lock(&_rings_lock);
+  ring = _rings;
+  pthread_mutex_unlock(&_rings_lock);
+
+  // rings are only ever pushed onto the front, so the rest of the list is stable
+  for (; NULL != ring; ring = ring->next) {
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (; tail != head; tail++, n++) {
+      record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+      dzlog(__FILE__, sizeof(__FILE__) - 1, __func__, sizeof(__func__) - 1, __LINE__,
+            record->level, "%s", record->message);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    if (dropped != ring->reported) {
+      dzlog(__FILE__, sizeof(__FILE__) - 1, __func__, sizeof(__func__) - 1, __LINE__,
+            LOG_LEVEL_WARN, "log ring full, dropped %lu records", dropped - ring->reported);
+      ring->reported = dropped;
+    }
+  }
+
+  return n;
+}
+
+static void *_writer_main(void *arg) {
+
+  struct timespec interval = { LOG_FLUSH_MS / 1000, (LOG_FLUSH_MS % 1000) * 1000000L };
+
+  (void) arg;
+
+  // poll rather than be woken, so that logging never costs the event loops a syscall
+  while (!atomic_load(&_stopping)) {
+    if (0 == _drain()) {
+      nanosleep(&interval, NULL);
+    }
+  }
+  _drain();
+  return NULL;
+}
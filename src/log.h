@@ -0,0 +1,47 @@
+/* log.h
+ *
+ * Asynchronous logging. Every thread formats its records into a ring of its own,
+ * and a writer thread hands them to zlog, so the event loops never wait on output.
+ */
+#ifndef log_h
+#define log_h
+
+#include "config.h"
+
+// same values as zlog's levels
+#define LOG_LEVEL_DEBUG 20
+#define LOG_LEVEL_INFO 40
+#define LOG_LEVEL_WARN 80
+#define LOG_LEVEL_ERROR 100
+
+/* Records below LOG_LEVEL compile to nothing, though their arguments are still
+ * type-checked (and count as used).
+ */
+#define LOG_AT(level, ...) \
+  do { if ((level) >= LOG_LEVEL) log_write((level), __VA_ARGS__); } while (0)
+
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/* Initializes zlog from the given configuration, and starts the writer thread.
+ *
+ * @return success or error codes.
+ */
+int log_init(const char *conf);
+
+/* Stops the writer thread once it has written everything queued, and closes zlog.
+ * Records written afterwards go to zlog directly.
+ */
+void log_fini(void);
+
+/* Queues a record on the calling thread's ring. If the ring is full, the record is
+ * dropped and counted; the writer reports the count.
+ */
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/* Returns the number of records dropped so far, across all threads. */
+unsigned long log_dropped(void);
+
+#endif /* log_h */
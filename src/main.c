@@ -8,8 +8,18 @@
 //
 //
 
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
-#include <zlog.h>
+#include "log.h"
+#include "mem.h"
+#include "config.h"
+#include "backend.h"
+#include "splice.h"
+#include "tls.h"
+#include "uring.h"
+#include "opts.h"
 #include "proxy.h"
 #include "main.h"
 
@@ -18,6 +28,8 @@
 
 static void _free_logger();
 static int _init_logger();
+static int _parse_args(const int argc, const char **argv, proxy_opts *opts);
+static void _usage(const char *prog);
 
 // -- PUBLIC --
 
@@ -25,28 +37,489 @@ int main(const int argc,
          const char **argv) {
 
   int rc = 0;
+  proxy_opts opts;
+
+  mem_pool_init();  // before libevent allocates anything
+  proxy_opts_init(&opts);
+  if (SUCCESS != (rc = _parse_args(argc, argv, &opts))) {
+    _usage(argv[0]);
+    return ERR_OPTS_HELP == rc ? SUCCESS : rc;
+  }
 
   if (SUCCESS != (rc = _init_logger())) {
     return rc;
   }
 
-  dzlog_info("logger initialized.");
-  dzlog_debug("argc: %d", argc);
-  dzlog_debug("argv: %lu", sizeof(argv));
+  log_info("logger initialized.");
+  log_debug("argc: %d", argc);
 
-  if (SUCCESS != (rc = proxy("localhost", "8080", "jimjh.com", "80"))) {
-    _free_logger();
-    return rc;
+  rc = proxy(&opts);
+  mem_pool_fini();
+  _free_logger();
+  return rc;
+}
+
+// -- PRIVATE --
+
+static int _parse_args(const int argc, const char **argv, proxy_opts *opts) {
+
+  static const struct option long_opts[] = {
+    {"listen",   required_argument, NULL, 'l'},
+    {"upstream", required_argument, NULL, 'u'},
+    {"strategy", required_argument, NULL, 's'},
+    {"workers",  required_argument, NULL, 'w'},
+    {"backlog",  required_argument, NULL, 'q'},
+    {"connect-timeout", required_argument, NULL, 't'},
+    {"idle-timeout",  required_argument, NULL, 'i'},
+    {"read-timeout",  required_argument, NULL, 'R'},
+    {"write-timeout", required_argument, NULL, 'W'},
+    {"lifetime",      required_argument, NULL, 'L'},
+    {"health-interval", required_argument, NULL, 'H'},
+    {"pool-min", required_argument, NULL, 'm'},
+    {"pool-max", required_argument, NULL, 'M'},
+    {"relay",    required_argument, NULL, 'r'},
+    {"engine",   required_argument, NULL, 'e'},
+    {"buffer-high", required_argument, NULL, 'b'},
+    {"buffer-low",  required_argument, NULL, 'B'},
+    {"memory-budget", required_argument, NULL, 'g'},
+    {"admin",    required_argument, NULL, 'a'},
+    {"max-conns-per-ip", required_argument, NULL, 'c'},
+    {"conn-rate", required_argument, NULL, 'n'},
+    {"conn-burst", required_argument, NULL, 'N'},
+    {"rate-limit", required_argument, NULL, 'k'},
+    {"global-rate-limit", required_argument, NULL, 'K'},
+    {"drain-timeout", required_argument, NULL, 'D'},
+    {"handoff",  required_argument, NULL, 'x'},
+    {"protocol", required_argument, NULL, 'P'},
+    {"udp-flow-timeout", required_argument, NULL, 'F'},
+    {"sockopt",  required_argument, NULL, 'O'},
+    {"trace-sample", required_argument, NULL, 'T'},
+    {"tls-cert", required_argument, NULL, 'C'},
+    {"tls-key",  required_argument, NULL, 'Y'},
+    {"cache-size", required_argument, NULL, 'S'},
+    {"help",     no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  proxy_upstream *up = NULL;
+  char *end = NULL;
+  int c = 0;
+  int i = 0;
+
+  while (-1 != (c = getopt_long(argc, (char * const *) argv, "l:u:s:w:q:t:i:R:W:L:H:m:M:r:e:b:B:g:a:c:n:N:k:K:D:x:P:F:O:T:C:Y:S:h", long_opts, NULL))) {
+    switch (c) {
+      case 'l':
+        opts->listen_path[0] = '\0';
+        if (0 == strncmp(optarg, "unix:", 5)) {
+          if ('\0' == optarg[5] || strlen(optarg + 5) >= sizeof(opts->listen_path)) {
+            fprintf(stderr, "invalid listen socket path: %s\n", optarg);
+            return ERR_OPTS_PARSE;
+          }
+          strncpy(opts->listen_path, optarg + 5, sizeof(opts->listen_path) - 1);
+        } else if (SUCCESS != parse_host_port(optarg,
+                                       opts->listen_addr, sizeof(opts->listen_addr),
+                                       opts->listen_port, sizeof(opts->listen_port))) {
+          fprintf(stderr, "invalid listen address: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'u':
+        if (OPTS_MAX_UPSTREAMS == opts->nupstreams) {
+          fprintf(stderr, "too many upstreams, at most %d\n", OPTS_MAX_UPSTREAMS);
+          return ERR_OPTS_PARSE;
+        }
+        up = &opts->upstreams[opts->nupstreams];
+        if (0 == strncmp(optarg, "unix:", 5)) {
+          if ('\0' == optarg[5] || strlen(optarg + 5) >= OPTS_PATH_LEN) {
+            fprintf(stderr, "invalid upstream socket path: %s\n", optarg);
+            return ERR_OPTS_PARSE;
+          }
+          strncpy(up->addr, optarg, sizeof(up->addr) - 1);
+          strncpy(up->port, "0", sizeof(up->port) - 1);
+        } else if (SUCCESS != parse_host_port(optarg, up->addr, sizeof(up->addr), up->port, sizeof(up->port))) {
+          fprintf(stderr, "invalid upstream address: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        opts->nupstreams++;
+        break;
+      case 's':
+        if (SUCCESS != backend_strategy_parse(optarg, &opts->strategy)) {
+          fprintf(stderr, "invalid strategy: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'w':
+        opts->workers = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->workers) {
+          fprintf(stderr, "invalid worker count: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'q':
+        opts->backlog = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 >= opts->backlog) {
+          fprintf(stderr, "invalid backlog: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 't':
+        opts->connect_timeout_ms = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 >= opts->connect_timeout_ms) {
+          fprintf(stderr, "invalid connect timeout: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'i':
+        opts->idle_timeout_ms = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->idle_timeout_ms) {
+          fprintf(stderr, "invalid idle timeout: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'R':
+        opts->read_timeout_ms = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->read_timeout_ms) {
+          fprintf(stderr, "invalid read timeout: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'W':
+        opts->write_timeout_ms = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->write_timeout_ms) {
+          fprintf(stderr, "invalid write timeout: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'L':
+        opts->lifetime_ms = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->lifetime_ms) {
+          fprintf(stderr, "invalid lifetime: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'H':
+        opts->health_interval_ms = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->health_interval_ms) {
+          fprintf(stderr, "invalid health check interval: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'm':
+        opts->pool_min = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->pool_min) {
+          fprintf(stderr, "invalid pool size: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'M':
+        opts->pool_max = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->pool_max) {
+          fprintf(stderr, "invalid pool size: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'r':
+        if (0 == strcmp(optarg, "splice")) {
+          opts->splice = 1;
+        } else if (0 == strcmp(optarg, "buffer")) {
+          opts->splice = 0;
+        } else {
+          fprintf(stderr, "invalid relay: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'e':
+        if (0 == strcmp(optarg, "uring")) {
+          opts->uring = 1;
+        } else if (0 == strcmp(optarg, "libevent")) {
+          opts->uring = 0;
+        } else {
+          fprintf(stderr, "invalid engine: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'b':
+        opts->buffer_high = strtoul(optarg, &end, 10);
+        if ('\0' != *end || '-' == optarg[0] || 0 == opts->buffer_high) {
+          fprintf(stderr, "invalid buffer size: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'B':
+        opts->buffer_low = strtoul(optarg, &end, 10);
+        if ('\0' != *end || '-' == optarg[0]) {
+          fprintf(stderr, "invalid buffer size: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'g':
+        opts->memory_budget = strtoul(optarg, &end, 10);
+        if ('\0' != *end || '-' == optarg[0]) {
+          fprintf(stderr, "invalid memory budget: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'a':
+        if (0 == strncmp(optarg, "unix:", 5)) {
+          if ('\0' == optarg[5] || strlen(optarg + 5) >= sizeof(opts->admin_path)) {
+            fprintf(stderr, "invalid admin socket path: %s\n", optarg);
+            return ERR_OPTS_PARSE;
+          }
+          strncpy(opts->admin_path, optarg + 5, sizeof(opts->admin_path) - 1);
+        } else if (SUCCESS != parse_host_port(optarg,
+                                              opts->admin_addr, sizeof(opts->admin_addr),
+                                              opts->admin_port, sizeof(opts->admin_port))) {
+          fprintf(stderr, "invalid admin address: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'c':
+        opts->max_conns_per_ip = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->max_conns_per_ip) {
+          fprintf(stderr, "invalid connection cap: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'n':
+        opts->conn_rate = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->conn_rate) {
+          fprintf(stderr, "invalid connection rate: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'N':
+        opts->conn_burst = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 >= opts->conn_burst) {
+          fprintf(stderr, "invalid connection burst: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'k':
+        opts->rate_limit = strtoul(optarg, &end, 10);
+        if ('\0' != *end || '-' == optarg[0]) {
+          fprintf(stderr, "invalid rate limit: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'K':
+        opts->global_rate_limit = strtoul(optarg, &end, 10);
+        if ('\0' != *end || '-' == optarg[0]) {
+          fprintf(stderr, "invalid rate limit: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'D':
+        opts->drain_timeout_ms = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->drain_timeout_ms) {
+          fprintf(stderr, "invalid drain timeout: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'x':
+        if ('\0' == optarg[0] || strlen(optarg) >= sizeof(opts->handoff_path)) {
+          fprintf(stderr, "invalid handoff socket path: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        strncpy(opts->handoff_path, optarg, sizeof(opts->handoff_path) - 1);
+        break;
+      case 'P':
+        if (0 == strcmp(optarg, "udp")) {
+          opts->udp = 1;
+          opts->http = 0;
+        } else if (0 == strcmp(optarg, "tcp")) {
+          opts->udp = 0;
+          opts->http = 0;
+        } else if (0 == strcmp(optarg, "http")) {
+          opts->udp = 0;
+          opts->http = 1;
+        } else {
+          fprintf(stderr, "invalid protocol: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'F':
+        opts->udp_flow_timeout_ms = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 >= opts->udp_flow_timeout_ms) {
+          fprintf(stderr, "invalid flow timeout: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'O':
+        if (SUCCESS != sock_profile_parse(&opts->sock, optarg)) {
+          fprintf(stderr, "invalid socket option: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'T':
+        opts->trace_sample = (int) strtol(optarg, &end, 10);
+        if ('\0' != *end || 0 > opts->trace_sample) {
+          fprintf(stderr, "invalid trace sample: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'C':
+        if ('\0' == optarg[0] || strlen(optarg) >= sizeof(opts->tls_cert)) {
+          fprintf(stderr, "invalid certificate path: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        strncpy(opts->tls_cert, optarg, sizeof(opts->tls_cert) - 1);
+        break;
+      case 'Y':
+        if ('\0' == optarg[0] || strlen(optarg) >= sizeof(opts->tls_key)) {
+          fprintf(stderr, "invalid key path: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        strncpy(opts->tls_key, optarg, sizeof(opts->tls_key) - 1);
+        break;
+      case 'S':
+        opts->cache_size = strtoul(optarg, &end, 10);
+        if ('\0' != *end || '-' == optarg[0]) {
+          fprintf(stderr, "invalid cache size: %s\n", optarg);
+          return ERR_OPTS_PARSE;
+        }
+        break;
+      case 'h':
+        return ERR_OPTS_HELP;
+      default:
+        return ERR_OPTS_PARSE;
+    }
+  }
+
+  if (0 == opts->nupstreams) {
+    opts->nupstreams = 1;  // the default
+  }
+
+  if (opts->pool_min > opts->pool_max) {
+    opts->pool_max = opts->pool_min;
+  }
+
+  if (opts->buffer_low > opts->buffer_high) {
+    opts->buffer_low = opts->buffer_high;
+  }
+
+  if (opts->splice && !splice_supported()) {
+    fprintf(stderr, "splice is not supported on this platform, relaying with bufferevents\n");
+    opts->splice = 0;
+  }
+
+  if (opts->splice && (0 < opts->rate_limit || 0 < opts->global_rate_limit)) {
+    fprintf(stderr, "rate limits apply to bufferevents, relaying with them instead of splice\n");
+    opts->splice = 0;
+  }
+
+  if (opts->splice && opts->http) {
+    fprintf(stderr, "HTTP is framed in bufferevents, relaying with them instead of splice\n");
+    opts->splice = 0;
+  }
+
+  if (0 < opts->cache_size && !opts->http) {
+    fprintf(stderr, "only HTTP responses are cached, ignoring --cache-size without --protocol http\n");
+    opts->cache_size = 0;
+  }
+
+  for (i = 0; opts->udp && i < opts->nupstreams; i++) {
+    if ('\0' != opts->listen_path[0] || 0 == strncmp(opts->upstreams[i].addr, "unix:", 5)) {
+      fprintf(stderr, "UDP is relayed between IP addresses only\n");
+      return ERR_OPTS_PARSE;
+    }
+  }
+
+  if (opts->udp && (opts->splice || 0 < opts->rate_limit || 0 < opts->global_rate_limit ||
+                    0 < opts->max_conns_per_ip || 0 < opts->conn_rate)) {
+    fprintf(stderr, "relay engines, rate limits and admission apply to TCP, ignoring them for UDP\n");
+    opts->splice = 0;
+  }
+
+  if ('\0' != opts->tls_key[0] && '\0' == opts->tls_cert[0]) {
+    fprintf(stderr, "--tls-key needs --tls-cert\n");
+    return ERR_OPTS_PARSE;
+  }
+
+  if ('\0' != opts->tls_cert[0] && (opts->udp || !tls_supported())) {
+    fprintf(stderr, opts->udp ? "TLS is terminated on TCP listeners only\n" : "TLS is not supported in this build\n");
+    return ERR_OPTS_PARSE;
+  }
+
+  if (opts->uring && !uring_supported()) {
+    fprintf(stderr, "io_uring is not supported in this build, using libevent\n");
+    opts->uring = 0;
   }
 
-  _free_logger();
   return SUCCESS;
 }
 
-// -- PRIVATE --
+static void _usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -l, --listen HOST:PORT    address to accept connections on, or unix:PATH (default %s:%s)\n"
+          "  -u, --upstream HOST:PORT  address to proxy connections to, or unix:PATH; repeat for several (default %s:%s)\n"
+          "  -s, --strategy NAME       rr, least, p2c or hash of the client address (default %s)\n"
+          "  -w, --workers N           event loop threads, 0 for one per core (default %d)\n"
+          "  -q, --backlog N           pending connections queued per listener (default %d)\n"
+          "  -t, --connect-timeout MS  give up on an upstream connect after MS (default %d)\n"
+          "  -i, --idle-timeout MS     close connections that relay nothing for MS, 0 for never (default %d)\n"
+          "  -R, --read-timeout MS     close when a side sends nothing for MS, 0 for never (default %d)\n"
+          "  -W, --write-timeout MS    close when queued output does not drain for MS, 0 for never (default %d)\n"
+          "  -L, --lifetime MS         close connections after MS, 0 for never (default %d)\n"
+          "  -H, --health-interval MS  probe each backend every MS, 0 for passive checks only (default %d)\n"
+          "  -m, --pool-min N          pre-connected upstream sockets per worker (default %d)\n"
+          "  -M, --pool-max N          upper bound the pool may grow to, 0 disables it (default %d)\n"
+          "  -r, --relay ENGINE        buffer (bufferevents) or splice (zero-copy) (default %s)\n"
+          "  -e, --engine NAME         libevent, or uring where the kernel has io_uring (default %s)\n"
+          "  -b, --buffer-high BYTES   stop reading a side once its partner has this much queued (default %d)\n"
+          "  -B, --buffer-low BYTES    resume reading once the queue drains to this (default %d)\n"
+          "  -g, --memory-budget BYTES bytes queued across all connections, 0 for no limit (default %lu)\n"
+          "  -a, --admin HOST:PORT     serve Prometheus metrics there, or on unix:PATH (default off)\n"
+          "  -c, --max-conns-per-ip N  connections a client address may have open, 0 for no cap (default %d)\n"
+          "  -n, --conn-rate N         new connections per second per client address, 0 for no limit (default %d)\n"
+          "  -N, --conn-burst N        new connections a client address may open at once (default %d)\n"
+          "  -k, --rate-limit BYTES    bytes per second read from each side of a connection, 0 for no limit (default %lu)\n"
+          "  -K, --global-rate-limit BYTES  bytes per second read across all connections (default %lu)\n"
+          "  -D, --drain-timeout MS    on SIGQUIT, wait up to MS for connections to finish (default %d)\n"
+          "  -x, --handoff PATH        take over the listeners of the proxy at PATH, and serve them there (default off)\n"
+          "  -P, --protocol NAME       tcp, udp to relay datagrams per client address, or http to keep\n"
+          "                            upstream connections alive between requests (default tcp)\n"
+          "  -F, --udp-flow-timeout MS forget a UDP client after MS without a datagram (default %d)\n"
+          "  -O, --sockopt NAME=VALUE  nodelay, rcvbuf, sndbuf, defer-accept, fastopen, fastopen-connect,\n"
+          "                            keepalive=IDLE[:INTVL[:CNT]] or notsent-lowat; 0 keeps the kernel's;\n"
+          "                            repeat for several (default nodelay=%d)\n"
+          "  -T, --trace-sample N      log the stages of one in N connections, 0 for none (default %d)\n"
+          "  -C, --tls-cert PATH       terminate TLS on the listener with this PEM certificate chain (default off)\n"
+          "  -Y, --tls-key PATH        its PEM private key (default the certificate file)\n"
+          "  -S, --cache-size BYTES    cache HTTP responses to GETs in BYTES across workers, 0 for none (default %lu)\n"
+          "  -h, --help                show this message\n",
+          prog,
+          DEFAULT_LISTEN_ADDR, DEFAULT_LISTEN_PORT,
+          DEFAULT_UP_ADDR, DEFAULT_UP_PORT,
+          LB_STRATEGY,
+          WORKERS,
+          LISTEN_BACKLOG,
+          CONNECT_TIMEOUT_MS,
+          IDLE_TIMEOUT_MS,
+          READ_TIMEOUT_MS,
+          WRITE_TIMEOUT_MS,
+          LIFETIME_MS,
+          HEALTH_INTERVAL_MS,
+          POOL_MIN,
+          POOL_MAX,
+          RELAY_SPLICE ? "splice" : "buffer",
+          IO_URING ? "uring" : "libevent",
+          BUFFER_HIGH_WM,
+          BUFFER_LOW_WM,
+          (unsigned long) MEMORY_BUDGET,
+          MAX_CONNS_PER_IP,
+          CONN_RATE,
+          CONN_BURST,
+          (unsigned long) RATE_LIMIT,
+          (unsigned long) GLOBAL_RATE_LIMIT,
+          DRAIN_TIMEOUT_MS,
+          UDP_FLOW_TIMEOUT_MS,
+          SOCK_NODELAY,
+          TRACE_SAMPLE,
+          (unsigned long) HTTP_CACHE_SIZE);
+}
 
 static void _free_logger() {
-  zlog_fini();
+  log_fini();
 }
 
 
@@ -54,7 +527,7 @@ static int _init_logger() {
 
   int rc = 0;
 
-  if (0 != (rc = dzlog_init("zlog.conf", "main"))) {
+  if (0 != (rc = log_init("zlog.conf"))) {
     printf("Unable to initialize logger.\n");
     return ERR_LOG_INIT;
   }
@@ -0,0 +1,240 @@
+/* mem.c
+ *
+ * Allocator for libevent's own memory (bufferevents, evbuffer chains, events), with
+ * a free list per thread and size class so that connection churn reuses blocks
+ * instead of going through malloc.
+ *
+ * Requests are rounded up to a power of two between MEM_MIN_SHIFT and MEM_MAX_SHIFT,
+ * which covers libevent's structs and its evbuffer chains (1 KiB doubling up to the
+ * 16 KiB a read asks for), and anything larger goes straight to malloc. Each block
+ * carries a header with its class, so it can be freed on any thread; it then joins
+ * that thread's free list, unless the thread already caches MEM_CACHE_BYTES.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "mem.h"
+
+#define MEM_MIN_SHIFT 6  // 64 bytes
+#define MEM_MAX_SHIFT 14  // 16 KiB
+#define MEM_CLASSES (MEM_MAX_SHIFT - MEM_MIN_SHIFT + 1)
+#define MEM_LARGE MEM_CLASSES  // class of blocks that bypass the cache
+
+/* Precedes every block; 16 bytes, so blocks keep malloc's alignment. */
+typedef struct {
+  size_t cls;
+  size_t size;  // requested size of a large block
+} mem_header;
+
+typedef struct mem_cache_struct mem_cache;
+
+/* One per thread, on the heap so that it outlives the thread and can be released
+ * by mem_pool_fini.
+ */
+struct mem_cache_struct {
+  mem_header *free[MEM_CLASSES];  // linked through the first word after the header
+  size_t cached;  // bytes on the free lists
+  long in_use;  // bytes handed out by this thread less those it freed
+  long high_water;
+  unsigned long hits;
+  unsigned long misses;
+  mem_cache *next;
+};
+
+// -- DECLARATIONS --
+
+/* Returns the calling thread's cache, creating it on first use, or NULL. */
+static mem_cache *_cache(void);
+static size_t _class(size_t size);
+static void *_malloc(size_t size);
+static void *_realloc(void *ptr, size_t size);
+static void _free(void *ptr);
+
+static __thread mem_cache *_thread_cache = NULL;
+static mem_cache *_caches = NULL;
+static pthread_mutex_t _caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// -- PUBLIC --
+
+void mem_pool_init(void) {
+#if MEM_POOL
+  event_set_mem_functions(_malloc, _realloc, _free);
+#else
+  (void) _malloc;
+  (void) _realloc;
+  (void) _free;
+#endif
+}
+
+void mem_pool_fini(void) {
+
+  mem_cache *cache = NULL;
+  mem_header *block = NULL;
+  int i = 0;
+
+  pthread_mutex_lock(&_caches_lock);
+  while (NULL != (cache = _caches)) {
+    _caches = cache->next;
+    for (i = 0; i < MEM_CLASSES; i++) {
+      while (NULL != (block = cache->free[i])) {
+        cache->free[i] = *(mem_header **) (block + 1);
+        free(block);
+      }
+    }
+    free(cache);
+  }
+  pthread_mutex_unlock(&_caches_lock);
+  _thread_cache = NULL;
+}
+
+void mem_pool_report(int worker_id) {
+  mem_cache *cache = _thread_cache;
+  if (NULL == cache) {
+    return;
+  }
+  log_info("worker %d memory pool: %ld bytes in use, high water %ld, %zu bytes cached, %lu hits, %lu misses",
+           worker_id, cache->in_use, cache->high_water, cache->cached, cache->hits, cache->misses);
+}
+
+// -- PRIVATE --
+
+static mem_cache *_cache(void) {
+
+  mem_cache *cache = _thread_cache;
+
+  if (NULL != cache || NULL == (cache = calloc(1, sizeof(mem_cache)))) {
+    return cache;
+  }
+
+  pthread_mutex_lock(&_caches_lock);
+  cache->next = _caches;
+  _caches = cache;
+  pthread_mutex_unlock(&_caches_lock);
+
+  _thread_cache = cache;
+  return cache;
+}
+
+static size_t _class(size_t size) {
+  size_t cls = 0;
+  if (size > (1UL << MEM_MAX_SHIFT)) {
+    return MEM_LARGE;
+  }
+  if (size <= (1UL << MEM_MIN_SHIFT)) {
+    return 0;
+  }
+  cls = 64 - __builtin_clzl(size - 1);  // bits needed for size - 1, i.e. log2 rounded up
+  return cls - MEM_MIN_SHIFT;
+}
+
+static void *_malloc(size_t size) {
+
+  mem_cache *cache = _cache();
+  size_t cls = _class(size);
+  size_t block_size = 0;
+  mem_header *block = NULL;
+
+  if (MEM_LARGE == cls) {
+    if (NULL == (block = malloc(sizeof(mem_header) + size))) {
+      return NULL;
+    }
+    block->cls = MEM_LARGE;
+    block->size = size;
+    return block + 1;
+  }
+
+  block_size = 1UL << (cls + MEM_MIN_SHIFT);
+  if (NULL != cache && NULL != (block = cache->free[cls])) {
+    cache->free[cls] = *(mem_header **) (block + 1);
+    cache->cached -= block_size;
+    cache->hits++;
+  } else {
+    if (NULL == (block = malloc(sizeof(mem_header) + block_size))) {
+      return NULL;
+    }
+    block->cls = cls;
+    if (NULL != cache) {
+      cache->misses++;
+    }
+  }
+
+  if (NULL != cache && (cache->in_use += block_size) > cache->high_water) {
+    cache->high_water = cache->in_use;
+  }
+  return block + 1;
+}
+
+static void *_realloc(void *ptr, size_t size) {
+
+  mem_header *block = NULL;
+  size_t old_size = 0;
+  void *moved = NULL;
+
+  if (NULL == ptr) {
+    return _malloc(size);
+  }
+  if (0 == size) {
+    _free(ptr);
+    return NULL;
+  }
+
+  block = (mem_header *) ptr - 1;
+  if (MEM_LARGE == block->cls && MEM_LARGE == _class(size)) {
+    if (NULL == (block = realloc(block, sizeof(mem_header) + size))) {
+      return NULL;
+    }
+    block->size = size;
+    return block + 1;
+  }
+
+  old_size = MEM_LARGE == block->cls ? block->size : 1UL << (block->cls + MEM_MIN_SHIFT);
+  if (MEM_LARGE != block->cls && size <= old_size) {
+    return ptr;  // still fits its class
+  }
+
+  if (NULL == (moved = _malloc(size))) {
+    return NULL;
+  }
+  memcpy(moved, ptr, MIN(old_size, size));
+  _free(ptr);
+  return moved;
+}
+
+static void _free(void *ptr) {
+
+  mem_cache *cache = NULL;
+  mem_header *block = NULL;
+  size_t block_size = 0;
+
+  if (NULL == ptr) {
+    return;
+  }
+
+  block = (mem_header *) ptr - 1;
+  if (MEM_LARGE == block->cls) {
+    free(block);
+    return;
+  }
+
+  block_size = 1UL << (block->cls + MEM_MIN_SHIFT);
+  if (NULL == (cache = _cache())) {
+    free(block);
+    return;
+  }
+
+  cache->in_use -= block_size;
+  if (cache->cached + block_size > MEM_CACHE_BYTES) {
+    free(block);
+    return;
+  }
+  *(mem_header **) ptr = cache->free[block->cls];
+  cache->free[block->cls] = block;
+  cache->cached += block_size;
+}
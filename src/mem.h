@@ -0,0 +1,23 @@
+/* mem.h
+ *
+ * Allocator for libevent's own memory (bufferevents, evbuffer chains, events), with
+ * a free list per thread and size class so that connection churn reuses blocks
+ * instead of going through malloc.
+ */
+#ifndef mem_h
+#define mem_h
+
+/* Installs the allocator with event_set_mem_functions. Must be called before any
+ * other libevent function; a no-op unless MEM_POOL is set.
+ */
+void mem_pool_init(void);
+
+/* Releases the blocks cached by every thread. Call once the other threads have
+ * exited and libevent is done with its objects.
+ */
+void mem_pool_fini(void);
+
+/* Logs the calling thread's occupancy, high-water mark and cache hits. */
+void mem_pool_report(int worker_id);
+
+#endif /* mem_h */
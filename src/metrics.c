@@ -0,0 +1,340 @@
+/* metrics.c
+ *
+ * Per-worker counters and latency histograms, merged and rendered in the Prometheus
+ * text format when scraped.
+ *
+ * Histogram buckets are log-linear: values below METRICS_SUB_BUCKETS get a bucket
+ * each, and every power of two above is split into METRICS_SUB_BUCKETS equal parts.
+ * Scrapes only show the power-of-two boundaries, which line up with the buckets.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <event2/buffer.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "metrics.h"
+
+#define METRICS_RENDER_MIN_BITS 4  // 16us
+#define METRICS_RENDER_MAX_BITS 36  // about 19 hours
+
+// -- DECLARATIONS --
+
+/* Returns the bucket holding value. */
+static int _bucket(uint64_t value);
+/* Returns the largest value the bucket holds. */
+static uint64_t _bucket_max(int bucket);
+static int _render_counter(struct evbuffer *out, const char *name, const char *help, const char *type,
+                           uint64_t value);
+/* Returns added - removed, or 0 if a snapshot caught removed ahead of added. */
+static uint64_t _gauge(uint64_t added, uint64_t removed);
+/* Renders one counter per label value. */
+static int _render_labeled(struct evbuffer *out, const char *name, const char *help, const char *label,
+                           const char **values, const _Atomic uint64_t *counters, int n);
+static int _render_histogram(struct evbuffer *out, const char *name, const char *help,
+                             const metrics_histogram *h);
+
+// -- PUBLIC --
+
+metrics *metrics_new(void) {
+
+  void *m = NULL;
+
+  // apart from the other workers' metrics, so updates never share a cache line
+  if (0 != posix_memalign(&m, 64, sizeof(metrics))) {
+    error("posix_memalign metrics");
+    return NULL;
+  }
+  memset(m, 0, sizeof(metrics));
+  return m;
+}
+
+void metrics_free(metrics *m) {
+  free(m);
+}
+
+void metrics_observe(metrics_histogram *h, uint64_t value) {
+  metrics_add(&h->buckets[_bucket(value)], 1);
+  metrics_add(&h->count, 1);
+  metrics_add(&h->sum, value);
+}
+
+uint64_t metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_merge(metrics *dst, const metrics *src) {
+  int i = 0;
+  metrics_add(&dst->bytes_a2c, atomic_load_explicit(&src->bytes_a2c, memory_order_relaxed));
+  metrics_add(&dst->bytes_c2a, atomic_load_explicit(&src->bytes_c2a, memory_order_relaxed));
+  metrics_add(&dst->connections_opened, atomic_load_explicit(&src->connections_opened, memory_order_relaxed));
+  metrics_add(&dst->connections_closed, atomic_load_explicit(&src->connections_closed, memory_order_relaxed));
+  metrics_add(&dst->connect_failures, atomic_load_explicit(&src->connect_failures, memory_order_relaxed));
+  for (i = 0; i < METRICS_TIMEOUTS; i++) {
+    metrics_add(&dst->timeouts[i], atomic_load_explicit(&src->timeouts[i], memory_order_relaxed));
+  }
+  for (i = 0; i < METRICS_REJECTS; i++) {
+    metrics_add(&dst->rejected[i], atomic_load_explicit(&src->rejected[i], memory_order_relaxed));
+  }
+  metrics_add(&dst->datagrams_dropped, atomic_load_explicit(&src->datagrams_dropped, memory_order_relaxed));
+  for (i = 0; i < METRICS_TLS_RESULTS; i++) {
+    metrics_add(&dst->tls_handshakes[i], atomic_load_explicit(&src->tls_handshakes[i], memory_order_relaxed));
+  }
+  metrics_add(&dst->tls_offloaded, atomic_load_explicit(&src->tls_offloaded, memory_order_relaxed));
+  metrics_add(&dst->http_requests, atomic_load_explicit(&src->http_requests, memory_order_relaxed));
+  metrics_add(&dst->http_kept, atomic_load_explicit(&src->http_kept, memory_order_relaxed));
+  for (i = 0; i < METRICS_CACHE_RESULTS; i++) {
+    metrics_add(&dst->http_cache[i], atomic_load_explicit(&src->http_cache[i], memory_order_relaxed));
+  }
+  metrics_add(&dst->http_cache_stored, atomic_load_explicit(&src->http_cache_stored, memory_order_relaxed));
+  metrics_add(&dst->http_cache_removed, atomic_load_explicit(&src->http_cache_removed, memory_order_relaxed));
+  metrics_add(&dst->http_cache_objects_stored,
+              atomic_load_explicit(&src->http_cache_objects_stored, memory_order_relaxed));
+  metrics_add(&dst->http_cache_objects_removed,
+              atomic_load_explicit(&src->http_cache_objects_removed, memory_order_relaxed));
+  metrics_histogram_merge(&dst->resolve_time, &src->resolve_time);
+  metrics_histogram_merge(&dst->connect_time, &src->connect_time);
+  metrics_histogram_merge(&dst->first_byte_time, &src->first_byte_time);
+  metrics_histogram_merge(&dst->lifetime, &src->lifetime);
+}
+
+void metrics_histogram_merge(metrics_histogram *dst, const metrics_histogram *src) {
+  int i = 0;
+  for (i = 0; i < METRICS_BUCKETS; i++) {
+    metrics_add(&dst->buckets[i], atomic_load_explicit(&src->buckets[i], memory_order_relaxed));
+  }
+  metrics_add(&dst->count, atomic_load_explicit(&src->count, memory_order_relaxed));
+  metrics_add(&dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed));
+}
+
+uint64_t metrics_quantile(const metrics_histogram *h, double q) {
+
+  uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+  uint64_t rank = (uint64_t) (q * count);
+  uint64_t seen = 0;
+  int i = 0;
+
+  if (0 == count) {
+    return 0;
+  }
+  if ((double) rank < q * count || 0 == rank) {
+    rank++;  // rounded up, and at least the first value
+  }
+
+  for (i = 0; i < METRICS_BUCKETS; i++) {
+    seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    if (seen >= rank) {
+      return _bucket_max(i);
+    }
+  }
+  return _bucket_max(METRICS_BUCKETS - 1);
+}
+
+int metrics_render(const metrics *m, struct evbuffer *out) {
+
+  static const char *timeouts[METRICS_TIMEOUTS] = { "connect", "idle", "read", "write", "lifetime" };
+  static const char *rejections[METRICS_REJECTS] = { "per_ip_connections", "per_ip_rate", "per_ip_table_full" };
+  static const char *handshakes[METRICS_TLS_RESULTS] = { "full", "resumed", "failed" };
+  static const char *lookups[METRICS_CACHE_RESULTS] = { "hit", "miss", "coalesced" };
+  uint64_t opened = atomic_load_explicit(&m->connections_opened, memory_order_relaxed);
+  uint64_t closed = atomic_load_explicit(&m->connections_closed, memory_order_relaxed);
+
+  if (0 > evbuffer_add_printf(out,
+                              "# HELP proxy_bytes_total Bytes relayed; a2c from clients to upstreams, c2a back.\n"
+                              "# TYPE proxy_bytes_total counter\n"
+                              "proxy_bytes_total{direction=\"a2c\"} %lu\n"
+                              "proxy_bytes_total{direction=\"c2a\"} %lu\n",
+                              (unsigned long) atomic_load_explicit(&m->bytes_a2c, memory_order_relaxed),
+                              (unsigned long) atomic_load_explicit(&m->bytes_c2a, memory_order_relaxed)) ||
+      SUCCESS != _render_counter(out, "proxy_connections_total", "Client connections accepted.", "counter",
+                                 opened) ||
+      SUCCESS != _render_counter(out, "proxy_connections_active", "Client connections being relayed.", "gauge",
+                                 _gauge(opened, closed)) ||
+      SUCCESS != _render_counter(out, "proxy_upstream_connect_failures_total", "Failed upstream connects.",
+                                 "counter", atomic_load_explicit(&m->connect_failures, memory_order_relaxed)) ||
+      SUCCESS != _render_labeled(out, "proxy_timeouts_total",
+                                 "Timeouts by kind; all but connect close the connection.",
+                                 "kind", timeouts, m->timeouts, METRICS_TIMEOUTS) ||
+      SUCCESS != _render_labeled(out, "proxy_connections_rejected_total",
+                                 "Clients turned away on accept, by the limit they hit.",
+                                 "reason", rejections, m->rejected, METRICS_REJECTS) ||
+      SUCCESS != _render_counter(out, "proxy_udp_datagrams_dropped_total",
+                                 "UDP datagrams dropped: too long, no room for their flow, or a full socket.",
+                                 "counter", atomic_load_explicit(&m->datagrams_dropped, memory_order_relaxed)) ||
+      SUCCESS != _render_labeled(out, "proxy_tls_handshakes_total", "TLS handshakes with clients, by result.",
+                                 "result", handshakes, m->tls_handshakes, METRICS_TLS_RESULTS) ||
+      SUCCESS != _render_counter(out, "proxy_tls_offloaded_total",
+                                 "TLS connections whose crypto the kernel took over (kTLS).",
+                                 "counter", atomic_load_explicit(&m->tls_offloaded, memory_order_relaxed)) ||
+      SUCCESS != _render_counter(out, "proxy_http_requests_total", "HTTP requests relayed.",
+                                 "counter", atomic_load_explicit(&m->http_requests, memory_order_relaxed)) ||
+      SUCCESS != _render_counter(out, "proxy_http_upstream_kept_total",
+                                 "Upstream connections kept alive after a response, for the next request.",
+                                 "counter", atomic_load_explicit(&m->http_kept, memory_order_relaxed)) ||
+      SUCCESS != _render_labeled(out, "proxy_http_cache_lookups_total",
+                                 "Lookups in the HTTP response cache, by result; coalesced ones waited for a miss.",
+                                 "result", lookups, m->http_cache, METRICS_CACHE_RESULTS) ||
+      SUCCESS != _render_counter(out, "proxy_http_cache_bytes", "Bytes of responses held in the HTTP cache.",
+                                 "gauge", _gauge(atomic_load_explicit(&m->http_cache_stored, memory_order_relaxed),
+                                                 atomic_load_explicit(&m->http_cache_removed, memory_order_relaxed))) ||
+      SUCCESS != _render_counter(out, "proxy_http_cache_objects", "Responses held in the HTTP cache.",
+                                 "gauge",
+                                 _gauge(atomic_load_explicit(&m->http_cache_objects_stored, memory_order_relaxed),
+                                        atomic_load_explicit(&m->http_cache_objects_removed, memory_order_relaxed))) ||
+      SUCCESS != _render_histogram(out, "proxy_upstream_resolve_seconds",
+                                   "Time from looking an upstream up to having its address; 0 on a cache hit.",
+                                   &m->resolve_time) ||
+      SUCCESS != _render_histogram(out, "proxy_upstream_connect_seconds",
+                                   "Time from starting an upstream connect to the upstream accepting it.",
+                                   &m->connect_time) ||
+      SUCCESS != _render_histogram(out, "proxy_upstream_first_byte_seconds",
+                                   "Time from an upstream connecting, or being sent the client's first byte "
+                                   "if later, to its first byte back.",
+                                   &m->first_byte_time) ||
+      SUCCESS != _render_histogram(out, "proxy_connection_duration_seconds",
+                                   "Time from accepting a client to closing its relay.",
+                                   &m->lifetime)) {
+    return ERR_METRICS_RENDER;
+  }
+  return SUCCESS;
+}
+
+void metrics_report(const metrics *m, int worker_id) {
+
+  uint64_t opened = atomic_load_explicit(&m->connections_opened, memory_order_relaxed);
+  uint64_t closed = atomic_load_explicit(&m->connections_closed, memory_order_relaxed);
+
+  uint64_t timeouts = 0;
+  uint64_t rejected = 0;
+  int i = 0;
+
+  for (i = 0; i < METRICS_TIMEOUTS; i++) {
+    timeouts += atomic_load_explicit(&m->timeouts[i], memory_order_relaxed);
+  }
+  for (i = 0; i < METRICS_REJECTS; i++) {
+    rejected += atomic_load_explicit(&m->rejected[i], memory_order_relaxed);
+  }
+
+  log_info("worker %d metrics: %lu connections, %lu rejected, %lu active, %lu connect failures, %lu timeouts, "
+           "%lu bytes a2c, %lu bytes c2a, resolve p50 %luus p99 %luus, connect p50 %luus p99 %luus, "
+           "first byte p50 %luus p99 %luus, lifetime p50 %luus p99 %luus",
+           worker_id,
+           (unsigned long) opened,
+           (unsigned long) rejected,
+           (unsigned long) _gauge(opened, closed),
+           (unsigned long) atomic_load_explicit(&m->connect_failures, memory_order_relaxed),
+           (unsigned long) timeouts,
+           (unsigned long) atomic_load_explicit(&m->bytes_a2c, memory_order_relaxed),
+           (unsigned long) atomic_load_explicit(&m->bytes_c2a, memory_order_relaxed),
+           (unsigned long) metrics_quantile(&m->resolve_time, 0.5),
+           (unsigned long) metrics_quantile(&m->resolve_time, 0.99),
+           (unsigned long) metrics_quantile(&m->connect_time, 0.5),
+           (unsigned long) metrics_quantile(&m->connect_time, 0.99),
+           (unsigned long) metrics_quantile(&m->first_byte_time, 0.5),
+           (unsigned long) metrics_quantile(&m->first_byte_time, 0.99),
+           (unsigned long) metrics_quantile(&m->lifetime, 0.5),
+           (unsigned long) metrics_quantile(&m->lifetime, 0.99));
+}
+
+// -- PRIVATE --
+
+static int _bucket(uint64_t value) {
+
+  int bits = 0;
+
+  if (value >= (1ULL << METRICS_MAX_BITS)) {
+    value = (1ULL << METRICS_MAX_BITS) - 1;
+  }
+  if (value < METRICS_SUB_BUCKETS) {
+    return (int) value;
+  }
+
+  bits = 63 - __builtin_clzll(value);  // position of the highest set bit
+  return (bits - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+         (int) ((value >> (bits - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+static uint64_t _bucket_max(int bucket) {
+
+  int bits = 0;
+  int sub = 0;
+
+  if (METRICS_BUCKETS - 1 <= bucket) {
+    return (1ULL << METRICS_MAX_BITS) - 1;
+  }
+  if (METRICS_SUB_BUCKETS > ++bucket) {
+    return bucket - 1;
+  }
+
+  // one below the smallest value of the next bucket
+  bits = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+  sub = bucket % METRICS_SUB_BUCKETS;
+  return ((uint64_t) (METRICS_SUB_BUCKETS + sub) << (bits - METRICS_SUB_BITS)) - 1;
+}
+
+static int _render_counter(struct evbuffer *out, const char *name, const char *help, const char *type,
+                           uint64_t value) {
+  if (0 > evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n",
+                              name, help, name, type, name, (unsigned long) value)) {
+    return ERR_METRICS_RENDER;
+  }
+  return SUCCESS;
+}
+
+static uint64_t _gauge(uint64_t added, uint64_t removed) {
+  return added > removed ? added - removed : 0;
+}
+
+static int _render_labeled(struct evbuffer *out, const char *name, const char *help, const char *label,
+                           const char **values, const _Atomic uint64_t *counters, int n) {
+
+  int i = 0;
+
+  if (0 > evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name)) {
+    return ERR_METRICS_RENDER;
+  }
+  for (i = 0; i < n; i++) {
+    if (0 > evbuffer_add_printf(out, "%s{%s=\"%s\"} %lu\n", name, label, values[i],
+                                (unsigned long) atomic_load_explicit(&counters[i], memory_order_relaxed))) {
+      return ERR_METRICS_RENDER;
+    }
+  }
+  return SUCCESS;
+}
+
+static int _render_histogram(struct evbuffer *out, const char *name, const char *help,
+                             const metrics_histogram *h) {
+
+  uint64_t cumulative = 0;
+  int bucket = 0;
+  int bits = 0;
+
+  if (0 > evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name)) {
+    return ERR_METRICS_RENDER;
+  }
+
+  // counts of values below each power of two; the fine buckets never straddle one. le is
+  // inclusive, so the bound is the largest value counted, one below the power of two
+  for (bits = METRICS_RENDER_MIN_BITS; bits <= METRICS_RENDER_MAX_BITS; bits++) {
+    for (; bucket < METRICS_BUCKETS && _bucket_max(bucket) < (1ULL << bits); bucket++) {
+      cumulative += atomic_load_explicit(&h->buckets[bucket], memory_order_relaxed);
+    }
+    if (0 > evbuffer_add_printf(out, "%s_bucket{le=\"%.6f\"} %lu\n",
+                                name, (double) ((1ULL << bits) - 1) / 1e6, (unsigned long) cumulative)) {
+      return ERR_METRICS_RENDER;
+    }
+  }
+
+  if (0 > evbuffer_add_printf(out, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.6f\n%s_count %lu\n",
+                              name, (unsigned long) atomic_load_explicit(&h->count, memory_order_relaxed),
+                              name, (double) atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e6,
+                              name, (unsigned long) atomic_load_explicit(&h->count, memory_order_relaxed))) {
+    return ERR_METRICS_RENDER;
+  }
+  return SUCCESS;
+}
@@ -0,0 +1,129 @@
+/* metrics.h
+ *
+ * Per-worker counters and latency histograms, merged and rendered in the Prometheus
+ * text format when scraped.
+ */
+#ifndef metrics_h
+#define metrics_h
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <event2/buffer.h>
+#include "defs.h"
+
+// histograms keep 2^METRICS_SUB_BITS buckets per power of two, i.e. within 12.5%
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 40  // microseconds, about 12 days; longer values land in the last bucket
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+typedef struct metrics_struct metrics;
+
+/* Timeouts that close a connection, counted by kind. */
+typedef enum {
+  METRICS_TIMEOUT_CONNECT,  // the upstream did not accept in time
+  METRICS_TIMEOUT_IDLE,  // nothing was relayed either way
+  METRICS_TIMEOUT_READ,  // a side that was being read from sent nothing
+  METRICS_TIMEOUT_WRITE,  // a side did not take what was queued for it
+  METRICS_TIMEOUT_LIFETIME,  // the connection outlived its limit
+  METRICS_TIMEOUTS
+} metrics_timeout;
+
+/* Clients turned away on accept, counted by reason. */
+typedef enum {
+  METRICS_REJECT_CONNS,  // their address had too many connections open
+  METRICS_REJECT_RATE,  // their address opened connections too fast
+  METRICS_REJECT_TABLE,  // every address sharing its slots in the table had connections open
+  METRICS_REJECTS
+} metrics_reject;
+
+/* TLS handshakes with clients, counted by how they went. */
+typedef enum {
+  METRICS_TLS_FULL,  // a new session was negotiated
+  METRICS_TLS_RESUMED,  // an earlier one was resumed, by session ID or ticket
+  METRICS_TLS_FAILED,  // the handshake failed, or the client went away during it
+  METRICS_TLS_RESULTS
+} metrics_tls;
+
+/* Lookups in the HTTP response cache, counted by result. */
+typedef enum {
+  METRICS_CACHE_HIT,  // answered from the cache
+  METRICS_CACHE_MISS,  // relayed upstream
+  METRICS_CACHE_COALESCED,  // waited for a concurrent miss on the same key
+  METRICS_CACHE_RESULTS
+} metrics_cache;
+
+/* Log-linear histogram of microsecond values, in the manner of HdrHistogram. */
+typedef struct {
+  _Atomic uint64_t buckets[METRICS_BUCKETS];
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+} metrics_histogram;
+
+/* Each worker writes only to its own metrics, so updates are plain loads and stores
+ * (relaxed atomics, without a lock prefix); the scraper reads them from another
+ * thread. Workers' metrics are allocated apart, a cache line each at least.
+ */
+struct metrics_struct {
+  _Alignas(64) _Atomic uint64_t bytes_a2c;  // from the accepted client to the upstream
+  _Atomic uint64_t bytes_c2a;  // from the upstream back to the client
+  _Atomic uint64_t connections_opened;
+  _Atomic uint64_t connections_closed;
+  _Atomic uint64_t connect_failures;  // failed upstream connects, retried or not
+  _Atomic uint64_t timeouts[METRICS_TIMEOUTS];
+  _Atomic uint64_t rejected[METRICS_REJECTS];
+  _Atomic uint64_t datagrams_dropped;  // UDP datagrams that could not be relayed
+  _Atomic uint64_t tls_handshakes[METRICS_TLS_RESULTS];
+  _Atomic uint64_t tls_offloaded;  // TLS connections whose crypto the kernel took over
+  _Atomic uint64_t http_requests;  // requests relayed with --protocol http
+  _Atomic uint64_t http_kept;  // upstream connections kept alive for another client's request
+  _Atomic uint64_t http_cache[METRICS_CACHE_RESULTS];
+  _Atomic uint64_t http_cache_stored;  // bytes of responses stored; with removed, the cache's size
+  _Atomic uint64_t http_cache_removed;  // bytes of responses evicted, expired or replaced
+  _Atomic uint64_t http_cache_objects_stored;
+  _Atomic uint64_t http_cache_objects_removed;
+  metrics_histogram resolve_time;  // from looking the upstream up to having its address
+  metrics_histogram connect_time;  // from starting a connect to the upstream accepting it
+  metrics_histogram first_byte_time;  // from the upstream having a request to its first byte back
+  metrics_histogram lifetime;  // from accepting a client to closing its relay
+};
+
+/* Adds to a counter owned by the calling thread. */
+static inline void metrics_add(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+/* Creates zeroed metrics for one worker.
+ *
+ * @return the metrics, or NULL on error.
+ */
+metrics *metrics_new(void);
+
+void metrics_free(metrics *m);
+
+/* Records a value, in microseconds, from the thread that owns the histogram. */
+void metrics_observe(metrics_histogram *h, uint64_t value);
+
+/* Returns monotonic microseconds. */
+uint64_t metrics_now(void);
+
+/* Adds src, which may be being updated by its worker, into dst. */
+void metrics_merge(metrics *dst, const metrics *src);
+
+/* Adds src, which may be being updated by its owner, into dst. */
+void metrics_histogram_merge(metrics_histogram *dst, const metrics_histogram *src);
+
+/* Returns the upper bound, in microseconds, of the bucket holding the given quantile. */
+uint64_t metrics_quantile(const metrics_histogram *h, double q);
+
+/* Appends m in the Prometheus text exposition format.
+ *
+ * @return success or error codes.
+ */
+int metrics_render(const metrics *m, struct evbuffer *out);
+
+/* Logs the counters and the median and tail latencies. */
+void metrics_report(const metrics *m, int worker_id);
+
+#endif /* metrics_h */
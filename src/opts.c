@@ -0,0 +1,89 @@
+/* opts.c
+ *
+ * Runtime options for the proxy, filled in by the CLI.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "config.h"
+#include "opts.h"
+
+// -- PUBLIC --
+
+void proxy_opts_init(proxy_opts *opts) {
+  memset(opts, 0, sizeof(proxy_opts));
+  strncpy(opts->listen_addr, DEFAULT_LISTEN_ADDR, sizeof(opts->listen_addr) - 1);
+  strncpy(opts->listen_port, DEFAULT_LISTEN_PORT, sizeof(opts->listen_port) - 1);
+  strncpy(opts->upstreams[0].addr, DEFAULT_UP_ADDR, sizeof(opts->upstreams[0].addr) - 1);
+  strncpy(opts->upstreams[0].port, DEFAULT_UP_PORT, sizeof(opts->upstreams[0].port) - 1);
+  backend_strategy_parse(LB_STRATEGY, &opts->strategy);
+  opts->workers = WORKERS;
+  opts->backlog = LISTEN_BACKLOG;
+  opts->connect_timeout_ms = CONNECT_TIMEOUT_MS;
+  opts->idle_timeout_ms = IDLE_TIMEOUT_MS;
+  opts->read_timeout_ms = READ_TIMEOUT_MS;
+  opts->write_timeout_ms = WRITE_TIMEOUT_MS;
+  opts->lifetime_ms = LIFETIME_MS;
+  opts->health_interval_ms = HEALTH_INTERVAL_MS;
+  opts->pool_min = POOL_MIN;
+  opts->pool_max = POOL_MAX;
+  opts->splice = RELAY_SPLICE;
+  opts->uring = IO_URING;
+  opts->buffer_high = BUFFER_HIGH_WM;
+  opts->buffer_low = BUFFER_LOW_WM;
+  opts->memory_budget = MEMORY_BUDGET;
+  opts->max_conns_per_ip = MAX_CONNS_PER_IP;
+  opts->conn_rate = CONN_RATE;
+  opts->conn_burst = CONN_BURST;
+  opts->rate_limit = RATE_LIMIT;
+  opts->global_rate_limit = GLOBAL_RATE_LIMIT;
+  opts->drain_timeout_ms = DRAIN_TIMEOUT_MS;
+  opts->udp_flow_timeout_ms = UDP_FLOW_TIMEOUT_MS;
+  opts->cache_size = HTTP_CACHE_SIZE;
+  sock_profile_init(&opts->sock);
+  opts->trace_sample = TRACE_SAMPLE;
+}
+
+int parse_host_port(const char *spec,
+                    char *host, size_t host_len,
+                    char *port, size_t port_len) {
+
+  const char *sep = NULL;
+  const char *host_start = spec;
+  size_t length = 0;
+
+  if ('[' == spec[0]) {
+    // bracketed IPv6 literal, e.g. [::1]:8080
+    if (NULL == (sep = strchr(spec, ']')) || ':' != sep[1]) {
+      return ERR_OPTS_PARSE;
+    }
+    host_start = spec + 1;
+    length = sep - host_start;
+    sep++;
+  } else {
+    if (NULL == (sep = strrchr(spec, ':'))) {
+      return ERR_OPTS_PARSE;
+    }
+    length = sep - host_start;
+  }
+
+  if (0 == length || length >= host_len || '\0' == sep[1] || strlen(sep + 1) >= port_len) {
+    return ERR_OPTS_PARSE;
+  }
+
+  memset(host, 0, host_len);
+  memcpy(host, host_start, length);
+  memset(port, 0, port_len);
+  strncpy(port, sep + 1, port_len - 1);
+  return SUCCESS;
+}
+
+int proxy_opts_workers(const proxy_opts *opts) {
+  long cores = 0;
+  if (0 < opts->workers) {
+    return opts->workers;
+  }
+  cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return 0 < cores ? (int) cores : 1;
+}
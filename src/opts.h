@@ -0,0 +1,83 @@
+/* opts.h
+ *
+ * Runtime options for the proxy, filled in by the CLI.
+ */
+#ifndef opts_h
+#define opts_h
+
+#include <stddef.h>
+#include "backend.h"  // before defs.h, which defines str
+#include "defs.h"
+#include "sockopt.h"
+
+#define OPTS_HOST_LEN 1025  // same as NI_MAXHOST
+#define OPTS_PORT_LEN 32  // same as NI_MAXSERV
+#define OPTS_MAX_UPSTREAMS 64
+#define OPTS_PATH_LEN 108  // same as sun_path
+#define OPTS_FILE_LEN 4096  // same as PATH_MAX
+
+/* A Unix socket upstream keeps its "unix:/path" (or "unix:@name") in addr, with port 0. */
+typedef struct {
+  char addr[OPTS_HOST_LEN];
+  char port[OPTS_PORT_LEN];
+} proxy_upstream;
+
+struct proxy_opts_struct {
+  char listen_addr[OPTS_HOST_LEN];
+  char listen_port[OPTS_PORT_LEN];
+  char listen_path[OPTS_PATH_LEN];  // or a Unix socket, for "unix:/path"; empty for TCP
+  proxy_upstream upstreams[OPTS_MAX_UPSTREAMS];  // the first holds the default until one is given
+  int nupstreams;
+  backend_strategy strategy;
+  int workers;  // number of event loop threads; 0 means one per online core
+  int backlog;  // pending connections the kernel queues per listener
+  int connect_timeout_ms;  // how long to wait for the upstream to accept a connection
+  int idle_timeout_ms;  // close a connection that relays nothing for this long; 0 for never
+  int read_timeout_ms;  // or whose side being read from sends nothing for this long
+  int write_timeout_ms;  // or whose queued output does not drain for this long
+  int lifetime_ms;  // or that has been open this long
+  int health_interval_ms;  // between active probes of each backend; 0 for passive checks only
+  int pool_min;  // pre-connected upstream sockets per worker; pool_max of 0 disables the pool
+  int pool_max;
+  int splice;  // relay with splice(2) where possible
+  int uring;  // accept and relay through io_uring where the kernel has it
+  size_t buffer_high;  // per-direction output cap; reading pauses above it
+  size_t buffer_low;  // reading resumes once the output drains to this
+  size_t memory_budget;  // output buffered across all connections; 0 for no limit
+  char admin_addr[OPTS_HOST_LEN];  // metrics listener; empty unless --admin is given
+  char admin_port[OPTS_PORT_LEN];
+  char admin_path[OPTS_PATH_LEN];  // or a Unix socket, for "unix:/path"
+  int max_conns_per_ip;  // connections a client address may have open; 0 for no cap
+  int conn_rate;  // new connections per second a client address may open; 0 for no limit
+  int conn_burst;  // and how many it may open at once
+  size_t rate_limit;  // bytes per second read from each side of a connection; 0 for no limit
+  size_t global_rate_limit;  // and across all connections
+  int drain_timeout_ms;  // how long SIGQUIT waits for connections to finish
+  char handoff_path[OPTS_PATH_LEN];  // Unix socket to inherit listeners from and hand them on; empty for none
+  int udp;  // relay datagrams instead of TCP connections
+  int udp_flow_timeout_ms;  // forget a client address after this long without a datagram
+  int http;  // frame HTTP/1.x requests and responses, keeping upstream connections alive between them
+  size_t cache_size;  // bytes of HTTP responses cached across workers; 0 for no cache
+  sock_profile sock;  // socket options for listeners, accepted and upstream sockets
+  int trace_sample;  // log the stages of one in this many connections; 0 for none
+  char tls_cert[OPTS_FILE_LEN];  // PEM certificate chain to terminate TLS with; empty for plain TCP
+  char tls_key[OPTS_FILE_LEN];  // and its private key; empty if it is in tls_cert
+};
+
+typedef struct proxy_opts_struct proxy_opts;
+
+/* Fills in the defaults from config.h. */
+void proxy_opts_init(proxy_opts *opts);
+
+/* Splits "host:port" (or "[v6]:port") into its parts.
+ *
+ * @return success or ERR_OPTS_PARSE.
+ */
+int parse_host_port(const char *spec,
+                    char *host, size_t host_len,
+                    char *port, size_t port_len);
+
+/* Resolves the worker count, expanding 0 to the number of online cores. */
+int proxy_opts_workers(const proxy_opts *opts);
+
+#endif /* opts_h */
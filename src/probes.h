@@ -0,0 +1,26 @@
+/* probes.h
+ *
+ * Static tracepoints (USDT) for perf and bpftrace, under the event_proxy provider. Built
+ * in where sys/sdt.h is installed; an unattached probe is a single nop.
+ *
+ *   accept(accept_fd, family)               a client was accepted
+ *   read(fd, from_client, bytes)            a bufferevent read some bytes
+ *   event(fd, what, connected)              a bufferevent connected, hit EOF, errored or timed out
+ *   close(accept_fd, lifetime_us, first_byte_us)  a relay closed; first_byte_us is -1 if
+ *                                           the upstream sent nothing
+ */
+#ifndef probes_h
+#define probes_h
+
+#include "config.h"
+
+#if TRACE_PROBES
+#include <sys/sdt.h>
+#define PROBE2(name, a, b) DTRACE_PROBE2(event_proxy, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(event_proxy, name, a, b, c)
+#else
+#define PROBE2(name, a, b) ((void) 0)
+#define PROBE3(name, a, b, c) ((void) 0)
+#endif
+
+#endif /* probes_h */
@@ -11,140 +11,474 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <netdb.h>
-#include <zlog.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <event2/event.h>
 #include <event2/bufferevent.h>
+#include <event2/thread.h>
+#include <pthread.h>
+#include "log.h"
 #include "config.h"
 #include "errors.h"
+#include "admin.h"
+#include "handoff.h"
+#include "http_cache.h"
 #include "io.h"
+#include "metrics.h"
+#include "tls.h"
+#include "worker.h"
 #include "proxy.h"
 
 // -- DECLARATIONS --
 
-/* Creates a TCP socket, binds to the given port, and starts listening. */
+/* Creates a TCP socket, binds to the given port, and starts listening; a UDP
+ * (SOCK_DGRAM) socket is only bound. With reuseport set, several sockets may be bound
+ * to the same address and the kernel spreads incoming connections across them.
+ */
 static int _init_listen_fd(const str listen_addr,
                            const str listen_port,
+                           int socktype,
+                           int reuseport,
+                           int backlog,
                            int *sock_fd);
-/* Starts an event loop with the given listening file descriptor. */
-static int _init_event_loop(int listen_fd,
-                            const str up_addr,
-                            const str up_port);
+/* Creates a Unix domain socket at path (or "@name" in the abstract namespace), replacing a
+ * stale one, and starts listening. */
+static int _init_unix_fd(const char *path, int backlog, int *sock_fd);
+/* Checks that a listener handed over by the old proxy has the socket type and address that
+ * this one was asked to listen on; a replacement started with other options must not take
+ * it over. @return success or error codes. */
+static int _check_inherited(const proxy_opts *opts, int listen_fd);
+/* Returns true if a and b are the same IPv4 or IPv6 address and port. */
+static int _same_inet(const struct sockaddr *a, const struct sockaddr *b);
+/* Creates the admin listener, if one was asked for; admin_fd is left at -1 otherwise. */
+static int _init_admin_fd(const proxy_opts *opts, int *admin_fd);
+/* Starts the workers and runs the control event loop until they have stopped. The control
+ * loop takes ownership of admin_fd and handoff_fd, either of which may be -1.
+ */
+static int _init_event_loop(worker *workers, int nworkers, int admin_fd, int handoff_fd, int drain_ms);
+/* Merges the workers' metrics for the admin listener. */
+static int _render_metrics(struct evbuffer *out, void *arg);
 
 // -- PUBLIC --
 
-int proxy(const str listen_addr,
-          const str listen_port,
-          const str up_addr,
-          const str up_port) {
+int proxy(const proxy_opts *opts) {
 
-  dzlog_debug("proxy invoked: %s:%s -> %s:%s", listen_addr, listen_port, up_addr, up_port);
+  log_debug("proxy invoked: %s:%s -> %d upstreams, %s", opts->listen_addr, opts->listen_port,
+              opts->nupstreams, backend_strategy_name(opts->strategy));
 
+  proxy_opts run = *opts;  // with workers for every inherited listener
+  int nworkers = proxy_opts_workers(opts);
+  worker *workers = NULL;
+  tls_server *tls = NULL;
+  http_cache *cache = NULL;
+  admission *admission = NULL;
+  handoff_fds inherited;
+  int handoff_peer = -1;
+  int handoff_fd = -1;
   int listen_fd = -1;
+  int admin_fd = -1;
   int rc = SUCCESS;
+  int i = 0;
 
-  // create listen file descriptor
-  if (SUCCESS != (rc = _init_listen_fd(listen_addr, listen_port, &listen_fd))) {
-    return rc;
+  // let event_base_loopexit be called across threads
+  if (0 != evthread_use_pthreads()) {
+    log_error("evthread_use_pthreads failed");
+    return ERR_EVENT_THREADS;
+  }
+
+  // a write to a peer that has gone away (a Unix socket in particular) fails with EPIPE
+  // instead of killing the proxy
+  signal(SIGPIPE, SIG_IGN);
+
+  // one context for every worker, so that they share its session cache and ticket keys
+  if ('\0' != opts->tls_cert[0] &&
+      NULL == (tls = tls_server_new(opts->tls_cert, '\0' != opts->tls_key[0] ? opts->tls_key : opts->tls_cert))) {
+    return ERR_TLS_INIT;
   }
 
-  // create event loop on given fd
-  if (SUCCESS != (rc = _init_event_loop(listen_fd, up_addr, up_port))) {
+  // and one response cache, so a response fetched by one worker is a hit on the others
+  if (0 < opts->cache_size && NULL == (cache = http_cache_new(opts->cache_size))) {
+    if (NULL != tls) {
+      tls_server_free(tls); tls = NULL;
+    }
+    return ERR_HTTP_CACHE_INIT;
+  }
+
+  // and one table of client addresses, so that their limits hold whichever worker they reach
+  if ((0 < opts->max_conns_per_ip || 0 < opts->conn_rate) &&
+      NULL == (admission = admission_new(opts->max_conns_per_ip, opts->conn_rate, opts->conn_burst, metrics_now()))) {
+    if (NULL != tls) {
+      tls_server_free(tls); tls = NULL;
+    }
+    if (NULL != cache) {
+      http_cache_free(cache); cache = NULL;
+    }
+    return ERR_CONN_DETAILS_NEW;
+  }
+
+  // a running proxy hands over its listeners, so the address is never without one
+  memset(&inherited, 0, sizeof(inherited));
+  inherited.admin_fd = -1;
+  if ('\0' != opts->handoff_path[0] &&
+      SUCCESS != (rc = handoff_receive(opts->handoff_path, &inherited, &handoff_peer))) {
+    if (NULL != tls) {
+      tls_server_free(tls); tls = NULL;
+    }
+    if (NULL != cache) {
+      http_cache_free(cache); cache = NULL;
+    }
+    if (NULL != admission) {
+      admission_free(admission); admission = NULL;
+    }
     return rc;
   }
+  if (inherited.nlisten > nworkers) {
+    log_info("running %d workers, one per inherited listener", inherited.nlisten);
+    nworkers = inherited.nlisten;
+  }
+  run.workers = nworkers;
 
-  return SUCCESS;
+  if (NULL == (workers = calloc(nworkers, sizeof(worker)))) {
+    error("calloc workers");
+    rc = ERR_THREAD_CREATE;
+    nworkers = 0;
+  }
+
+  for (i = 0; i < nworkers; i++) {
+    workers[i].listen_fd = -1;
+  }
+
+  // one listening socket and event_base per worker; with a handoff socket, a replacement
+  // may run more workers than this proxy, so its extra listeners must be able to join
+  for (i = 0; SUCCESS == rc && i < nworkers; i++) {
+    if (i < inherited.nlisten) {
+      listen_fd = inherited.listen_fds[i];
+      inherited.listen_fds[i] = -1;
+      if (SUCCESS != (rc = _check_inherited(opts, listen_fd))) {
+        close(listen_fd);
+        break;
+      }
+    } else if ('\0' != opts->listen_path[0] && 0 < i) {
+      // Unix sockets have no SO_REUSEPORT, so the workers accept off one listener
+      if (0 > (listen_fd = dup(workers[0].listen_fd))) {
+        error("dup");
+        rc = ERR_NET_LISTEN;
+        break;
+      }
+    } else if ('\0' != opts->listen_path[0]) {
+      if (SUCCESS != (rc = _init_unix_fd(opts->listen_path, opts->backlog, &listen_fd))) {
+        break;
+      }
+    } else if (SUCCESS != (rc = _init_listen_fd(opts->listen_addr, opts->listen_port,
+                                                  opts->udp ? SOCK_DGRAM : SOCK_STREAM,
+                                                  nworkers > 1 || '\0' != opts->handoff_path[0],
+                                                  opts->backlog, &listen_fd))) {
+      break;
+    }
+    if ((0 == i || '\0' == opts->listen_path[0] || i < inherited.nlisten) &&
+        SUCCESS != sock_profile_listener(&opts->sock, listen_fd)) {
+      log_warn("socket options refused on listener %d", i);
+    }
+    if (SUCCESS != (rc = worker_init(&workers[i], i, listen_fd, &run, tls, cache, admission))) {
+      worker_free(&workers[i]);
+      break;
+    }
+  }
+  for (; i < inherited.nlisten; i++) {
+    if (0 <= inherited.listen_fds[i]) close(inherited.listen_fds[i]);
+  }
+  if (SUCCESS == rc) {
+    sock_profile_report(&opts->sock, workers[0].listen_fd);
+  }
+
+  if (SUCCESS == rc && 0 <= inherited.admin_fd && ('\0' != opts->admin_path[0] || '\0' != opts->admin_addr[0])) {
+    admin_fd = inherited.admin_fd;
+    inherited.admin_fd = -1;
+  } else if (SUCCESS == rc) {
+    rc = _init_admin_fd(opts, &admin_fd);
+  }
+  if (0 <= inherited.admin_fd) {
+    close(inherited.admin_fd); inherited.admin_fd = -1;
+  }
+
+  // take the handoff socket over from the old proxy, then let it drain
+  if (SUCCESS == rc && '\0' != opts->handoff_path[0]) {
+    rc = _init_unix_fd(opts->handoff_path, 1, &handoff_fd);
+  }
+  if (0 <= handoff_peer) {
+    if (SUCCESS == rc) {
+      handoff_ready(handoff_peer);
+    } else {
+      close(handoff_peer);  // the old proxy carries on
+    }
+    handoff_peer = -1;
+  }
+
+  // run workers and the control loop
+  if (SUCCESS == rc) {
+    rc = _init_event_loop(workers, nworkers, admin_fd, handoff_fd, opts->drain_timeout_ms);
+  } else if (0 <= admin_fd) {
+    close(admin_fd);
+  }
+
+  for (i = 0; i < nworkers; i++) {
+    worker_free(&workers[i]);
+  }
+  free(workers); workers = NULL;
+  if (NULL != tls) {
+    tls_server_free(tls); tls = NULL;
+  }
+  if (NULL != cache) {
+    http_cache_free(cache); cache = NULL;
+  }
+  if (NULL != admission) {
+    admission_free(admission); admission = NULL;
+  }
+  return rc;
 
 }
 
 // -- PRIVATE --
-static void quit_cb (int signum, short event, void *arg) {
-  struct event_base *ev_base = arg;
+
+typedef struct control_struct {
+  struct event_base *ev_base;
+  worker *workers;
+  int nworkers;
+  admin_server *admin;  // NULL without --admin
+  handoff_server *handoff;  // NULL without --handoff, and once draining
+  struct event *ev_drain;  // checks on draining workers
+  int drain_ms;
+  int draining;
+} control;
+
+/* Stops the workers and the control loop at once. */
+static void _stop(control *ctl) {
   int rc = 0;
-  dzlog_info("quitting on signal: %d, event: %d", signum, event);
-  if (0 > (rc = event_base_loopexit(ev_base, NULL))) {  // exit after all current events
-    dzlog_error("loopexit failed with rc: %d", rc);
+  int i = 0;
+  for (i = 0; i < ctl->nworkers; i++) {
+    worker_stop(&ctl->workers[i]);
+  }
+  if (0 > (rc = event_base_loopexit(ctl->ev_base, NULL))) {  // exit after all current events
+    log_error("loopexit failed with rc: %d", rc);
   }
 }
 
-static int _init_event_loop(int listen_fd,
-                            const str up_addr,
-                            const str up_port) {
+/* Has the workers stop accepting and finish their connections; the control loop exits
+ * once they all have.
+ */
+static void _drain(control *ctl) {
+  struct timeval interval = { DRAIN_CHECK_MS / 1000, (DRAIN_CHECK_MS % 1000) * 1000 };
+  int i = 0;
+  ctl->draining = 1;
+  if (NULL != ctl->handoff) {
+    handoff_server_free(ctl->handoff); ctl->handoff = NULL;
+  }
+  for (i = 0; i < ctl->nworkers; i++) {
+    worker_drain(&ctl->workers[i], ctl->drain_ms);
+  }
+  event_add(ctl->ev_drain, &interval);
+}
 
-  struct event_base *ev_base = NULL;
-  struct event *ev_listen = NULL;
-  struct event *ev_quit = NULL;
-  conn_details *conn = NULL;  // allocated struct to be shared with all upstream clients
+static void drain_cb (evutil_socket_t fd, short event, void *arg) {
+  control *ctl = arg;
+  int i = 0;
+  (void) fd;
+  (void) event;
+  for (i = 0; i < ctl->nworkers; i++) {
+    if (!worker_exited(&ctl->workers[i])) {
+      return;
+    }
+  }
+  log_info("all workers drained");
+  event_del(ctl->ev_drain);
+  event_base_loopexit(ctl->ev_base, NULL);
+}
 
-  // make descriptor non-blocking
-  if (0 != fcntl(listen_fd, F_SETFL, O_NONBLOCK)) {
-    error("fcntl");
-    return ERR_NET_FCNTL;
+static void quit_cb (int signum, short event, void *arg) {
+  control *ctl = arg;
+  log_info("quitting on signal: %d, event: %d", signum, event);
+  if (ctl->draining) {
+    _stop(ctl);  // asked twice, so stop waiting
+  } else {
+    _drain(ctl);
   }
+}
 
-  // initialize event loop
-  if (NULL == (ev_base = event_base_new())) {
-    return ERR_EVENT_BASE;
+static void term_cb (int signum, short event, void *arg) {
+  log_info("stopping on signal: %d, event: %d", signum, event);
+  _stop(arg);
+}
+
+static void _handoff_collect(handoff_fds *fds, void *arg) {
+  control *ctl = arg;
+  int i = 0;
+  for (i = 0; i < ctl->nworkers && fds->nlisten < HANDOFF_MAX_FDS - 1; i++) {
+    fds->listen_fds[fds->nlisten++] = ctl->workers[i].listen_fd;
   }
+  fds->admin_fd = NULL != ctl->admin ? ctl->admin->listen_fd : -1;
+}
 
-  // create conn_details (this transfers ownership of ev_base to conn_details)
-  if (NULL == (conn = conn_details_new(ev_base, up_addr, up_port))) {
-    event_base_free(ev_base); ev_base = NULL;
-    return ERR_CONN_DETAILS_NEW;
+static void _handoff_ready(void *arg) {
+  log_info("replacement took over the listeners, draining");
+  _drain(arg);
+}
+
+static void report_cb (int signum, short event, void *arg) {
+  control *ctl = arg;
+  int i = 0;
+  log_info("reporting on signal: %d, event: %d", signum, event);
+  for (i = 0; i < ctl->nworkers; i++) {
+    worker_report(&ctl->workers[i]);
+  }
+  if (0 < ctl->nworkers && NULL != ctl->workers[0].admission) {
+    admission_report(ctl->workers[0].admission);
+  }
+  log_info("log: %lu records dropped", log_dropped());
+}
+
+static int _render_metrics(struct evbuffer *out, void *arg) {
+
+  control *ctl = arg;
+  metrics *total = NULL;
+  int rc = SUCCESS;
+  int i = 0;
+
+  if (NULL == (total = metrics_new())) {
+    return ERR_METRICS_RENDER;
+  }
+  for (i = 0; i < ctl->nworkers; i++) {
+    metrics_merge(total, ctl->workers[i].metrics);
+  }
+
+  if (SUCCESS == (rc = metrics_render(total, out)) &&
+      0 > evbuffer_add_printf(out,
+                              "# HELP proxy_log_dropped_total Log records dropped because a ring was full.\n"
+                              "# TYPE proxy_log_dropped_total counter\n"
+                              "proxy_log_dropped_total %lu\n",
+                              log_dropped())) {
+    rc = ERR_METRICS_RENDER;
+  }
+
+  metrics_free(total); total = NULL;
+  return rc;
+}
+
+static int _init_event_loop(worker *workers, int nworkers, int admin_fd, int handoff_fd, int drain_ms) {
+
+  control ctl;
+  struct event *ev_quit = NULL;
+  struct event *ev_term = NULL;
+  struct event *ev_report = NULL;
+  sigset_t mask, old_mask;
+  int started = 0;
+  int rc = SUCCESS;
+  int i = 0;
+
+  memset(&ctl, 0, sizeof(control));
+  ctl.workers = workers;
+  ctl.nworkers = nworkers;
+  ctl.drain_ms = drain_ms;
+
+  // the control loop handles signals (SIGQUIT to drain, SIGTERM to stop, SIGUSR1 to log
+  // statistics), the admin listener and handoffs to a replacement
+  if (NULL == (ctl.ev_base = event_base_new())) {
+    if (0 <= admin_fd) close(admin_fd);
+    if (0 <= handoff_fd) close(handoff_fd);
+    return ERR_EVENT_BASE;
   }
 
-  // create a new event (EV_PERSIST means add the event back to the select set after firing)
-  // EV_READ means it's a read event
-  // the last argument is passed along to the callback
-  if (NULL == (ev_listen = event_new(ev_base, listen_fd, EV_READ|EV_PERSIST, do_accept, conn))) {
-    event_base_free(ev_base); ev_base = NULL;
-    conn_details_free(conn); conn = NULL;
+  if (0 <= admin_fd && NULL == (ctl.admin = admin_new(ctl.ev_base, admin_fd, _render_metrics, &ctl))) {
+    if (0 <= handoff_fd) close(handoff_fd);
+    event_base_free(ctl.ev_base); ctl.ev_base = NULL;
     return ERR_EVENT_NEW;
   }
 
-  if (0 != event_add(ev_listen, NULL)) { // NULL means no timeout
-    event_base_free(ev_base); ev_base = NULL;
-    conn_details_free(conn); conn = NULL;
-    event_free(ev_listen); ev_listen = NULL;
-    return ERR_EVENT_ADD;
+  if (0 <= handoff_fd &&
+      NULL == (ctl.handoff = handoff_server_new(ctl.ev_base, handoff_fd, _handoff_collect, _handoff_ready, &ctl))) {
+    if (NULL != ctl.admin) admin_free(ctl.admin);
+    event_base_free(ctl.ev_base); ctl.ev_base = NULL;
+    return ERR_EVENT_NEW;
   }
 
-  if (NULL == (ev_quit = evsignal_new(ev_base, SIGQUIT, quit_cb, ev_base))) {
-    event_base_free(ev_base); ev_base = NULL;
-    conn_details_free(conn); conn = NULL;
-    event_free(ev_listen); ev_listen = NULL;
+  if (NULL == (ev_quit = evsignal_new(ctl.ev_base, SIGQUIT, quit_cb, &ctl))) {
+    if (NULL != ctl.handoff) handoff_server_free(ctl.handoff);
+    if (NULL != ctl.admin) admin_free(ctl.admin);
+    event_base_free(ctl.ev_base); ctl.ev_base = NULL;
     return ERR_EVENT_NEW;
   }
 
   if (0 != event_add(ev_quit, NULL)) { // NULL means no timeout
-    event_base_free(ev_base); ev_base = NULL;
-    conn_details_free(conn); conn = NULL;
-    event_free(ev_listen); ev_listen = NULL;
     event_free(ev_quit); ev_quit = NULL;
+    if (NULL != ctl.handoff) handoff_server_free(ctl.handoff);
+    if (NULL != ctl.admin) admin_free(ctl.admin);
+    event_base_free(ctl.ev_base); ctl.ev_base = NULL;
     return ERR_EVENT_ADD;
   }
 
-  dzlog_info("constructed event objects");
-
-  dzlog_info("dispatching event loop");
-  if (0 != event_base_dispatch(ev_base)) { // start loop; blocks
-    event_base_free(ev_base); ev_base = NULL;
-    conn_details_free(conn); conn = NULL;
-    event_free(ev_listen); ev_listen = NULL;
+  if (NULL == (ev_report = evsignal_new(ctl.ev_base, SIGUSR1, report_cb, &ctl)) ||
+      0 != event_add(ev_report, NULL) ||
+      NULL == (ev_term = evsignal_new(ctl.ev_base, SIGTERM, term_cb, &ctl)) ||
+      0 != event_add(ev_term, NULL) ||
+      NULL == (ctl.ev_drain = event_new(ctl.ev_base, -1, EV_PERSIST, drain_cb, &ctl))) {
+    if (NULL != ev_term) event_free(ev_term);
+    if (NULL != ev_report) event_free(ev_report);
     event_free(ev_quit); ev_quit = NULL;
-    return ERR_EVENT_DISPATCH;
+    if (NULL != ctl.handoff) handoff_server_free(ctl.handoff);
+    if (NULL != ctl.admin) admin_free(ctl.admin);
+    event_base_free(ctl.ev_base); ctl.ev_base = NULL;
+    return ERR_EVENT_ADD;
   }
 
-  dzlog_info("event loop exited");
-  event_base_free(ev_base);
-  conn_details_free(conn);
-  event_free(ev_listen);
-  event_free(ev_quit);
-  return SUCCESS;
+  // workers inherit a blocked signal mask, so signals are delivered to this thread
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  for (started = 0; started < nworkers; started++) {
+    if (SUCCESS != (rc = worker_start(&workers[started]))) {
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  log_info("started %d workers", started);
+
+  if (SUCCESS == rc) {
+    log_info("dispatching control loop");
+    if (0 != event_base_dispatch(ctl.ev_base)) { // start loop; blocks
+      rc = ERR_EVENT_DISPATCH;
+    }
+    log_info("control loop exited");
+  }
+
+  // make sure every worker is stopped, even if the control loop failed
+  for (i = 0; i < started; i++) {
+    worker_stop(&workers[i]);
+  }
+  for (i = 0; i < started; i++) {
+    int worker_rc = worker_join(&workers[i]);
+    if (SUCCESS == rc) {
+      rc = worker_rc;
+    }
+  }
+
+  if (NULL != ctl.handoff) {
+    handoff_server_free(ctl.handoff); ctl.handoff = NULL;
+  }
+  if (NULL != ctl.admin) {
+    admin_free(ctl.admin); ctl.admin = NULL;
+  }
+  event_free(ctl.ev_drain); ctl.ev_drain = NULL;
+  event_free(ev_term); ev_term = NULL;
+  event_free(ev_report); ev_report = NULL;
+  event_free(ev_quit); ev_quit = NULL;
+  event_base_free(ctl.ev_base); ctl.ev_base = NULL;
+  return rc;
 }
 
 static int _init_listen_fd(const str listen_addr,
                            const str listen_port,
+                           int socktype,
+                           int reuseport,
+                           int backlog,
                            int *sock_fd) {
 
   char printable[BUFFER_LEN];
@@ -155,16 +489,16 @@ static int _init_listen_fd(const str listen_addr,
   struct addrinfo *p = NULL;
 
   memset(printable, 0, BUFFER_LEN);
-  dzlog_debug("_init_sock_fd invoked: %s:%s", listen_addr, listen_port);
+  log_debug("_init_sock_fd invoked: %s:%s", listen_addr, listen_port);
 
   // first, do a DNS lookup (which also works with IP addresses) to construct addrinfo
-  inet_hints(&hints);
+  inet_hints(&hints, socktype);
   if (0 != getaddrinfo(listen_addr, listen_port, &hints, &servinfo)) {  // modern way, instead of gethostinfo and htons
     error("getaddrinfo");
     return ERR_NET_HOST;
   }
 
-  dzlog_debug("getaddrinfo returned.");
+  log_debug("getaddrinfo returned.");
 
   // keep trying until we find an address we can use
   for (p = servinfo; NULL != p; p = p->ai_next) {
@@ -178,6 +512,13 @@ static int _init_listen_fd(const str listen_addr,
     // reuse recently used addresses
     setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 
+    // share the address with the other workers' listeners
+    if (reuseport && 0 != setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))) {
+      error("setsockopt SO_REUSEPORT");
+      close(listen_fd);
+      continue;
+    }
+
     // bind to address and port
     if (0 != bind(listen_fd, p->ai_addr, p->ai_addrlen)) {
       close(listen_fd);
@@ -186,7 +527,7 @@ static int _init_listen_fd(const str listen_addr,
 
     // "network to presentation"
     inet_ntop_addrinfo(p, printable, BUFFER_LEN);
-    dzlog_info("bound socket to %s:%s", printable, listen_port);
+    log_info("bound socket to %s:%s", printable, listen_port);
     break;
   }
 
@@ -202,12 +543,132 @@ static int _init_listen_fd(const str listen_addr,
     return ERR_NET_BIND;
   }
 
-  if (0 != listen(listen_fd, LISTEN_BACKLOG)) {
+  // datagrams are read off the bound socket
+  if (SOCK_STREAM == socktype && 0 != listen(listen_fd, backlog)) {
     error("listen");
+    close(listen_fd);
     return ERR_NET_LISTEN;
   }
 
-  dzlog_info("listening on fd %u", listen_fd);
+  log_info("listening on fd %u", listen_fd);
   *sock_fd = listen_fd;
   return SUCCESS;
 }
+
+static int _init_unix_fd(const char *path, int backlog, int *sock_fd) {
+
+  struct sockaddr_un addr;
+  socklen_t addr_len = unix_sockaddr(path, &addr);
+  int listen_fd = -1;
+
+  if (0 > (listen_fd = socket(AF_UNIX, SOCK_STREAM, 0))) {
+    error("socket");
+    return ERR_NET_BIND;
+  }
+
+  // a socket file left behind by an earlier run would make bind fail; abstract names
+  // go away with their last descriptor
+  if ('@' != path[0]) {
+    unlink(path);
+  }
+  if (0 != bind(listen_fd, (struct sockaddr *) &addr, addr_len)) {
+    error("bind");
+    close(listen_fd);
+    return ERR_NET_BIND;
+  }
+
+  if (0 != listen(listen_fd, backlog)) {
+    error("listen");
+    close(listen_fd);
+    return ERR_NET_LISTEN;
+  }
+
+  log_info("listening on %s with fd %u", path, listen_fd);
+  *sock_fd = listen_fd;
+  return SUCCESS;
+}
+
+static int _check_inherited(const proxy_opts *opts, int listen_fd) {
+
+  struct sockaddr_storage bound;
+  socklen_t bound_len = sizeof(bound);
+  const struct sockaddr_un *bound_un = (const struct sockaddr_un *) &bound;
+  struct sockaddr_un wanted;
+  socklen_t wanted_len = 0;
+  struct addrinfo hints;
+  struct addrinfo *servinfo = NULL;
+  struct addrinfo *p = NULL;
+  int socktype = opts->udp ? SOCK_DGRAM : SOCK_STREAM;
+  int type = 0;
+  socklen_t type_len = sizeof(type);
+  int match = 0;
+
+  memset(&bound, 0, sizeof(bound));
+  if (0 != getsockopt(listen_fd, SOL_SOCKET, SO_TYPE, &type, &type_len) ||
+      0 != getsockname(listen_fd, (struct sockaddr *) &bound, &bound_len)) {
+    error("inherited listener");
+    return ERR_NET_HANDOFF;
+  }
+
+  if (type != socktype) {
+    log_error("inherited a %s listener, expected %s", SOCK_DGRAM == type ? "UDP" : "stream",
+              opts->udp ? "UDP" : "stream");
+    return ERR_NET_HANDOFF;
+  }
+
+  if ('\0' != opts->listen_path[0]) {
+    // a path ends at its NUL, an abstract name where the address does
+    wanted_len = unix_sockaddr(opts->listen_path, &wanted);
+    match = AF_UNIX == bound.ss_family &&
+            ('@' == opts->listen_path[0]
+             ? bound_len == wanted_len &&
+               0 == memcmp(bound_un->sun_path, wanted.sun_path, wanted_len - offsetof(struct sockaddr_un, sun_path))
+             : 0 == strncmp(bound_un->sun_path, wanted.sun_path, sizeof(wanted.sun_path)));
+    if (!match) {
+      log_error("inherited listener is not on %s", opts->listen_path);
+    }
+    return match ? SUCCESS : ERR_NET_HANDOFF;
+  }
+
+  inet_hints(&hints, socktype);
+  if (0 != getaddrinfo(opts->listen_addr, opts->listen_port, &hints, &servinfo)) {
+    error("getaddrinfo");
+    return ERR_NET_HOST;
+  }
+  for (p = servinfo; NULL != p && !match; p = p->ai_next) {
+    match = _same_inet(p->ai_addr, (const struct sockaddr *) &bound);
+  }
+  freeaddrinfo(servinfo);
+
+  if (!match) {
+    log_error("inherited listener is not on %s:%s", opts->listen_addr, opts->listen_port);
+  }
+  return match ? SUCCESS : ERR_NET_HANDOFF;
+}
+
+static int _same_inet(const struct sockaddr *a, const struct sockaddr *b) {
+  const struct sockaddr_in *a4 = (const struct sockaddr_in *) a;
+  const struct sockaddr_in *b4 = (const struct sockaddr_in *) b;
+  const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) a;
+  const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *) b;
+
+  if (a->sa_family != b->sa_family) {
+    return 0;
+  }
+  if (AF_INET == a->sa_family) {
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  }
+  return AF_INET6 == a->sa_family && a6->sin6_port == b6->sin6_port &&
+         0 == memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+}
+
+static int _init_admin_fd(const proxy_opts *opts, int *admin_fd) {
+  *admin_fd = -1;
+  if ('\0' != opts->admin_path[0]) {
+    return _init_unix_fd(opts->admin_path, opts->backlog, admin_fd);
+  }
+  if ('\0' != opts->admin_addr[0]) {
+    return _init_listen_fd(opts->admin_addr, opts->admin_port, SOCK_STREAM, 0, opts->backlog, admin_fd);
+  }
+  return SUCCESS;
+}
@@ -5,15 +5,13 @@
 #define proxy_h
 
 #include <stdio.h>
-#include <zlog.h>
+#include "log.h"
 #include "defs.h"
+#include "opts.h"
 
 /**
- * Proxies TCP frames from listen to up.
+ * Proxies TCP frames from listen to up, using opts->workers event loops.
  */
-int proxy(const str listen_addr,
-          const str listen_port,
-          const str up_addr,
-          const str up_port);
+int proxy(const proxy_opts *opts);
 
 #endif /* proxy_h */
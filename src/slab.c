@@ -0,0 +1,101 @@
+/* slab.c
+ *
+ * Per-worker pool of fixed-size objects, carved out of slabs and recycled through a
+ * free list, for state that every connection allocates.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "slab.h"
+
+#define SLAB_ALIGN 16  // as malloc's
+
+// -- DECLARATIONS --
+
+/* Allocates another slab and puts its objects on the free list. */
+static int _grow(slab_pool *pool);
+
+// -- PUBLIC --
+
+slab_pool *slab_pool_new(const char *name, size_t size, int per_slab) {
+
+  slab_pool *pool = NULL;
+
+  if (NULL == (pool = calloc(1, sizeof(slab_pool)))) {
+    error("calloc slab_pool");
+    return NULL;
+  }
+  pool->name = name;
+  pool->size = (MAX(size, sizeof(void *)) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1);
+  pool->per_slab = per_slab;
+  return pool;
+}
+
+void slab_pool_free(slab_pool *pool) {
+  void *slab = NULL;
+  while (NULL != (slab = pool->slabs)) {
+    pool->slabs = *(void **) slab;
+    free(slab);
+  }
+  free(pool);
+}
+
+void *slab_alloc(slab_pool *pool) {
+
+  void *object = NULL;
+
+  if (NULL == pool->free && SUCCESS != _grow(pool)) {
+    return NULL;
+  }
+
+  object = pool->free;
+  pool->free = *(void **) object;
+  memset(object, 0, pool->size);
+
+  if (++pool->in_use > pool->high_water) {
+    pool->high_water = pool->in_use;
+  }
+  return object;
+}
+
+void slab_free(slab_pool *pool, void *object) {
+  *(void **) object = pool->free;
+  pool->free = object;
+  pool->in_use--;
+}
+
+void slab_pool_report(const slab_pool *pool, int worker_id) {
+  log_info("worker %d %s pool: %lu in use, high water %lu, %lu slabs of %d",
+           worker_id, pool->name, pool->in_use, pool->high_water, pool->nslabs, pool->per_slab);
+}
+
+// -- PRIVATE --
+
+static int _grow(slab_pool *pool) {
+
+  char *slab = NULL;
+  char *object = NULL;
+  int i = 0;
+
+  // the first SLAB_ALIGN bytes link the slabs together
+  if (NULL == (slab = malloc(SLAB_ALIGN + pool->size * pool->per_slab))) {
+    error("malloc slab");
+    return ERR_SLAB_ALLOC;
+  }
+  *(void **) slab = pool->slabs;
+  pool->slabs = slab;
+  pool->nslabs++;
+
+  // in address order, so that consecutive allocations are adjacent
+  for (i = pool->per_slab - 1; i >= 0; i--) {
+    object = slab + SLAB_ALIGN + pool->size * i;
+    *(void **) object = pool->free;
+    pool->free = object;
+  }
+  return SUCCESS;
+}
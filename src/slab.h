@@ -0,0 +1,46 @@
+/* slab.h
+ *
+ * Per-worker pool of fixed-size objects, carved out of slabs and recycled through a
+ * free list, for state that every connection allocates.
+ */
+#ifndef slab_h
+#define slab_h
+
+#include <stddef.h>
+#include "defs.h"
+
+typedef struct slab_pool_struct slab_pool;
+
+/* Used by one thread only. Slabs are kept until the pool is freed, so a worker holds on
+ * to enough of them for its busiest moment.
+ */
+struct slab_pool_struct {
+  const char *name;  // for reports
+  size_t size;  // of one object, rounded up to keep them aligned
+  int per_slab;
+  void *free;  // objects ready for reuse, linked through their first word
+  void *slabs;  // linked through their first word
+  unsigned long in_use;
+  unsigned long high_water;
+  unsigned long nslabs;
+};
+
+/* Creates a pool of objects of the given size, allocated per_slab at a time.
+ *
+ * @return the pool, or NULL on error.
+ */
+slab_pool *slab_pool_new(const char *name, size_t size, int per_slab);
+
+/* Frees every slab; objects still in use become invalid. */
+void slab_pool_free(slab_pool *pool);
+
+/* Returns a zeroed object, or NULL if a new slab could not be allocated. */
+void *slab_alloc(slab_pool *pool);
+
+/* Returns the object to the pool. */
+void slab_free(slab_pool *pool, void *object);
+
+/* Logs the occupancy and high-water mark. */
+void slab_pool_report(const slab_pool *pool, int worker_id);
+
+#endif /* slab_h */
@@ -0,0 +1,267 @@
+/* sockopt.c
+ *
+ * The socket options applied to listeners, accepted sockets and upstream sockets.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "sockopt.h"
+
+#define SOCKOPT_LISTENER 1
+#define SOCKOPT_ACCEPTED 2
+#define SOCKOPT_UPSTREAM 4
+#define SOCKOPT_CONNECTION (SOCKOPT_ACCEPTED | SOCKOPT_UPSTREAM)
+
+/* One option, and which sockets it goes on. */
+typedef struct {
+  const char *name;
+  int level;
+  int optname;
+  size_t field;  // offset of its value in sock_profile
+  int where;
+  int flag;  // set to 1 whenever the field is set
+  int doubled;  // the kernel reports twice what was set, for its own bookkeeping
+} sock_option;
+
+// options a platform lacks are left out, and never set
+static const sock_option _options[] = {
+  { "TCP_NODELAY", IPPROTO_TCP, TCP_NODELAY, offsetof(sock_profile, nodelay), SOCKOPT_CONNECTION, 1, 0 },
+  { "SO_RCVBUF", SOL_SOCKET, SO_RCVBUF, offsetof(sock_profile, rcvbuf), SOCKOPT_LISTENER | SOCKOPT_UPSTREAM, 0, 1 },
+  { "SO_SNDBUF", SOL_SOCKET, SO_SNDBUF, offsetof(sock_profile, sndbuf), SOCKOPT_LISTENER | SOCKOPT_UPSTREAM, 0, 1 },
+#ifdef TCP_DEFER_ACCEPT
+  { "TCP_DEFER_ACCEPT", IPPROTO_TCP, TCP_DEFER_ACCEPT, offsetof(sock_profile, defer_accept_s), SOCKOPT_LISTENER, 0, 0 },
+#endif
+#ifdef TCP_FASTOPEN
+  { "TCP_FASTOPEN", IPPROTO_TCP, TCP_FASTOPEN, offsetof(sock_profile, fastopen), SOCKOPT_LISTENER, 0, 0 },
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+  { "TCP_FASTOPEN_CONNECT", IPPROTO_TCP, TCP_FASTOPEN_CONNECT, offsetof(sock_profile, fastopen_connect),
+    SOCKOPT_UPSTREAM, 1, 0 },
+#endif
+  { "SO_KEEPALIVE", SOL_SOCKET, SO_KEEPALIVE, offsetof(sock_profile, keepalive_s), SOCKOPT_CONNECTION, 1, 0 },
+#if defined(TCP_KEEPIDLE)
+  { "TCP_KEEPIDLE", IPPROTO_TCP, TCP_KEEPIDLE, offsetof(sock_profile, keepalive_s), SOCKOPT_CONNECTION, 0, 0 },
+#elif defined(TCP_KEEPALIVE)  // macOS calls the idle time this
+  { "TCP_KEEPALIVE", IPPROTO_TCP, TCP_KEEPALIVE, offsetof(sock_profile, keepalive_s), SOCKOPT_CONNECTION, 0, 0 },
+#endif
+#ifdef TCP_KEEPINTVL
+  { "TCP_KEEPINTVL", IPPROTO_TCP, TCP_KEEPINTVL, offsetof(sock_profile, keepalive_intvl_s), SOCKOPT_CONNECTION, 0, 0 },
+#endif
+#ifdef TCP_KEEPCNT
+  { "TCP_KEEPCNT", IPPROTO_TCP, TCP_KEEPCNT, offsetof(sock_profile, keepalive_cnt), SOCKOPT_CONNECTION, 0, 0 },
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+  { "TCP_NOTSENT_LOWAT", IPPROTO_TCP, TCP_NOTSENT_LOWAT, offsetof(sock_profile, notsent_lowat), SOCKOPT_CONNECTION, 0, 0 },
+#endif
+};
+
+#define SOCKOPT_COUNT ((int) (sizeof(_options) / sizeof(_options[0])))
+
+// -- DECLARATIONS --
+
+/* Returns the value to set for the option, or 0 to leave it alone. */
+static int _value(const sock_profile *p, const sock_option *o);
+/* Sets the options meant for where. @return the number the kernel refused. */
+static int _apply(const sock_profile *p, int fd, int where, int tcp);
+/* Reads back the options meant for where, and logs them. @return the number that did not take. */
+static int _check(const sock_profile *p, int fd, int where, int tcp, const char *sockets);
+/* Tells whether fd is a TCP socket, and whether it is a stream. */
+static void _kind(int fd, int *tcp, int *stream);
+/* Parses a non-negative number up to the end or to a ':'. */
+static int _number(const char *s, const char **end, int *value);
+
+// -- PUBLIC --
+
+void sock_profile_init(sock_profile *p) {
+  memset(p, 0, sizeof(sock_profile));
+  p->nodelay = SOCK_NODELAY;
+  p->rcvbuf = SOCK_RCVBUF;
+  p->sndbuf = SOCK_SNDBUF;
+  p->defer_accept_s = SOCK_DEFER_ACCEPT_S;
+  p->fastopen = SOCK_FASTOPEN;
+  p->fastopen_connect = SOCK_FASTOPEN_CONNECT;
+  p->keepalive_s = SOCK_KEEPALIVE_S;
+  p->keepalive_intvl_s = SOCK_KEEPALIVE_INTVL_S;
+  p->keepalive_cnt = SOCK_KEEPALIVE_CNT;
+  p->notsent_lowat = SOCK_NOTSENT_LOWAT;
+}
+
+int sock_profile_parse(sock_profile *p, const char *spec) {
+
+  static const struct { const char *name; size_t field; } names[] = {
+    { "nodelay", offsetof(sock_profile, nodelay) },
+    { "rcvbuf", offsetof(sock_profile, rcvbuf) },
+    { "sndbuf", offsetof(sock_profile, sndbuf) },
+    { "defer-accept", offsetof(sock_profile, defer_accept_s) },
+    { "fastopen", offsetof(sock_profile, fastopen) },
+    { "fastopen-connect", offsetof(sock_profile, fastopen_connect) },
+    { "keepalive", offsetof(sock_profile, keepalive_s) },
+    { "notsent-lowat", offsetof(sock_profile, notsent_lowat) },
+  };
+  const char *value = strchr(spec, '=');
+  const char *end = NULL;
+  size_t length = 0;
+  int *field = NULL;
+  size_t i = 0;
+
+  if (NULL == value) {
+    return ERR_OPTS_PARSE;
+  }
+  length = (size_t) (value - spec);
+  value++;
+
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (length == strlen(names[i].name) && 0 == strncmp(spec, names[i].name, length)) {
+      field = (int *) ((char *) p + names[i].field);
+      break;
+    }
+  }
+  if (NULL == field || SUCCESS != _number(value, &end, field)) {
+    return ERR_OPTS_PARSE;
+  }
+
+  // keepalive=idle[:interval[:count]]
+  if (&p->keepalive_s == field && ':' == *end && SUCCESS != _number(end + 1, &end, &p->keepalive_intvl_s)) {
+    return ERR_OPTS_PARSE;
+  }
+  if (&p->keepalive_s == field && ':' == *end && SUCCESS != _number(end + 1, &end, &p->keepalive_cnt)) {
+    return ERR_OPTS_PARSE;
+  }
+  return '\0' == *end ? SUCCESS : ERR_OPTS_PARSE;
+}
+
+int sock_profile_listener(const sock_profile *p, int fd) {
+  int tcp = 0;
+  int stream = 0;
+  _kind(fd, &tcp, &stream);
+  if (0 < _apply(p, fd, SOCKOPT_LISTENER, tcp)) {
+    return ERR_NET_SOCKOPT;
+  }
+  return SUCCESS;
+}
+
+void sock_profile_accepted(const sock_profile *p, int fd, int family) {
+  _apply(p, fd, SOCKOPT_ACCEPTED, AF_UNIX != family);
+}
+
+void sock_profile_upstream(const sock_profile *p, int fd, int family) {
+  _apply(p, fd, SOCKOPT_UPSTREAM, AF_UNIX != family);
+}
+
+int sock_profile_report(const sock_profile *p, int listen_fd) {
+
+  int failed = 0;
+  int tcp = 0;
+  int stream = 0;
+  int fd = -1;
+
+  _kind(listen_fd, &tcp, &stream);
+  failed += _check(p, listen_fd, SOCKOPT_LISTENER, tcp, "listening");
+  if (!stream) {
+    return failed;  // datagram flows get the listener's options only
+  }
+
+  // accepted sockets get the same options as this one, less the buffers they inherit
+  if (0 > (fd = socket(AF_INET, SOCK_STREAM, 0))) {
+    error("socket");
+    return failed;
+  }
+  _apply(p, fd, SOCKOPT_UPSTREAM, 1);
+  failed += _check(p, fd, SOCKOPT_UPSTREAM, 1, "accepted and upstream");
+  close(fd);
+  return failed;
+}
+
+// -- PRIVATE --
+
+static int _value(const sock_profile *p, const sock_option *o) {
+  int value = *(const int *) ((const char *) p + o->field);
+  return o->flag && 0 != value ? 1 : value;
+}
+
+static int _apply(const sock_profile *p, int fd, int where, int tcp) {
+
+  int failed = 0;
+  int value = 0;
+  int i = 0;
+
+  for (i = 0; i < SOCKOPT_COUNT; i++) {
+    const sock_option *o = &_options[i];
+    if (0 == (o->where & where) || (!tcp && IPPROTO_TCP == o->level) || 0 == (value = _value(p, o))) {
+      continue;
+    }
+    if (0 != setsockopt(fd, o->level, o->optname, &value, sizeof(value))) {
+      failed++;
+    }
+  }
+  return failed;
+}
+
+static int _check(const sock_profile *p, int fd, int where, int tcp, const char *sockets) {
+
+  int failed = 0;
+  int value = 0;
+  int got = 0;
+  socklen_t len = sizeof(got);
+  int i = 0;
+
+  for (i = 0; i < SOCKOPT_COUNT; i++) {
+    const sock_option *o = &_options[i];
+    if (0 == (o->where & where) || (!tcp && IPPROTO_TCP == o->level) || 0 == (value = _value(p, o))) {
+      continue;
+    }
+    got = 0;
+    len = sizeof(got);
+    if (0 != getsockopt(fd, o->level, o->optname, &got, &len)) {
+      got = -errno;
+    }
+    // a deferred accept is kept as a number of SYN-ACK retransmits, and comes back rounded up
+    if (0 < got && got >= (o->doubled ? 2 * value : value)) {
+      log_info("socket option %s on %s sockets: set %d, kernel reports %d", o->name, sockets, value, got);
+    } else {
+      log_warn("socket option %s on %s sockets did not take: set %d, kernel reports %d",
+               o->name, sockets, value, got);
+      failed++;
+    }
+  }
+  return failed;
+}
+
+static void _kind(int fd, int *tcp, int *stream) {
+  int domain = 0;
+  int type = 0;
+#ifdef SO_DOMAIN
+  socklen_t len = sizeof(domain);
+  getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+#else
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  getsockname(fd, (struct sockaddr *) &addr, &len);
+  domain = addr.ss_family;
+#endif
+  len = sizeof(type);
+  getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+  *stream = SOCK_STREAM == type;
+  *tcp = *stream && AF_UNIX != domain;
+}
+
+static int _number(const char *s, const char **end, int *value) {
+  char *stop = NULL;
+  long n = strtol(s, &stop, 10);
+  if (stop == s || 0 > n || n > 0x7fffffff) {
+    return ERR_OPTS_PARSE;
+  }
+  *value = (int) n;
+  *end = stop;
+  return SUCCESS;
+}
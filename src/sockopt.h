@@ -0,0 +1,57 @@
+/* sockopt.h
+ *
+ * The socket options applied to listeners, accepted sockets and upstream sockets.
+ */
+#ifndef sockopt_h
+#define sockopt_h
+
+#include <sys/socket.h>
+#include "defs.h"
+
+/* Each option is left to the kernel's default when 0. TCP options are skipped on Unix
+ * and UDP sockets.
+ */
+typedef struct {
+  int nodelay;  // TCP_NODELAY on accepted and upstream sockets
+  int rcvbuf;  // SO_RCVBUF, on listeners (accepted sockets inherit it) and upstream sockets
+  int sndbuf;  // SO_SNDBUF, likewise
+  int defer_accept_s;  // TCP_DEFER_ACCEPT on listeners: wake up once data has arrived
+  int fastopen;  // TCP_FASTOPEN queue length on listeners
+  int fastopen_connect;  // TCP_FASTOPEN_CONNECT on upstream sockets
+  int keepalive_s;  // SO_KEEPALIVE with TCP_KEEPIDLE on accepted and upstream sockets
+  int keepalive_intvl_s;  // TCP_KEEPINTVL, with keepalive_s
+  int keepalive_cnt;  // TCP_KEEPCNT, with keepalive_s
+  int notsent_lowat;  // TCP_NOTSENT_LOWAT on accepted and upstream sockets
+} sock_profile;
+
+/* Fills in the defaults from config.h. */
+void sock_profile_init(sock_profile *p);
+
+/* Sets one option from "name=value", e.g. "nodelay=0", "rcvbuf=262144" or
+ * "keepalive=60:10:5" (idle, interval and count).
+ *
+ * @return success or ERR_OPTS_PARSE.
+ */
+int sock_profile_parse(sock_profile *p, const char *spec);
+
+/* Applies the listener options to fd, which may be a TCP, UDP or Unix listener.
+ *
+ * @return success, or ERR_NET_SOCKOPT if an option was refused.
+ */
+int sock_profile_listener(const sock_profile *p, int fd);
+
+/* Applies the per-connection options to a freshly accepted socket. */
+void sock_profile_accepted(const sock_profile *p, int fd, int family);
+
+/* Applies the per-connection options to an upstream socket, before it connects. */
+void sock_profile_upstream(const sock_profile *p, int fd, int family);
+
+/* Reads the options back from listen_fd and, for a stream listener, from a probe TCP
+ * socket, and logs what the kernel made of each one that is set; options that did not
+ * take are logged as warnings.
+ *
+ * @return the number of options that did not take.
+ */
+int sock_profile_report(const sock_profile *p, int listen_fd);
+
+#endif /* sockopt_h */
@@ -0,0 +1,333 @@
+/* splice.c
+ *
+ * Zero-copy relay between two connected sockets, using splice(2) through a pipe
+ * per direction so that proxied bytes never enter user space.
+ *
+ * Each direction moves bytes from its source socket into its pipe, and from the
+ * pipe into its destination socket. A direction only reads while its pipe is empty,
+ * so a slow receiver holds back the sender with at most one pipe's worth in flight.
+ * EOF on a source is passed on as a shutdown(SHUT_WR) once the pipe is flushed.
+ */
+
+#define _GNU_SOURCE  // splice
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "splice.h"
+
+#ifdef __linux__
+
+typedef struct splice_dir_struct {
+  int in_fd;  // pointers without ownership
+  int out_fd;
+  int pipe_fds[2];
+  size_t buffered;  // bytes sitting in the pipe
+  _Atomic uint64_t *relayed;  // the worker's byte counter for this direction
+  uint64_t *first_byte;  // stamped when the first byte goes out; may be NULL
+  int eof;  // in_fd has nothing more to say
+  int done;  // eof, and out_fd has been shut down for writing
+  struct event *ev_in;
+  struct event *ev_out;
+  splice_relay *relay;
+} splice_dir;
+
+struct splice_relay_struct {
+  int accept_fd;
+  int client_fd;
+  int moved;  // at least one byte went through
+  uint64_t bytes;  // relayed in both directions
+  splice_dir a2c;
+  splice_dir c2a;
+  splice_fallback_cb fallback;
+  splice_closed_cb closed;
+  void *arg;
+};
+
+// -- DECLARATIONS --
+
+static int _dir_init(struct event_base *ev_base, splice_dir *dir, splice_relay *relay, int in_fd, int out_fd,
+                     _Atomic uint64_t *relayed);
+static void _dir_free(splice_dir *dir);
+/* Moves bytes from in_fd into the pipe. */
+static int _fill(splice_dir *dir);
+/* Moves bytes from the pipe into out_fd. */
+static int _flush(splice_dir *dir);
+/* Frees the relay; closes both sockets unless they are handed back. */
+static void _relay_close(splice_relay *relay, int close_fds);
+static void _dir_cb(evutil_socket_t fd, short what, void *arg);
+
+// -- PUBLIC --
+
+int splice_supported(void) {
+  return 1;
+}
+
+splice_relay *splice_relay_new(struct event_base *ev_base,
+                               int accept_fd,
+                               int client_fd,
+                               metrics *metrics,
+                               splice_fallback_cb fallback,
+                               splice_closed_cb closed,
+                               void *arg) {
+
+  splice_relay *relay = NULL;
+
+  if (NULL == (relay = calloc(1, sizeof(splice_relay)))) {
+    error("calloc splice_relay");
+    return NULL;
+  }
+  relay->accept_fd = accept_fd;
+  relay->client_fd = client_fd;
+  relay->fallback = fallback;
+  relay->closed = closed;
+  relay->arg = arg;
+  relay->a2c.pipe_fds[0] = relay->a2c.pipe_fds[1] = -1;
+  relay->c2a.pipe_fds[0] = relay->c2a.pipe_fds[1] = -1;
+
+  if (SUCCESS != _dir_init(ev_base, &relay->a2c, relay, accept_fd, client_fd, &metrics->bytes_a2c) ||
+      SUCCESS != _dir_init(ev_base, &relay->c2a, relay, client_fd, accept_fd, &metrics->bytes_c2a)) {
+    splice_relay_free(relay);
+    return NULL;
+  }
+
+  return relay;
+}
+
+int splice_relay_start(splice_relay *relay) {
+  if (0 != event_add(relay->a2c.ev_in, NULL) || 0 != event_add(relay->c2a.ev_in, NULL)) {
+    _relay_close(relay, 1);
+    return ERR_EVENT_ADD;
+  }
+  return SUCCESS;
+}
+
+uint64_t splice_relay_bytes(const splice_relay *relay) {
+  return relay->bytes;
+}
+
+void splice_relay_trace(splice_relay *relay, uint64_t *a2c_first, uint64_t *c2a_first) {
+  relay->a2c.first_byte = a2c_first;
+  relay->c2a.first_byte = c2a_first;
+}
+
+void splice_relay_close(splice_relay *relay) {
+  _relay_close(relay, 1);
+}
+
+void splice_relay_free(splice_relay *relay) {
+  _dir_free(&relay->a2c);
+  _dir_free(&relay->c2a);
+  free(relay);
+}
+
+// -- PRIVATE --
+
+static int _dir_init(struct event_base *ev_base, splice_dir *dir, splice_relay *relay, int in_fd, int out_fd,
+                     _Atomic uint64_t *relayed) {
+
+  dir->in_fd = in_fd;
+  dir->out_fd = out_fd;
+  dir->relay = relay;
+  dir->relayed = relayed;
+
+  if (0 != pipe2(dir->pipe_fds, O_NONBLOCK | O_CLOEXEC)) {
+    error("pipe2");
+    dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+    return ERR_NET_SPLICE;
+  }
+
+  if (NULL == (dir->ev_in = event_new(ev_base, in_fd, EV_READ | EV_PERSIST, _dir_cb, dir)) ||
+      NULL == (dir->ev_out = event_new(ev_base, out_fd, EV_WRITE | EV_PERSIST, _dir_cb, dir))) {
+    return ERR_EVENT_NEW;
+  }
+
+  return SUCCESS;
+}
+
+static void _dir_free(splice_dir *dir) {
+  if (NULL != dir->ev_in) {
+    event_free(dir->ev_in); dir->ev_in = NULL;
+  }
+  if (NULL != dir->ev_out) {
+    event_free(dir->ev_out); dir->ev_out = NULL;
+  }
+  if (0 <= dir->pipe_fds[0]) {
+    close(dir->pipe_fds[0]); dir->pipe_fds[0] = -1;
+  }
+  if (0 <= dir->pipe_fds[1]) {
+    close(dir->pipe_fds[1]); dir->pipe_fds[1] = -1;
+  }
+}
+
+static int _fill(splice_dir *dir) {
+
+  ssize_t n = splice(dir->in_fd, NULL, dir->pipe_fds[1], NULL, SPLICE_LEN,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  if (0 < n) {
+    dir->buffered += n;
+    dir->relay->moved = 1;
+  } else if (0 == n) {
+    dir->eof = 1;
+  } else if (EAGAIN != errno && EWOULDBLOCK != errno) {
+    return ERR_NET_SPLICE;
+  }
+
+  return SUCCESS;
+}
+
+static int _flush(splice_dir *dir) {
+
+  ssize_t n = 0;
+
+  while (0 < dir->buffered) {
+    n = splice(dir->pipe_fds[0], NULL, dir->out_fd, NULL, dir->buffered,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (0 < n) {
+      dir->buffered -= n;
+      dir->relay->bytes += n;
+      metrics_add(dir->relayed, n);
+      if (NULL != dir->first_byte && 0 == *dir->first_byte) {
+        *dir->first_byte = metrics_now();
+      }
+    } else if (0 > n && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+      break;  // out_fd is full; wait for EV_WRITE
+    } else {
+      return ERR_NET_SPLICE;
+    }
+  }
+
+  return SUCCESS;
+}
+
+static void _relay_close(splice_relay *relay, int close_fds) {
+  splice_closed_cb closed = relay->closed;
+  void *arg = relay->arg;
+
+  if (close_fds) {
+    close(relay->accept_fd);
+    close(relay->client_fd);
+  }
+  log_debug("splice relay on fds %u and %u closed", relay->accept_fd, relay->client_fd);
+  splice_relay_free(relay);
+
+  if (close_fds && NULL != closed) {
+    closed(arg);
+  }
+}
+
+static void _dir_cb(evutil_socket_t fd, short what, void *arg) {
+
+  splice_dir *dir = arg;
+  splice_relay *relay = dir->relay;
+  int rc = SUCCESS;
+
+  (void) fd;
+
+  if (what & EV_READ) {
+    rc = _fill(dir);
+  }
+  if (SUCCESS == rc) {
+    rc = _flush(dir);
+  }
+
+  if (SUCCESS != rc) {
+    if (EINVAL == errno && !relay->moved && NULL != relay->fallback) {
+      // these sockets cannot be spliced; nothing was consumed, so hand them back
+      splice_fallback_cb fallback = relay->fallback;
+      int accept_fd = relay->accept_fd;
+      int client_fd = relay->client_fd;
+      void *fallback_arg = relay->arg;
+      log_info("splice unsupported on fds %u and %u, falling back", accept_fd, client_fd);
+      _relay_close(relay, 0);
+      fallback(accept_fd, client_fd, fallback_arg);
+      return;
+    }
+    if (EPIPE != errno && ECONNRESET != errno) {
+      error("splice");
+    }
+    _relay_close(relay, 1);
+    return;
+  }
+
+  if (0 < dir->buffered) {
+    // the receiver is behind: stop reading until the pipe drains
+    event_del(dir->ev_in);
+    event_add(dir->ev_out, NULL);
+    return;
+  }
+
+  event_del(dir->ev_out);
+  if (!dir->eof) {
+    event_add(dir->ev_in, NULL);
+    return;
+  }
+
+  // pass the EOF on, and close once both directions are done
+  event_del(dir->ev_in);
+  if (!dir->done) {
+    dir->done = 1;
+    shutdown(dir->out_fd, SHUT_WR);
+  }
+  if (relay->a2c.done && relay->c2a.done) {
+    _relay_close(relay, 1);
+  }
+}
+
+#else  // no splice(2) outside of Linux
+
+int splice_supported(void) {
+  return 0;
+}
+
+splice_relay *splice_relay_new(struct event_base *ev_base,
+                               int accept_fd,
+                               int client_fd,
+                               metrics *metrics,
+                               splice_fallback_cb fallback,
+                               splice_closed_cb closed,
+                               void *arg) {
+  (void) ev_base;
+  (void) accept_fd;
+  (void) client_fd;
+  (void) metrics;
+  (void) fallback;
+  (void) closed;
+  (void) arg;
+  return NULL;
+}
+
+int splice_relay_start(splice_relay *relay) {
+  (void) relay;
+  return ERR_NET_SPLICE;
+}
+
+uint64_t splice_relay_bytes(const splice_relay *relay) {
+  (void) relay;
+  return 0;
+}
+
+void splice_relay_trace(splice_relay *relay, uint64_t *a2c_first, uint64_t *c2a_first) {
+  (void) relay;
+  (void) a2c_first;
+  (void) c2a_first;
+}
+
+void splice_relay_close(splice_relay *relay) {
+  (void) relay;
+}
+
+void splice_relay_free(splice_relay *relay) {
+  (void) relay;
+}
+
+#endif
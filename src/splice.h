@@ -0,0 +1,59 @@
+/* splice.h
+ *
+ * Zero-copy relay between two connected sockets, using splice(2) through a pipe
+ * per direction so that proxied bytes never enter user space.
+ */
+#ifndef splice_h
+#define splice_h
+
+#include <event2/event.h>
+#include "defs.h"
+#include "metrics.h"
+
+typedef struct splice_relay_struct splice_relay;
+
+/* Invoked when the kernel refuses to splice these sockets before any byte was
+ * moved. The relay has been freed; the callee owns both descriptors and should
+ * fall back to another relay.
+ */
+typedef void (*splice_fallback_cb)(int accept_fd, int client_fd, void *arg);
+
+/* Invoked once a started relay has closed both descriptors and freed itself. */
+typedef void (*splice_closed_cb)(void *arg);
+
+/* Returns true if this build can splice at all. */
+int splice_supported(void);
+
+/* Allocates the pipes and events for a relay, without starting it. Relayed bytes
+ * are counted in metrics.
+ *
+ * @return the relay, or NULL if it could not be set up (e.g. out of descriptors).
+ */
+splice_relay *splice_relay_new(struct event_base *ev_base,
+                               int accept_fd,
+                               int client_fd,
+                               metrics *metrics,
+                               splice_fallback_cb fallback,
+                               splice_closed_cb closed,
+                               void *arg);
+
+/* Starts relaying. From here on the relay owns both descriptors, and frees itself
+ * once both directions are finished.
+ */
+int splice_relay_start(splice_relay *relay);
+
+/* Returns the bytes relayed so far, in both directions. */
+uint64_t splice_relay_bytes(const splice_relay *relay);
+
+/* Has the relay stamp metrics_now() into *a2c_first and *c2a_first, if they are still 0,
+ * when it relays the first byte each way. Either may be NULL.
+ */
+void splice_relay_trace(splice_relay *relay, uint64_t *a2c_first, uint64_t *c2a_first);
+
+/* Closes a started relay: both descriptors are closed and the closed callback is invoked. */
+void splice_relay_close(splice_relay *relay);
+
+/* Frees a relay that was never started, leaving its descriptors open. */
+void splice_relay_free(splice_relay *relay);
+
+#endif /* splice_h */
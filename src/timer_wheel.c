@@ -0,0 +1,182 @@
+/* timer_wheel.c
+ *
+ * Hierarchical timer wheel for per-connection timeouts: arming, re-arming and
+ * cancelling a timer are O(1), so a timer can be pushed back on every read.
+ *
+ * A timer due in fewer than TIMER_WHEEL_SLOTS ticks sits in the level 0 slot of the
+ * tick it expires on; one due later sits in a coarser level, in the slot of the
+ * higher bits of its expiry. Whenever the low bits of the tick wrap to 0, the next
+ * slot of the level above is emptied into the levels below, so each timer moves at
+ * most TIMER_WHEEL_LEVELS - 1 times however often it is re-armed in between.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_CATCH_UP 1000  // ticks processed per wakeup after a stall
+
+// -- DECLARATIONS --
+
+static void _link(wheel_timer *head, wheel_timer *timer);
+static void _unlink(wheel_timer *timer);
+/* Places the timer in the slot for its expiry, relative to the current tick. */
+static void _insert(timer_wheel *wheel, wheel_timer *timer);
+/* Moves a slot's timers down to the levels below. */
+static void _cascade(timer_wheel *wheel, int level, int slot);
+/* Advances one tick, and fires the timers due on it. */
+static void _advance(timer_wheel *wheel);
+static void _tick_cb(evutil_socket_t fd, short what, void *arg);
+
+// -- PUBLIC --
+
+timer_wheel *timer_wheel_new(struct event_base *ev_base, int tick_ms) {
+
+  timer_wheel *wheel = NULL;
+  struct timeval interval = { tick_ms / 1000, (tick_ms % 1000) * 1000 };
+  int level = 0;
+  int slot = 0;
+
+  if (NULL == (wheel = calloc(1, sizeof(timer_wheel)))) {
+    error("calloc timer_wheel");
+    return NULL;
+  }
+  wheel->tick_ms = tick_ms;
+  wheel->started = metrics_now();
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      wheel->slots[level][slot].next = wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+    }
+  }
+
+  if (NULL == (wheel->ev_tick = event_new(ev_base, -1, EV_PERSIST, _tick_cb, wheel)) ||
+      0 != event_add(wheel->ev_tick, &interval)) {
+    timer_wheel_free(wheel);
+    return NULL;
+  }
+
+  return wheel;
+}
+
+void timer_wheel_free(timer_wheel *wheel) {
+  if (NULL != wheel->ev_tick) {
+    event_free(wheel->ev_tick); wheel->ev_tick = NULL;
+  }
+  free(wheel);
+}
+
+void wheel_timer_init(wheel_timer *timer, wheel_timer_cb cb, void *arg) {
+  timer->next = timer->prev = NULL;
+  timer->expires = 0;
+  timer->cb = cb;
+  timer->arg = arg;
+}
+
+void wheel_timer_arm(timer_wheel *wheel, wheel_timer *timer, uint64_t ms) {
+  uint64_t ticks = (ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  if (wheel_timer_armed(timer)) {
+    _unlink(timer);
+  }
+  timer->expires = wheel->now + (0 < ticks ? ticks : 1);
+  _insert(wheel, timer);
+  wheel->armed++;
+}
+
+void wheel_timer_cancel(wheel_timer *timer) {
+  if (wheel_timer_armed(timer)) {
+    _unlink(timer);
+  }
+}
+
+// -- PRIVATE --
+
+static void _link(wheel_timer *head, wheel_timer *timer) {
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static void _unlink(wheel_timer *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+}
+
+static void _insert(timer_wheel *wheel, wheel_timer *timer) {
+
+  uint64_t delta = timer->expires > wheel->now ? timer->expires - wheel->now : 0;
+  int level = 0;
+
+  if (delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+    timer->expires = wheel->now + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    delta = timer->expires - wheel->now;
+  }
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >> (TIMER_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  _link(&wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], timer);
+}
+
+static void _cascade(timer_wheel *wheel, int level, int slot) {
+
+  wheel_timer *head = &wheel->slots[level][slot];
+  wheel_timer *timer = NULL;
+
+  while (head != (timer = head->next)) {
+    _unlink(timer);
+    _insert(wheel, timer);
+  }
+}
+
+static void _advance(timer_wheel *wheel) {
+
+  wheel_timer due;
+  wheel_timer *timer = NULL;
+  int level = 1;
+
+  wheel->now++;
+
+  // find the levels that wrapped, and empty the coarsest one first
+  while (level < TIMER_WHEEL_LEVELS && 0 == (wheel->now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1))) {
+    level++;
+  }
+  for (level--; level > 0; level--) {
+    _cascade(wheel, level, (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+  }
+
+  // take the slot over, so that callbacks can arm and cancel timers as they please
+  due.next = due.prev = &due;
+  while (&wheel->slots[0][wheel->now & TIMER_WHEEL_MASK] != (timer = wheel->slots[0][wheel->now & TIMER_WHEEL_MASK].next)) {
+    _unlink(timer);
+    _link(&due, timer);
+  }
+
+  while (&due != (timer = due.next)) {
+    _unlink(timer);
+    wheel->fired++;
+    timer->cb(timer, timer->arg);
+  }
+}
+
+static void _tick_cb(evutil_socket_t fd, short what, void *arg) {
+
+  timer_wheel *wheel = arg;
+  uint64_t target = (metrics_now() - wheel->started) / 1000 / wheel->tick_ms;
+  int n = 0;
+
+  (void) fd;
+  (void) what;
+
+  while (wheel->now < target && n++ < TIMER_WHEEL_MAX_CATCH_UP) {
+    _advance(wheel);
+  }
+}
@@ -0,0 +1,70 @@
+/* timer_wheel.h
+ *
+ * Hierarchical timer wheel for per-connection timeouts: arming, re-arming and
+ * cancelling a timer are O(1), so a timer can be pushed back on every read.
+ */
+#ifndef timer_wheel_h
+#define timer_wheel_h
+
+#include <stdint.h>
+#include <event2/event.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4  // 2^24 ticks; longer timers are clamped to that
+
+typedef struct timer_wheel_struct timer_wheel;
+typedef struct wheel_timer_struct wheel_timer;
+
+/* Invoked on the wheel's thread once the timer expires; the timer is disarmed and
+ * may be armed again.
+ */
+typedef void (*wheel_timer_cb)(wheel_timer *timer, void *arg);
+
+/* Embedded in whatever it times, so arming never allocates. */
+struct wheel_timer_struct {
+  wheel_timer *next;  // NULL while disarmed
+  wheel_timer *prev;
+  uint64_t expires;  // in ticks
+  wheel_timer_cb cb;
+  void *arg;
+};
+
+/* Level 0 holds the next TIMER_WHEEL_SLOTS ticks one slot per tick; each level above
+ * covers TIMER_WHEEL_SLOTS times as long with the same number of slots, and its timers
+ * move down a level as their slot comes up. One event per tick drives it.
+ */
+struct timer_wheel_struct {
+  int tick_ms;
+  uint64_t started;  // metrics_now() at tick 0
+  uint64_t now;  // ticks processed
+  wheel_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // list heads
+  struct event *ev_tick;
+  unsigned long armed;
+  unsigned long fired;
+};
+
+/* Creates a wheel with the given granularity, and starts ticking.
+ *
+ * @return the wheel, or NULL on error.
+ */
+timer_wheel *timer_wheel_new(struct event_base *ev_base, int tick_ms);
+
+/* Frees the wheel; timers still armed are forgotten. */
+void timer_wheel_free(timer_wheel *wheel);
+
+/* Sets up a disarmed timer. */
+void wheel_timer_init(wheel_timer *timer, wheel_timer_cb cb, void *arg);
+
+/* Arms the timer to expire after ms, rounded up to a tick, disarming it first if need be. */
+void wheel_timer_arm(timer_wheel *wheel, wheel_timer *timer, uint64_t ms);
+
+/* Disarms the timer; a no-op if it is not armed. */
+void wheel_timer_cancel(wheel_timer *timer);
+
+/* Returns true if the timer is armed. */
+static inline int wheel_timer_armed(const wheel_timer *timer) {
+  return NULL != timer->next;
+}
+
+#endif /* timer_wheel_h */
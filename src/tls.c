@@ -0,0 +1,209 @@
+/* tls.c
+ *
+ * TLS termination for accepted connections, with OpenSSL bufferevents.
+ */
+
+#include "config.h"
+
+#if TLS
+// before log.h, whose defs.h defines str
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <event2/bufferevent_ssl.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "log.h"
+#include "errors.h"
+#include "tls.h"
+
+#if TLS
+
+#define TLS_SESSION_ID_CONTEXT "event-proxy"
+
+struct tls_server_struct {
+  SSL_CTX *ctx;
+};
+
+// -- PUBLIC --
+
+int tls_supported(void) {
+  return 1;
+}
+
+tls_server *tls_server_new(const char *cert, const char *key) {
+
+  tls_server *tls = NULL;
+  char message[BUFFER_LEN];
+
+  if (NULL == (tls = calloc(1, sizeof(tls_server)))) {
+    error("calloc tls_server");
+    return NULL;
+  }
+
+  if (NULL == (tls->ctx = SSL_CTX_new(TLS_server_method()))) {
+    log_error("SSL_CTX_new failed");
+    tls_server_free(tls);
+    return NULL;
+  }
+
+  if (1 != SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION) ||
+      1 != SSL_CTX_use_certificate_chain_file(tls->ctx, cert) ||
+      1 != SSL_CTX_use_PrivateKey_file(tls->ctx, key, SSL_FILETYPE_PEM) ||
+      1 != SSL_CTX_check_private_key(tls->ctx)) {
+    ERR_error_string_n(ERR_get_error(), message, sizeof(message));
+    log_error("cannot load TLS certificate %s and key %s: %s", cert, key, message);
+    ERR_clear_error();
+    tls_server_free(tls);
+    return NULL;
+  }
+
+  // session IDs are looked up in this context's cache, which every worker shares; tickets are
+  // sealed with its keys, so a ticket from one worker is good on another
+  SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(tls->ctx, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout(tls->ctx, TLS_SESSION_TIMEOUT_S);
+  SSL_CTX_set_session_id_context(tls->ctx, (const unsigned char *) TLS_SESSION_ID_CONTEXT,
+                                 sizeof(TLS_SESSION_ID_CONTEXT) - 1);
+  if (!TLS_TICKETS) {
+    SSL_CTX_set_options(tls->ctx, SSL_OP_NO_TICKET);
+  }
+
+  // idle connections give their read and write buffers back
+  SSL_CTX_set_mode(tls->ctx, SSL_MODE_RELEASE_BUFFERS);
+
+  // plenty of clients just close the connection; OpenSSL 3 makes that an error, not an EOF
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  SSL_CTX_set_options(tls->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+#ifdef SSL_OP_ENABLE_KTLS
+  if (TLS_KTLS) {
+    SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS);
+  }
+  log_info("terminating TLS with %s, kernel TLS %s", cert, TLS_KTLS ? "where the kernel has it" : "off");
+#else
+  log_info("terminating TLS with %s, kernel TLS not supported by %s", cert, OpenSSL_version(OPENSSL_VERSION));
+#endif
+
+  return tls;
+}
+
+void tls_server_free(tls_server *tls) {
+  if (NULL != tls->ctx) {
+    SSL_CTX_free(tls->ctx); tls->ctx = NULL;
+  }
+  free(tls);
+}
+
+struct bufferevent *tls_bufferevent_new(tls_server *tls, struct event_base *ev_base, int fd) {
+
+  SSL *ssl = NULL;
+  struct bufferevent *bev = NULL;
+
+  if (NULL == (ssl = SSL_new(tls->ctx))) {
+    log_error("SSL_new failed");
+    return NULL;
+  }
+
+  // frees ssl on failure
+  if (NULL == (bev = bufferevent_openssl_socket_new(ev_base, fd, ssl, BUFFEREVENT_SSL_ACCEPTING,
+                                                    BEV_OPT_CLOSE_ON_FREE))) {
+    log_error("bufferevent_openssl_socket_new returned NULL");
+    return NULL;
+  }
+
+  // and older versions report it as a dirty shutdown
+  bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+  return bev;
+}
+
+int tls_resumed(struct bufferevent *bev) {
+  SSL *ssl = bufferevent_openssl_get_ssl(bev);
+  return NULL != ssl && SSL_session_reused(ssl);
+}
+
+int tls_offloaded(struct bufferevent *bev) {
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL *ssl = bufferevent_openssl_get_ssl(bev);
+  return NULL != ssl &&
+         BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) &&
+         !SSL_has_pending(ssl);
+#else
+  (void) bev;
+  return 0;  // an OpenSSL without kTLS never hands the crypto to the kernel
+#endif
+}
+
+void tls_shutdown(struct bufferevent *bev) {
+  SSL *ssl = bufferevent_openssl_get_ssl(bev);
+  if (NULL != ssl) {
+    SSL_shutdown(ssl);  // only sends ours; the client's comes as an EOF
+    ERR_clear_error();
+  }
+}
+
+void tls_log_error(struct bufferevent *bev, int fd) {
+
+  unsigned long e = bufferevent_get_openssl_error(bev);
+  char message[BUFFER_LEN];
+
+  if (0 == e) {
+    log_info("TLS handshake on fd %d failed: the client went away", fd);
+    return;
+  }
+
+  // the first is the cause; libevent may add the bare SSL_get_error code after it
+  ERR_error_string_n(e, message, sizeof(message));
+  log_info("TLS handshake on fd %d failed: %s", fd, message);
+  while (0 != bufferevent_get_openssl_error(bev)) {
+    continue;
+  }
+}
+
+#else  // no OpenSSL in this build
+
+int tls_supported(void) {
+  return 0;
+}
+
+tls_server *tls_server_new(const char *cert, const char *key) {
+  (void) cert;
+  (void) key;
+  log_error("TLS is not supported in this build");
+  return NULL;
+}
+
+void tls_server_free(tls_server *tls) {
+  (void) tls;
+}
+
+struct bufferevent *tls_bufferevent_new(tls_server *tls, struct event_base *ev_base, int fd) {
+  (void) tls;
+  (void) ev_base;
+  (void) fd;
+  return NULL;
+}
+
+int tls_resumed(struct bufferevent *bev) {
+  (void) bev;
+  return 0;
+}
+
+int tls_offloaded(struct bufferevent *bev) {
+  (void) bev;
+  return 0;
+}
+
+void tls_shutdown(struct bufferevent *bev) {
+  (void) bev;
+}
+
+void tls_log_error(struct bufferevent *bev, int fd) {
+  (void) bev;
+  (void) fd;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/* tls.h
+ *
+ * TLS termination for accepted connections, with OpenSSL bufferevents. One server context
+ * is shared by every worker, and with it the session cache and the session ticket keys.
+ */
+#ifndef tls_h
+#define tls_h
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+typedef struct tls_server_struct tls_server;
+
+/* Returns true if this build can terminate TLS at all. */
+int tls_supported(void);
+
+/* Loads the certificate chain and private key (PEM; key may be the same file as cert), and
+ * sets up the session cache, session tickets and, where OpenSSL has it, kernel TLS.
+ *
+ * @return the server, or NULL on error (which is logged).
+ */
+tls_server *tls_server_new(const char *cert, const char *key);
+
+/* Frees the server; call once no connection uses it. */
+void tls_server_free(tls_server *tls);
+
+/* Creates a bufferevent that does the server side of a handshake on fd, and then reads and
+ * writes plain text. It reports BEV_EVENT_CONNECTED once the handshake is done, and a client
+ * that closes without a close_notify as an EOF. Freeing it closes fd.
+ *
+ * @return the bufferevent, or NULL on error.
+ */
+struct bufferevent *tls_bufferevent_new(tls_server *tls, struct event_base *ev_base, int fd);
+
+/* Returns true if the handshake on bev resumed an earlier session. */
+int tls_resumed(struct bufferevent *bev);
+
+/* Returns true if the kernel took over the record layer both ways (kTLS) and OpenSSL holds
+ * nothing back, so that bev's socket may be relayed as plain text without it.
+ */
+int tls_offloaded(struct bufferevent *bev);
+
+/* Sends a close_notify on bev, if it is a TLS bufferevent; its output should be flushed. */
+void tls_shutdown(struct bufferevent *bev);
+
+/* Logs why a handshake on bev failed. */
+void tls_log_error(struct bufferevent *bev, int fd);
+
+#endif /* tls_h */
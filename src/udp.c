@@ -0,0 +1,593 @@
+/* udp.c
+ *
+ * UDP relay: datagrams from each client address form a flow with its own socket
+ * connected to the flow's backend, so replies find their way back. Datagrams are
+ * received and sent in batches with recvmmsg/sendmmsg on Linux, and a recvmsg/sendmsg
+ * at a time elsewhere.
+ */
+
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include "metrics.h"  // before defs.h, which libevent's headers trip over
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "health.h"
+#include "slab.h"
+#include "udp.h"
+
+#define UDP_MASK (UDP_MAX_FLOWS - 1)
+
+#ifdef __linux__
+typedef struct mmsghdr udp_msg;
+#else
+/* The part of struct mmsghdr used here. */
+typedef struct {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+} udp_msg;
+#endif
+
+typedef struct udp_flow_struct udp_flow;
+
+/* One client address, and the socket its datagrams are relayed through. */
+struct udp_flow_struct {
+  udp_flow *next;  // in its hash chain
+  udp_relay *relay;
+  struct sockaddr_storage client;
+  socklen_t client_len;
+  uint32_t hash;
+  backend *backend;
+  int fd;  // connected to the backend; -1 while it is being resolved
+  struct event *ev_read;
+  dns_waiter *waiter;
+  struct evbuffer *pending;  // datagrams held until the backend is resolved, each after its length
+  int npending;
+  wheel_timer idle;
+  uint64_t started;
+  uint64_t last_active;  // metrics_now() of the last datagram either way
+};
+
+/* A worker's relay. The batch arrays are reused by both directions, since the worker
+ * only ever runs one callback at a time.
+ */
+struct udp_relay_struct {
+  struct event_base *ev_base;
+  int listen_fd;
+  struct event *ev_listen;
+  backend_set *backends;
+  dns_cache *dns;
+  metrics *metrics;
+  timer_wheel *timers;
+  int flow_timeout_ms;
+  uint64_t seed;
+  slab_pool *flows;
+  unsigned long nflows;
+  unsigned long batches;
+  unsigned long datagrams;
+  unsigned long dropped;
+
+  char *buffers;  // UDP_BATCH buffers of UDP_DATAGRAM_LEN
+  udp_msg in[UDP_BATCH];
+  struct iovec in_iovs[UDP_BATCH];
+  struct sockaddr_storage in_addrs[UDP_BATCH];
+  udp_flow *in_flows[UDP_BATCH];  // the flow of each datagram received, or NULL once handled
+  udp_msg out[UDP_BATCH];
+  struct iovec out_iovs[UDP_BATCH];
+
+  udp_flow *table[UDP_MAX_FLOWS];  // hash chains
+};
+
+// -- DECLARATIONS --
+
+/* Reads a batch from the clients, and sends each flow's share of it upstream. */
+static void _listen_cb(evutil_socket_t fd, short event, void *arg);
+/* Reads a batch of replies from a flow's backend, and sends them to its client. */
+static void _flow_read_cb(evutil_socket_t fd, short event, void *arg);
+/* Receives up to UDP_BATCH datagrams into the relay's buffers. @return how many, or -1. */
+static int _receive(udp_relay *u, int fd, int named);
+/* Sends n prepared datagrams from out; those the socket has no room for are dropped.
+ * @return the errno of the failed send, or 0. */
+static int _send(udp_relay *u, int fd, int n);
+/* recvmmsg and sendmmsg, or loops of recvmsg and sendmsg where there are none.
+ * @return the datagrams received or sent, or -1 with errno set if the first one failed. */
+static int _recvmmsg(int fd, udp_msg *msgs, unsigned int n);
+static int _sendmmsg(int fd, udp_msg *msgs, unsigned int n);
+/* Returns a non-blocking, close-on-exec datagram socket, or -1 with errno set. */
+static int _socket(int family);
+/* Returns the client's flow, creating it if need be; NULL if it cannot be relayed. */
+static udp_flow *_flow_get(udp_relay *u, const struct sockaddr_storage *client, socklen_t client_len);
+/* Opens the flow's socket to the first resolved address. @return success or error codes. */
+static int _flow_connect(udp_flow *flow, const dns_entry *entry);
+static void _flow_resolved_cb(int result, const dns_entry *entry, void *arg);
+/* Holds a datagram until the flow's backend is resolved. */
+static void _flow_hold(udp_flow *flow, const char *data, size_t len);
+/* Expires the flow unless a datagram went through since the timer was armed. */
+static void _flow_idle_cb(wheel_timer *timer, void *arg);
+static void _flow_free(udp_flow *flow);
+static uint32_t _hash(const udp_relay *u, const struct sockaddr_storage *client);
+static int _same(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+
+// -- PUBLIC --
+
+udp_relay *udp_relay_new(struct event_base *ev_base,
+                         int listen_fd,
+                         backend_set *backends,
+                         dns_cache *dns,
+                         metrics *metrics,
+                         timer_wheel *timers,
+                         int flow_timeout_ms) {
+
+  udp_relay *u = NULL;
+
+  if (NULL == (u = calloc(1, sizeof(udp_relay)))) {
+    error("calloc udp_relay");
+    return NULL;
+  }
+  u->ev_base = ev_base;
+  u->listen_fd = listen_fd;
+  u->backends = backends;
+  u->dns = dns;
+  u->metrics = metrics;
+  u->timers = timers;
+  u->flow_timeout_ms = flow_timeout_ms;
+  u->seed = metrics_now() | 1;
+
+  if (NULL == (u->buffers = malloc((size_t) UDP_BATCH * UDP_DATAGRAM_LEN))) {
+    error("malloc udp buffers");
+    udp_relay_free(u);
+    return NULL;
+  }
+  if (NULL == (u->flows = slab_pool_new("udp flow", sizeof(udp_flow), SLAB_OBJECTS)) ||
+      NULL == (u->ev_listen = event_new(ev_base, listen_fd, EV_READ | EV_PERSIST, _listen_cb, u)) ||
+      0 != event_add(u->ev_listen, NULL)) {
+    udp_relay_free(u);
+    return NULL;
+  }
+  return u;
+}
+
+void udp_relay_stop(udp_relay *u) {
+  if (NULL != u->ev_listen) {
+    event_free(u->ev_listen); u->ev_listen = NULL;
+  }
+}
+
+unsigned long udp_relay_flows(const udp_relay *u) {
+  return u->nflows;
+}
+
+void udp_relay_report(const udp_relay *u, int worker_id) {
+  log_info("worker %d udp: %lu flows, %lu datagrams in %lu batches, %lu dropped",
+           worker_id, u->nflows, u->datagrams, u->batches, u->dropped);
+  slab_pool_report(u->flows, worker_id);
+}
+
+void udp_relay_free(udp_relay *u) {
+  int i = 0;
+  for (i = 0; i < UDP_MAX_FLOWS; i++) {
+    while (NULL != u->table[i]) {
+      _flow_free(u->table[i]);
+    }
+  }
+  udp_relay_stop(u);
+  if (NULL != u->flows) {
+    slab_pool_free(u->flows); u->flows = NULL;
+  }
+  free(u->buffers); u->buffers = NULL;
+  free(u);
+}
+
+// -- PRIVATE --
+
+static void _listen_cb(evutil_socket_t fd, short event, void *arg) {
+
+  udp_relay *u = arg;
+  udp_flow *flow = NULL;
+  uint64_t now = metrics_now();
+  size_t len = 0;
+  int n = 0;
+  int i = 0;
+  int j = 0;
+  int k = 0;
+
+  (void) event;
+
+  if (0 >= (n = _receive(u, fd, 1))) {
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    u->in_flows[i] = NULL;
+    len = u->in[i].msg_len;
+    if ((u->in[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+        NULL == (flow = _flow_get(u, &u->in_addrs[i], u->in[i].msg_hdr.msg_namelen))) {
+      u->dropped++;
+      metrics_add(&u->metrics->datagrams_dropped, 1);
+      continue;
+    }
+    flow->last_active = now;
+    metrics_add(&u->metrics->bytes_a2c, len);
+    if (0 > flow->fd) {
+      _flow_hold(flow, u->in_iovs[i].iov_base, len);
+      continue;
+    }
+    u->in_flows[i] = flow;
+  }
+
+  // one sendmmsg per flow, with its datagrams in the order they came in
+  for (i = 0; i < n; i++) {
+    if (NULL == (flow = u->in_flows[i])) {
+      continue;
+    }
+    for (j = i, k = 0; j < n; j++) {
+      if (flow != u->in_flows[j]) {
+        continue;
+      }
+      u->out_iovs[k].iov_base = u->in_iovs[j].iov_base;
+      u->out_iovs[k].iov_len = u->in[j].msg_len;
+      u->out[k].msg_hdr.msg_name = NULL;
+      u->out[k].msg_hdr.msg_namelen = 0;
+      u->in_flows[j] = NULL;
+      k++;
+    }
+    if (ECONNREFUSED == _send(u, flow->fd, k)) {
+      health_failure(flow->backend);
+    }
+  }
+}
+
+static void _flow_read_cb(evutil_socket_t fd, short event, void *arg) {
+
+  udp_flow *flow = arg;
+  udp_relay *u = flow->relay;
+  int n = 0;
+  int i = 0;
+  int k = 0;
+
+  (void) event;
+
+  if (0 > (n = _receive(u, fd, 0))) {
+    // an ICMP port unreachable for an earlier datagram
+    if (ECONNREFUSED == errno) {
+      health_failure(flow->backend);
+    }
+    return;
+  }
+  if (0 == n) {
+    return;
+  }
+
+  flow->last_active = metrics_now();
+  health_success(flow->backend);
+  for (i = 0; i < n; i++) {
+    if (u->in[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      u->dropped++;
+      metrics_add(&u->metrics->datagrams_dropped, 1);
+      continue;
+    }
+    metrics_add(&u->metrics->bytes_c2a, u->in[i].msg_len);
+    u->out_iovs[k].iov_base = u->in_iovs[i].iov_base;
+    u->out_iovs[k].iov_len = u->in[i].msg_len;
+    u->out[k].msg_hdr.msg_name = &flow->client;
+    u->out[k].msg_hdr.msg_namelen = flow->client_len;
+    k++;
+  }
+  _send(u, u->listen_fd, k);
+}
+
+static int _receive(udp_relay *u, int fd, int named) {
+
+  int n = 0;
+  int i = 0;
+
+  for (i = 0; i < UDP_BATCH; i++) {
+    u->in_iovs[i].iov_base = u->buffers + (size_t) i * UDP_DATAGRAM_LEN;
+    u->in_iovs[i].iov_len = UDP_DATAGRAM_LEN;
+    memset(&u->in[i].msg_hdr, 0, sizeof(struct msghdr));
+    u->in[i].msg_hdr.msg_iov = &u->in_iovs[i];
+    u->in[i].msg_hdr.msg_iovlen = 1;
+    if (named) {
+      u->in[i].msg_hdr.msg_name = &u->in_addrs[i];
+      u->in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+  }
+
+  if (0 > (n = _recvmmsg(fd, u->in, UDP_BATCH))) {
+    if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno) {
+      return 0;
+    }
+    if (ECONNREFUSED != errno) {
+      error("recvmmsg");
+    }
+    return -1;
+  }
+  u->batches++;
+  u->datagrams += (unsigned long) n;
+  return n;
+}
+
+static int _send(udp_relay *u, int fd, int n) {
+
+  int sent = 0;
+  int rc = 0;
+  int i = 0;
+
+  for (i = 0; i < n; i++) {
+    u->out[i].msg_hdr.msg_iov = &u->out_iovs[i];
+    u->out[i].msg_hdr.msg_iovlen = 1;
+    u->out[i].msg_hdr.msg_control = NULL;
+    u->out[i].msg_hdr.msg_controllen = 0;
+    u->out[i].msg_hdr.msg_flags = 0;
+  }
+
+  while (sent < n) {
+    if (0 > (rc = _sendmmsg(fd, u->out + sent, (unsigned int) (n - sent)))) {
+      if (EINTR == errno) {
+        continue;
+      }
+      rc = errno;
+      if (EAGAIN != errno && EWOULDBLOCK != errno && ECONNREFUSED != errno) {
+        error("sendmmsg");
+      }
+      // UDP has no backpressure to apply: what does not fit is dropped, as the network would
+      u->dropped += (unsigned long) (n - sent);
+      metrics_add(&u->metrics->datagrams_dropped, (uint64_t) (n - sent));
+      return rc;
+    }
+    sent += rc;
+  }
+  return 0;
+}
+
+static int _recvmmsg(int fd, udp_msg *msgs, unsigned int n) {
+#ifdef __linux__
+  return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+#else
+  unsigned int i = 0;
+  ssize_t len = 0;
+  for (i = 0; i < n; i++) {
+    if (0 > (len = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT))) {
+      return 0 < i ? (int) i : -1;
+    }
+    msgs[i].msg_len = (unsigned int) len;
+  }
+  return (int) n;
+#endif
+}
+
+static int _sendmmsg(int fd, udp_msg *msgs, unsigned int n) {
+#ifdef __linux__
+  return sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+#else
+  unsigned int i = 0;
+  ssize_t len = 0;
+  for (i = 0; i < n; i++) {
+    if (0 > (len = sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT))) {
+      return 0 < i ? (int) i : -1;
+    }
+    msgs[i].msg_len = (unsigned int) len;
+  }
+  return (int) n;
+#endif
+}
+
+static int _socket(int family) {
+#ifdef __linux__
+  return socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#else
+  int fd = socket(family, SOCK_DGRAM, 0);
+  if (0 <= fd && (0 != evutil_make_socket_nonblocking(fd) || 0 != evutil_make_socket_closeonexec(fd))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+#endif
+}
+
+static udp_flow *_flow_get(udp_relay *u, const struct sockaddr_storage *client, socklen_t client_len) {
+
+  uint32_t hash = _hash(u, client);
+  udp_flow *flow = NULL;
+  backend *b = NULL;
+  const dns_entry *entry = NULL;
+
+  for (flow = u->table[hash & UDP_MASK]; NULL != flow; flow = flow->next) {
+    if (hash == flow->hash && _same(&flow->client, client)) {
+      return flow;
+    }
+  }
+
+  if (UDP_MAX_FLOWS <= u->nflows ||
+      NULL == (b = backend_select(u->backends, (const struct sockaddr *) client, client_len)) ||
+      NULL == (flow = slab_alloc(u->flows))) {
+    return NULL;
+  }
+
+  flow->relay = u;
+  memcpy(&flow->client, client, client_len);
+  flow->client_len = client_len;
+  flow->hash = hash;
+  flow->fd = -1;
+  flow->backend = b;
+  flow->started = flow->last_active = metrics_now();
+  flow->next = u->table[hash & UDP_MASK];
+  u->table[hash & UDP_MASK] = flow;
+  u->nflows++;
+  backend_acquire(b);
+  metrics_add(&u->metrics->connections_opened, 1);
+  wheel_timer_init(&flow->idle, _flow_idle_cb, flow);
+  wheel_timer_arm(u->timers, &flow->idle, (uint64_t) u->flow_timeout_ms);
+
+  entry = dns_cache_lookup(u->dns, b->host, b->port_num, _flow_resolved_cb, flow, &flow->waiter);
+  if ((NULL == entry && NULL == flow->waiter) ||
+      (NULL != entry && SUCCESS != _flow_connect(flow, entry))) {
+    _flow_free(flow);
+    return NULL;
+  }
+  return flow;
+}
+
+static int _flow_connect(udp_flow *flow, const dns_entry *entry) {
+
+  udp_relay *u = flow->relay;
+  int fd = -1;
+
+  if (0 > (fd = _socket(entry->addrs[0].ss_family))) {
+    error("socket");
+    return ERR_NET_CONNECT;
+  }
+  // connected, so that the kernel hands this socket only the backend's replies
+  if (0 != connect(fd, (const struct sockaddr *) &entry->addrs[0], entry->addr_lens[0])) {
+    error("connect");
+    health_failure(flow->backend);
+    close(fd);
+    return ERR_NET_CONNECT;
+  }
+  if (NULL == (flow->ev_read = event_new(u->ev_base, fd, EV_READ | EV_PERSIST, _flow_read_cb, flow)) ||
+      0 != event_add(flow->ev_read, NULL)) {
+    if (NULL != flow->ev_read) {
+      event_free(flow->ev_read); flow->ev_read = NULL;
+    }
+    close(fd);
+    return ERR_EVENT_ADD;
+  }
+  flow->fd = fd;
+  return SUCCESS;
+}
+
+static void _flow_resolved_cb(int result, const dns_entry *entry, void *arg) {
+
+  udp_flow *flow = arg;
+  udp_relay *u = flow->relay;
+  uint16_t len = 0;
+
+  flow->waiter = NULL;
+  if (SUCCESS != result || SUCCESS != _flow_connect(flow, entry)) {
+    u->dropped += (unsigned long) flow->npending;
+    metrics_add(&u->metrics->datagrams_dropped, (uint64_t) flow->npending);
+    _flow_free(flow);
+    return;
+  }
+
+  // the held datagrams go out one by one; there are at most UDP_PENDING of them, once
+  while (NULL != flow->pending && sizeof(len) == evbuffer_remove(flow->pending, &len, sizeof(len))) {
+    if (0 > send(flow->fd, evbuffer_pullup(flow->pending, len), len, MSG_DONTWAIT)) {
+      u->dropped++;
+      metrics_add(&u->metrics->datagrams_dropped, 1);
+    }
+    evbuffer_drain(flow->pending, len);
+  }
+  if (NULL != flow->pending) {
+    evbuffer_free(flow->pending); flow->pending = NULL;
+  }
+  flow->npending = 0;
+}
+
+static void _flow_hold(udp_flow *flow, const char *data, size_t len) {
+
+  udp_relay *u = flow->relay;
+  uint16_t len16 = (uint16_t) len;  // at most UDP_DATAGRAM_LEN
+
+  if (UDP_PENDING <= flow->npending ||
+      (NULL == flow->pending && NULL == (flow->pending = evbuffer_new())) ||
+      0 != evbuffer_add(flow->pending, &len16, sizeof(len16)) ||
+      0 != evbuffer_add(flow->pending, data, len)) {
+    u->dropped++;
+    metrics_add(&u->metrics->datagrams_dropped, 1);
+    return;
+  }
+  flow->npending++;
+}
+
+static void _flow_idle_cb(wheel_timer *timer, void *arg) {
+
+  udp_flow *flow = arg;
+  udp_relay *u = flow->relay;
+  uint64_t idle_ms = (metrics_now() - flow->last_active) / 1000;
+
+  (void) timer;
+
+  // datagrams only stamp the flow, which is cheaper than pushing the timer back each time
+  if (idle_ms < (uint64_t) u->flow_timeout_ms) {
+    wheel_timer_arm(u->timers, &flow->idle, (uint64_t) u->flow_timeout_ms - idle_ms);
+    return;
+  }
+  metrics_add(&u->metrics->timeouts[METRICS_TIMEOUT_IDLE], 1);
+  _flow_free(flow);
+}
+
+static void _flow_free(udp_flow *flow) {
+
+  udp_relay *u = flow->relay;
+  udp_flow **link = &u->table[flow->hash & UDP_MASK];
+
+  while (*link != flow) {
+    link = &(*link)->next;
+  }
+  *link = flow->next;
+
+  wheel_timer_cancel(&flow->idle);
+  if (NULL != flow->waiter) {
+    dns_cache_cancel(flow->waiter); flow->waiter = NULL;
+  }
+  if (NULL != flow->ev_read) {
+    event_free(flow->ev_read); flow->ev_read = NULL;
+  }
+  if (0 <= flow->fd) {
+    close(flow->fd); flow->fd = -1;
+  }
+  if (NULL != flow->pending) {
+    evbuffer_free(flow->pending); flow->pending = NULL;
+  }
+  backend_release(flow->backend);
+  metrics_add(&u->metrics->connections_closed, 1);
+  metrics_observe(&u->metrics->lifetime, metrics_now() - flow->started);
+  u->nflows--;
+  slab_free(u->flows, flow);
+}
+
+static uint32_t _hash(const udp_relay *u, const struct sockaddr_storage *client) {
+
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+  uint64_t h = 0;
+
+  if (AF_INET6 == client->ss_family) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) client;
+    memcpy(&lo, in6->sin6_addr.s6_addr, 8);
+    memcpy(&hi, in6->sin6_addr.s6_addr + 8, 8);
+    lo ^= in6->sin6_port;
+  } else {
+    const struct sockaddr_in *in = (const struct sockaddr_in *) client;
+    lo = (uint64_t) in->sin_addr.s_addr << 16 | in->sin_port;
+  }
+
+  // seeded per relay, so that clients cannot aim their addresses at one chain
+  h = (lo ^ u->seed) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 29) ^ hi) * 0xbf58476d1ce4e5b9ULL;
+  return (uint32_t) (h >> 32);
+}
+
+static int _same(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+  if (a->ss_family != b->ss_family) {
+    return 0;
+  }
+  if (AF_INET6 == a->ss_family) {
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *) b;
+    return a6->sin6_port == b6->sin6_port &&
+           0 == memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+  }
+  return ((const struct sockaddr_in *) a)->sin_port == ((const struct sockaddr_in *) b)->sin_port &&
+         ((const struct sockaddr_in *) a)->sin_addr.s_addr == ((const struct sockaddr_in *) b)->sin_addr.s_addr;
+}
@@ -0,0 +1,45 @@
+/* udp.h
+ *
+ * UDP relay: datagrams from each client address form a flow with its own socket
+ * connected to the flow's backend, so replies find their way back. Datagrams are
+ * received and sent in batches with recvmmsg/sendmmsg on Linux, and a recvmsg/sendmsg
+ * at a time elsewhere.
+ */
+#ifndef udp_h
+#define udp_h
+
+#include <event2/event.h>
+#include "backend.h"
+#include "dns_cache.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+typedef struct udp_relay_struct udp_relay;
+
+/* Starts reading datagrams from listen_fd, a bound UDP socket that the caller keeps
+ * ownership of. Flows are forgotten after flow_timeout_ms without a datagram either way.
+ *
+ * @return the relay, or NULL on error.
+ */
+udp_relay *udp_relay_new(struct event_base *ev_base,
+                         int listen_fd,
+                         backend_set *backends,
+                         dns_cache *dns,
+                         metrics *metrics,
+                         timer_wheel *timers,
+                         int flow_timeout_ms);
+
+/* Stops reading from the listener. Replies on open flows are still relayed, since they
+ * go out through the listener. */
+void udp_relay_stop(udp_relay *u);
+
+/* Returns the open flows. */
+unsigned long udp_relay_flows(const udp_relay *u);
+
+/* Logs the flow and batch counters. */
+void udp_relay_report(const udp_relay *u, int worker_id);
+
+/* Closes every flow and frees the relay; the listener is left open. */
+void udp_relay_free(udp_relay *u);
+
+#endif /* udp_h */
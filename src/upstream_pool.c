@@ -0,0 +1,410 @@
+/* upstream_pool.c
+ *
+ * Per-worker pool of pre-connected, idle sockets to one upstream.
+ *
+ * Sockets are connected without blocking, and watched for reads while idle: an
+ * upstream has nothing to say before it receives a request, so readability means
+ * it closed the connection (or broke protocol) and the socket is evicted.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "upstream_pool.h"
+
+struct pool_conn_struct {
+  int fd;
+  struct event *ev;  // EV_WRITE while connecting, EV_READ while idle
+  upstream_pool *pool;
+  pool_conn *prev;
+  pool_conn *next;
+};
+
+// -- DECLARATIONS --
+
+/* Starts as many connects as needed to reach the pool's target. */
+static void _refill(upstream_pool *pool);
+/* Starts one non-blocking connect to the first resolved address. */
+static void _connect(upstream_pool *pool, const dns_entry *entry);
+/* Closes idle sockets above the target, and above the number put back that are kept. */
+static void _trim(upstream_pool *pool);
+static void _link(pool_conn **head, pool_conn *pc);
+static void _unlink(pool_conn **head, pool_conn *pc);
+static void _conn_free(pool_conn *pc);
+/* Returns true if an idle socket was closed or broken by the upstream. */
+static int _is_stale(int fd);
+static void _resolved_cb(int result, const dns_entry *entry, void *arg);
+static void _connect_cb(evutil_socket_t fd, short event, void *arg);
+static void _idle_cb(evutil_socket_t fd, short event, void *arg);
+static void _refill_cb(evutil_socket_t fd, short event, void *arg);
+static void _kick_cb(evutil_socket_t fd, short event, void *arg);
+
+// -- PUBLIC --
+
+upstream_pool *upstream_pool_new(struct event_base *ev_base,
+                                 dns_cache *dns,
+                                 const str host,
+                                 int port,
+                                 int min,
+                                 int max,
+                                 int keep,
+                                 const struct timeval *connect_timeout,
+                                 const sock_profile *sock) {
+
+  upstream_pool *pool = NULL;
+  struct timeval interval = { POOL_REFILL_INTERVAL_MS / 1000, (POOL_REFILL_INTERVAL_MS % 1000) * 1000 };
+
+  if (NULL == (pool = calloc(1, sizeof(upstream_pool)))) {
+    error("calloc upstream_pool");
+    return NULL;
+  }
+
+  if (NULL == (pool->host = strndup(host, MAX_LINE))) {
+    error("strndup host");
+    free(pool);
+    return NULL;
+  }
+
+  pool->ev_base = ev_base;
+  pool->dns = dns;
+  pool->port = port;
+  pool->min = min;
+  pool->max = MAX(min, max);
+  pool->keep = keep;
+  pool->target = min;
+  pool->connect_timeout = *connect_timeout;
+  pool->sock = *sock;
+  pool->sock.fastopen_connect = 0;  // pooled sockets connect before there is data to carry in the SYN
+
+  if (NULL == (pool->ev_refill = event_new(ev_base, -1, EV_PERSIST, _refill_cb, pool)) ||
+      NULL == (pool->ev_kick = event_new(ev_base, -1, 0, _kick_cb, pool)) ||
+      0 != event_add(pool->ev_refill, &interval)) {
+    upstream_pool_free(pool);
+    return NULL;
+  }
+
+  _refill(pool);
+  return pool;
+}
+
+void upstream_pool_free(upstream_pool *pool) {
+  pool_conn *pc = NULL;
+
+  while (NULL != (pc = pool->idle)) {
+    _unlink(&pool->idle, pc);
+    _conn_free(pc);
+  }
+  while (NULL != (pc = pool->connecting)) {
+    _unlink(&pool->connecting, pc);
+    _conn_free(pc);
+  }
+  if (NULL != pool->waiter) {
+    dns_cache_cancel(pool->waiter); pool->waiter = NULL;
+  }
+  if (NULL != pool->ev_kick) {
+    event_free(pool->ev_kick); pool->ev_kick = NULL;
+  }
+  if (NULL != pool->ev_refill) {
+    event_free(pool->ev_refill); pool->ev_refill = NULL;
+  }
+  free(pool->host); pool->host = NULL;
+  free(pool);
+}
+
+int upstream_pool_take(upstream_pool *pool) {
+
+  pool_conn *pc = NULL;
+  int fd = -1;
+
+  while (NULL != (pc = pool->idle)) {
+    _unlink(&pool->idle, pc);
+    pool->nidle--;
+
+    // the upstream may have hung up since the loop last polled
+    if (_is_stale(pc->fd)) {
+      pool->evictions++;
+      _conn_free(pc);
+      continue;
+    }
+
+    fd = pc->fd;
+    pc->fd = -1;
+    _conn_free(pc);
+    break;
+  }
+
+  if (0 <= fd) {
+    pool->hits++;
+  } else {
+    pool->misses++;
+    pool->drained = 1;
+    pool->target = MIN(pool->max, pool->target + 1);
+  }
+
+  // refill after the current callback, so the accept path does not pay for it
+  if (!pool->failing && 0 < pool->max) {
+    event_active(pool->ev_kick, EV_TIMEOUT, 0);
+  }
+
+  return fd;
+}
+
+void upstream_pool_put(upstream_pool *pool, int fd) {
+
+  pool_conn *pc = NULL;
+
+  if (pool->nidle + pool->nconnecting >= MAX(pool->max, pool->keep) ||
+      NULL == (pc = calloc(1, sizeof(pool_conn)))) {
+    close(fd);
+    return;
+  }
+  pc->fd = fd;
+  pc->pool = pool;
+
+  if (NULL == (pc->ev = event_new(pool->ev_base, fd, EV_READ, _idle_cb, pc)) ||
+      0 != event_add(pc->ev, NULL)) {
+    _conn_free(pc);
+    return;
+  }
+
+  // taken first, while the upstream is the least likely to have timed it out
+  _link(&pool->idle, pc);
+  pool->nidle++;
+  pool->returns++;
+  pool->reused = 1;
+}
+
+void upstream_pool_report(const upstream_pool *pool, int worker_id) {
+  log_info("worker %d pool %s:%d: %d idle, %d connecting, target %d, %lu hits, %lu misses, "
+             "%lu returns, %lu evictions, %lu failures",
+             worker_id, pool->host, pool->port, pool->nidle, pool->nconnecting, pool->target,
+             pool->hits, pool->misses, pool->returns, pool->evictions, pool->failures);
+}
+
+// -- PRIVATE --
+
+static void _refill(upstream_pool *pool) {
+
+  const dns_entry *entry = NULL;
+  int needed = pool->target - pool->nidle - pool->nconnecting;
+
+  if (0 >= needed || NULL != pool->waiter) {
+    return;
+  }
+
+  entry = dns_cache_lookup(pool->dns, pool->host, pool->port, _resolved_cb, pool, &pool->waiter);
+  if (NULL == entry) {
+    if (NULL == pool->waiter) {
+      pool->failures++;
+      pool->failing = 1;
+    }
+    return;
+  }
+
+  while (0 < needed--) {
+    _connect(pool, entry);
+  }
+}
+
+static void _connect(upstream_pool *pool, const dns_entry *entry) {
+
+  pool_conn *pc = NULL;
+  int fd = -1;
+
+  fd = socket(entry->addrs[0].ss_family, SOCK_STREAM, 0);
+  if (0 > fd) {
+    error("socket");
+    pool->failures++;
+    pool->failing = 1;
+    return;
+  }
+
+  if (0 != evutil_make_socket_nonblocking(fd) || 0 != evutil_make_socket_closeonexec(fd)) {
+    error("fcntl");
+    close(fd);
+    pool->failures++;
+    pool->failing = 1;
+    return;
+  }
+  sock_profile_upstream(&pool->sock, fd, entry->addrs[0].ss_family);
+
+  if (0 != connect(fd, (struct sockaddr *) &entry->addrs[0], entry->addr_lens[0]) && EINPROGRESS != errno) {
+    error("connect");
+    close(fd);
+    pool->failures++;
+    pool->failing = 1;
+    return;
+  }
+
+  if (NULL == (pc = calloc(1, sizeof(pool_conn)))) {
+    error("calloc pool_conn");
+    close(fd);
+    return;
+  }
+  pc->fd = fd;
+  pc->pool = pool;
+
+  // writable once connected (or refused); the timeout bounds the handshake
+  if (NULL == (pc->ev = event_new(pool->ev_base, fd, EV_WRITE, _connect_cb, pc)) ||
+      0 != event_add(pc->ev, &pool->connect_timeout)) {
+    _conn_free(pc);
+    return;
+  }
+
+  _link(&pool->connecting, pc);
+  pool->nconnecting++;
+}
+
+static void _trim(upstream_pool *pool) {
+  pool_conn *pc = NULL;
+  while (pool->nidle > MAX(pool->target, pool->keep) && NULL != (pc = pool->idle)) {
+    _unlink(&pool->idle, pc);
+    pool->nidle--;
+    _conn_free(pc);
+  }
+}
+
+static void _link(pool_conn **head, pool_conn *pc) {
+  pc->prev = NULL;
+  pc->next = *head;
+  if (NULL != *head) {
+    (*head)->prev = pc;
+  }
+  *head = pc;
+}
+
+static void _unlink(pool_conn **head, pool_conn *pc) {
+  if (NULL != pc->prev) {
+    pc->prev->next = pc->next;
+  } else {
+    *head = pc->next;
+  }
+  if (NULL != pc->next) {
+    pc->next->prev = pc->prev;
+  }
+  pc->prev = NULL;
+  pc->next = NULL;
+}
+
+static void _conn_free(pool_conn *pc) {
+  if (NULL != pc->ev) {
+    event_free(pc->ev); pc->ev = NULL;
+  }
+  if (0 <= pc->fd) {
+    close(pc->fd); pc->fd = -1;
+  }
+  free(pc);
+}
+
+static int _is_stale(int fd) {
+  char byte;
+  ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (0 > n) {
+    return EAGAIN != errno && EWOULDBLOCK != errno;
+  }
+  return 1;  // EOF, or bytes nobody asked for
+}
+
+static void _resolved_cb(int result, const dns_entry *entry, void *arg) {
+  upstream_pool *pool = arg;
+
+  (void) entry;
+  pool->waiter = NULL;
+  if (SUCCESS != result) {
+    pool->failures++;
+    pool->failing = 1;
+    return;
+  }
+  _refill(pool);
+}
+
+static void _connect_cb(evutil_socket_t fd, short event, void *arg) {
+
+  pool_conn *pc = arg;
+  upstream_pool *pool = pc->pool;
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  _unlink(&pool->connecting, pc);
+  pool->nconnecting--;
+
+  if (event & EV_TIMEOUT) {
+    log_error("timed out pre-connecting to %s:%d", pool->host, pool->port);
+    err = ETIMEDOUT;
+  } else if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+    err = errno;
+  }
+
+  if (0 != err) {
+    errno = err;
+    error("pre-connect");
+    pool->failures++;
+    pool->failing = 1;
+    _conn_free(pc);
+    return;
+  }
+
+  // watch for the upstream hanging up while the socket sits in the pool
+  pool->failing = 0;
+  event_assign(pc->ev, pool->ev_base, fd, EV_READ, _idle_cb, pc);
+  if (0 != event_add(pc->ev, NULL)) {
+    _conn_free(pc);
+    return;
+  }
+
+  _link(&pool->idle, pc);
+  pool->nidle++;
+  _trim(pool);
+}
+
+static void _idle_cb(evutil_socket_t fd, short event, void *arg) {
+
+  pool_conn *pc = arg;
+  upstream_pool *pool = pc->pool;
+
+  (void) event;
+  log_debug("evicting pooled connection with fd %u", fd);
+
+  _unlink(&pool->idle, pc);
+  pool->nidle--;
+  pool->evictions++;
+  _conn_free(pc);
+
+  if (!pool->failing) {
+    _refill(pool);
+  }
+}
+
+static void _refill_cb(evutil_socket_t fd, short event, void *arg) {
+
+  upstream_pool *pool = arg;
+
+  (void) fd;
+  (void) event;
+
+  // shrink back towards min while nobody is draining the pool, or putting sockets back
+  if (!pool->drained && !pool->reused) {
+    if (pool->target > pool->min) {
+      pool->target--;
+    }
+    _trim(pool);
+  }
+  pool->drained = 0;
+  pool->reused = 0;
+  pool->failing = 0;  // retry once per tick
+  _refill(pool);
+}
+
+static void _kick_cb(evutil_socket_t fd, short event, void *arg) {
+  (void) fd;
+  (void) event;
+  _refill(arg);
+}
@@ -0,0 +1,86 @@
+/* upstream_pool.h
+ *
+ * Per-worker pool of pre-connected, idle sockets to one upstream.
+ */
+#ifndef upstream_pool_h
+#define upstream_pool_h
+
+#include <sys/time.h>
+#include <event2/event.h>
+#include "defs.h"
+#include "dns_cache.h"
+#include "sockopt.h"
+
+typedef struct pool_conn_struct pool_conn;
+typedef struct upstream_pool_struct upstream_pool;
+
+/* The pool keeps between min and max sockets connected or connecting. It starts out
+ * aiming for min, grows its target by one whenever a take finds it empty, and shrinks
+ * back towards min while it is not being drained. Sockets put back after use count
+ * towards the target, so they are taken before any more are connected; up to keep of
+ * them are held on to regardless, and any more are closed once they stop coming back.
+ */
+struct upstream_pool_struct {
+  struct event_base *ev_base;
+  dns_cache *dns;
+  str host;
+  int port;
+  int min;
+  int max;
+  int keep;  // sockets put back after use that are held even above the target
+  int target;
+  struct timeval connect_timeout;
+  sock_profile sock;  // applied to each socket before it connects
+
+  pool_conn *idle;  // connected and ready to be taken
+  pool_conn *connecting;
+  int nidle;
+  int nconnecting;
+  int failing;  // the last connect failed; only refill on the timer
+  int drained;  // a take found the pool empty since the last tick
+  int reused;  // a socket was put back since the last tick
+  dns_waiter *waiter;
+  struct event *ev_refill;  // periodic top-up
+  struct event *ev_kick;  // refill right after a take
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long returns;  // sockets put back after use
+  unsigned long evictions;  // idle sockets closed by the upstream
+  unsigned long failures;
+};
+
+/* Creates a pool and starts filling it; with max 0, it only holds sockets put back.
+ *
+ * @return the pool, or NULL on error.
+ */
+upstream_pool *upstream_pool_new(struct event_base *ev_base,
+                                 dns_cache *dns,
+                                 const str host,
+                                 int port,
+                                 int min,
+                                 int max,
+                                 int keep,
+                                 const struct timeval *connect_timeout,
+                                 const sock_profile *sock);
+
+/* Closes every pooled socket and frees the pool. */
+void upstream_pool_free(upstream_pool *pool);
+
+/* Takes a connected socket out of the pool and schedules a refill. The caller owns
+ * the returned descriptor.
+ *
+ * @return a connected, non-blocking descriptor, or -1 if the pool is empty.
+ */
+int upstream_pool_take(upstream_pool *pool);
+
+/* Puts a socket back after use, e.g. an HTTP keep-alive connection between requests, or
+ * closes it if the pool already holds max, or keep, sockets. The pool owns the descriptor afterwards; the upstream
+ * must not be expecting anything more on it.
+ */
+void upstream_pool_put(upstream_pool *pool, int fd);
+
+/* Logs the pool counters. */
+void upstream_pool_report(const upstream_pool *pool, int worker_id);
+
+#endif /* upstream_pool_h */
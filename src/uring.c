@@ -0,0 +1,754 @@
+/* uring.c
+ *
+ * I/O engine built on io_uring: accepts with one multishot accept per listener, and
+ * relays connected pipes with recv/send submissions instead of readiness callbacks,
+ * receiving into a ring of buffers shared by the worker's connections.
+ *
+ * The worker's event_base still runs the loop: it polls the ring's descriptor, and
+ * each wakeup reaps every completion and submits whatever they queued with a single
+ * io_uring_enter. A direction of a relay holds at most one buffer: a receive picks a
+ * free buffer from the ring once bytes arrive, and its completion submits a send of
+ * that buffer linked to the next receive, so the kernel only reads again once the
+ * send went through. The buffer goes back to the ring when the send completes. EOF
+ * on a source is passed on as a shutdown(SHUT_WR), as with splice.
+ *
+ * A send towards a receiver that is behind holds its buffer, so the ring can run dry
+ * while the other direction of the same pipe is what the receiver waits for. Rather
+ * than wait for the ring, a direction that finds it empty receives into a spare buffer
+ * of its own, which keeps every pipe moving at the cost of the memory libevent uses.
+ *
+ * The syscalls are made directly, so this needs no liburing; it needs Linux 5.19 for
+ * buffer rings and multishot accept, and falls back to libevent without them.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "slab.h"
+#include "uring.h"
+
+#if defined(__linux__) && URING_ENGINE
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_GROUP 0  // buffer group of the receive buffers
+#define URING_OP_ACCEPT 0  // kept in the low bits of user_data
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_CANCEL 3
+#define URING_OP_MASK 3
+
+typedef struct uring_dir_struct uring_dir;
+
+struct uring_dir_struct {
+  int in_fd;  // pointers without ownership
+  int out_fd;
+  int bid;  // ring buffer being sent, or -1
+  char *spare;  // or the spare buffer received into when the ring ran dry
+  unsigned length;  // bytes in it
+  int done;  // in_fd has nothing more to say, and out_fd has been shut down for writing
+  _Atomic uint64_t *relayed;  // the worker's byte counter for this direction
+  uint64_t *first_byte;  // stamped when the first byte goes out; may be NULL
+  uring_relay *relay;
+};
+
+struct uring_relay_struct {
+  int accept_fd;
+  int client_fd;
+  int inflight;  // submissions whose completions are still to come
+  int closing;
+  uint64_t bytes;  // relayed in both directions
+  uring_dir a2c;
+  uring_dir c2a;
+  uring_closed_cb closed;
+  void *arg;
+  uring *u;
+  uring_relay *prev;  // in the engine's list of live relays
+  uring_relay *next;
+};
+
+struct uring_struct {
+  int ring_fd;
+  void *ring;  // submission and completion rings share one mapping
+  size_t ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_flags;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_queued;  // our tail; the kernel's is only moved on submit
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_len;
+  char *buffers;
+  size_t buffers_len;
+  uint16_t buf_tail;
+
+  int listen_fd;  // -1 once accepting stopped
+  uring_accept_cb accept_cb;
+  void *accept_arg;
+  int accept_owed;  // the accept, or its cancellation, found the submission ring full
+
+  uring_relay *live;  // relays holding descriptors, which uring_free closes
+
+  struct event *ev_ring;
+  metrics *metrics;
+  slab_pool *relays;
+  slab_pool *spares;  // URING_BUFFER_LEN each
+
+  unsigned long enters;
+  unsigned long submitted;
+  unsigned long completed;
+  unsigned long spare_receives;
+};
+
+// -- DECLARATIONS --
+
+static int _setup(uring *u);
+static int _buffers_setup(uring *u);
+/* Returns true if n submission entries are free, submitting the queued ones to make room. */
+static int _sq_room(uring *u, unsigned n);
+/* Returns the next free submission entry, or NULL if the kernel left the ring full. */
+static struct io_uring_sqe *_sqe(uring *u, int op, void *data);
+/* Hands the queued submissions to the kernel. */
+static void _submit(uring *u);
+/* Arms the multishot accept, or cancels it once accepting stopped; if the ring is full,
+ * this is owed until the next wakeup. */
+static void _accept_arm(uring *u);
+/* Receives into a buffer from the ring, or into a spare one if spare is set.
+ *
+ * @return success or error codes.
+ */
+static int _recv(uring_dir *dir, char *spare);
+/* Returns the buffer a direction received into, to the ring or to the spares. */
+static void _buffer_release(uring_dir *dir);
+static void _buffer_return(uring *u, int bid);
+static void _accepted(uring *u, const struct io_uring_cqe *cqe);
+static void _received(uring_dir *dir, const struct io_uring_cqe *cqe);
+static void _sent(uring_dir *dir, const struct io_uring_cqe *cqe);
+/* Shuts both sockets down, so that whatever is in flight completes. */
+static void _relay_close(uring_relay *relay);
+/* Closes the sockets and frees the relay, once nothing is in flight. */
+static void _relay_release(uring_relay *relay);
+static void _ring_cb(evutil_socket_t fd, short what, void *arg);
+
+// -- PUBLIC --
+
+int uring_supported(void) {
+  return 1;
+}
+
+uring *uring_new(struct event_base *ev_base, metrics *metrics) {
+
+  uring *u = NULL;
+
+  if (NULL == (u = calloc(1, sizeof(uring)))) {
+    error("calloc uring");
+    return NULL;
+  }
+  u->ring_fd = -1;
+  u->listen_fd = -1;
+  u->metrics = metrics;
+
+  if (SUCCESS != _setup(u) || SUCCESS != _buffers_setup(u)) {
+    uring_free(u);
+    return NULL;
+  }
+
+  if (NULL == (u->relays = slab_pool_new("io_uring relay", sizeof(uring_relay), SLAB_OBJECTS)) ||
+      NULL == (u->spares = slab_pool_new("io_uring spare buffer", URING_BUFFER_LEN, SLAB_OBJECTS / 4)) ||
+      NULL == (u->ev_ring = event_new(ev_base, u->ring_fd, EV_READ | EV_PERSIST, _ring_cb, u)) ||
+      0 != event_add(u->ev_ring, NULL)) {
+    uring_free(u);
+    return NULL;
+  }
+
+  return u;
+}
+
+int uring_accept(uring *u, int listen_fd, uring_accept_cb cb, void *arg) {
+  u->listen_fd = listen_fd;
+  u->accept_cb = cb;
+  u->accept_arg = arg;
+  _accept_arm(u);
+  _submit(u);
+  return u->accept_owed ? ERR_NET_URING : SUCCESS;
+}
+
+void uring_accept_stop(uring *u) {
+  if (0 > u->listen_fd) {
+    return;
+  }
+  u->listen_fd = -1;  // not to be re-armed when the cancelled accept completes
+  _accept_arm(u);
+  _submit(u);
+}
+
+uring_relay *uring_relay_new(uring *u, int accept_fd, int client_fd, uring_closed_cb closed, void *arg) {
+
+  uring_relay *relay = NULL;
+
+  if (NULL == (relay = slab_alloc(u->relays))) {
+    return NULL;
+  }
+  relay->accept_fd = accept_fd;
+  relay->client_fd = client_fd;
+  relay->closed = closed;
+  relay->arg = arg;
+  relay->u = u;
+
+  relay->a2c.in_fd = accept_fd;
+  relay->a2c.out_fd = client_fd;
+  relay->a2c.bid = -1;
+  relay->a2c.relayed = &u->metrics->bytes_a2c;
+  relay->a2c.relay = relay;
+
+  relay->c2a.in_fd = client_fd;
+  relay->c2a.out_fd = accept_fd;
+  relay->c2a.bid = -1;
+  relay->c2a.relayed = &u->metrics->bytes_c2a;
+  relay->c2a.relay = relay;
+
+  relay->next = u->live;
+  if (NULL != u->live) {
+    u->live->prev = relay;
+  }
+  u->live = relay;
+
+  return relay;
+}
+
+void uring_relay_start(uring_relay *relay) {
+  if (SUCCESS != _recv(&relay->a2c, NULL) || SUCCESS != _recv(&relay->c2a, NULL)) {
+    log_info("io_uring submission ring is full; closing fds %u and %u", relay->accept_fd, relay->client_fd);
+    uring_relay_close(relay);
+    return;
+  }
+  _submit(relay->u);
+}
+
+uint64_t uring_relay_bytes(const uring_relay *relay) {
+  return relay->bytes;
+}
+
+void uring_relay_trace(uring_relay *relay, uint64_t *a2c_first, uint64_t *c2a_first) {
+  relay->a2c.first_byte = a2c_first;
+  relay->c2a.first_byte = c2a_first;
+}
+
+void uring_relay_close(uring_relay *relay) {
+  _relay_close(relay);
+  if (0 == relay->inflight) {
+    _relay_release(relay);
+  }
+}
+
+void uring_report(const uring *u, int worker_id) {
+  log_info("worker %d io_uring: %lu enters, %lu submitted, %lu completed, %lu spare receives",
+           worker_id, u->enters, u->submitted, u->completed, u->spare_receives);
+  slab_pool_report(u->relays, worker_id);
+  slab_pool_report(u->spares, worker_id);
+}
+
+void uring_free(uring *u) {
+
+  uring_relay *relay = NULL;
+
+  if (NULL != u->ev_ring) {
+    event_free(u->ev_ring); u->ev_ring = NULL;
+  }
+  if (0 <= u->ring_fd) {
+    close(u->ring_fd); u->ring_fd = -1;  // cancels everything in flight
+  }
+  // relays still running own their descriptors; their pipes are freed by the worker
+  for (relay = u->live; NULL != relay; relay = relay->next) {
+    close(relay->accept_fd);
+    close(relay->client_fd);
+  }
+  u->live = NULL;
+  if (NULL != u->relays) {
+    slab_pool_free(u->relays); u->relays = NULL;
+  }
+  if (NULL != u->spares) {
+    slab_pool_free(u->spares); u->spares = NULL;
+  }
+  if (NULL != u->ring) {
+    munmap(u->ring, u->ring_len); u->ring = NULL;
+  }
+  if (NULL != u->sqes) {
+    munmap(u->sqes, u->sqes_len); u->sqes = NULL;
+  }
+  if (NULL != u->buf_ring) {
+    munmap(u->buf_ring, u->buf_ring_len); u->buf_ring = NULL;
+  }
+  if (NULL != u->buffers) {
+    munmap(u->buffers, u->buffers_len); u->buffers = NULL;
+  }
+  free(u);
+}
+
+// -- PRIVATE --
+
+static int _setup(uring *u) {
+
+  struct io_uring_params params;
+  char *ring = NULL;
+  unsigned i = 0;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = URING_ENTRIES * 4;  // room for a burst of accepts and receives
+
+  if (0 > (u->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params))) {
+    log_info("io_uring_setup failed: %s", strerror(errno));
+    return ERR_NET_URING;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+    log_info("io_uring lacks features %#x", IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP);
+    return ERR_NET_URING;
+  }
+
+  u->ring_len = MAX(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  if (MAP_FAILED == (ring = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 u->ring_fd, IORING_OFF_SQ_RING))) {
+    error("mmap io_uring");
+    return ERR_NET_URING;
+  }
+  u->ring = ring;
+
+  u->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (MAP_FAILED == (u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    u->ring_fd, IORING_OFF_SQES))) {
+    u->sqes = NULL;
+    error("mmap io_uring entries");
+    return ERR_NET_URING;
+  }
+
+  u->sq_head = (unsigned *) (ring + params.sq_off.head);
+  u->sq_tail = (unsigned *) (ring + params.sq_off.tail);
+  u->sq_flags = (unsigned *) (ring + params.sq_off.flags);
+  u->sq_mask = *(unsigned *) (ring + params.sq_off.ring_mask);
+  u->sq_entries = params.sq_entries;
+  u->sq_queued = *u->sq_tail;
+  u->cq_head = (unsigned *) (ring + params.cq_off.head);
+  u->cq_tail = (unsigned *) (ring + params.cq_off.tail);
+  u->cq_mask = *(unsigned *) (ring + params.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (ring + params.cq_off.cqes);
+
+  // entries are used in ring order, so the indirection array never changes
+  for (i = 0; i < params.sq_entries; i++) {
+    ((unsigned *) (ring + params.sq_off.array))[i] = i;
+  }
+
+  return SUCCESS;
+}
+
+static int _buffers_setup(uring *u) {
+
+  struct io_uring_buf_reg reg;
+  int bid = 0;
+
+  u->buf_ring_len = URING_BUFFERS * sizeof(struct io_uring_buf);
+  if (MAP_FAILED == (u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))) {
+    u->buf_ring = NULL;
+    error("mmap io_uring buffer ring");
+    return ERR_NET_URING;
+  }
+
+  u->buffers_len = (size_t) URING_BUFFERS * URING_BUFFER_LEN;
+  if (MAP_FAILED == (u->buffers = mmap(NULL, u->buffers_len, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))) {
+    u->buffers = NULL;
+    error("mmap io_uring buffers");
+    return ERR_NET_URING;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) u->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_GROUP;
+  if (0 != syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    log_info("io_uring buffer rings are unsupported: %s", strerror(errno));
+    return ERR_NET_URING;
+  }
+
+  for (bid = 0; bid < URING_BUFFERS; bid++) {
+    _buffer_return(u, bid);
+  }
+  return SUCCESS;
+}
+
+static int _sq_room(uring *u, unsigned n) {
+  if (u->sq_queued - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) + n > u->sq_entries) {
+    _submit(u);
+  }
+  // the kernel may take fewer than were queued, e.g. while its completions overflow
+  return u->sq_queued - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) + n <= u->sq_entries;
+}
+
+static struct io_uring_sqe *_sqe(uring *u, int op, void *data) {
+
+  struct io_uring_sqe *sqe = NULL;
+
+  if (!_sq_room(u, 1)) {
+    return NULL;
+  }
+
+  sqe = &u->sqes[u->sq_queued & u->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t) data | op;
+  u->sq_queued++;
+  return sqe;
+}
+
+static void _submit(uring *u) {
+
+  unsigned flags = 0;
+  unsigned pending = 0;
+  int n = 0;
+
+  __atomic_store_n(u->sq_tail, u->sq_queued, __ATOMIC_RELEASE);
+
+  // completions that did not fit the ring wait in the kernel until we ask for them
+  if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+
+  while (0 < (pending = u->sq_queued - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)) || flags) {
+    u->enters++;
+    if (0 > (n = syscall(__NR_io_uring_enter, u->ring_fd, pending, 0, flags, NULL, 0))) {
+      if (EINTR == errno) {
+        continue;
+      }
+      error("io_uring_enter");
+      return;
+    }
+    u->submitted += n;
+    flags = 0;
+    if (0 == n) {
+      return;  // the kernel is out of resources; retry on the next wakeup
+    }
+  }
+}
+
+static void _accept_arm(uring *u) {
+
+  struct io_uring_sqe *sqe = NULL;
+
+  if (NULL == (sqe = _sqe(u, 0 <= u->listen_fd ? URING_OP_ACCEPT : URING_OP_CANCEL, u))) {
+    u->accept_owed = 1;
+    return;
+  }
+  u->accept_owed = 0;
+
+  if (0 > u->listen_fd) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) u | URING_OP_ACCEPT;
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = u->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static int _recv(uring_dir *dir, char *spare) {
+
+  struct io_uring_sqe *sqe = NULL;
+
+  if (NULL == (sqe = _sqe(dir->relay->u, URING_OP_RECV, dir))) {
+    return ERR_NET_URING;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = dir->in_fd;
+  sqe->len = URING_BUFFER_LEN;
+  if (NULL != spare) {
+    sqe->addr = (uintptr_t) spare;
+  } else {
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+  }
+  dir->relay->inflight++;
+  return SUCCESS;
+}
+
+static void _buffer_release(uring_dir *dir) {
+  if (NULL != dir->spare) {
+    slab_free(dir->relay->u->spares, dir->spare); dir->spare = NULL;
+  }
+  if (0 <= dir->bid) {
+    _buffer_return(dir->relay->u, dir->bid);
+    dir->bid = -1;
+  }
+}
+
+static void _buffer_return(uring *u, int bid) {
+
+  struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+
+  buf->addr = (uintptr_t) (u->buffers + (size_t) bid * URING_BUFFER_LEN);
+  buf->len = URING_BUFFER_LEN;
+  buf->bid = bid;
+  __atomic_store_n(&u->buf_ring->tail, ++u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void _accepted(uring *u, const struct io_uring_cqe *cqe) {
+
+  if (0 <= cqe->res) {
+    u->accept_cb(cqe->res, u->accept_arg);
+  } else if (-ECONNABORTED != cqe->res && -EINTR != cqe->res && -ECANCELED != cqe->res) {
+    errno = -cqe->res;
+    error("io_uring accept");
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE) && 0 <= u->listen_fd) {
+    _accept_arm(u);  // the kernel stopped the multishot accept
+  }
+}
+
+static void _received(uring_dir *dir, const struct io_uring_cqe *cqe) {
+
+  uring_relay *relay = dir->relay;
+  uring *u = relay->u;
+  struct io_uring_sqe *sqe = NULL;
+  char *spare = NULL;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    dir->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  }
+
+  // the send is linked to the receive after it, so both must fit the submission ring
+  if (!relay->closing && 0 < cqe->res && _sq_room(u, 2)) {
+    // send this buffer, and receive the next one once it is through
+    dir->length = cqe->res;
+    sqe = _sqe(u, URING_OP_SEND, dir);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = dir->out_fd;
+    sqe->addr = (uintptr_t) (NULL != dir->spare ? dir->spare : u->buffers + (size_t) dir->bid * URING_BUFFER_LEN);
+    sqe->len = cqe->res;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;  // a short send fails the link
+    sqe->flags = IOSQE_IO_LINK;
+    relay->inflight++;
+    _recv(dir, NULL);
+    return;
+  }
+
+  _buffer_release(dir);
+  if (relay->closing) {
+    return;
+  }
+
+  if (0 < cqe->res) {
+    log_info("io_uring submission ring is full; closing fds %u and %u", relay->accept_fd, relay->client_fd);
+    _relay_close(relay);
+    return;
+  }
+
+  if (0 == cqe->res) {
+    // pass the EOF on, and close once both directions are done
+    dir->done = 1;
+    shutdown(dir->out_fd, SHUT_WR);
+    if (relay->a2c.done && relay->c2a.done) {
+      _relay_close(relay);
+    }
+    return;
+  }
+
+  if (-ENOBUFS == cqe->res && NULL != (spare = slab_alloc(u->spares))) {
+    // the ring is dry; rather than wait for a buffer that may only come back once this
+    // direction moves, receive into one of our own
+    u->spare_receives++;
+    dir->spare = spare;
+    if (SUCCESS == _recv(dir, spare)) {
+      return;
+    }
+    _buffer_release(dir);
+  }
+
+  // -ECANCELED means the send before it failed, and was reported
+  if (-ECANCELED != cqe->res && -ECONNRESET != cqe->res) {
+    errno = -cqe->res;
+    error("io_uring recv");
+  }
+  _relay_close(relay);
+}
+
+static void _sent(uring_dir *dir, const struct io_uring_cqe *cqe) {
+
+  uring_relay *relay = dir->relay;
+
+  if (0 < cqe->res) {
+    relay->bytes += cqe->res;
+    metrics_add(dir->relayed, cqe->res);
+    if (NULL != dir->first_byte && 0 == *dir->first_byte) {
+      *dir->first_byte = metrics_now();
+    }
+  }
+  _buffer_release(dir);
+
+  if (!relay->closing && (0 > cqe->res || (unsigned) cqe->res < dir->length)) {
+    if (0 > cqe->res && -EPIPE != cqe->res && -ECONNRESET != cqe->res) {
+      errno = -cqe->res;
+      error("io_uring send");
+    }
+    _relay_close(relay);
+  }
+}
+
+static void _relay_close(uring_relay *relay) {
+  if (relay->closing) {
+    return;
+  }
+  relay->closing = 1;
+  shutdown(relay->accept_fd, SHUT_RDWR);
+  shutdown(relay->client_fd, SHUT_RDWR);
+}
+
+static void _relay_release(uring_relay *relay) {
+  uring_closed_cb closed = relay->closed;
+  void *arg = relay->arg;
+  uring *u = relay->u;
+
+  if (NULL != relay->prev) {
+    relay->prev->next = relay->next;
+  } else {
+    u->live = relay->next;
+  }
+  if (NULL != relay->next) {
+    relay->next->prev = relay->prev;
+  }
+
+  close(relay->accept_fd);
+  close(relay->client_fd);
+  log_debug("io_uring relay on fds %u and %u closed", relay->accept_fd, relay->client_fd);
+  slab_free(u->relays, relay);
+
+  if (NULL != closed) {
+    closed(arg);
+  }
+}
+
+static void _ring_cb(evutil_socket_t fd, short what, void *arg) {
+
+  uring *u = arg;
+  unsigned head = *u->cq_head;
+  struct io_uring_cqe cqe;
+  uring_dir *dir = NULL;
+  uring_relay *relay = NULL;
+
+  (void) fd;
+  (void) what;
+
+  while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = u->cqes[head & u->cq_mask];
+    __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);  // the handlers may submit
+    u->completed++;
+
+    if (URING_OP_ACCEPT == (cqe.user_data & URING_OP_MASK)) {
+      _accepted(u, &cqe);
+      continue;
+    }
+    if (URING_OP_CANCEL == (cqe.user_data & URING_OP_MASK)) {
+      continue;
+    }
+
+    dir = (uring_dir *) (uintptr_t) (cqe.user_data & ~(uint64_t) URING_OP_MASK);
+    relay = dir->relay;
+    relay->inflight--;
+    if (URING_OP_RECV == (cqe.user_data & URING_OP_MASK)) {
+      _received(dir, &cqe);
+    } else {
+      _sent(dir, &cqe);
+    }
+    if (relay->closing && 0 == relay->inflight) {
+      _relay_release(relay);
+    }
+  }
+
+  if (u->accept_owed) {
+    _accept_arm(u);
+  }
+  _submit(u);
+}
+
+#else  // no io_uring in this build
+
+int uring_supported(void) {
+  return 0;
+}
+
+uring *uring_new(struct event_base *ev_base, metrics *metrics) {
+  (void) ev_base;
+  (void) metrics;
+  return NULL;
+}
+
+int uring_accept(uring *u, int listen_fd, uring_accept_cb cb, void *arg) {
+  (void) u;
+  (void) listen_fd;
+  (void) cb;
+  (void) arg;
+  return ERR_NET_URING;
+}
+
+void uring_accept_stop(uring *u) {
+  (void) u;
+}
+
+uring_relay *uring_relay_new(uring *u, int accept_fd, int client_fd, uring_closed_cb closed, void *arg) {
+  (void) u;
+  (void) accept_fd;
+  (void) client_fd;
+  (void) closed;
+  (void) arg;
+  return NULL;
+}
+
+void uring_relay_start(uring_relay *relay) {
+  (void) relay;
+}
+
+uint64_t uring_relay_bytes(const uring_relay *relay) {
+  (void) relay;
+  return 0;
+}
+
+void uring_relay_trace(uring_relay *relay, uint64_t *a2c_first, uint64_t *c2a_first) {
+  (void) relay;
+  (void) a2c_first;
+  (void) c2a_first;
+}
+
+void uring_relay_close(uring_relay *relay) {
+  (void) relay;
+}
+
+void uring_report(const uring *u, int worker_id) {
+  (void) u;
+  (void) worker_id;
+}
+
+void uring_free(uring *u) {
+  (void) u;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/* uring.h
+ *
+ * I/O engine built on io_uring: accepts with one multishot accept per listener, and
+ * relays connected pipes with recv/send submissions instead of readiness callbacks,
+ * receiving into a ring of buffers shared by the worker's connections.
+ */
+#ifndef uring_h
+#define uring_h
+
+#include <event2/event.h>
+#include "metrics.h"
+
+typedef struct uring_struct uring;
+typedef struct uring_relay_struct uring_relay;
+
+/* Invoked for every connection the multishot accept hands back; the callee owns
+ * accept_fd, which is non-blocking and close-on-exec.
+ */
+typedef void (*uring_accept_cb)(int accept_fd, void *arg);
+
+/* Invoked once a started relay has closed both descriptors and freed itself. */
+typedef void (*uring_closed_cb)(void *arg);
+
+/* Returns true if this build has the io_uring engine. */
+int uring_supported(void);
+
+/* Sets up a ring and its receive buffers, and polls the ring from ev_base. Relayed
+ * bytes are counted in metrics.
+ *
+ * @return the engine, or NULL if the kernel lacks io_uring or the features used here,
+ *         in which case the caller should stay on libevent.
+ */
+uring *uring_new(struct event_base *ev_base, metrics *metrics);
+
+/* Starts accepting on listen_fd.
+ *
+ * @return success or error codes.
+ */
+int uring_accept(uring *u, int listen_fd, uring_accept_cb cb, void *arg);
+
+/* Cancels the multishot accept; connections it already took are still handed over. */
+void uring_accept_stop(uring *u);
+
+/* Allocates a relay between two connected sockets, without starting it.
+ *
+ * @return the relay, or NULL if the pool is out of memory.
+ */
+uring_relay *uring_relay_new(uring *u, int accept_fd, int client_fd, uring_closed_cb closed, void *arg);
+
+/* Starts relaying. From here on the relay owns both descriptors, and frees itself
+ * once both directions are finished, or at once if the submission ring is full.
+ */
+void uring_relay_start(uring_relay *relay);
+
+/* Returns the bytes relayed so far, in both directions. */
+uint64_t uring_relay_bytes(const uring_relay *relay);
+
+/* Has the relay stamp metrics_now() into *a2c_first and *c2a_first, if they are still 0,
+ * when it relays the first byte each way. Either may be NULL.
+ */
+void uring_relay_trace(uring_relay *relay, uint64_t *a2c_first, uint64_t *c2a_first);
+
+/* Closes a started relay. Both descriptors are shut down at once, and closed, with the
+ * closed callback invoked, once the kernel is done with the relay.
+ */
+void uring_relay_close(uring_relay *relay);
+
+/* Logs submissions, completions and buffer shortages. */
+void uring_report(const uring *u, int worker_id);
+
+/* Closes the ring, which cancels whatever is in flight, and frees the engine along
+ * with any relays that were still running, closing their descriptors without invoking
+ * their closed callbacks.
+ */
+void uring_free(uring *u);
+
+#endif /* uring_h */
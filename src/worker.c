@@ -0,0 +1,384 @@
+/* worker.c
+ *
+ * An event loop thread with its own listener, event_base and connections.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+#include "log.h"
+#include "config.h"
+#include "errors.h"
+#include "io.h"
+#include "mem.h"
+#include "worker.h"
+
+// -- DECLARATIONS --
+
+/* Thread entry point; dispatches the event loop until it is stopped. */
+static void *_worker_main(void *arg);
+/* Logs the worker's statistics on its own thread. */
+static void _report_cb(evutil_socket_t fd, short event, void *arg);
+/* Stops accepting on the first call, and stops the loop once drained. */
+static void _drain_cb(evutil_socket_t fd, short event, void *arg);
+/* Returns this worker's share of a limit, rounded up so that it is never 0 unless the limit is. */
+static size_t _share_bytes(size_t limit, int nworkers);
+/* Creates a bucket for reading at most rate bytes per second, with a second's worth of burst. */
+static struct ev_token_bucket_cfg *_rate_cfg(size_t rate);
+
+// -- PUBLIC --
+
+int worker_init(worker *w, int id, int listen_fd, const proxy_opts *opts, tls_server *tls,
+                http_cache *cache, admission *admission) {
+
+  struct timeval health_timeout = { HEALTH_TIMEOUT_MS / 1000, (HEALTH_TIMEOUT_MS % 1000) * 1000 };
+  int nworkers = proxy_opts_workers(opts);
+  int rc = SUCCESS;
+  int i = 0;
+
+  memset(w, 0, sizeof(worker));
+  w->id = id;
+  w->listen_fd = listen_fd;
+
+  // make descriptor non-blocking
+  if (0 != fcntl(listen_fd, F_SETFL, O_NONBLOCK)) {
+    error("fcntl");
+    return ERR_NET_FCNTL;
+  }
+
+  // initialize event loop
+  if (NULL == (w->ev_base = event_base_new())) {
+    return ERR_EVENT_BASE;
+  }
+
+  // resolver for upstream names, configured from /etc/resolv.conf
+  if (NULL == (w->dns_base = evdns_base_new(w->ev_base, EVDNS_BASE_INITIALIZE_NAMESERVERS))) {
+    log_error("evdns_base_new failed");
+    worker_free(w);
+    return ERR_EVENT_DNS;
+  }
+
+  // cache of resolved upstream addresses, refreshed in the background
+  if (NULL == (w->dns = dns_cache_new(w->ev_base, w->dns_base))) {
+    worker_free(w);
+    return ERR_EVENT_DNS;
+  }
+
+  // every worker gets its own backends, so their counters never cross threads
+  if (NULL == (w->backends = backend_set_new(opts->strategy, (uint32_t) id + 1))) {
+    worker_free(w);
+    return ERR_CONN_DETAILS_NEW;
+  }
+  for (i = 0; i < opts->nupstreams; i++) {
+    if (SUCCESS != (rc = backend_set_add(w->backends, opts->upstreams[i].addr, opts->upstreams[i].port))) {
+      worker_free(w);
+      return rc;
+    }
+  }
+
+  if (NULL == (w->metrics = metrics_new())) {
+    worker_free(w);
+    return ERR_CONN_DETAILS_NEW;
+  }
+
+  if (NULL == (w->timers = timer_wheel_new(w->ev_base, TIMER_TICK_MS))) {
+    worker_free(w);
+    return ERR_EVENT_NEW;
+  }
+
+  w->admission = admission;
+  if (0 < opts->rate_limit && NULL == (w->rate_limit = _rate_cfg(opts->rate_limit))) {
+    worker_free(w);
+    return ERR_CONN_DETAILS_NEW;
+  }
+  if (0 < opts->global_rate_limit &&
+      (NULL == (w->rate_group_cfg = _rate_cfg(_share_bytes(opts->global_rate_limit, nworkers))) ||
+       NULL == (w->rate_group = bufferevent_rate_limit_group_new(w->ev_base, w->rate_group_cfg)))) {
+    worker_free(w);
+    return ERR_CONN_DETAILS_NEW;
+  }
+
+  // every worker gets its own copy of the connection details
+  if (NULL == (w->conn = conn_details_new(w->ev_base, w->dns, w->backends, opts->connect_timeout_ms))) {
+    worker_free(w);
+    return ERR_CONN_DETAILS_NEW;
+  }
+
+  w->conn->splice = opts->splice;
+  w->conn->metrics = w->metrics;
+  w->conn->buffer_high = opts->buffer_high;
+  w->conn->buffer_low = opts->buffer_low;
+  w->conn->memory_budget = opts->memory_budget / proxy_opts_workers(opts);  // no sharing between workers
+  w->conn->timers = w->timers;
+  w->conn->idle_timeout_ms = opts->idle_timeout_ms;
+  w->conn->read_timeout_ms = opts->read_timeout_ms;
+  w->conn->write_timeout_ms = opts->write_timeout_ms;
+  w->conn->lifetime_ms = opts->lifetime_ms;
+  w->conn->admission = w->admission;
+  w->conn->rate_limit = w->rate_limit;
+  w->conn->rate_group = w->rate_group;
+  w->conn->sock = opts->sock;
+  w->conn->trace_sample = opts->trace_sample;
+  w->conn->tls = tls;
+  w->conn->http = opts->http;
+  w->conn->cache = cache;
+
+  // pre-connected sockets to each backend; with HTTP, also the ones kept alive between requests,
+  // which are only pre-connected if asked for
+  for (i = 0; (0 < opts->pool_max || opts->http) && !opts->udp && i < w->backends->nbackends; i++) {
+    backend *b = &w->backends->backends[i];
+    if (NULL == (b->pool = upstream_pool_new(w->ev_base, w->dns, b->host, b->port_num,
+                                             opts->pool_min, opts->pool_max, opts->http ? HTTP_KEEPALIVE : 0,
+                                             &w->conn->connect_timeout, &opts->sock))) {
+      worker_free(w);
+      return ERR_CONN_DETAILS_NEW;
+    }
+  }
+
+  // probes the backends, and lets ejected ones back in
+  // a TCP connect says nothing about a UDP service, so datagram backends are only checked passively
+  if (NULL == (w->health = health_new(w->ev_base, w->dns, w->backends, opts->udp ? 0 : opts->health_interval_ms,
+                                      &health_timeout))) {
+    worker_free(w);
+    return ERR_EVENT_NEW;
+  }
+
+  // with io_uring, a multishot accept replaces the accept event
+  if (opts->uring && !opts->udp && NULL == (w->uring = uring_new(w->ev_base, w->metrics))) {
+    log_warn("worker %d cannot use io_uring, falling back to libevent", id);
+  }
+
+  if (opts->udp) {
+    if (NULL == (w->udp = udp_relay_new(w->ev_base, listen_fd, w->backends, w->dns, w->metrics, w->timers,
+                                        opts->udp_flow_timeout_ms))) {
+      worker_free(w);
+      return ERR_EVENT_NEW;
+    }
+  } else if (NULL != w->uring) {
+    // the zero-copy relay bypasses the bufferevents that carry the rate limits, and HTTP framing
+    if (NULL == w->rate_limit && NULL == w->rate_group && !opts->http) {
+      w->conn->uring = w->uring;
+    }
+    if (SUCCESS != (rc = uring_accept(w->uring, listen_fd, do_accepted, w->conn))) {
+      worker_free(w);
+      return rc;
+    }
+  } else {
+    // create a new event (EV_PERSIST means add the event back to the select set after firing)
+    // EV_READ means it's a read event
+    // the last argument is passed along to the callback
+    if (NULL == (w->ev_listen = event_new(w->ev_base, listen_fd, EV_READ|EV_PERSIST, do_accept, w->conn))) {
+      worker_free(w);
+      return ERR_EVENT_NEW;
+    }
+
+    if (0 != event_add(w->ev_listen, NULL)) { // NULL means no timeout
+      worker_free(w);
+      return ERR_EVENT_ADD;
+    }
+  }
+
+  // activated from the control loop
+  if (NULL == (w->ev_report = event_new(w->ev_base, -1, 0, _report_cb, w)) ||
+      NULL == (w->ev_drain = event_new(w->ev_base, -1, EV_PERSIST, _drain_cb, w))) {
+    worker_free(w);
+    return ERR_EVENT_NEW;
+  }
+
+  log_info("worker %d constructed event objects on fd %u, accepting with %s",
+           id, listen_fd, NULL != w->udp ? "recvmmsg" : NULL != w->uring ? "io_uring" : "libevent");
+  return SUCCESS;
+}
+
+int worker_start(worker *w) {
+  int rc = 0;
+  if (0 != (rc = pthread_create(&w->thread, NULL, _worker_main, w))) {
+    log_error("pthread_create failed for worker %d with rc: %d", w->id, rc);
+    return ERR_THREAD_CREATE;
+  }
+  return SUCCESS;
+}
+
+void worker_stop(worker *w) {
+  int rc = 0;
+  if (0 > (rc = event_base_loopexit(w->ev_base, NULL))) {  // exit after all current events
+    log_error("loopexit failed for worker %d with rc: %d", w->id, rc);
+  }
+}
+
+void worker_drain(worker *w, int drain_ms) {
+  w->drain_ms = drain_ms;  // published by event_active's lock
+  event_active(w->ev_drain, 0, 0);
+}
+
+int worker_exited(worker *w) {
+  return atomic_load(&w->exited);
+}
+
+void worker_report(worker *w) {
+  event_active(w->ev_report, 0, 0);
+}
+
+int worker_join(worker *w) {
+  int rc = 0;
+  if (0 != (rc = pthread_join(w->thread, NULL))) {
+    log_error("pthread_join failed for worker %d with rc: %d", w->id, rc);
+    return ERR_THREAD_JOIN;
+  }
+  return w->rc;
+}
+
+void worker_free(worker *w) {
+  if (NULL != w->ev_drain) {
+    event_free(w->ev_drain); w->ev_drain = NULL;
+  }
+  if (NULL != w->ev_report) {
+    event_free(w->ev_report); w->ev_report = NULL;
+  }
+  if (NULL != w->ev_listen) {
+    event_free(w->ev_listen); w->ev_listen = NULL;
+  }
+  if (NULL != w->uring) {
+    uring_free(w->uring); w->uring = NULL;
+  }
+  if (NULL != w->udp) {
+    udp_relay_free(w->udp); w->udp = NULL;
+  }
+  if (NULL != w->health) {
+    health_free(w->health); w->health = NULL;
+  }
+  // connections the drain deadline cut short; one more turn of the loop finalizes their
+  // bufferevents, which take themselves out of the rate limit group
+  if (NULL != w->conn && 0 < conn_details_active(w->conn)) {
+    conn_details_close(w->conn);
+    event_base_loop(w->ev_base, EVLOOP_NONBLOCK);
+  }
+  if (NULL != w->rate_group) {
+    bufferevent_rate_limit_group_free(w->rate_group); w->rate_group = NULL;
+  }
+  if (NULL != w->rate_group_cfg) {
+    ev_token_bucket_cfg_free(w->rate_group_cfg); w->rate_group_cfg = NULL;
+  }
+  if (NULL != w->rate_limit) {
+    ev_token_bucket_cfg_free(w->rate_limit); w->rate_limit = NULL;
+  }
+  if (NULL != w->conn) {
+    conn_details_free(w->conn); w->conn = NULL;
+  }
+  w->admission = NULL;  // the proxy's
+  if (NULL != w->timers) {
+    timer_wheel_free(w->timers); w->timers = NULL;
+  }
+  if (NULL != w->metrics) {
+    metrics_free(w->metrics); w->metrics = NULL;
+  }
+  if (NULL != w->backends) {
+    backend_set_free(w->backends); w->backends = NULL;
+  }
+  if (NULL != w->dns) {
+    dns_cache_free(w->dns); w->dns = NULL;
+  }
+  if (NULL != w->dns_base) {
+    evdns_base_free(w->dns_base, 0); w->dns_base = NULL;
+  }
+  if (NULL != w->ev_base) {
+    event_base_free(w->ev_base); w->ev_base = NULL;
+  }
+  if (0 <= w->listen_fd) {
+    close(w->listen_fd); w->listen_fd = -1;
+  }
+}
+
+// -- PRIVATE --
+
+static void *_worker_main(void *arg) {
+  worker *w = arg;
+
+  log_info("worker %d dispatching event loop", w->id);
+  if (0 != event_base_dispatch(w->ev_base)) { // start loop; blocks
+    w->rc = ERR_EVENT_DISPATCH;
+    atomic_store(&w->exited, 1);
+    return NULL;
+  }
+
+  log_info("worker %d event loop exited", w->id);
+  _report_cb(-1, 0, w);
+  w->rc = SUCCESS;
+  atomic_store(&w->exited, 1);
+  return NULL;
+}
+
+static void _drain_cb(evutil_socket_t fd, short event, void *arg) {
+
+  worker *w = arg;
+  struct timeval interval = { DRAIN_CHECK_MS / 1000, (DRAIN_CHECK_MS % 1000) * 1000 };
+  unsigned long active = conn_details_active(w->conn) + (NULL != w->udp ? udp_relay_flows(w->udp) : 0);
+
+  (void) fd;
+  (void) event;
+
+  if (0 == w->drain_deadline) {
+    // closing the listener refuses new clients, unless a replacement holds it too
+    if (NULL != w->uring) {
+      uring_accept_stop(w->uring);
+    }
+    if (NULL != w->ev_listen) {
+      event_free(w->ev_listen); w->ev_listen = NULL;
+    }
+    if (NULL != w->udp) {
+      udp_relay_stop(w->udp);  // replies to open flows still go out through the listener
+    } else {
+      close(w->listen_fd); w->listen_fd = -1;
+    }
+    w->drain_deadline = metrics_now() + (uint64_t) w->drain_ms * 1000;
+    log_info("worker %d stopped accepting, draining %lu connections", w->id, active);
+    event_add(w->ev_drain, &interval);
+  }
+
+  if (0 < active && metrics_now() < w->drain_deadline) {
+    return;
+  }
+
+  if (0 < active) {
+    log_warn("worker %d closing %lu connections at the drain deadline", w->id, active);
+  } else {
+    log_info("worker %d drained", w->id);
+  }
+  event_del(w->ev_drain);
+  event_base_loopexit(w->ev_base, NULL);
+}
+
+static void _report_cb(evutil_socket_t fd, short event, void *arg) {
+  worker *w = arg;
+  (void) fd;
+  (void) event;
+  dns_cache_report(w->dns, w->id);
+  conn_details_report(w->conn, w->id);
+  metrics_report(w->metrics, w->id);
+  log_info("worker %d timers: %lu armed, %lu fired", w->id, w->timers->armed, w->timers->fired);
+  mem_pool_report(w->id);
+  if (NULL != w->uring) {
+    uring_report(w->uring, w->id);
+  }
+  if (NULL != w->udp) {
+    udp_relay_report(w->udp, w->id);
+  }
+  backend_set_report(w->backends, w->id);
+}
+
+static size_t _share_bytes(size_t limit, int nworkers) {
+  return (limit + (size_t) nworkers - 1) / (size_t) nworkers;
+}
+
+static struct ev_token_bucket_cfg *_rate_cfg(size_t rate) {
+  struct timeval tick = { RATE_LIMIT_TICK_MS / 1000, (RATE_LIMIT_TICK_MS % 1000) * 1000 };
+  size_t per_tick = rate * RATE_LIMIT_TICK_MS / 1000;
+  if (0 == per_tick) {
+    per_tick = 1;
+  }
+  return ev_token_bucket_cfg_new(per_tick, rate > per_tick ? rate : per_tick,
+                                 EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, &tick);
+}
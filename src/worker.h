@@ -0,0 +1,93 @@
+/* worker.h
+ *
+ * An event loop thread with its own listener, event_base and connections.
+ */
+#ifndef worker_h
+#define worker_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/bufferevent.h>
+#include "admission.h"
+#include "backend.h"
+#include "dns_cache.h"
+#include "health.h"
+#include "http_cache.h"
+#include "io.h"
+#include "metrics.h"
+#include "opts.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "udp.h"
+#include "uring.h"
+
+/* A worker owns everything reachable from its event_base; connections accepted
+ * by a worker are relayed by that worker and never cross threads.
+ */
+struct worker_struct {
+  int id;
+  pthread_t thread;
+  int listen_fd;
+  struct event_base *ev_base;
+  struct evdns_base *dns_base;
+  dns_cache *dns;
+  backend_set *backends;
+  health_checker *health;
+  struct event *ev_listen;
+  uring *uring;  // accepts and relays instead of ev_listen, unless NULL
+  udp_relay *udp;  // relays datagrams instead, with --protocol udp
+  timer_wheel *timers;  // connection timeouts
+  admission *admission;  // per-address caps shared by the workers, or NULL
+  struct ev_token_bucket_cfg *rate_limit;  // per-bufferevent read rate, or NULL
+  struct ev_token_bucket_cfg *rate_group_cfg;  // the worker's share of the global rate, or NULL
+  struct bufferevent_rate_limit_group *rate_group;
+  struct event *ev_report;
+  struct event *ev_drain;  // activated to start draining, then checks on the draining
+  int drain_ms;
+  uint64_t drain_deadline;  // metrics_now() by which to stop; 0 unless draining
+  conn_details *conn;
+  metrics *metrics;  // written by this worker only, scraped by the control loop
+  int rc;  // return code of the event loop, valid after worker_join
+  _Atomic int exited;  // set once the event loop has returned
+};
+
+typedef struct worker_struct worker;
+
+/* Creates the event_base and accept event for the given listening descriptor.
+ * The worker takes ownership of listen_fd. Accepted connections do a TLS handshake with
+ * tls first, unless it is NULL; tls is shared by the workers and must outlive them, as is
+ * cache, which answers HTTP requests where it can, and admission, which caps each client
+ * address across the workers; either may be NULL.
+ *
+ * @return success or error codes.
+ */
+int worker_init(worker *w, int id, int listen_fd, const proxy_opts *opts, tls_server *tls,
+                http_cache *cache, admission *admission);
+
+/* Runs the event loop on a new thread. */
+int worker_start(worker *w);
+
+/* Asks the event loop to exit; safe to call from any thread. */
+void worker_stop(worker *w);
+
+/* Asks the worker to stop accepting, close its listener, and stop once its connections
+ * have finished or drain_ms has passed; safe to call from any thread.
+ */
+void worker_drain(worker *w, int drain_ms);
+
+/* Returns true once the event loop has returned; safe to call from any thread. */
+int worker_exited(worker *w);
+
+/* Asks the worker to log its statistics; safe to call from any thread. */
+void worker_report(worker *w);
+
+/* Waits for the event loop thread to finish. */
+int worker_join(worker *w);
+
+/* Frees the event objects and closes the listening descriptor. */
+void worker_free(worker *w);
+
+#endif /* worker_h */